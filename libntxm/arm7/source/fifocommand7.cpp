@@ -65,6 +65,7 @@ static void RecvCommandStopRecording()
 
 static void RecvCommandSetSong(SetSongCommand *c) {
     ntxm7->setSong((Song*)c->ptr);
+    fifoSendValue32(FIFO_NTXM, 0); // The arm9 may free the old song now
 }
 
 static void RecvCommandStartPlay(StartPlayCommand *c) {
@@ -91,6 +92,15 @@ static void RecvCommandSetStereoOutput(SetStereoOutputCommand *c) {
     ntxm_stereo_output = c->state;
 }
 
+static void RecvCommandSampleRequestDone(RequestSampleCommand *c) {
+    ntxm7->sampleRequestDone(c->sample);
+}
+
+static void RecvCommandSetChannelSamples(SetChannelSamplesCommand *c) {
+    ntxm7->setChannelSamples(c->table);
+    fifoSendValue32(FIFO_NTXM, 0); // The arm9 may free the old table now
+}
+
 void CommandDbgOut(const char *formatstr, ...)
 {
 #ifdef DEBUG
@@ -154,6 +164,17 @@ void CommandSampleFinish(void)
     fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
 }
 
+void CommandRequestSample(Sample *sample)
+{
+    NTXMFifoMessage command;
+    command.commandType = REQUEST_SAMPLE;
+
+    RequestSampleCommand *c = &command.requestSample;
+    c->sample = sample;
+
+    fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
+}
+
 void CommandRecvHandler(int bytes, void *user_data) {
     NTXMFifoMessage command;
 
@@ -199,6 +220,12 @@ void CommandRecvHandler(int bytes, void *user_data) {
         case SET_STEREO_OUTPUT:
             RecvCommandSetStereoOutput(&command.setStereoOutput);
             break;
+        case SAMPLE_REQUEST_DONE:
+            RecvCommandSampleRequestDone(&command.requestSample);
+            break;
+        case SET_CHANNEL_SAMPLES:
+            RecvCommandSetChannelSamples(&command.setChannelSamples);
+            break;
         default:
             break;
     }
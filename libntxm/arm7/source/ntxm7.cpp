@@ -98,3 +98,13 @@ void NTXM7::setPatternLoop(bool loopstate)
 {
 	player->setPatternLoop(loopstate);
 }
+
+void NTXM7::sampleRequestDone(Sample *sample)
+{
+	player->sampleRequestDone(sample);
+}
+
+void NTXM7::setChannelSamples(Sample **table)
+{
+	player->setChannelSamples(table);
+}
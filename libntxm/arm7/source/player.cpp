@@ -50,7 +50,7 @@ extern bool ntxm_recording;
 /* ===================== PUBLIC ===================== */
 
 Player::Player(void (*_externalTimerHandler)(void))
-	:song(0), externalTimerHandler(_externalTimerHandler)
+	:song(0), externalTimerHandler(_externalTimerHandler), n_requested_samples(0)
 {
 	initState();
 
@@ -75,9 +75,30 @@ void Player::operator delete (void *p) {
 
 void Player::setSong(Song *_song)
 {
+	// The buffers of streamed samples go away with the song
+	for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+		stopStream(channel);
+
+	// So do the samples, fading notes are cut off
+	if(song != 0)
+	{
+		for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+		{
+			if( (state.playing_single_sample) && (state.single_sample_channel == channel) )
+				continue;
+			SCHANNEL_CR(channel) = 0;
+		}
+	}
+
+	// The player relies on Song::validate(), which CommandSetSong() makes sure of
+	if( (_song != 0) && !_song->isPlayable() )
+		_song = 0;
+
 	song = _song;
 	initState();
 
+	n_requested_samples = 0;
+
 	// Init fading
 	memset(state.channel_fade_active, 0, sizeof(state.channel_fade_active));
 	memset(state.channel_fade_ms, 0, sizeof(state.channel_fade_ms));
@@ -147,7 +168,7 @@ void Player::stop(void)
 }
 
 // Play the note with the given settings. channel == 255 -> search for free channel
-void Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
+bool Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
 {
 	//reset portamento to init
 	state.channel_porta_accumulator[channel] = 0;
@@ -155,12 +176,23 @@ void Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
 	state.channel_porta_enabled[channel] = false;
 	
 	if( (state.playing == true) && (song->channelMuted(channel) == true) )
-		return;
+		return false;
 
-	Instrument *inst = song->instruments[instidx];
+	// The song is validated, so there is always an instrument and a sample
+	Instrument *inst = song->play_instruments[instidx];
 
-	if(inst == 0)
-		return;
+	if(note > MAX_NOTE)
+		return false;
+
+	const NoteInfo *ni = inst->getNoteInfo(note);
+
+	// Lazily loaded sample whose data is not in RAM. The note is skipped, but
+	// the arm9 loads the data for the next time.
+	if(!ni->sample->isLoaded())
+	{
+		requestSample(ni->sample);
+		return false;
+	}
 
 	if(channel == 255) // Find a free channel
 	{
@@ -169,7 +201,7 @@ void Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
 			--c;
 
 		if( c < 0 )
-			return;
+			return false;
 		else
 		{
 			channel = c;
@@ -183,18 +215,18 @@ void Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
 	state.channel_instrument[channel] = instidx;
 
 	if(volume == NO_VOLUME) {
-		state.channel_volume[channel] = MAX_VOLUME * inst->getSampleForNote(note)->getVolume() / 255;
+		state.channel_volume[channel] = MAX_VOLUME * ni->volume / 255;
 	} else {
-		state.channel_volume[channel] = volume * inst->getSampleForNote(note)->getVolume() / 255;
+		state.channel_volume[channel] = volume * ni->volume / 255;
 	}
-	state.channel_prev_sample_vol[channel] = inst->getSampleForNote(note)->getVolume(); //Store for later channel volume updates
+	state.channel_prev_sample_vol[channel] = ni->volume; //Store for later channel volume updates
 
-	if(inst->getSampleForNote(note)->getLoop() != 0) {
+	if(ni->loop != NO_LOOP) {
 		state.channel_loop[channel] = true;
 		state.channel_ms_left[channel] = 0;
 	} else {
 		state.channel_loop[channel] = false;
-		state.channel_ms_left[channel] = inst->calcPlayLength(note);
+		state.channel_ms_left[channel] = ni->play_length;
 	}
 
 	state.channel_fade_vol[channel] = state.channel_volume[channel];
@@ -203,10 +235,12 @@ void Player::playNote(u8 note, u8 volume, u8 channel, u8 instidx)
 	state.channel_active[channel] = 1;
 
 	//xm standard is to reset effect panning each note
-	u8 pan = inst->getSampleForNote(note)->getBasePanning();
-	inst->getSampleForNote(note)->setPanning(pan);
+	ni->sample->setPanning(ni->sample->getBasePanning());
 	
 	inst->play(note, volume, channel);
+	setChannelStream(channel, ni->sample->getStream());
+
+	return true;
 }
 
 // Play the given sample (and send a notification when done)
@@ -229,6 +263,7 @@ void Player::playSample(Sample *sample, u8 note, u8 volume, u8 channel)
 
 	// Play
 	sample->play(note, volume, channel);
+	setChannelStream(channel, sample->getStream());
 }
 
 // Stop playback on a channel
@@ -257,6 +292,45 @@ void Player::stopChannel(u8 channel)
 	}
 }
 
+void Player::sampleRequestDone(Sample *sample)
+{
+	for(u8 i=0; i<n_requested_samples; ++i)
+	{
+		if(requested_samples[i] == sample)
+		{
+			requested_samples[i] = requested_samples[--n_requested_samples];
+			return;
+		}
+	}
+}
+
+void Player::setChannelSamples(Sample **table)
+{
+	if(ntxm_channel_samples != 0)
+	{
+		for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+		{
+			if(ntxm_channel_samples[channel] == 0)
+				continue;
+
+			stopStream(channel);
+			SCHANNEL_CR(channel) = 0;
+			state.channel_active[channel] = 0;
+			ntxm_channel_samples[channel] = 0;
+
+			if( (state.playing_single_sample) && (state.single_sample_channel == channel) )
+			{
+				state.playing_single_sample = false;
+				state.single_sample_ms_remaining = 0;
+
+				CommandSampleFinish();
+			}
+		}
+	}
+
+	ntxm_channel_samples = table;
+}
+
 void Player::playTimerHandler(void)
 {
 	if(ntxm_recording && !state.playing)
@@ -268,6 +342,9 @@ void Player::playTimerHandler(void)
 	// Fading stuff
 	handleFade(passed_time);
 
+	updateStreams(passed_time);
+	releaseStoppedChannels();
+
 	// Are we playing a single sample (a sample not from the song)?
 	// (Built in for games etc)
 	if(state.playing_single_sample)
@@ -359,7 +436,7 @@ void Player::playTimerHandler(void)
 	{
 		if(state.channel_active[channel])
 		{
-			Instrument *inst = song->getInstrument(state.channel_instrument[channel]);
+			Instrument *inst = song->play_instruments[state.channel_instrument[channel]];
 			inst->updateEnvelopePos(song->getBPM(), passed_time, channel, state.channel_note[channel]);
 			state.channel_env_vol[channel] = inst->getEnvelopeAmp(channel, state.channel_note[channel]);
 		}
@@ -489,7 +566,7 @@ void Player::playRow(void)
 	{
 		u8 note   = song->patterns[state.pattern][channel][state.row].note;
 		u8 volume = song->patterns[state.pattern][channel][state.row].volume;
-		u8 inst   = song->patterns[state.pattern][channel][state.row].instrument;
+		u8 inst   = rowInstrument(channel, song->patterns[state.pattern][channel][state.row].instrument);
 		u8 effect = song->patterns[state.pattern][channel][state.row].effect;
 		u8 param  = song->patterns[state.pattern][channel][state.row].effect_param;
 		u16 test_delay = (((effect << 8) & 0x0f00) | (param & 0xf0));
@@ -497,23 +574,39 @@ void Player::playRow(void)
 		effect = (effect >> 4) & 0xf;
 
 		//Skip new note if doing porta to note, we'll slide towards it instead
-		if((note!=EMPTY_NOTE)&&(note!=STOP_NOTE)&&(song->instruments[inst]!=0)&&(effect != EFFECT_PORTA_TONE)&&(test_delay != DELAY_CMD))
+		if((note!=EMPTY_NOTE)&&(note!=STOP_NOTE)&&(inst!=NO_INSTRUMENT)&&(effect != EFFECT_PORTA_TONE)&&(test_delay != DELAY_CMD))
 		{
-			playNote(note, volume, channel, inst);
-
-			state.channel_active[channel] = 1;
-			if(song->instruments[inst]->getSampleForNote(note)->getLoop() != 0) {
-				state.channel_loop[channel] = true;
-				state.channel_ms_left[channel] = 0;
-			} else {
-				state.channel_loop[channel] = false;
-				state.channel_ms_left[channel] = song->instruments[inst]->calcPlayLength(note);
+			// Notes that were not played don't keep the channel busy
+			if(playNote(note, volume, channel, inst))
+			{
+				const NoteInfo *ni = song->play_instruments[inst]->getNoteInfo(note);
+				state.channel_active[channel] = 1;
+				if(ni->loop != NO_LOOP) {
+					state.channel_loop[channel] = true;
+					state.channel_ms_left[channel] = 0;
+				} else {
+					state.channel_loop[channel] = false;
+					state.channel_ms_left[channel] = ni->play_length;
+				}
 			}
 		}
 		updateChannelVol(volume, channel);
 	}
 }
 
+// A note without an instrument plays the channel's last one, like in XM.
+// Returns NO_INSTRUMENT if there is none, or if it is missing from the song.
+u8 Player::rowInstrument(u8 channel, u8 inst)
+{
+	if(inst == NO_INSTRUMENT)
+		inst = state.channel_instrument[channel];
+
+	if( (inst == NO_INSTRUMENT) || (song->play_instruments[inst] == song->empty_instrument) )
+		return NO_INSTRUMENT;
+
+	return inst;
+}
+
 void Player::updateChannelVol(u8 volume, u8 channel)
 {
 	if(volume == NO_VOLUME) {
@@ -534,7 +627,7 @@ void Player::handleEffects(void)
 		u8 effect = song->patterns[state.pattern][channel][state.row].effect;
 		u8 param  = song->patterns[state.pattern][channel][state.row].effect_param;
 		u8 instidx = state.channel_instrument[channel];
-		Instrument *inst = song->instruments[instidx];
+		Instrument *inst = song->play_instruments[instidx];
 		
 		if(effect != NO_EFFECT)
 		{
@@ -644,8 +737,8 @@ void Player::handleEffects(void)
 					{
 						state.channel_porta_enabled[channel] = true;
 						u8 note = state.channel_note[channel];
-						u8 rel = inst->getSampleForNote(note)->getRelNote();
-						s8 fine = inst->getSampleForNote(note)->getFinetune();
+						u8 rel = inst->getNoteInfo(note)->sample->getRelNote();
+						s8 fine = inst->getNoteInfo(note)->sample->getFinetune();
 						note += (48 + rel); 	// Add 48 to the note, because otherwise note can get negative (later on)
 																	// Also add rel note and finetune from sample settings so the effect won't be out of tune
 						state.channel_porta_accumulator[channel] = (u32)((128 * note) + fine); // 128 is max finesteps per note
@@ -660,8 +753,8 @@ void Player::handleEffects(void)
 					{
 						state.channel_porta_enabled[channel] = true;
 						u8 note = state.channel_note[channel];
-						u8 rel = inst->getSampleForNote(note)->getRelNote();
-						s8 fine = inst->getSampleForNote(note)->getFinetune();
+						u8 rel = inst->getNoteInfo(note)->sample->getRelNote();
+						s8 fine = inst->getNoteInfo(note)->sample->getFinetune();
 						note += (48 + rel); 	// Add 48 to the note, because otherwise note can get negative (later on)
 																	// Also add rel note and finetune from sample settings so the effect won't be out of tune
 						state.channel_porta_accumulator[channel] = (u32)((128 * note) + fine); // 128 is max finesteps per note
@@ -676,8 +769,8 @@ void Player::handleEffects(void)
 					{
 						state.channel_porta_enabled[channel] = true;
 						u8 note = state.channel_prev_note[channel];
-						u8 rel = inst->getSampleForNote(note)->getRelNote();
-						s8 fine = inst->getSampleForNote(note)->getFinetune();
+						u8 rel = inst->getNoteInfo(note)->sample->getRelNote();
+						s8 fine = inst->getNoteInfo(note)->sample->getFinetune();
 						note += (48 + rel); 	// Add 48 to the note, because otherwise note can get negative (later on)
 																	// Also add rel note and finetune from sample settings so the effect won't be out of tune
 						state.channel_porta_accumulator[channel] = (u32)((128 * note) + fine); // 128 is max finesteps per note
@@ -712,8 +805,9 @@ void Player::handleEffects(void)
 				{
 					u8 inst = state.channel_instrument[channel];
 					u8 note = state.channel_note[channel];
-					song->instruments[inst]->getSampleForNote(note)->setPanning(param);
-					song->instruments[inst]->getSampleForNote(note)->updatePanning(channel);
+					Sample *sample = song->play_instruments[inst]->getNoteInfo(note)->sample;
+					sample->setPanning(param);
+					sample->updatePanning(channel);
 					break;
 				}
 			}
@@ -728,7 +822,7 @@ void Player::handleTickEffects(void)
 		u8 effect  = song->patterns[state.pattern][channel][state.row].effect;
 		u8 param   = song->patterns[state.pattern][channel][state.row].effect_param;
 		u8 instidx = state.channel_instrument[channel];
-		Instrument *inst = song->instruments[instidx];
+		Instrument *inst = song->play_instruments[instidx];
 
 		if(effect != NO_EFFECT)
 		{
@@ -743,9 +837,6 @@ void Player::handleTickEffects(void)
 					halftone2 = (param & 0xF0) >> 4;
 					halftone1 = param & 0x0F;
 
-					if (inst == 0)
-						continue;
-
 					switch(state.row_ticks % 3)
 					{
 						case(0):
@@ -850,16 +941,21 @@ void Player::handleTickEffects(void)
 							{
 								u8 note   = song->patterns[state.pattern][channel][state.row].note;
 								u8 volume = song->patterns[state.pattern][channel][state.row].volume;
-								u8 inst   = song->patterns[state.pattern][channel][state.row].instrument;
-								playNote(note, volume, channel, inst);
-
+								u8 inst   = rowInstrument(channel, song->patterns[state.pattern][channel][state.row].instrument);
+								if( (note > MAX_NOTE) || (inst == NO_INSTRUMENT) ) // Empty or stop, or nothing to play
+									break;
+								
+								if(!playNote(note, volume, channel, inst))
+									break;
+
+								const NoteInfo *ni = song->play_instruments[inst]->getNoteInfo(note);
 								state.channel_active[channel] = 1;
-								if(song->instruments[inst]->getSampleForNote(note)->getLoop() != 0) {
+								if(ni->loop != NO_LOOP) {
 									state.channel_loop[channel] = true;
 									state.channel_ms_left[channel] = 0;
 								} else {
 									state.channel_loop[channel] = false;
-									state.channel_ms_left[channel] = song->instruments[inst]->calcPlayLength(note);
+									state.channel_ms_left[channel] = ni->play_length;
 								}
 							}
 							break;
@@ -908,7 +1004,7 @@ void Player::finishEffects(void)
 		u8 effect = state.channel_effect[channel];
 		u8 new_effect = song->patterns[state.pattern][channel][state.row].effect;
 		u8 instidx = state.channel_instrument[channel];
-		Instrument *inst = song->instruments[instidx];
+		Instrument *inst = song->play_instruments[instidx];
 
 		if( (effect != NO_EFFECT) && (new_effect != effect) )
 		{
@@ -916,9 +1012,6 @@ void Player::finishEffects(void)
 			{
 				case(EFFECT_ARPEGGIO):
 				{
-					if (inst == 0)
-						continue;
-
 					// Reset note
 					inst->bendNote(state.channel_note[channel] + 0,
 									state.channel_note[channel], 0, channel);
@@ -938,8 +1031,6 @@ void Player::finishEffects(void)
 				
 				case(EFFECT_VIBRATO):
 				{
-					if (inst== 0)
-						continue;
 					resetVibrato(channel);
 					break;
 				}
@@ -959,8 +1050,9 @@ void Player::initState(void)
 	state.patternloop = false;
 	memset(state.channel_active, 0, sizeof(state.channel_active));
 	memset(state.channel_ms_left, 0, sizeof(state.channel_ms_left));
-	memset(state.channel_note, EMPTY_NOTE, sizeof(state.channel_note));
-	memset(state.channel_prev_note, EMPTY_NOTE, sizeof(state.channel_prev_note));
+	// Always a valid note, so the effects can look it up without checks
+	memset(state.channel_note, 0, sizeof(state.channel_note));
+	memset(state.channel_prev_note, 0, sizeof(state.channel_prev_note));
 	memset(state.channel_instrument, NO_INSTRUMENT, sizeof(state.channel_instrument));
 	memset(state.channel_effect, NO_EFFECT, sizeof(state.channel_effect));
 	memset(state.channel_effect_param, NO_EFFECT_PARAM, sizeof(state.channel_effect_param));
@@ -979,11 +1071,88 @@ void Player::initState(void)
 	memset(state.channel_vib_accumulator, 0, sizeof(state.channel_vib_accumulator));
 	memset(state.channel_vib_phase_increment, 0, sizeof(state.channel_vib_phase_increment));
 	memset(state.channel_vib_depth, 0, sizeof(state.channel_vib_depth));
+	memset(state.channel_stream, 0, sizeof(state.channel_stream));
 	state.playing_single_sample = false;
 	state.single_sample_ms_remaining = 0;
 	state.single_sample_channel = 0;
 }
 
+// Asks the arm9 for the data once, not for every note until it's there. If
+// too many are pending, the sample is asked for again later.
+void Player::requestSample(Sample *sample)
+{
+	for(u8 i=0; i<n_requested_samples; ++i)
+		if(requested_samples[i] == sample)
+			return;
+
+	if(n_requested_samples == PLAYER_MAX_SAMPLE_REQUESTS)
+		return;
+
+	requested_samples[n_requested_samples++] = sample;
+	CommandRequestSample(sample);
+}
+
+// Channels the hardware stopped no longer play their sample, so the arm9 may
+// free its data
+void Player::releaseStoppedChannels(void)
+{
+	if(ntxm_channel_samples == 0)
+		return;
+
+	for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+		if( (ntxm_channel_samples[channel] != 0) && !(SCHANNEL_CR(channel) & SCHANNEL_ENABLE) )
+			ntxm_channel_samples[channel] = 0;
+}
+
+// Remembers which streamed sample a channel plays, so its play position can
+// be counted. A stream that was replaced by another note is no longer playing.
+void Player::setChannelStream(u8 channel, StreamState *stream)
+{
+	StreamState *old = state.channel_stream[channel];
+	if( (old != 0) && (old != stream) && (old->channel == channel) )
+		old->playing = false;
+
+	state.channel_stream[channel] = stream;
+}
+
+// Advances the play positions of streamed samples and stops them at the end
+void Player::updateStreams(u32 passed_time)
+{
+	for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+	{
+		StreamState *stream = state.channel_stream[channel];
+		if(stream == 0)
+			continue;
+
+		if(stream->channel != channel) // Restarted on another channel
+		{
+			SCHANNEL_CR(channel) = 0;
+			state.channel_stream[channel] = 0;
+			continue;
+		}
+
+		u32 frac = stream->play_frac + passed_time * stream->rate;
+		stream->play_pos += frac >> 16;
+		stream->play_frac = frac & 0xFFFF;
+
+		if(stream->play_pos >= stream->length)
+			stopStream(channel);
+	}
+}
+
+void Player::stopStream(u8 channel)
+{
+	StreamState *stream = state.channel_stream[channel];
+	if(stream == 0)
+		return;
+
+	SCHANNEL_CR(channel) = 0;
+	if(stream->channel == channel)
+		stream->playing = false;
+
+	state.channel_stream[channel] = 0;
+}
+
 void Player::initEffState(void)
 {
 	effstate.pattern_loop_begin = 0;
@@ -1001,36 +1170,46 @@ void Player::initEffState(void)
 
 void Player::initDefaultPanning(void)
 {
-  u8 instidx = song->getInstruments();
+	// The song keeps track of the highest instrument, so this only visits
+	// instruments up to there and their samples
+	u8 instidx = song->n_instruments;
 	u16 smpidx = 0;
 	Instrument *inst;
+	Sample *smp;
 	
 	for ( u8 i = 0; i < instidx; i++)
 	{
 		inst = song->instruments[i];
+		if (inst == 0)
+			continue;
 		smpidx = inst->getSamples();
 		for (u16 j = 0; j < smpidx; j++)
 		{
-			inst->getSample(j)->setBasePanning();
+			smp = inst->getSample(j);
+			if (smp != 0)
+				smp->setBasePanning();
 		}
 	}
 }
 
 void Player::resetPanning(void)
 {
-  u8 instidx = song->getInstruments();
+	u8 instidx = song->n_instruments;
 	u16 smpidx = 0;
 	Instrument *inst;
-	u8 base_pan = 0;
+	Sample *smp;
 
 	for ( u8 i = 0; i < instidx; i++)
 	{
 		inst = song->instruments[i];
+		if (inst == 0)
+			continue;
 		smpidx = inst->getSamples();
 		for (u16 j = 0; j < smpidx; j++)
 		{
-			base_pan = inst->getSample(j)->getBasePanning();
-			inst->getSample(j)->setPanning(base_pan);
+			smp = inst->getSample(j);
+			if (smp != 0)
+				smp->setPanning(smp->getBasePanning());
 		}
 	}
 }
@@ -0,0 +1,236 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <nds.h>
+
+#include "ntxm/adpcm.h"
+#include "ntxm/ntxmtools.h"
+
+static const u16 adpcm_step_table[ADPCM_MAX_INDEX + 1] = {
+	7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+	50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+	253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+	1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+	3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442, 11487,
+	12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const s8 adpcm_index_table[8] = {-1, -1, -1, -1, 2, 4, 6, 8};
+
+// One step of the decoder, exactly as the hardware does it, including its
+// rounding and the clipping at +-0x7FFF
+static inline void adpcmStep(AdpcmState *state, u8 code)
+{
+	u32 step = adpcm_step_table[state->index];
+	
+	s32 diff = step >> 3;
+	if(code & 1) diff += step >> 2;
+	if(code & 2) diff += step >> 1;
+	if(code & 4) diff += step;
+	
+	if(code & 8) {
+		state->value -= diff;
+		if(state->value < -0x7FFF)
+			state->value = -0x7FFF;
+	} else {
+		state->value += diff;
+		if(state->value > 0x7FFF)
+			state->value = 0x7FFF;
+	}
+	
+	state->index += adpcm_index_table[code & 7];
+	if(state->index < 0)
+		state->index = 0;
+	else if(state->index > ADPCM_MAX_INDEX)
+		state->index = ADPCM_MAX_INDEX;
+}
+
+// Picks the code that brings the decoder closest to value
+static inline u8 adpcmCode(const AdpcmState *state, s32 value)
+{
+	s32 delta = value - state->value;
+	u8 sign = 0;
+	if(delta < 0) {
+		sign = 8;
+		delta = -delta;
+	}
+	
+	// The usual IMA quantization rounds down
+	s32 step = adpcm_step_table[state->index];
+	u8 code = 0;
+	if(delta >= step) {
+		code |= 4;
+		delta -= step;
+	}
+	step >>= 1;
+	if(delta >= step) {
+		code |= 2;
+		delta -= step;
+	}
+	step >>= 1;
+	if(delta >= step)
+		code |= 1;
+	
+	if(code == 7)
+		return sign | code;
+	
+	// so the next code up can be closer
+	AdpcmState low = *state, high = *state;
+	adpcmStep(&low, sign | code);
+	adpcmStep(&high, sign | (code + 1));
+	
+	if(abs(high.value - value) < abs(low.value - value))
+		return sign | (code + 1);
+	return sign | code;
+}
+
+static inline s32 pcmValue(const void *src, u32 i, bool is_16_bit)
+{
+	return is_16_bit ? ((const s16*)src)[i] : ((const s8*)src)[i] * 256;
+}
+
+/* ===================== PUBLIC ===================== */
+
+AdpcmEncoder::AdpcmEncoder(u8 *_dest)
+	:dest(_dest), n_samples(0), last(0), signal(0), noise(0)
+{
+	state.value = 0;
+	state.index = 0;
+}
+
+void AdpcmEncoder::start(const void *src, u32 n, bool is_16_bit)
+{
+	state.value = (n > 0) ? pcmValue(src, 0, is_16_bit) : 0;
+	if(state.value < -0x7FFF)
+		state.value = -0x7FFF;
+	
+	// A start index that is too small makes the beginning lag behind, one that
+	// is too large makes it noisy. Try them all on the first samples.
+	u32 n_seed = (n < ADPCM_SEED_SAMPLES) ? n : ADPCM_SEED_SAMPLES;
+	u64 best_error = 0;
+	s32 best_index = 0;
+	
+	for(s32 index=0; index<=ADPCM_MAX_INDEX; ++index)
+	{
+		AdpcmState trial = {state.value, index};
+		u64 error = 0;
+		
+		for(u32 i=0; i<n_seed; ++i)
+		{
+			s32 value = pcmValue(src, i, is_16_bit);
+			adpcmStep(&trial, adpcmCode(&trial, value));
+			s32 diff = trial.value - value;
+			error += (s64)diff * diff;
+		}
+		
+		if( (index == 0) || (error < best_error) ) {
+			best_error = error;
+			best_index = index;
+		}
+	}
+	
+	state.index = best_index;
+	
+	if(dest != 0)
+	{
+		dest[0] = state.value & 0xFF;
+		dest[1] = (state.value >> 8) & 0xFF;
+		dest[2] = state.index;
+		dest[3] = 0;
+	}
+}
+
+void AdpcmEncoder::encode(const void *src, u32 n, bool is_16_bit)
+{
+	for(u32 i=0; i<n; ++i)
+		encodeValue(pcmValue(src, i, is_16_bit));
+}
+
+void AdpcmEncoder::finish(void)
+{
+	while(n_samples % ADPCM_BLOCK_SAMPLES != 0)
+		encodeValue(last);
+}
+
+s16 AdpcmEncoder::getSnr(void)
+{
+	return ntxm_snr(signal, noise);
+}
+
+AdpcmDecoder::AdpcmDecoder(const u8 *_src)
+	:src(_src + ADPCM_HEADER_SIZE), pos(0)
+{
+	state.value = (s16)(_src[0] | (_src[1] << 8));
+	state.index = _src[2];
+	if(state.index > ADPCM_MAX_INDEX)
+		state.index = ADPCM_MAX_INDEX;
+}
+
+void AdpcmDecoder::decode(s16 *out, u32 n)
+{
+	for(u32 i=0; i<n; ++i, ++pos)
+	{
+		u8 code = src[pos >> 1];
+		if(pos & 1)
+			code >>= 4;
+		
+		adpcmStep(&state, code & 0xF);
+		out[i] = state.value;
+	}
+}
+
+/* ===================== PRIVATE ===================== */
+
+void AdpcmEncoder::encodeValue(s32 value)
+{
+	u8 code = adpcmCode(&state, value);
+	adpcmStep(&state, code);
+	
+	if(dest != 0)
+	{
+		u8 *byte = &dest[ADPCM_HEADER_SIZE + (n_samples >> 1)];
+		if(n_samples & 1)
+			*byte |= code << 4;
+		else
+			*byte = code;
+	}
+	
+	s32 diff = state.value - value;
+	signal += (s64)value * value;
+	noise += (s64)diff * diff;
+	
+	last = value;
+	n_samples++;
+}
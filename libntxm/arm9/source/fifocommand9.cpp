@@ -8,11 +8,15 @@
 #include <nds/ndstypes.h>
 #include "ntxm/fifocommand.h"
 #include "ntxm/ntxmtools.h"
+#include "ntxm/song.h"
 
 void (*onUpdateRow)(u16 row) = 0;
 void (*onStop)(void) = 0;
 void (*onPlaySampleFinished)(void) = 0;
 void (*onPotPosChange)(u16 potpos) = 0;
+void (*onSampleRequest)(Sample *sample) = 0;
+
+static volatile u16 last_potpos = 0;
 
 void RegisterRowCallback(void (*onUpdateRow_)(u16))
 {
@@ -34,6 +38,16 @@ void RegisterPotPosChangeCallback(void (*onPotPosChange_)(u16))
     onPotPosChange = onPotPosChange_;
 }
 
+void RegisterSampleRequestCallback(void (*onSampleRequest_)(Sample*))
+{
+    onSampleRequest = onSampleRequest_;
+}
+
+u16 GetPotPos(void)
+{
+    return last_potpos;
+}
+
 void RecvCommandUpdateRow(UpdateRowCommand *c)
 {
     if(onUpdateRow)
@@ -42,6 +56,7 @@ void RecvCommandUpdateRow(UpdateRowCommand *c)
 
 void RecvCommandUpdatePotPos(UpdatePotPosCommand *c)
 {
+    last_potpos = c->potpos;
     if(onPotPosChange)
         onPotPosChange(c->potpos);
 }
@@ -57,6 +72,12 @@ void RecvCommandSampleFinish(void) {
         onPlaySampleFinished();
 }
 
+void RecvCommandRequestSample(RequestSampleCommand *c)
+{
+    if(onSampleRequest)
+        onSampleRequest(c->sample);
+}
+
 void CommandRecvHandler(int bytes, void *user_data) {
     NTXMFifoMessage msg;
 
@@ -85,6 +106,10 @@ void CommandRecvHandler(int bytes, void *user_data) {
             RecvCommandSampleFinish();
             break;
 
+        case REQUEST_SAMPLE:
+            RecvCommandRequestSample(&msg.requestSample);
+            break;
+
         default:
             break;
     }
@@ -148,6 +173,10 @@ int CommandStopRecording(void)
 
 void CommandSetSong(void *song)
 {
+    // The arm7 only plays validated songs
+    if( (song != 0) && !((Song*)song)->isPlayable() )
+        ((Song*)song)->validate();
+
     NTXMFifoMessage command;
     SetSongCommand* c = &command.setSong;
 
@@ -155,6 +184,10 @@ void CommandSetSong(void *song)
     c->ptr = song;
 
     fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
+
+    // The arm7 answers when it no longer uses the old song
+    fifoWaitValue32(FIFO_NTXM);
+    fifoGetValue32(FIFO_NTXM);
 }
 
 void CommandStartPlay(u8 potpos, u16 row, bool loop)
@@ -167,6 +200,8 @@ void CommandStartPlay(u8 potpos, u16 row, bool loop)
     c->row = row;
     c->loop = loop;
 
+    last_potpos = potpos;
+
     fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
 }
 
@@ -242,3 +277,29 @@ void CommandSetStereoOutput(bool state)
 
     fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
 }
+
+void CommandSampleRequestDone(Sample *sample)
+{
+    NTXMFifoMessage command;
+    command.commandType = SAMPLE_REQUEST_DONE;
+
+    RequestSampleCommand* c = &command.requestSample;
+    c->sample = sample;
+
+    fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
+}
+
+void CommandSetChannelSamples(Sample **table)
+{
+    NTXMFifoMessage command;
+    command.commandType = SET_CHANNEL_SAMPLES;
+
+    SetChannelSamplesCommand* c = &command.setChannelSamples;
+    c->table = table;
+
+    fifoSendDatamsg(FIFO_NTXM, sizeof(command), (u8*)&command);
+
+    // The arm7 answers when it no longer writes to the old table
+    fifoWaitValue32(FIFO_NTXM);
+    fifoGetValue32(FIFO_NTXM);
+}
@@ -207,6 +207,7 @@ u16 ModTransport::load(const char *filename, Song **_song)
 	
 	fclose(modfile);
 	
+	song->validate();
 	*_song = song;
 	
 	return 0;
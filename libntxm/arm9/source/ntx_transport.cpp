@@ -0,0 +1,668 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <nds.h>
+
+#include "ntxm/ntx_transport.h"
+#include "ntxm/reader.h"
+#include "ntxm/ntxmtools.h"
+#include "ntxm/adpcm.h"
+
+#define ALIGN4(x)	(((x) + 3) & ~3)
+
+const char *ntxtransporterrors[] =
+	{"could not open file",
+	"not an ntx file",
+	"unsupported ntx version",
+	"memory full",
+	"read error",
+	"file is corrupt",
+	"disk is full",
+	"sample is not loaded"};
+
+// Names are stored without the terminating zero if they fill the field
+static void copyName(char *dest, const char *name, u32 size)
+{
+	u32 len = strlen(name);
+	memcpy(dest, name, (len < size) ? len : size);
+}
+
+static bool channelEmpty(const Cell *cells, u16 rows, const Cell *empty)
+{
+	for(u16 row=0; row<rows; ++row)
+		if(memcmp(&cells[row], empty, sizeof(Cell)) != 0)
+			return false;
+	
+	return true;
+}
+
+static u8 countChannels(u16 mask)
+{
+	u8 n = 0;
+	for(; mask != 0; mask >>= 1)
+		n += mask & 1;
+	
+	return n;
+}
+
+/* ===================== PUBLIC ===================== */
+
+NTXTransport::NTXTransport()
+	:song(0), block(0), block_buffer(0), block_size(0), file_start(0), header(0),
+	patterns(0), instruments(0), samples(0)
+{
+}
+
+NTXTransport::~NTXTransport()
+{
+}
+
+u16 NTXTransport::load(const char *filename, Song **_song)
+{
+	FileReader reader(filename);
+	if(!reader.isOpen())
+		return NTX_TRANSPORT_ERROR_FOPENFAIL;
+	
+	return load(&reader, _song);
+}
+
+u16 NTXTransport::loadFromMemory(const u8 *data, u32 size, Song **_song)
+{
+	MemoryReader reader(data, size);
+	return load(&reader, _song);
+}
+
+u16 NTXTransport::loadInPlace(u8 *data, u32 size, Song **_song)
+{
+	MemoryReader reader(data, size, true);
+	return load(&reader, _song);
+}
+
+u16 NTXTransport::load(Reader *reader, Song **_song)
+{
+	u16 err = loadBlock(reader);
+	
+	if(err == 0)
+		err = loadPatterns();
+	
+	if(err == 0)
+		err = loadInstruments(reader);
+	
+	if(err == 0)
+		song->validate();
+	
+	free(block_buffer);
+	block_buffer = 0;
+	block = 0;
+	header = 0;
+	
+	if(err != 0)
+	{
+		my_dprintf("loading failed: %s\n", getError(err));
+		delete song;
+		song = 0;
+		return err;
+	}
+	
+	DC_FlushAll();
+	
+	*_song = song;
+	song = 0;
+	
+	return 0;
+}
+
+u16 NTXTransport::save(const char *filename, Song *song)
+{
+	Cell empty;
+	song->clearCell(&empty);
+	
+	u16 n_patterns = song->getNumPatterns();
+	u16 n_inst = song->getInstruments();
+	u8 n_channels = song->getChannels();
+	
+	u16 n_samples = 0;
+	for(u16 inst=0; inst<n_inst; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			// Lazy samples may not be in RAM, streamed ones never are
+			if( (sample != 0) && (!sample->isLoaded() || (sample->getStream() != 0)) )
+				return NTX_TRANSPORT_SAMPLE_NOT_LOADED;
+		}
+		
+		n_samples += instrument->getSamples();
+	}
+	
+	//
+	// Lay out the file
+	//
+	
+	u32 patterns_offset = sizeof(NTXHeader);
+	u32 instruments_offset = patterns_offset + sizeof(NTXPattern)*n_patterns;
+	u32 samples_offset = instruments_offset + sizeof(NTXInstrument)*n_inst;
+	u32 size = samples_offset + sizeof(NTXSample)*n_samples;
+	
+	u16 *channel_masks = (u16*)malloc(sizeof(u16)*n_patterns);
+	if(channel_masks == 0)
+		return NTX_TRANSPORT_ERROR_MEMFULL;
+	
+	// Empty channels are left out
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		Cell **pattern = song->getPattern(ptn);
+		u16 rows = song->getPatternLength(ptn);
+		
+		channel_masks[ptn] = 0;
+		for(u8 chn=0; chn<n_channels; ++chn)
+			if(!channelEmpty(pattern[chn], rows, &empty))
+				channel_masks[ptn] |= BIT(chn);
+		
+		size = ALIGN4(size) + sizeof(Cell)*rows*countChannels(channel_masks[ptn]);
+	}
+	
+	u32 data_offset = ALIGN4(size);
+	
+	u8 *out = (u8*)calloc(1, data_offset);
+	if(out == 0)
+	{
+		free(channel_masks);
+		return NTX_TRANSPORT_ERROR_MEMFULL;
+	}
+	
+	//
+	// Header
+	//
+	
+	NTXHeader *head = (NTXHeader*)out;
+	memcpy(head->magic, NTX_MAGIC, 4);
+	head->version = NTX_VERSION;
+	head->data_offset = data_offset;
+	copyName(head->name, song->getName(), MAX_SONG_NAME_LENGTH);
+	head->speed = song->getTempo();
+	head->bpm = song->getBPM();
+	head->n_channels = n_channels;
+	head->restart_position = song->getRestartPosition();
+	head->pot_length = song->getPotLength();
+	head->n_patterns = n_patterns;
+	head->n_instruments = n_inst;
+	head->n_samples = n_samples;
+	head->patterns = patterns_offset;
+	head->instruments = instruments_offset;
+	head->samples = samples_offset;
+	
+	for(u16 i=0; i<head->pot_length; ++i)
+		head->pot[i] = song->getPotEntry(i);
+	
+	//
+	// Patterns
+	//
+	
+	NTXPattern *ntx_patterns = (NTXPattern*)(out + patterns_offset);
+	u32 pos = samples_offset + sizeof(NTXSample)*n_samples;
+	
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		Cell **pattern = song->getPattern(ptn);
+		u16 rows = song->getPatternLength(ptn);
+		
+		pos = ALIGN4(pos);
+		ntx_patterns[ptn].cells = pos;
+		ntx_patterns[ptn].rows = rows;
+		ntx_patterns[ptn].channels = channel_masks[ptn];
+		
+		for(u8 chn=0; chn<n_channels; ++chn)
+		{
+			if(channel_masks[ptn] & BIT(chn))
+			{
+				memcpy(out + pos, pattern[chn], sizeof(Cell)*rows);
+				pos += sizeof(Cell)*rows;
+			}
+		}
+	}
+	
+	free(channel_masks);
+	
+	//
+	// Instruments and samples
+	//
+	
+	NTXInstrument *ntx_instruments = (NTXInstrument*)(out + instruments_offset);
+	NTXSample *ntx_samples = (NTXSample*)(out + samples_offset);
+	u16 sample_idx = 0;
+	u32 data_pos = data_offset;
+	
+	for(u16 inst=0; inst<n_inst; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		NTXInstrument *ntx_inst = &ntx_instruments[inst];
+		copyName(ntx_inst->name, instrument->getName(), MAX_INST_NAME_LENGTH);
+		ntx_inst->flags = NTX_INST_PRESENT;
+		ntx_inst->type = instrument->type;
+		ntx_inst->volume = instrument->volume;
+		ntx_inst->n_samples = instrument->getSamples();
+		ntx_inst->first_sample = sample_idx;
+		
+		ntx_inst->vol_flags = (instrument->vol_env_on ? NTX_ENV_ON : 0) |
+			(instrument->vol_env_sustain ? NTX_ENV_SUSTAIN : 0) | (instrument->vol_env_loop ? NTX_ENV_LOOP : 0);
+		ntx_inst->pan_flags = (instrument->pan_env_on ? NTX_ENV_ON : 0) |
+			(instrument->pan_env_sustain ? NTX_ENV_SUSTAIN : 0) | (instrument->pan_env_loop ? NTX_ENV_LOOP : 0);
+		ntx_inst->n_vol_points = instrument->n_vol_points;
+		ntx_inst->vol_sustain_point = instrument->vol_sustain_point;
+		ntx_inst->n_pan_points = instrument->n_pan_points;
+		ntx_inst->pan_sustain_point = instrument->pan_sustain_point;
+		
+		// Unused points are not initialised, they stay 0 from the calloc
+		for(u8 i=0; (i<instrument->n_vol_points) && (i<MAX_ENV_POINTS); ++i)
+		{
+			ntx_inst->vol_points[2*i] = instrument->vol_envelope_x[i];
+			ntx_inst->vol_points[2*i+1] = instrument->vol_envelope_y[i];
+		}
+		for(u8 i=0; (i<instrument->n_pan_points) && (i<MAX_ENV_POINTS); ++i)
+		{
+			ntx_inst->pan_points[2*i] = instrument->pan_envelope_x[i];
+			ntx_inst->pan_points[2*i+1] = instrument->pan_envelope_y[i];
+		}
+		
+		memcpy(ntx_inst->note_samples, instrument->note_samples, MAX_OCTAVE*12);
+		
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			NTXSample *ntx_sample = &ntx_samples[sample_idx++];
+			
+			ntx_sample->data = data_pos;
+			if(sample == 0)
+				continue;
+			
+			u32 bytes = sample->getSize();
+			
+			ntx_sample->n_samples = sample->getNSamples();
+			ntx_sample->loop_start = sample->getLoopStart();
+			ntx_sample->loop_length = sample->getLoopLength();
+			ntx_sample->flags = NTX_SAMPLE_PRESENT | (sample->is16bit() ? NTX_SAMPLE_16BIT : 0) |
+				(sample->isCompressed() ? NTX_SAMPLE_ADPCM : 0);
+			ntx_sample->loop = sample->getLoop();
+			ntx_sample->volume = sample->getVolume();
+			ntx_sample->panning = sample->getBasePanning();
+			ntx_sample->rel_note = sample->getRelNote();
+			ntx_sample->finetune = sample->getFinetune();
+			copyName(ntx_sample->name, sample->getName(), SAMPLE_NAME_LENGTH);
+			
+			data_pos += ALIGN4(bytes);
+		}
+	}
+	
+	head->file_size = data_pos;
+	
+	//
+	// Write it all, the song data with one write and the samples with one each
+	//
+	
+	FILE *file = fopen(filename, "wb");
+	if(file == NULL)
+	{
+		free(out);
+		return NTX_TRANSPORT_ERROR_FOPENFAIL;
+	}
+	
+	bool ok = (fwrite(out, 1, data_offset, file) == data_offset);
+	free(out);
+	
+	for(u16 inst=0; ok && (inst<n_inst); ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u16 smp=0; ok && (smp<instrument->getSamples()); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if(sample == 0)
+				continue;
+			
+			u32 bytes = sample->getSize();
+			u32 padding = ALIGN4(bytes) - bytes;
+			u32 zero = 0;
+			
+			ok = (fwrite(sample->getData(), 1, bytes, file) == bytes) &&
+				(fwrite(&zero, 1, padding, file) == padding);
+		}
+	}
+	
+	if(fclose(file) != 0)
+		ok = false;
+	
+	if(!ok)
+		return NTX_TRANSPORT_DISK_FULL;
+	
+	return 0;
+}
+
+const char *NTXTransport::getError(u16 error_id)
+{
+	return ntxtransporterrors[error_id-1];
+}
+
+/* ===================== PRIVATE ===================== */
+
+// Gets everything before the sample data. Songs in memory are used from
+// there if they are word aligned, else it is read in one go.
+u16 NTXTransport::loadBlock(Reader *reader)
+{
+	file_start = reader->tell();
+	u32 available = reader->getSize() - file_start;
+	
+	NTXHeader head;
+	const u8 *mem = reader->getPointer(sizeof(NTXHeader));
+	if( (mem != 0) && (((uintptr_t)mem & 3) == 0) )
+		memcpy(&head, mem, sizeof(NTXHeader));
+	else if(reader->read(&head, sizeof(NTXHeader)) != sizeof(NTXHeader))
+		return NTX_TRANSPORT_ERROR_MAGICNUMBERINVALID;
+	else
+		mem = 0;
+	
+	if(memcmp(head.magic, NTX_MAGIC, 4) != 0)
+		return NTX_TRANSPORT_ERROR_MAGICNUMBERINVALID;
+	
+	if( (head.version == 0) || (head.version > NTX_VERSION) )
+		return NTX_TRANSPORT_ERROR_VERSION;
+	
+	if( (head.data_offset < sizeof(NTXHeader)) || (head.data_offset > head.file_size) ||
+		(head.file_size > available) )
+		return NTX_TRANSPORT_ERROR_CORRUPT;
+	
+	if( (head.n_channels == 0) || (head.n_channels > MAX_CHANNELS) ||
+		(head.n_patterns == 0) || (head.n_patterns > MAX_PATTERNS) ||
+		(head.pot_length == 0) || (head.pot_length > MAX_POT_LENGTH) ||
+		(head.n_instruments > MAX_INSTRUMENTS) )
+		return NTX_TRANSPORT_ERROR_CORRUPT;
+	
+	block_size = head.data_offset;
+	
+	if(mem != 0)
+	{
+		block = reader->getPointer(block_size);
+		if(block == 0)
+			return NTX_TRANSPORT_ERROR_READ;
+		reader->skip(block_size);
+	}
+	else
+	{
+		block_buffer = (u8*)malloc(block_size);
+		if(block_buffer == 0)
+			return NTX_TRANSPORT_ERROR_MEMFULL;
+		
+		memcpy(block_buffer, &head, sizeof(NTXHeader));
+		
+		u32 rest = block_size - sizeof(NTXHeader);
+		if(reader->read(block_buffer + sizeof(NTXHeader), rest) != rest)
+			return NTX_TRANSPORT_ERROR_READ;
+		
+		block = block_buffer;
+	}
+	
+	// Offsets to pointers
+	header = (const NTXHeader*)block;
+	patterns = (const NTXPattern*)relocate(header->patterns, sizeof(NTXPattern)*header->n_patterns);
+	instruments = (const NTXInstrument*)relocate(header->instruments, sizeof(NTXInstrument)*header->n_instruments);
+	samples = (const NTXSample*)relocate(header->samples, sizeof(NTXSample)*header->n_samples);
+	
+	if( (patterns == 0) || (instruments == 0) || (samples == 0) )
+		return NTX_TRANSPORT_ERROR_CORRUPT;
+	
+	return 0;
+}
+
+// Turns an offset in the file into a pointer into the block, or 0 if the
+// data would not be inside the block or is not word aligned
+const void *NTXTransport::relocate(u32 offset, u32 size)
+{
+	if( (offset & 3) || (offset > block_size) || (size > block_size - offset) )
+		return 0;
+	
+	return block + offset;
+}
+
+u16 NTXTransport::loadPatterns(void)
+{
+	char name[MAX_SONG_NAME_LENGTH+1] = {0};
+	memcpy(name, header->name, MAX_SONG_NAME_LENGTH);
+	
+	song = new Song(header->speed, header->bpm, header->n_channels);
+	if(song == 0)
+		return NTX_TRANSPORT_ERROR_MEMFULL;
+	
+	song->setName(name);
+	song->setRestartPosition(header->restart_position);
+	
+	song->setPotEntry(0, header->pot[0]); // The first entry is made automatically by the song
+	for(u16 i=1; i<header->pot_length; ++i)
+		song->potAdd(header->pot[i]);
+	
+	for(u16 ptn=0; ptn<header->n_patterns; ++ptn)
+	{
+		const NTXPattern *ntx_pattern = &patterns[ptn];
+		u16 rows = ntx_pattern->rows;
+		u16 channels = ntx_pattern->channels;
+		
+		if( (rows == 0) || (rows > MAX_PATTERN_LENGTH) || (channels >> header->n_channels) )
+			return NTX_TRANSPORT_ERROR_CORRUPT;
+		
+		const Cell *cells = (const Cell*)relocate(ntx_pattern->cells, sizeof(Cell)*rows*countChannels(channels));
+		if(cells == 0)
+			return NTX_TRANSPORT_ERROR_CORRUPT;
+		
+		bool added;
+		if(ptn > 0)
+			added = song->addPattern(rows);
+		else
+			added = song->resizePattern(0, rows); // The first pattern is made by the song
+		if(!added)
+			return NTX_TRANSPORT_ERROR_MEMFULL;
+		
+		// The new pattern is empty, so only the stored channels are copied
+		Cell **pattern = song->getPattern(ptn);
+		for(u8 chn=0; chn<header->n_channels; ++chn)
+		{
+			if(channels & BIT(chn))
+			{
+				memcpy(pattern[chn], cells, sizeof(Cell)*rows);
+				cells += rows;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+u16 NTXTransport::loadInstruments(Reader *reader)
+{
+	for(u16 inst=0; inst<header->n_instruments; ++inst)
+	{
+		const NTXInstrument *ntx_inst = &instruments[inst];
+		if(!(ntx_inst->flags & NTX_INST_PRESENT))
+			continue;
+		
+		if( (ntx_inst->n_samples > MAX_INSTRUMENT_SAMPLES) ||
+			(ntx_inst->first_sample + ntx_inst->n_samples > header->n_samples) ||
+			(ntx_inst->n_vol_points > MAX_ENV_POINTS) || (ntx_inst->n_pan_points > MAX_ENV_POINTS) )
+			return NTX_TRANSPORT_ERROR_CORRUPT;
+		
+		char name[MAX_INST_NAME_LENGTH+1] = {0};
+		memcpy(name, ntx_inst->name, MAX_INST_NAME_LENGTH);
+		
+		Instrument *instrument = new Instrument(name, ntx_inst->type, ntx_inst->volume);
+		if(instrument == 0)
+			return NTX_TRANSPORT_ERROR_MEMFULL;
+		
+		instrument->setVolumeEnvelope((u16*)ntx_inst->vol_points, ntx_inst->n_vol_points, ntx_inst->vol_sustain_point,
+			ntx_inst->vol_flags & NTX_ENV_ON, ntx_inst->vol_flags & NTX_ENV_SUSTAIN, ntx_inst->vol_flags & NTX_ENV_LOOP);
+		instrument->setPanningEnvelope((u16*)ntx_inst->pan_points, ntx_inst->n_pan_points, ntx_inst->pan_sustain_point,
+			ntx_inst->pan_flags & NTX_ENV_ON, ntx_inst->pan_flags & NTX_ENV_SUSTAIN, ntx_inst->pan_flags & NTX_ENV_LOOP);
+		
+		memcpy(instrument->note_samples, ntx_inst->note_samples, MAX_OCTAVE*12);
+		
+		// The samples are put in directly, so the note table is built only once
+		if(ntx_inst->n_samples > 0)
+		{
+			instrument->samples = (Sample**)calloc(ntx_inst->n_samples, sizeof(Sample*));
+			if(instrument->samples == 0)
+			{
+				delete instrument;
+				return NTX_TRANSPORT_ERROR_MEMFULL;
+			}
+			instrument->n_samples = ntx_inst->n_samples;
+		}
+		
+		for(u8 smp=0; smp<ntx_inst->n_samples; ++smp)
+		{
+			u16 err = 0;
+			instrument->samples[smp] = loadSample(reader, &samples[ntx_inst->first_sample + smp], &err);
+			if(err != 0)
+			{
+				delete instrument;
+				return err;
+			}
+		}
+		
+		instrument->updateNoteTable();
+		song->setInstrument(inst, instrument);
+	}
+	
+	return 0;
+}
+
+// Returns 0 for empty sample slots and on errors
+Sample *NTXTransport::loadSample(Reader *reader, const NTXSample *ntx_sample, u16 *err)
+{
+	if(!(ntx_sample->flags & NTX_SAMPLE_PRESENT))
+		return 0;
+	
+	bool is_16_bit = ntx_sample->flags & NTX_SAMPLE_16BIT;
+	bool is_adpcm = ntx_sample->flags & NTX_SAMPLE_ADPCM;
+	// 64 bit, so huge sample counts can't wrap around
+	u64 file_bytes = is_16_bit ? 2*(u64)ntx_sample->n_samples : ntx_sample->n_samples;
+	if(is_adpcm)
+		file_bytes = ADPCM_SIZE((u64)ntx_sample->n_samples);
+	
+	if( (ntx_sample->data & 3) || (ntx_sample->data < header->data_offset) ||
+		(ntx_sample->data > header->file_size) || (file_bytes > header->file_size - ntx_sample->data) ||
+		(ntx_sample->loop > PING_PONG_LOOP) ||
+		// ADPCM samples are made of whole words, so their loops can be too
+		( is_adpcm && ( (ntx_sample->n_samples == 0) || (ntx_sample->n_samples % ADPCM_BLOCK_SAMPLES != 0) ) ) )
+	{
+		*err = NTX_TRANSPORT_ERROR_CORRUPT;
+		return 0;
+	}
+	u32 bytes = file_bytes;
+	
+	reader->skip((s32)(file_start + ntx_sample->data) - (s32)reader->tell());
+	
+	// Writable buffers are played from directly, other data is copied
+	void *data = 0;
+	bool external_data = false;
+	
+	if(bytes > 0)
+	{
+		data = reader->getWritablePointer(bytes);
+		if((uintptr_t)data & 3)
+			data = 0;
+		
+		if(data != 0)
+		{
+			external_data = true;
+			reader->skip(bytes);
+		}
+		else
+		{
+			data = malloc(bytes);
+			if(data == 0)
+			{
+				*err = NTX_TRANSPORT_ERROR_MEMFULL;
+				return 0;
+			}
+			
+			if(reader->read(data, bytes) != bytes)
+			{
+				free(data);
+				*err = NTX_TRANSPORT_ERROR_READ;
+				return 0;
+			}
+		}
+	}
+	
+	Sample *sample = new Sample(data, ntx_sample->n_samples, 8363, is_16_bit);
+	if(sample == 0)
+	{
+		if(!external_data)
+			free(data);
+		*err = NTX_TRANSPORT_ERROR_MEMFULL;
+		return 0;
+	}
+	
+	char name[SAMPLE_NAME_LENGTH+1] = {0};
+	memcpy(name, ntx_sample->name, SAMPLE_NAME_LENGTH);
+	
+	sample->setExternalData(external_data);
+	sample->setVolume(ntx_sample->volume);
+	sample->setRelNote(ntx_sample->rel_note);
+	sample->setFinetune(ntx_sample->finetune);
+	sample->setPanning(ntx_sample->panning);
+	sample->setBasePanning();
+	sample->setName(name);
+	if(is_adpcm)
+		sample->setAdpcmData();
+	
+	// The loop is set before the loop type, so a ping-pong loop is built only once
+	sample->setLoopStartAndLength(ntx_sample->loop_start, ntx_sample->loop_length);
+	if(!sample->setLoop(ntx_sample->loop))
+	{
+		delete sample;
+		*err = NTX_TRANSPORT_ERROR_MEMFULL;
+		return 0;
+	}
+	
+	return sample;
+}
@@ -35,7 +35,7 @@
 #include "ntxm/fifocommand.h"
 
 NTXM9::NTXM9()
-	:xm_transport(0), song(0)
+	:xm_transport(0), sample_cache(0), song(0), play_early(false), song_sent(false)
 {
 	xm_transport = new XMTransport();
 	CommandInit();
@@ -43,19 +43,125 @@ NTXM9::NTXM9()
 
 NTXM9::~NTXM9()
 {
+	unloadSong();
 	delete xm_transport;
-	
-	if(song != 0)
-		delete song;
 }
 
 u16 NTXM9::load(const char *filename)
 {
+	unloadSong();
+	
 	u16 err = xm_transport->load(filename, &song);
 	CommandSetSong(song);
 	return err;
 }
 
+u16 NTXM9::beginLoad(const char *filename, bool _play_early)
+{
+	unloadSong();
+	
+	play_early = _play_early;
+	song_sent = false;
+	
+	return xm_transport->beginLoad(filename);
+}
+
+u16 NTXM9::loadStep(u32 budget_us)
+{
+	u16 err = xm_transport->step(budget_us);
+	
+	// A load that finished without a song failed. finish() deletes the song
+	// then, so the arm7 has to let go of it first.
+	bool failed = (err != 0) || ( (xm_transport->loadFinished()) && (xm_transport->getLoadingSong() == 0) );
+	if(failed)
+	{
+		if(song_sent)
+		{
+			CommandStopPlay();
+			CommandSetSong(0);
+		}
+		u16 finish_err = xm_transport->finish(&song);
+		song = 0;
+		song_sent = false;
+		return (err != 0) ? err : finish_err;
+	}
+	
+	if( (play_early) && (!song_sent) && (xm_transport->getLoadingSong() != 0) )
+	{
+		song = xm_transport->getLoadingSong();
+		CommandSetSong(song);
+		song_sent = true;
+	}
+	
+	if(xm_transport->loadFinished())
+	{
+		err = xm_transport->finish(&song);
+		if( (err == 0) && (!song_sent) )
+			CommandSetSong(song);
+		song_sent = false;
+		return err;
+	}
+	
+	return 0;
+}
+
+bool NTXM9::loadFinished(void)
+{
+	return xm_transport->loadFinished();
+}
+
+u8 NTXM9::getLoadProgress(void)
+{
+	return xm_transport->getLoadProgress();
+}
+
+u16 NTXM9::loadLazy(const char *filename, u32 sample_budget, u32 stream_min_size)
+{
+	unloadSong();
+	
+	FileReader *reader = new FileReader(filename);
+	if(!reader->isOpen())
+	{
+		delete reader;
+		return XM_TRANSPORT_ERROR_FOPENFAIL;
+	}
+	
+	xm_transport->setLazySamples(true);
+	u16 err = xm_transport->load(reader, &song);
+	xm_transport->setLazySamples(false);
+	
+	if(err != 0)
+	{
+		delete reader;
+		song = 0;
+		return err;
+	}
+	
+	// Have the beginning of the song ready before it is played
+	sample_cache = new SampleCache(song, reader, sample_budget);
+	if(stream_min_size > 0)
+		sample_cache->streamLongSamples(stream_min_size);
+	sample_cache->update(0);
+	
+	CommandSetSong(song);
+	
+	return 0;
+}
+
+void NTXM9::update(void)
+{
+	if(sample_cache != 0)
+		sample_cache->update(GetPotPos());
+}
+
+u32 NTXM9::getStreamUnderruns(void)
+{
+	if(sample_cache == 0)
+		return 0;
+	
+	return sample_cache->getStreamUnderruns();
+}
+
 const char *NTXM9::getError(u16 error_id)
 {
 	return xm_transport->getError(error_id);
@@ -76,3 +182,25 @@ void NTXM9::stop(void)
 	
 	CommandStopPlay();
 }
+
+// Takes the song away from the arm7 and deletes it
+void NTXM9::unloadSong(void)
+{
+	if(song == 0)
+		return;
+	
+	// Returns when the arm7 no longer plays it
+	CommandStopPlay();
+	CommandSetSong(0);
+	
+	delete sample_cache;
+	sample_cache = 0;
+	
+	// A song that is still loading belongs to the transport
+	if(song_sent)
+		xm_transport->abortLoad();
+	else
+		delete song;
+	song = 0;
+	song_sent = false;
+}
@@ -0,0 +1,291 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntxm/reader.h"
+#include "ntxm/ntxmtools.h"
+
+/* ===================== Reader ===================== */
+
+u32 Reader::readDeltaCoded(void *dest, u32 size, bool is_16_bit, s16 *last)
+{
+	u8 *data = (u8*)dest;
+	u32 done = 0;
+	
+	while(done < size)
+	{
+		u32 block = size - done;
+		if(block > READER_DECODE_BLOCK_SIZE)
+			block = READER_DECODE_BLOCK_SIZE;
+		
+		u32 got = read(data + done, block);
+		ntxm_delta_decode(data + done, data + done, got, is_16_bit, last);
+		done += got;
+		
+		if(got < block)
+			break;
+	}
+	
+	return done;
+}
+
+/* ===================== FileReader ===================== */
+
+FileReader::FileReader(const char *filename, u32 buffer_size)
+	:size(0)
+{
+	file = fopen(filename, "r");
+	if(file == NULL)
+		return;
+	
+	setvbuf(file, NULL, _IOFBF, buffer_size);
+	
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+}
+
+FileReader::~FileReader()
+{
+	if(file != NULL)
+		fclose(file);
+}
+
+u32 FileReader::read(void *dest, u32 size)
+{
+	return fread(dest, 1, size, file);
+}
+
+bool FileReader::skip(s32 offset)
+{
+	return fseek(file, offset, SEEK_CUR) == 0;
+}
+
+u32 FileReader::tell(void)
+{
+	return ftell(file);
+}
+
+/* ===================== MemoryReader ===================== */
+
+MemoryReader::MemoryReader(const u8 *_data, u32 _size)
+	:data(_data), writable_data(0), size(_size), pos(0)
+{
+}
+
+MemoryReader::MemoryReader(u8 *_data, u32 _size, bool writable)
+	:data(_data), writable_data(writable ? _data : 0), size(_size), pos(0)
+{
+}
+
+u32 MemoryReader::read(void *dest, u32 _size)
+{
+	if(pos >= size)
+		return 0;
+	if(_size > size - pos)
+		_size = size - pos;
+	
+	memcpy(dest, data + pos, _size);
+	pos += _size;
+	
+	return _size;
+}
+
+bool MemoryReader::skip(s32 offset)
+{
+	if( (offset < 0) && ((u32)-offset > pos) ) {
+		pos = 0;
+		return false;
+	}
+	
+	pos += offset;
+	if(pos > size) {
+		pos = size;
+		return false;
+	}
+	
+	return true;
+}
+
+const u8 *MemoryReader::getPointer(u32 _size)
+{
+	if( (pos > size) || (_size > size - pos) )
+		return 0;
+	
+	return data + pos;
+}
+
+u8 *MemoryReader::getWritablePointer(u32 _size)
+{
+	if( (writable_data == 0) || (pos > size) || (_size > size - pos) )
+		return 0;
+	
+	return writable_data + pos;
+}
+
+/* ===================== LZ77Reader ===================== */
+
+LZ77Reader::LZ77Reader(Reader *_src)
+	:src(_src), valid(false), size(0), pos(0), window(0)
+{
+	src_start = src->tell();
+	
+	u8 header[4];
+	if( (src->read(header, 4) != 4) || (header[0] != 0x10) )
+		return;
+	
+	size = header[1] | (header[2] << 8) | (header[3] << 16);
+	
+	window = (u8*)malloc(LZ77_WINDOW_SIZE);
+	if(window == 0)
+		return;
+	
+	valid = true;
+	restart();
+}
+
+LZ77Reader::~LZ77Reader()
+{
+	free(window);
+}
+
+u32 LZ77Reader::read(void *dest, u32 _size)
+{
+	if(!valid)
+		return 0;
+	
+	u8 *out = (u8*)dest;
+	u32 n = 0;
+	
+	while( (n < _size) && (pos < size) )
+	{
+		u8 byte;
+		
+		if(copy_len > 0)
+		{
+			byte = window[(pos - copy_disp) & (LZ77_WINDOW_SIZE-1)];
+			copy_len--;
+		}
+		else
+		{
+			if(flag_bits == 0) {
+				flags = nextByte();
+				flag_bits = 8;
+			}
+			
+			bool compressed = flags & 0x80;
+			flags <<= 1;
+			flag_bits--;
+			
+			if(compressed)
+			{
+				// 4 bits length-3, 12 bits displacement-1
+				u8 b0 = nextByte();
+				u8 b1 = nextByte();
+				copy_len = (b0 >> 4) + 3;
+				copy_disp = (((b0 & 0x0F) << 8) | b1) + 1;
+				continue;
+			}
+			
+			byte = nextByte();
+		}
+		
+		window[pos & (LZ77_WINDOW_SIZE-1)] = byte;
+		out[n++] = byte;
+		pos++;
+	}
+	
+	return n;
+}
+
+bool LZ77Reader::skip(s32 offset)
+{
+	if(!valid)
+		return false;
+	
+	u32 target;
+	if(offset < 0) {
+		if((u32)-offset > pos)
+			return false;
+		
+		target = pos + offset;
+		restart();
+	} else {
+		target = pos + offset;
+	}
+	
+	u8 discard[64];
+	while(pos < target)
+	{
+		u32 chunk = target - pos;
+		if(chunk > sizeof(discard))
+			chunk = sizeof(discard);
+		
+		if(read(discard, chunk) != chunk)
+			return false;
+	}
+	
+	return true;
+}
+
+/* ===================== PRIVATE ===================== */
+
+void LZ77Reader::restart(void)
+{
+	// Go back to the first byte after the header
+	src->skip((s32)(src_start + 4) - (s32)src->tell());
+	
+	pos = 0;
+	flags = 0;
+	flag_bits = 0;
+	copy_disp = 0;
+	copy_len = 0;
+	input_pos = 0;
+	input_len = 0;
+}
+
+u8 LZ77Reader::nextByte(void)
+{
+	if(input_pos == input_len)
+	{
+		input_len = src->read(input, LZ77_INPUT_BUFFER);
+		input_pos = 0;
+		
+		if(input_len == 0) // Truncated stream, pad with zeroes
+			return 0;
+	}
+	
+	return input[input_pos++];
+}
@@ -0,0 +1,406 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "ntxm/sample_cache.h"
+#include "ntxm/fifocommand.h"
+#include "ntxm/ntxmtools.h"
+
+#define CHANNEL_SAMPLES_SIZE	((MAX_CHANNELS * sizeof(Sample*) + 31) & ~31)
+
+// The cache that gets the arm7's requests
+static SampleCache *active_cache = 0;
+
+static void onSampleRequest(Sample *sample)
+{
+	if(active_cache != 0)
+		active_cache->request(sample);
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+	u32 sa = (u32)((const SampleCacheEntry*)a)->sample;
+	u32 sb = (u32)((const SampleCacheEntry*)b)->sample;
+	return (sa > sb) - (sa < sb);
+}
+
+/* ===================== PUBLIC ===================== */
+
+SampleCache::SampleCache(Song *_song, Reader *_reader, u32 _budget)
+	:song(_song), reader(_reader), budget(_budget), used(0),
+	lookahead(SAMPLE_CACHE_DEFAULT_LOOKAHEAD), entries(0), n_entries(0), streams(0), n_streams(0),
+	order_counter(SAMPLE_CACHE_KEEP_ORDERS), last_potpos(0xFFFF),
+	channel_samples_mem(0), channel_samples(0), request_head(0), request_tail(0)
+{
+	// Collect the lazy samples, sorted so they can be found quickly
+	for(u8 inst=0; inst<song->getInstruments(); ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument != 0)
+			n_entries += instrument->getSamples();
+	}
+	
+	entries = (SampleCacheEntry*)calloc(n_entries, sizeof(SampleCacheEntry));
+	if(entries == 0)
+		n_entries = 0;
+	
+	u16 n = 0;
+	for(u8 inst=0; (inst<song->getInstruments()) && (n<n_entries); ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u8 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if( (sample != 0) && (sample->getLazyOffset() != 0) )
+				entries[n++].sample = sample;
+		}
+	}
+	n_entries = n;
+	
+	qsort(entries, n_entries, sizeof(SampleCacheEntry), compareEntries);
+	
+	// Whole cache lines, so flushing something else never overwrites it
+	channel_samples_mem = (Sample**)memalign(32, CHANNEL_SAMPLES_SIZE);
+	if(channel_samples_mem != 0)
+	{
+		memset(channel_samples_mem, 0, CHANNEL_SAMPLES_SIZE);
+		DC_FlushRange(channel_samples_mem, CHANNEL_SAMPLES_SIZE);
+		DC_InvalidateRange(channel_samples_mem, CHANNEL_SAMPLES_SIZE);
+		channel_samples = (Sample * volatile *)memUncached(channel_samples_mem);
+		CommandSetChannelSamples(channel_samples_mem);
+	}
+	else
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+	}
+	
+	active_cache = this;
+	RegisterSampleRequestCallback(onSampleRequest);
+}
+
+SampleCache::~SampleCache()
+{
+	if(active_cache == this)
+	{
+		RegisterSampleRequestCallback(0);
+		active_cache = 0;
+	}
+	
+	// Stops the channels that play the samples, then the data can go
+	if(channel_samples_mem != 0)
+	{
+		CommandSetChannelSamples(0);
+		free(channel_samples_mem);
+	}
+	
+	for(u16 i=0; i<n_streams; ++i)
+		delete streams[i];
+	free(streams);
+	
+	for(u16 i=0; i<n_entries; ++i)
+		entries[i].sample->detachData();
+	
+	free(entries);
+	delete reader;
+}
+
+void SampleCache::update(u8 potpos)
+{
+	for(u16 i=0; i<n_streams; ++i)
+		streams[i]->update();
+	
+	if(potpos != last_potpos)
+	{
+		last_potpos = potpos;
+		order_counter++;
+		touchOrders(potpos);
+	}
+	
+	// Samples the arm7 could not play
+	while(request_head != request_tail)
+	{
+		Sample *sample = requests[request_head];
+		request_head = (request_head + 1) % SAMPLE_CACHE_MAX_REQUESTS;
+		
+		SampleCacheEntry *entry = findEntry(sample);
+		if(entry != 0)
+		{
+			entry->last_used = order_counter;
+			load(sample);
+		}
+		
+		CommandSampleRequestDone(sample);
+	}
+}
+
+void SampleCache::request(Sample *sample)
+{
+	u8 next = (request_tail + 1) % SAMPLE_CACHE_MAX_REQUESTS;
+	if(next == request_head) // Full, the arm7 will ask again
+		return;
+	
+	requests[request_tail] = sample;
+	request_tail = next;
+}
+
+bool SampleCache::load(Sample *sample)
+{
+	if(sample->isLoaded())
+		return true;
+	
+	SampleCacheEntry *entry = findEntry(sample);
+	if(entry == 0)
+		return false;
+	
+	// Ping pong loops grow by the reversed loop, which can move the data
+	u32 size = sample->getSize();
+	u32 needed = size;
+	if(sample->getLoop() == PING_PONG_LOOP)
+		needed += 2 * size;
+	
+	if(!makeRoom(needed))
+	{
+		my_dprintf("sample cache full\n");
+		return false;
+	}
+	
+	void *data = memalign(4, size);
+	if(data == 0)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return false;
+	}
+	
+	s16 last = 0;
+	if( (!reader->skip((s32)sample->getLazyOffset() - (s32)reader->tell()))
+		|| (reader->readDeltaCoded(data, size, sample->is16bit(), &last) != size) )
+	{
+		my_dprintf("sample read failed\n");
+		free(data);
+		return false;
+	}
+	
+	sample->attachData(data);
+	
+	entry->bytes = sample->getMemorySize();
+	used += entry->bytes;
+	
+	return true;
+}
+
+void SampleCache::evict(Sample *sample)
+{
+	SampleCacheEntry *entry = findEntry(sample);
+	if( (entry == 0) || (entry->bytes == 0) || isPlaying(sample) )
+		return;
+	
+	sample->detachData();
+	used -= entry->bytes;
+	entry->bytes = 0;
+}
+
+void SampleCache::streamLongSamples(u32 min_size)
+{
+	if(min_size < SAMPLE_STREAM_HEAD_SIZE + SAMPLE_STREAM_RING_SIZE)
+		min_size = SAMPLE_STREAM_HEAD_SIZE + SAMPLE_STREAM_RING_SIZE;
+	
+	for(u16 i=0; i<n_entries; ++i)
+	{
+		Sample *sample = entries[i].sample;
+		if( (sample->getLoop() != NO_LOOP) || (sample->getSize() < min_size) || (sample->getStream() != 0) )
+			continue;
+		
+		if(!makeRoom(SAMPLE_STREAM_HEAD_SIZE + SAMPLE_STREAM_RING_SIZE + sizeof(StreamState)))
+			return;
+		
+		SampleStream **new_streams = (SampleStream**)realloc(streams, (n_streams + 1) * sizeof(SampleStream*));
+		if(new_streams == 0)
+			return;
+		streams = new_streams;
+		
+		evict(sample);
+		
+		SampleStream *stream = new SampleStream(sample, reader, sample->getLazyOffset(), true);
+		if(!stream->isValid())
+		{
+			delete stream;
+			continue;
+		}
+		
+		streams[n_streams++] = stream;
+		used += stream->getMemoryUsage();
+	}
+}
+
+u32 SampleCache::getStreamUnderruns(void)
+{
+	u32 underruns = 0;
+	for(u16 i=0; i<n_streams; ++i)
+		underruns += streams[i]->getUnderruns();
+	
+	return underruns;
+}
+
+void SampleCache::setLookahead(u8 orders)
+{
+	lookahead = orders;
+}
+
+u32 SampleCache::getUsedMemory(void)
+{
+	return used;
+}
+
+u32 SampleCache::getBudget(void)
+{
+	return budget;
+}
+
+/* ===================== PRIVATE ===================== */
+
+SampleCacheEntry *SampleCache::findEntry(Sample *sample)
+{
+	s32 lo = 0, hi = (s32)n_entries - 1;
+	while(lo <= hi)
+	{
+		s32 mid = (lo + hi) / 2;
+		if(entries[mid].sample == sample)
+			return &entries[mid];
+		else if((u32)entries[mid].sample < (u32)sample)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	
+	return 0;
+}
+
+// Frees the least recently used samples until size bytes fit into the budget
+bool SampleCache::makeRoom(u32 size)
+{
+	if(size > budget)
+		return false;
+	
+	while(used + size > budget)
+	{
+		SampleCacheEntry *oldest = 0;
+		for(u16 i=0; i<n_entries; ++i)
+		{
+			SampleCacheEntry *entry = &entries[i];
+			if( (entry->bytes == 0) || (entry->last_used + SAMPLE_CACHE_KEEP_ORDERS > order_counter)
+				|| isPlaying(entry->sample) )
+				continue;
+			if( (oldest == 0) || (entry->last_used < oldest->last_used) )
+				oldest = entry;
+		}
+		
+		if(oldest == 0) // Everything loaded is still in use
+			return false;
+		
+		evict(oldest->sample);
+	}
+	
+	return true;
+}
+
+// Marks the samples of the current and the next pattern orders as needed
+// and loads them
+void SampleCache::touchOrders(u8 potpos)
+{
+	u16 order = potpos;
+	
+	for(u8 i=0; i<=lookahead; ++i)
+	{
+		if(order >= song->getPotLength())
+		{
+			order = song->getRestartPosition();
+			if(order >= song->getPotLength())
+				return;
+		}
+		
+		u8 ptn = song->getPotEntry(order);
+		Cell **pattern = song->getPattern(ptn);
+		u16 n_rows = song->getPatternLength(ptn);
+		Sample *prev = 0;
+		
+		for(u8 chn=0; chn<song->getChannels(); ++chn)
+		{
+			for(u16 row=0; row<n_rows; ++row)
+			{
+				Cell *cell = &pattern[chn][row];
+				if( (cell->note > MAX_NOTE) || (cell->instrument >= song->getInstruments()) )
+					continue;
+				
+				Instrument *inst = song->getInstrument(cell->instrument);
+				if(inst == 0)
+					continue;
+				
+				Sample *sample = inst->getNoteInfo(cell->note)->sample;
+				if( (sample == 0) || (sample == prev) )
+					continue;
+				prev = sample;
+				
+				SampleCacheEntry *entry = findEntry(sample);
+				if(entry != 0)
+					entry->last_used = order_counter;
+			}
+		}
+		
+		order++;
+	}
+	
+	// Load in a second pass, so nothing that is needed gets evicted for it
+	for(u16 i=0; i<n_entries; ++i)
+		if(entries[i].last_used == order_counter)
+			load(entries[i].sample);
+}
+
+// A channel that was started with the sample and was not stopped since. The
+// arm7 reads the data as long as that is the case.
+bool SampleCache::isPlaying(Sample *sample)
+{
+	if(channel_samples == 0)
+		return false;
+	
+	for(u8 channel=0; channel<MAX_CHANNELS; ++channel)
+		if(channel_samples[channel] == sample)
+			return true;
+	
+	return false;
+}
@@ -0,0 +1,209 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntxm/sample_pool.h"
+#include "ntxm/ntxmtools.h"
+
+SamplePoolEntry *SamplePool::entries = 0;
+u16 SamplePool::n_entries = 0;
+u16 SamplePool::capacity = 0;
+
+// FNV-1a over words, the pooled data comes from malloc and is aligned
+static u32 hashData(const void *data, u32 bytes)
+{
+	const u32 *words = (const u32*)data;
+	u32 hash = 2166136261u;
+
+	for(u32 i=0; i<bytes/4; ++i)
+		hash = (hash ^ words[i]) * 16777619u;
+
+	const u8 *rest = (const u8*)data + (bytes & ~3);
+	for(u32 i=0; i<(bytes & 3); ++i)
+		hash = (hash ^ rest[i]) * 16777619u;
+
+	return hash;
+}
+
+/* ===================== PUBLIC ===================== */
+
+u32 SamplePool::share(Sample *sample)
+{
+	if( (sample->sound_data == 0) || (sample->pool_data != 0) || (sample->external_data) ||
+		(sample->stream != 0) || (sample->lazy_offset != 0) )
+		return 0;
+
+	// A ping pong loop's reversed part is shared along with the rest
+	u32 bytes = sample->getMemorySize();
+	if(bytes == 0)
+		return 0;
+
+	u32 hash = hashData(sample->sound_data, bytes);
+	u16 idx = findHash(hash);
+
+	for(u16 i=idx; (i<n_entries) && (entries[i].hash == hash); ++i)
+	{
+		SamplePoolEntry *entry = &entries[i];
+		if( (entry->bytes != bytes) || (entry->format != sample->sound_format) ||
+			(memcmp(entry->data, sample->sound_data, bytes) != 0) )
+			continue;
+
+		void *own_data = sample->sound_data;
+		sample->sound_data = entry->data;
+		sample->pool_data = entry->data;
+		sample->external_data = true;
+		DC_FlushRange(sample, sizeof(Sample));
+		free(own_data);
+
+		entry->users++;
+
+		return bytes;
+	}
+
+	if(n_entries == capacity)
+	{
+		u16 new_capacity = (capacity == 0) ? 32 : capacity * 2;
+		SamplePoolEntry *new_entries = (SamplePoolEntry*)realloc(entries, new_capacity * sizeof(SamplePoolEntry));
+		if(new_entries == 0)
+		{
+			my_dprintf("memfull on line %d\n", __LINE__);
+			return 0;
+		}
+		entries = new_entries;
+		capacity = new_capacity;
+	}
+
+	memmove(&entries[idx + 1], &entries[idx], (n_entries - idx) * sizeof(SamplePoolEntry));
+	n_entries++;
+
+	SamplePoolEntry *entry = &entries[idx];
+	entry->data = sample->sound_data;
+	entry->bytes = bytes;
+	entry->hash = hash;
+	entry->format = sample->sound_format;
+	entry->users = 1;
+
+	// The data is the pool's now
+	sample->pool_data = sample->sound_data;
+	sample->external_data = true;
+	DC_FlushRange(sample, sizeof(Sample));
+
+	return 0;
+}
+
+u32 SamplePool::shareSong(Song *song)
+{
+	u32 saved = 0;
+
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+
+		for(u8 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if(sample != 0)
+				saved += share(sample);
+		}
+	}
+
+	return saved;
+}
+
+u32 SamplePool::getSharedBytes(void)
+{
+	u32 bytes = 0;
+	for(u16 i=0; i<n_entries; ++i)
+		bytes += (entries[i].users - 1) * entries[i].bytes;
+	return bytes;
+}
+
+u32 SamplePool::getPooledBytes(void)
+{
+	u32 bytes = 0;
+	for(u16 i=0; i<n_entries; ++i)
+		bytes += entries[i].bytes;
+	return bytes;
+}
+
+u16 SamplePool::getCopies(void)
+{
+	return n_entries;
+}
+
+/* ===================== PRIVATE ===================== */
+
+void SamplePool::release(void *data)
+{
+	for(u16 i=0; i<n_entries; ++i)
+	{
+		if(entries[i].data != data)
+			continue;
+
+		if(--entries[i].users > 0)
+			return;
+
+		free(data);
+		memmove(&entries[i], &entries[i + 1], (n_entries - i - 1) * sizeof(SamplePoolEntry));
+		n_entries--;
+
+		if(n_entries == 0)
+		{
+			free(entries);
+			entries = 0;
+			capacity = 0;
+		}
+		return;
+	}
+
+	my_dprintf("released data that is not pooled\n");
+}
+
+u16 SamplePool::findHash(u32 hash)
+{
+	u16 lo = 0, hi = n_entries;
+	while(lo < hi)
+	{
+		u16 mid = (lo + hi) / 2;
+		if(entries[mid].hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
@@ -0,0 +1,200 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+
+#include "ntxm/sample_stream.h"
+#include "ntxm/ntxmtools.h"
+
+// The state is accessed through an uncached address, so it must have cache
+// lines of its own
+#define STATE_ALLOC_SIZE	((sizeof(StreamState) + 31) & ~31)
+
+/* ===================== PUBLIC ===================== */
+
+SampleStream::SampleStream(Sample *_sample, Reader *_reader, u32 _offset, bool _delta_coded,
+	u32 _head_size, u32 _ring_size)
+	:sample(_sample), reader(_reader), offset(_offset), delta_coded(_delta_coded),
+	state_mem(0), state(0), buffer(0), head_size(_head_size), ring_size(_ring_size),
+	length(_sample->getSize()), fill_pos(0), generation(0), delta_last(0), head_last(0),
+	underruns(0), rewound(false), valid(false)
+{
+	state_mem = (StreamState*)memalign(32, STATE_ALLOC_SIZE);
+	buffer = (u8*)memalign(32, head_size + ring_size);
+	if( (state_mem == 0) || (buffer == 0) || (length < head_size) )
+	{
+		my_dprintf("stream init failed\n");
+		return;
+	}
+	
+	DC_InvalidateRange(state_mem, STATE_ALLOC_SIZE);
+	state = (StreamState*)memUncached(state_mem);
+	memset((void*)state, 0, sizeof(StreamState));
+	
+	state->buffer = buffer;
+	state->head_size = head_size;
+	state->ring_size = ring_size;
+	state->length = length;
+	
+	// The head is read once
+	if( (!reader->skip((s32)offset - (s32)reader->tell()))
+		|| (read(buffer, head_size) != head_size) )
+	{
+		my_dprintf("stream read failed\n");
+		return;
+	}
+	head_last = delta_last;
+	DC_FlushRange(buffer, head_size);
+	
+	rewind();
+	
+	valid = true;
+	sample->setStream(state_mem);
+}
+
+SampleStream::~SampleStream()
+{
+	if(valid)
+		sample->setStream(0);
+	
+	free(state_mem);
+	free(buffer);
+}
+
+bool SampleStream::isValid(void)
+{
+	return valid;
+}
+
+void SampleStream::update(void)
+{
+	if(!valid)
+		return;
+	
+	// While the sample is not playing, get the ring ready for the next start
+	if(!state->playing)
+	{
+		if(!rewound)
+			rewind();
+		return;
+	}
+	
+	// Started again while the ring was still in use. It has to be refilled
+	// while the hardware plays the head.
+	if(state->generation != generation)
+	{
+		generation = state->generation;
+		if(!rewound)
+		{
+			fill_pos = head_size;
+			delta_last = head_last;
+		}
+	}
+	rewound = false;
+	
+	u32 play_pos = state->play_pos;
+	if( (play_pos > fill_pos) && (fill_pos < length) )
+		underruns++;
+	
+	// A ring slot can be written once the hardware has played what was in it
+	if(play_pos < head_size)
+		play_pos = head_size;
+	fill( (play_pos + ring_size - SAMPLE_STREAM_MARGIN) & ~3 );
+}
+
+u16 SampleStream::getUnderruns(void)
+{
+	return underruns;
+}
+
+u32 SampleStream::getMemoryUsage(void)
+{
+	return STATE_ALLOC_SIZE + head_size + ring_size;
+}
+
+/* ===================== PRIVATE ===================== */
+
+u32 SampleStream::read(u8 *dest, u32 size)
+{
+	if(delta_coded)
+		return reader->readDeltaCoded(dest, size, sample->is16bit(), &delta_last);
+	else
+		return reader->read(dest, size);
+}
+
+// Fills the ring with the data that follows the head
+void SampleStream::rewind(void)
+{
+	fill_pos = head_size;
+	delta_last = head_last;
+	fill(head_size + ring_size - SAMPLE_STREAM_MARGIN);
+	generation = state->generation;
+	rewound = true;
+}
+
+// Writes the sample from fill_pos up to target into the ring. Data that was
+// skipped by an underrun is decoded anyway, the delta coding needs it.
+void SampleStream::fill(u32 target)
+{
+	if(fill_pos < length)
+		reader->skip((s32)(offset + fill_pos) - (s32)reader->tell());
+	
+	while(fill_pos < target)
+	{
+		u32 ring_pos = (fill_pos - head_size) % ring_size;
+		u32 size = target - fill_pos;
+		if(size > ring_size - ring_pos)
+			size = ring_size - ring_pos;
+		
+		u8 *dest = buffer + head_size + ring_pos;
+		
+		if(fill_pos < length)
+		{
+			if(size > length - fill_pos)
+				size = length - fill_pos;
+			
+			u32 got = read(dest, size);
+			if(got < size)
+				memset(dest + got, 0, size - got);
+		}
+		else
+		{
+			memset(dest, 0, size); // Silence after the end
+		}
+		
+		DC_FlushRange(dest, size);
+		fill_pos += size;
+	}
+}
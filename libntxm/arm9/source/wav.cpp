@@ -40,9 +40,229 @@
 #endif
 
 #include "ntxm/wav.h"
+#include "ntxm/reader.h"
 
 #ifdef ARM9
 #include "ntxm/ntxmtools.h"
+#include "ntxm/adpcm.h"
+#endif
+
+#define WAV_FORMAT_PCM			0x0001
+#define WAV_FORMAT_FLOAT		0x0003
+#define WAV_FORMAT_IMA_ADPCM	0x0011
+#define WAV_FORMAT_EXTENSIBLE	0xFFFE	// The real format is in the sub format
+
+#define WAV_BLOCK_FRAMES		256		// Frames that are converted at a time
+
+#ifdef ARM9
+
+// IEEE float to 16 bit without floating point math, which the DS would have
+// to emulate. 1.0 is 32768, beyond that is clipped.
+static inline s32 floatValue(u32 bits)
+{
+	// The mantissa with its hidden bit is 1.0 at 2^23, so it is shifted by 8
+	// for exponent 127 (1.0), and one more for every halving
+	s32 shift = 127 + 8 - (s32)((bits >> 23) & 0xFF);
+	s32 value;
+	if(shift >= 24)
+		value = 0;
+	else if(shift <= 8)
+		value = 32768;
+	else
+		value = ((bits & 0x7FFFFF) | 0x800000) >> shift;
+
+	if(bits & 0x80000000)
+		value = -value;
+	return my_clamp(value, -32768, 32767);
+}
+
+// A sample of any format as 16 bit. Only the upper 16 bits of 24 and 32 bit
+// are used.
+template <u16 bits, bool is_float>
+static inline s32 pcmValue(const u8 *src)
+{
+	switch(bits)
+	{
+		case 8:
+			return (src[0] - 128) * 256;
+		case 16:
+			return (s16)(src[0] | (src[1] << 8));
+		case 24:
+			return (s16)(src[1] | (src[2] << 8));
+		default:
+		{
+			u32 word = src[0] | (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
+			return is_float ? floatValue(word) : (s16)(word >> 16);
+		}
+	}
+}
+
+// Averages the channels of each frame. Stereo is mixed like ntxm_mix_to_mono().
+template <u16 bits, bool is_float>
+static void mixFrames(s16 *dest, const u8 *src, u32 n_frames, u16 n_channels)
+{
+	if(n_channels == 1)
+	{
+		for(u32 i=0; i<n_frames; ++i, src += bits / 8)
+			dest[i] = pcmValue<bits, is_float>(src);
+	}
+	else if(n_channels == 2)
+	{
+		for(u32 i=0; i<n_frames; ++i, src += bits / 4)
+			dest[i] = (pcmValue<bits, is_float>(src) + pcmValue<bits, is_float>(src + bits / 8)) >> 1;
+	}
+	else
+	{
+		for(u32 i=0; i<n_frames; ++i)
+		{
+			s32 sum = 0;
+			for(u16 c=0; c<n_channels; ++c, src += bits / 8)
+				sum += pcmValue<bits, is_float>(src);
+			dest[i] = sum / n_channels;
+		}
+	}
+}
+
+static void mixFrames(s16 *dest, const u8 *src, u32 n_frames, u16 n_channels, u16 bits, bool is_float)
+{
+	switch(bits)
+	{
+		case 8:
+			mixFrames<8, false>(dest, src, n_frames, n_channels);
+			break;
+		case 16:
+			mixFrames<16, false>(dest, src, n_frames, n_channels);
+			break;
+		case 24:
+			mixFrames<24, false>(dest, src, n_frames, n_channels);
+			break;
+		default:
+			if(is_float)
+				mixFrames<32, true>(dest, src, n_frames, n_channels);
+			else
+				mixFrames<32, false>(dest, src, n_frames, n_channels);
+			break;
+	}
+}
+
+// Takes the mixed frames, halves their rate and writes them to the sample in
+// its final format. The rate is halved like ntxm_decimate() does it, with a
+// window of 7 samples per halving that is kept from one block to the next.
+class WavOutput {
+	public:
+		WavOutput(u8 *_dest, u32 _n_samples, bool _is_16_bit, bool _dither, u8 _halvings)
+			:dest(_dest), n_samples(_n_samples), pos(0), is_16_bit(_is_16_bit), dither(_dither),
+			halvings(_halvings), n_pending(0), seed(1)
+		{
+			memset(n_in, 0, sizeof(n_in));
+			memset(n_out, 0, sizeof(n_out));
+		}
+
+		void put(const s16 *src, u32 n)
+		{
+			if(halvings == 0)
+			{
+				write(src, n);
+				return;
+			}
+
+			for(u32 i=0; i<n; ++i)
+				halve(0, src[i]);
+		}
+
+		// Repeats the last sample of each halving until it has all its output,
+		// like ntxm_decimate() does at the end
+		void finish(void)
+		{
+			for(u8 level=0; level<halvings; ++level)
+			{
+				u32 n_real = n_in[level];
+				while( (n_real > 0) && (n_out[level] < (n_real + 1) / 2) )
+					halve(level, window[level][6]);
+			}
+
+			flush();
+		}
+
+	private:
+		void halve(u8 level, s32 value)
+		{
+			if(level == halvings)
+			{
+				pending[n_pending++] = value;
+				if(n_pending == WAV_BLOCK_FRAMES)
+					flush();
+				return;
+			}
+
+			s32 *w = window[level];
+			if(n_in[level] == 0)
+			{
+				// The samples before the first are the first
+				for(u8 k=0; k<7; ++k)
+					w[k] = value;
+			}
+			else
+			{
+				for(u8 k=0; k<6; ++k)
+					w[k] = w[k+1];
+				w[6] = value;
+			}
+
+			// Sample 2j is in the middle of the window once 2j+3 is in it
+			u32 i = n_in[level]++;
+			if( (i < 3) || ((i & 1) == 0) )
+				return;
+
+			s32 y = (-w[0] + 9 * w[2] + 16 * w[3] + 9 * w[4] - w[6] + 16) >> 5;
+			n_out[level]++;
+			halve(level + 1, my_clamp(y, -32768, 32767));
+		}
+
+		void flush(void)
+		{
+			write(pending, n_pending);
+			n_pending = 0;
+		}
+
+		void write(const s16 *src, u32 n)
+		{
+			if(n > n_samples - pos)
+				n = n_samples - pos;
+
+			if(is_16_bit)
+			{
+				memcpy((s16*)dest + pos, src, n * 2);
+			}
+			else if(dither)
+			{
+				ntxm_dither_16to8((s8*)dest + pos, src, n, &seed);
+			}
+			else
+			{
+				for(u32 i=0; i<n; ++i)
+					((s8*)dest)[pos + i] = my_clamp((src[i] + 128) >> 8, -128, 127);
+			}
+
+			pos += n;
+		}
+
+		u8 *dest;
+		u32 n_samples;
+		u32 pos;
+		bool is_16_bit;
+		bool dither;		// 16 bit sources are dithered, 8 bit ones are only rounded
+		u8 halvings;
+
+		s32 window[WAV_MAX_HALVINGS][7];
+		u32 n_in[WAV_MAX_HALVINGS];		// Including the repeated last sample
+		u32 n_out[WAV_MAX_HALVINGS];
+
+		s16 pending[WAV_BLOCK_FRAMES];
+		u32 n_pending;
+		u32 seed;
+};
+
 #endif
 
 /* ===================== PUBLIC ===================== */
@@ -58,138 +278,250 @@ Wav::~Wav() {
 
 }
 
-bool Wav::load(const char *filename)
+bool Wav::load(const char *filename, bool to_8_bit, u32 max_rate)
 {
 #if defined(ARM9)
-	// Init
-
-	FILE *fileh;
+	FileReader reader(filename);
 
-	fileh = fopen(filename, "r");
-
-	if(!fileh)
+	if(!reader.isOpen())
 		return false;
 
+	return load(&reader, to_8_bit, max_rate);
+#else
+	return true;
+#endif
+}
+
+bool Wav::load(Reader *reader, bool to_8_bit, u32 max_rate)
+{
+#if defined(ARM9)
 	char buf[5] = {0};
 
 	// RIFF header
-	fread(buf, 1, 4, fileh);
+	reader->read(buf, 4);
 
 	if(strcmp(buf,"RIFF")!=0) {
-		fclose(fileh);
 		return false;
 	}
 
 	u32 riff_size;
-	fread(&riff_size, 4, 1, fileh);
+	reader->read(&riff_size, 4);
 
 	// WAVE header
-	fread(buf, 1, 4, fileh);
+	reader->read(buf, 4);
 	if(strcmp(buf,"WAVE")!=0) {
-		fclose(fileh);
-		return false;
-	}
-
-	// fmt chunk
-	fread(buf, 1, 4, fileh);
-	if(strcmp(buf,"fmt ")!=0) {
-		fclose(fileh);
 		return false;
 	}
 
-	u32 fmt_chunk_size;
-	fread(&fmt_chunk_size, 4, 1, fileh);
+	u16 format = 0;
+	u16 n_channels = 0; // They really thought they were cool when making this 16 bit.
+	u32 sampling_rate = 0;
+	u16 block_align = 0;
+	u16 bit_per_sample = 0;
+	u32 fact_samples = 0;
+	u32 data_chunk_size = 0;
 
-	u16 compression_code;
-	fread(&compression_code, 2, 1, fileh);
+	// The fmt chunk must come before the data chunk, anything else is skipped
+	bool eof = reader->read(buf, 4) != 4;
 
-	// 1 : pcm, 17 : ima adpcm
-	if(compression_code == 1) {
-		compression_ = CMP_PCM;
-	} /*else if(compression_code == 17) {
-		compression_ = CMP_ADPCM;
-	}*/ else {
-		fclose(fileh);
-		return false;
+	while(!eof)
+	{
+		u32 chunk_size = 0;
+		reader->read(&chunk_size, 4);
+
+		u32 chunk_start = reader->tell();
+
+		// Files that were cut off or written as a stream can claim more
+		if(chunk_size > reader->getSize() - chunk_start)
+			chunk_size = reader->getSize() - chunk_start;
+
+		if(strcmp(buf,"data")==0) {
+			data_chunk_size = chunk_size;
+			break;
+		}
+
+		if( (strcmp(buf,"fmt ")==0) && (chunk_size >= 16) )
+		{
+			reader->read(&format, 2);
+			reader->read(&n_channels, 2);
+			reader->read(&sampling_rate, 4);
+
+			u32 avg_bytes_per_sec; // We don't need this
+			reader->read(&avg_bytes_per_sec, 4);
+
+			reader->read(&block_align, 2);
+			reader->read(&bit_per_sample, 2);
+
+			// The format code is the first word of the sub format GUID
+			if( (format == WAV_FORMAT_EXTENSIBLE) && (chunk_size >= 40) ) {
+				reader->skip(8);
+				reader->read(&format, 2);
+			}
+		}
+		else if( (strcmp(buf,"fact")==0) && (chunk_size >= 4) )
+		{
+			reader->read(&fact_samples, 4);
+		}
+
+		// Chunks are padded to even sizes
+		reader->skip(chunk_start + chunk_size + (chunk_size & 1) - reader->tell());
+		eof = reader->read(buf, 4) != 4;
 	}
 
-	u16 n_channels; // They really thought they were cool when making this 16 bit.
-	fread(&n_channels, 2, 1, fileh);
-
-	if(n_channels > 2) {
-		fclose(fileh);
+	if( (eof) || (n_channels == 0) || (n_channels > WAV_MAX_CHANNELS) || (sampling_rate == 0) ) {
 		return false;
-	} else {
-		n_channels_ = n_channels;
 	}
 
-	u32 sampling_rate;
-	fread(&sampling_rate, 4, 1, fileh);
+	bool is_adpcm = (format == WAV_FORMAT_IMA_ADPCM);
+	bool is_float = (format == WAV_FORMAT_FLOAT);
 
-	sampling_rate_ = sampling_rate;
+	u32 n_frames;
+	u32 frame_size;		// Bytes read at a time
+	u32 block_samples;	// Frames per ADPCM block
 
-	u32 avg_bytes_per_sec; // We don't need this
-	fread(&avg_bytes_per_sec, 4, 1, fileh);
-
-	u16 block_align; // We don't need this
-	fread(&block_align, 2, 1, fileh);
-
-	u16 bit_per_sample;
-	fread(&bit_per_sample, 2, 1, fileh);
-	if((bit_per_sample==8)||(bit_per_sample==16)) {
-		bit_per_sample_ = bit_per_sample;
-	} else {
-		fclose(fileh);
-		return false;
+	if(is_adpcm)
+	{
+		// A block starts with a word per channel that holds the first sample
+		// and step index. Then come words of 8 codes for each channel in turn.
+		if( (bit_per_sample != 4) || (block_align <= 4 * n_channels) || (block_align % (4 * n_channels) != 0) ) {
+			return false;
+		}
+
+		block_samples = (block_align / n_channels - 4) * 2 + 1;
+		frame_size = block_align;
+
+		n_frames = data_chunk_size / block_align * block_samples;
+		u32 rest = data_chunk_size % block_align;
+		if(rest > 4 * n_channels)
+			n_frames += (rest / n_channels - 4) * 2 + 1;
+
+		if( (fact_samples != 0) && (fact_samples < n_frames) )
+			n_frames = fact_samples;
 	}
+	else if( (format == WAV_FORMAT_PCM) || ( (is_float) && (bit_per_sample == 32) ) )
+	{
+		if( (bit_per_sample != 8) && (bit_per_sample != 16) && (bit_per_sample != 24) && (bit_per_sample != 32) ) {
+			return false;
+		}
 
-	// Skip extra bytes
-	fseek(fileh, fmt_chunk_size - 16, SEEK_CUR);
-
-	fread(buf, 1, 4, fileh);
-
-	// Skip forward to the data chunk
-	while((!feof(fileh))&&(strcmp(buf,"data")!=0)) {
-		u32 chunk_size;
-		fread(&chunk_size, 4, 1, fileh);
-		fseek(fileh, chunk_size, 1);
-		fread(buf, 1, 4, fileh);
+		block_samples = WAV_BLOCK_FRAMES;
+		frame_size = n_channels * bit_per_sample / 8;
+		n_frames = data_chunk_size / frame_size;
+	}
+	else
+	{
+		return false;
 	}
 
-	if(feof(fileh)) {
-		fclose(fileh);
+	if(n_frames == 0) {
 		return false;
 	}
 
-	// data chunk
-	u32 data_chunk_size;
-	fread(&data_chunk_size, 4, 1, fileh);
-
-	u8 sample_size = bit_per_sample_/8;
-	if(compression_ == CMP_PCM) {
-		n_samples_ = data_chunk_size / sample_size;
-	} else {
-		n_samples_ = data_chunk_size * 2 * sample_size;
+	// What the sample ends up as
+	u8 halvings = 0;
+	u32 n_out = n_frames;
+	while( (max_rate != 0) && ((sampling_rate >> halvings) > max_rate) && (halvings < WAV_MAX_HALVINGS) )
+	{
+		halvings++;
+		n_out = (n_out + 1) / 2;
 	}
 
-	audio_data_ = (u8*)malloc(data_chunk_size);
+	bool is_8_bit = (bit_per_sample == 8) || (to_8_bit);
+	u32 out_size = is_8_bit ? n_out : n_out * 2;
+
+	audio_data_ = (u8*)malloc(out_size);
 	if(audio_data_ == 0) {
-		my_dprintf("Could not alloc mem(%ld) for wav.\n", data_chunk_size);
-		fclose(fileh);
+		my_dprintf("Could not alloc mem(%ld) for wav.\n", out_size);
 		return false;
 	}
 
-	// Read the data
-	memset(audio_data_, 0, data_chunk_size);
-	fread(audio_data_, data_chunk_size, 1, fileh);
-
-	// Convert 8 bit samples from unsigned to signed
-	if(bit_per_sample == 8) {
-		ntxm_unsigned2signed_8(audio_data_, data_chunk_size);
+	// Mono 8 and 16 bit only need to be made signed, right where they are
+	if( (!is_adpcm) && (!is_float) && (n_channels == 1) && (halvings == 0)
+		&& ( (bit_per_sample == 8) || ((bit_per_sample == 16) && (!to_8_bit)) ) )
+	{
+		u32 got = reader->read(audio_data_, out_size);
+		if(bit_per_sample == 8)
+			ntxm_unsigned2signed_8(audio_data_, got);
+		memset(audio_data_ + got, 0, out_size - got);
+	}
+	else
+	{
+		// The raw data of a block of frames, or of one ADPCM block. For ADPCM, the
+		// channels are decoded one after another, each in the DS's layout.
+		u32 raw_size = is_adpcm ? block_align + block_align / n_channels + block_samples * n_channels * 2
+			: WAV_BLOCK_FRAMES * frame_size;
+		u8 *raw = (u8*)malloc(raw_size);
+		if(raw == 0) {
+			my_dprintf("memfull on line %d\n", __LINE__);
+			free(audio_data_);
+			audio_data_ = 0;
+			return false;
+		}
+
+		WavOutput output(audio_data_, n_out, !is_8_bit, bit_per_sample != 8, halvings);
+		s16 mixed[WAV_BLOCK_FRAMES];
+
+		for(u32 done = 0; done < n_frames; )
+		{
+			u32 n = n_frames - done;
+			if(n > block_samples)
+				n = block_samples;
+
+			if(is_adpcm)
+			{
+				// Whatever is missing at the end of the file decodes to silence
+				u32 got = reader->read(raw, block_align);
+				memset(raw + got, 0, block_align - got);
+
+				u32 words = block_align / n_channels / 4 - 1;	// Of codes per channel
+				u8 *channel = raw + block_align;
+				s16 *decoded = (s16*)(channel + block_align / n_channels);
+
+				for(u16 c=0; c<n_channels; ++c)
+				{
+					memcpy(channel, raw + 4 * c, 4);
+					for(u32 word=0; word<words; ++word)
+						memcpy(channel + 4 + 4 * word, raw + 4 * n_channels + 4 * (word * n_channels + c), 4);
+
+					s16 *out = decoded + c * block_samples;
+					out[0] = (s16)(channel[0] | (channel[1] << 8));
+					AdpcmDecoder decoder(channel);
+					decoder.decode(out + 1, n - 1);
+				}
+
+				for(u32 i=0; i<n; i += WAV_BLOCK_FRAMES)
+				{
+					u32 m = (n - i < WAV_BLOCK_FRAMES) ? n - i : WAV_BLOCK_FRAMES;
+					for(u32 j=0; j<m; ++j)
+					{
+						s32 sum = 0;
+						for(u16 c=0; c<n_channels; ++c)
+							sum += decoded[c * block_samples + i + j];
+						mixed[j] = (n_channels == 2) ? (sum >> 1) : (sum / n_channels);
+					}
+					output.put(mixed, m);
+				}
+			}
+			else
+			{
+				u32 got = reader->read(raw, n * frame_size) / frame_size;
+				mixFrames(mixed, raw, got, n_channels, bit_per_sample, is_float);
+				memset(mixed + got, 0, (n - got) * 2);
+				output.put(mixed, n);
+			}
+
+			done += n;
+		}
+
+		output.finish();
+		free(raw);
 	}
 
-	// Finish up
-	fclose(fileh);
+	compression_ = CMP_PCM;
+	n_channels_ = 1;
+	sampling_rate_ = (sampling_rate + (1 << halvings >> 1)) >> halvings;
+	bit_per_sample_ = is_8_bit ? 8 : 16;
+	n_samples_ = n_out;
 
 #endif
 	return true;
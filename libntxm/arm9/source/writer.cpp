@@ -0,0 +1,144 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ntxm/writer.h"
+#include "ntxm/ntxmtools.h"
+
+/* ===================== PUBLIC ===================== */
+
+FileWriter::FileWriter(const char *filename, u32 _buffer_size)
+	:buffer(0), buffer_size(_buffer_size), pos(0), ok(true)
+{
+	file = fopen(filename, "wb");
+	if(file == NULL)
+		return;
+	
+	// The buffer is written in one piece, stdio would only copy it once more
+	setvbuf(file, NULL, _IONBF, 0);
+	
+	buffer = (u8*)malloc(buffer_size);
+	if(buffer == 0)
+	{
+		my_dprintf("writing with small buffer\n");
+		buffer = small_buffer;
+		buffer_size = WRITER_SMALL_BUFFER;
+	}
+}
+
+FileWriter::~FileWriter()
+{
+	close();
+}
+
+void FileWriter::write(const void *data, u32 size)
+{
+	const u8 *src = (const u8*)data;
+	
+	while(size > 0)
+	{
+		if(pos == buffer_size)
+			flush();
+		
+		u32 chunk = buffer_size - pos;
+		if(chunk > size)
+			chunk = size;
+		
+		memcpy(buffer + pos, src, chunk);
+		pos += chunk;
+		src += chunk;
+		size -= chunk;
+	}
+}
+
+void FileWriter::writeZeroes(u32 size)
+{
+	while(size > 0)
+	{
+		if(pos == buffer_size)
+			flush();
+		
+		u32 chunk = buffer_size - pos;
+		if(chunk > size)
+			chunk = size;
+		
+		memset(buffer + pos, 0, chunk);
+		pos += chunk;
+		size -= chunk;
+	}
+}
+
+u8 *FileWriter::getSpace(u32 *size)
+{
+	if(pos == buffer_size)
+		flush();
+	
+	*size = buffer_size - pos;
+	return buffer + pos;
+}
+
+void FileWriter::advance(u32 size)
+{
+	pos += size;
+}
+
+bool FileWriter::close(void)
+{
+	if(file == NULL)
+		return ok;
+	
+	flush();
+	
+	if(fclose(file) != 0)
+		ok = false;
+	file = NULL;
+	
+	if(buffer != small_buffer)
+		free(buffer);
+	buffer = 0;
+	
+	return ok;
+}
+
+/* ===================== PRIVATE ===================== */
+
+void FileWriter::flush(void)
+{
+	if( (pos > 0) && (fwrite(buffer, 1, pos, file) != pos) )
+		ok = false;
+	
+	pos = 0;
+}
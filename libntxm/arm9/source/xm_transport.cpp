@@ -43,7 +43,11 @@
 #include <fat.h>
 
 #include "ntxm/xm_transport.h"
+#include "ntxm/reader.h"
+#include "ntxm/writer.h"
 #include "ntxm/ntxmtools.h"
+#include "ntxm/adpcm.h"
+#include "ntxm/sample_pool.h"
 
 const char *xmtransporterrors[] =
 	{"fat init failed",
@@ -55,1225 +59,1419 @@ const char *xmtransporterrors[] =
 	"",
 	"pattern too long",
 	"file is zero byte",
-	"disk is full"};
+	"disk is full",
+	"sample is not loaded",
+	"invalid song header"};
 
-/* ===================== PUBLIC ===================== */
+// Packs a row of a pattern in the XM way and returns its size, which is at
+// most 5 bytes per channel. With dest=0, only the size is calculated.
+static u32 packRow(Cell **pattern, u16 row, u16 n_channels, u8 *dest)
+{
+	u32 datapos = 0;
 
-// Loads a song from a file and puts it in the song argument
-// returns 0 on success, an error code else
-u16 XMTransport::load(const char *filename, Song **_song)
+	for(u16 chn=0; chn<n_channels; ++chn)
+	{
+		const Cell &cell = pattern[chn][row];
+
+		u8 write_note = cell.note != EMPTY_NOTE;
+		u8 write_instrument = cell.instrument != NO_INSTRUMENT;
+		u8 write_volume = (cell.volume != NO_VOLUME) || (cell.effect2 != NO_EFFECT);
+		u8 write_effect = cell.effect != NO_EFFECT;
+		u8 write_effect_param = cell.effect_param != NO_EFFECT_PARAM;
+
+		u8 magicbyte = 0;
+		magicbyte |= write_note         << 0;
+		magicbyte |= write_instrument   << 1;
+		magicbyte |= write_volume       << 2;
+		magicbyte |= write_effect       << 3;
+		magicbyte |= write_effect_param << 4;
+
+		if(dest == 0)
+		{
+			datapos += write_note + write_instrument + write_volume + write_effect + write_effect_param;
+			if(magicbyte != 31)
+				datapos++;
+			continue;
+		}
+
+		// Check if everything in the cell is set. If not, use the magic byte
+		if(magicbyte != 31) {
+			magicbyte |= 1 << 7;
+			dest[datapos++] = magicbyte;
+		}
+
+		if(write_note) {
+			if(cell.note == STOP_NOTE) {
+				dest[datapos++] = 97;
+			} else {
+				dest[datapos++] = cell.note+1;
+			}
+		}
+		if(write_instrument) {
+			dest[datapos++] = cell.instrument+1;
+		}
+		if(write_volume) {
+			// Volume or volume effect?
+			if(cell.volume == NO_VOLUME) // Volume is not set, so it's a volume effect
+			{
+				// Convert "real" effect to volume effect
+				u8 eff2_type = cell.effect2;
+				u8 eff2_param = cell.effect2_param;
+
+				u8 volbyte = 0;
+
+				switch(eff2_type) {
+					case(0x0A): { // Volume slide
+						if(eff2_param > 0x0F) { // Up
+							volbyte = 0x70 | (eff2_param >> 4);
+						} else { // Down
+							volbyte = 0x60 | (eff2_param & 0x0F);
+						}
+						break;
+					}
+					case(0x0E): { // Fine volume slide
+						if((eff2_param & 0xF0) == 0xA0) { // Up
+							volbyte = 0x90 | (eff2_param & 0x0F);
+						} else if((eff2_param & 0xF0) == 0xB0) { // Down
+							volbyte = 0x80 | (eff2_param & 0x0F);
+						}
+						break;
+					}
+					case(0x04): { // Vibrato
+						if(eff2_param > 0x0F) { // Speed
+							volbyte = 0xA0 | (eff2_param >> 4);
+						} else { // Depth
+							volbyte = 0xB0 | (eff2_param & 0x0F);
+						}
+						break;
+					}
+					case(0x08): { // Set panning
+						volbyte = 0xC0 | (eff2_param >> 4);
+						break;
+					}
+					case(0x19): { // Panning slide
+						if(eff2_param > 0x0F) { // Right
+							volbyte = 0xE0 | (eff2_param >> 4);
+						} else { // Left
+							volbyte = 0xD0 | (eff2_param & 0x0F);
+						}
+						break;
+					}
+					case(0x03): { // Tone porta
+						volbyte = 0xF0 | (eff2_param >> 4);
+						break;
+					}
+				}
+
+				dest[datapos++] = volbyte;
+
+			} else {
+				dest[datapos++] = (cell.volume+1)/2+16;
+			}
+		}
+		if(write_effect) {
+			dest[datapos++] = cell.effect;
+		}
+		if(write_effect_param) {
+			dest[datapos++] = cell.effect_param;
+		}
+	}
+
+	return datapos;
+}
+
+// Envelopes always have 12 points in the file, unused points are 0
+static void writeEnvelope(FileWriter *writer, const u16 *xs, const u16 *ys, u8 n_points)
 {
-	//
-	// Init
-	//
-	u32 filesize = my_getFileSize(filename);
-	if(filesize == 0)
+	for(u8 i=0; i<MAX_ENV_POINTS; ++i)
 	{
-		my_dprintf("0-byte file!\n");
-		return XM_TRANSPORT_FILE_ZERO_BYTE;
+		if(i < n_points) {
+			writer->write16(xs[i]);
+			writer->write16(ys[i]);
+		} else {
+			writer->write32(0);
+		}
 	}
+}
 
-	FILE *xmfile = fopen(filename, "r");
-	if((s32)xmfile == -1)
-		return XM_TRANSPORT_ERROR_FOPENFAIL;
-	setvbuf(xmfile, NULL, _IOFBF, 4096);
-	//
-	// Read header
-	//
+// The size of the sample data in the file
+static u32 xmSampleSize(Sample *sample)
+{
+	if(sample->isCompressed())
+		return sample->getNSamples() * 2;
+	return sample->getSize();
+}
 
-	// Magic number
-	char magicnumber[18] = {0};
-	fread(magicnumber, 1, 17, xmfile);
+// Empty sample slots get a header with length 0
+static void writeSampleHeader(FileWriter *writer, Sample *sample)
+{
+	char sample_name[22];
+	memset(sample_name, ' ', 22);
 
-	if( strcmp(magicnumber, "Extended Module: ") != 0 ) {
-		my_dprintf("Not an XM file!\n");
-		fclose(xmfile);
-		return XM_TRANSPORT_ERROR_MAGICNUMBERINVALID;
+	if(sample == NULL)
+	{
+		writer->writeZeroes(17);
+		writer->write8(0x80);
+		writer->write(sample_name, 22);
+		return;
 	}
 
-	// Song name
-	char songname[21] = {0};
-	fread(songname, 1, 20, xmfile);
+	u32 smp_loop_start = sample->getLoopStart();
+	u32 smp_loop_length = sample->getLoopLength();
 
-	// Skip uninteresting stuff like tracker name
-	fseek(xmfile, 21, SEEK_CUR);
+	if(sample->is16bit())
+	{
+		smp_loop_start *= 2;
+		smp_loop_length *= 2;
+	}
 
-	u16 header_version;
-	fread(&header_version, 2, 1, xmfile);
-	my_dprintf("XM version %x\n", header_version);
+	u8 smp_type = sample->getLoop();
+	if(sample->is16bit())
+		smp_type |= 1<<4;
+
+	writer->write32(xmSampleSize(sample));
+	writer->write32(smp_loop_start);
+	writer->write32(smp_loop_length);
+	writer->write8((sample->getVolume() + 1) / 4); // Convert scale to 0-64
+	writer->write8(sample->getFinetune());
+	writer->write8(smp_type);
+	writer->write8(sample->getBasePanning());
+	writer->write8(sample->getRelNote());
+	writer->write8(0x80); // Reserved byte (what a crappy standard)
+
+	const char *name = sample->getName();
+	u32 name_length = strlen(name);
+	memcpy(sample_name, name, (name_length < 22) ? name_length : 22); // Don't copy \0 character
+	writer->write(sample_name, 22);
+}
 
-	// Header size
-	u32 header_size;
-	fread(&header_size, 4, 1, xmfile);
+// XMs have no ADPCM, so compressed samples are saved as 16 bit
+static void writeAdpcmSampleData(FileWriter *writer, Sample *sample)
+{
+	AdpcmDecoder decoder((const u8*)sample->getData());
+	s16 pcm[256];
+	u8 deltas[sizeof(pcm)];
+	s16 last = 0;
 
-	// Song length (pot size)
-	u16 pot_size;
-	fread(&pot_size, 2, 1, xmfile);
-	//my_dprintf("songlen: %u\n",pot_size);
+	u32 remaining = sample->getNSamples();
+	while(remaining > 0)
+	{
+		u32 n = (remaining < 256) ? remaining : 256;
+		decoder.decode(pcm, n);
+		ntxm_delta_encode(deltas, pcm, n * 2, true, &last);
+		writer->write(deltas, n * 2);
+		remaining -= n;
+	}
+}
 
-	// Restart position
-	u16 restart_pos;
-	fread(&restart_pos, 2, 1, xmfile);
-	//my_dprintf("restart: %u\n", restart_pos);
+// The data is delta coded straight into the writer's buffer
+static void writeSampleData(FileWriter *writer, Sample *sample)
+{
+	if(sample->isCompressed())
+	{
+		writeAdpcmSampleData(writer, sample);
+		return;
+	}
 
-	// Number of channels
-	u16 n_channels;
-	fread(&n_channels, 2, 1, xmfile);
-	//my_dprintf("n chn: %u\n", n_channels);
+	const u8 *sample_data = (const u8*)sample->getData();
+	u32 sample_size = sample->getSize();
+	bool is_16_bit = sample->is16bit();
+	s16 last = 0;
+
+	u32 pos = 0;
+	while(pos < sample_size)
+	{
+		u32 chunk;
+		u8 *dest = writer->getSpace(&chunk);
+		if(chunk > sample_size - pos)
+			chunk = sample_size - pos;
+
+		if(is_16_bit)
+		{
+			chunk &= ~1;
+			if(chunk == 0) // A sample is split between two blocks
+			{
+				u8 pair[2];
+				ntxm_delta_encode(pair, sample_data + pos, 2, true, &last);
+				writer->write(pair, 2);
+				pos += 2;
+				continue;
+			}
+		}
 
-	if(n_channels>16) {
-		//my_dprintf("I currently only support XMs with 16 or less channels!\n");
-		//return 0;
+		ntxm_delta_encode(dest, sample_data + pos, chunk, is_16_bit, &last);
+		writer->advance(chunk);
+		pos += chunk;
 	}
+}
 
-	// Number of patterns
-	u16 n_patterns;
-	fread(&n_patterns, 2, 1, xmfile);
-	//my_dprintf("n ptn: %u\n", n_patterns);
+/* ===================== PUBLIC ===================== */
 
-	// Number of instruments
-	u16 n_inst;
-	fread(&n_inst, 2, 1, xmfile);
-	my_dprintf("n inst: %u\n", n_inst);
+XMTransport::XMTransport()
+	:reader(0), owned_reader(0), song(0), load_stage(XM_LOAD_IDLE), load_error(0),
+	load_timer(XM_LOAD_DEFAULT_TIMER), lazy_samples(false), shared_samples(false), instinfo(0), instrument(0), sample_headers(0),
+	sample_data(0), external_data(false)
+{
+}
 
-	// Flags, currently only used for the frequency table (0: amiga, 1: linear)
-	// TODO: Amiga freq table
-	u16 flags;
-	fread(&flags, 2, 1, xmfile);
-	//my_dprintf("flags: %u\n", flags);
+XMTransport::~XMTransport()
+{
+	if(load_stage != XM_LOAD_IDLE)
+		abortLoad();
+}
 
-	// Tempo
-	u16 tempo;
-	fread(&tempo, 2, 1, xmfile);
-	if(tempo == 0) tempo = 1; // Found an XM that actually had 0 there
-	my_dprintf("tempo: %u\n", tempo);
+// Loads a song from a file and puts it in the song argument
+// returns 0 on success, an error code else
+u16 XMTransport::load(const char *filename, Song **_song)
+{
+	FileReader reader(filename);
+	if(!reader.isOpen())
+		return XM_TRANSPORT_ERROR_FOPENFAIL;
 
+	return load(&reader, _song);
+}
 
-	// BPM
-	u16 bpm;
-	fread(&bpm, 2, 1, xmfile);
-	//my_dprintf("bpm: %u\n", bpm);
-	my_dprintf("new song %u %u %u\n",tempo, bpm, n_channels );
-	// Construct the song with the current info
-	Song *song = new Song(tempo, bpm, n_channels);
-	if(song==NULL)
+u16 XMTransport::loadFromMemory(const u8 *data, u32 size, Song **_song)
+{
+	MemoryReader reader(data, size);
+	return load(&reader, _song);
+}
+
+u16 XMTransport::loadInPlace(u8 *data, u32 size, Song **_song)
+{
+	MemoryReader reader(data, size, true);
+	return load(&reader, _song);
+}
+
+u16 XMTransport::load(Reader *_reader, Song **_song)
+{
+	u16 err = beginLoad(_reader);
+	if(err != 0)
+		return err;
+
+	return finish(_song);
+}
+
+u16 XMTransport::beginLoad(const char *filename)
+{
+	FileReader *file_reader = new FileReader(filename);
+	if(!file_reader->isOpen())
 	{
-		fclose(xmfile);
-		my_dprintf("memfull on line %d\n", __LINE__);
-		delete song;
-		return XM_TRANSPORT_ERROR_MEMFULL;
+		delete file_reader;
+		return XM_TRANSPORT_ERROR_FOPENFAIL;
 	}
 
-	song->setName(songname);
+	u16 err = beginLoad(file_reader);
+	owned_reader = file_reader; // Deleted when loading is over
+	if(err != 0)
+		loadCleanup();
 
-	song->setRestartPosition(restart_pos);
+	return err;
+}
 
-	// Pattern order table
-	u8 i, potentry;
+u16 XMTransport::beginLoad(Reader *_reader)
+{
+	if(load_stage != XM_LOAD_IDLE)
+		abortLoad();
 
-	fread(&potentry, 1, 1, xmfile);
-	song->setPotEntry(0, potentry); // The first entry is made automatically by the song
+	reader = _reader;
 
-	for(i=1;i<pot_size;++i) {
-		fread(&potentry, 1, 1, xmfile);
-		song->potAdd(potentry);
+	u16 err = loadHeader();
+	if(err != 0)
+	{
+		loadCleanup();
+		return err;
 	}
-	fseek(xmfile, 256-pot_size, SEEK_CUR);
 
-	//
-	// Read patterns
-	//
-
-	u8 pattern;
-	for(pattern=0;pattern<n_patterns;++pattern)
-	{
-		//my_dprintf("Reading pattern %u\n",pattern);
+	cur_pattern = 0;
+	cur_inst = 0;
 
-		// Pattern header length
-		u32 pattern_header_length;
-		fread(&pattern_header_length, 4, 1, xmfile);
+	if(n_patterns > 0) {
+		load_stage = XM_LOAD_PATTERNS;
+	} else {
+		song->validate();
+		load_stage = (n_inst > 0) ? XM_LOAD_INSTRUMENTS : XM_LOAD_DONE;
+	}
 
-		//my_dprintf("ptn header: %u\n",pattern_header_length);
+	return 0;
+}
 
-		// Skip packing type (is always 0)
-		fseek(xmfile, 1, SEEK_CUR);
+u16 XMTransport::step(u32 budget_us)
+{
+	if(load_stage == XM_LOAD_ERROR)
+		return load_error;
 
-		// Number of rows
-		u16 n_rows;
-		if( (header_version == 0x104) || (header_version == 0x103) ) {
-			fread(&n_rows, 2, 1, xmfile);
-		} else {
-			u8 u8_n_rows;
-			fread(&u8_n_rows, 1, 1, xmfile);
-			n_rows = (u16)u8_n_rows + 1;
-		}
+	cpuStartTiming(load_timer);
 
-		if(n_rows > MAX_PATTERN_LENGTH)
+	while( (load_stage != XM_LOAD_IDLE) && (load_stage != XM_LOAD_DONE) )
+	{
+		u16 err = loadNext();
+		if(err != 0)
 		{
-			my_dprintf("Pattern too long: %u rows\n", n_rows);
-			fclose(xmfile);
-			delete song;
-			return XM_TRANSPORT_PATTERN_TOO_LONG;
+			cpuEndTiming();
+			loadFailed(err);
+			return err;
 		}
 
-		//my_dprintf("n_rows: %u\n",n_rows);
-
-		// Packed patterndata size
-		u16 patterndata_size;
-		fread(&patterndata_size, 2, 1, xmfile);
-		//TODO: Handle empty patterns (which are left out in the xm format)
-		//my_dprintf("patterndata_size: %u (%u/%u)\n", patterndata_size,pattern,n_patterns);
+		if(timerTicks2usec(cpuGetTiming()) >= budget_us)
+			break;
+	}
 
-		if(patterndata_size > 0) { // Read the pattern
+	cpuEndTiming();
 
-			u8 *ptn_data = (u8*)memalign(2, patterndata_size);
-			if (ptn_data == NULL) {
-				fclose(xmfile);
-				my_dprintf("memfull on line %d\n", __LINE__);
-				delete song;
-				return XM_TRANSPORT_ERROR_MEMFULL;
-			}
+	return 0;
+}
 
-			u32 bytes_read;
+bool XMTransport::loadFinished(void)
+{
+	return (load_stage == XM_LOAD_DONE) || (load_stage == XM_LOAD_ERROR) || (load_stage == XM_LOAD_IDLE);
+}
 
-			bytes_read = fread(ptn_data, 1, patterndata_size, xmfile);
+u8 XMTransport::getLoadProgress(void)
+{
+	if( (load_stage == XM_LOAD_IDLE) || (reader == 0) || (reader->getSize() == 0) )
+		return 0;
+	if(load_stage == XM_LOAD_DONE)
+		return 100;
 
-			if(bytes_read != patterndata_size) {
-				free(ptn_data);
-				fclose(xmfile);
-				my_dprintf("pattern read error.\nread:%lu (should be %u)\n", bytes_read, patterndata_size);
-				delete song;
-				return XM_TRANSPORT_ERROR_PATTERN_READ;
-			}
+	return (u64)reader->tell() * 100 / reader->getSize();
+}
 
-			u32 ptn_data_offset = 0;
+u16 XMTransport::finish(Song **_song)
+{
+	if(load_stage == XM_LOAD_IDLE)
+		return XM_TRANSPORT_ERROR_INITFAIL;
 
-			u8 chn;
-			u16 row;
+	while( (load_stage != XM_LOAD_DONE) && (load_stage != XM_LOAD_ERROR) )
+	{
+		u16 err = loadNext();
+		if(err != 0)
+			loadFailed(err);
+	}
 
-			if(pattern>0) {
-				song->addPattern();
-			}
+	if(load_stage == XM_LOAD_ERROR)
+	{
+		u16 err = load_error;
+		abortLoad();
+		return err;
+	}
 
-			song->resizePattern(pattern, n_rows);
+	my_dprintf("XM Loaded.\n");
 
-			Cell **ptn = song->getPattern(pattern);
+	*_song = song;
+	song = 0;
 
-			for(row=0;row<n_rows;++row)
-			{
-				for(chn=0;chn<n_channels;++chn)
-				{
-					u8 magicbyte = 0, note = EMPTY_NOTE, inst = NO_INSTRUMENT, vol = NO_VOLUME,
-						eff_type = NO_EFFECT, eff_param = NO_EFFECT_PARAM, eff2_type = NO_EFFECT,
-						eff2_param = NO_EFFECT_PARAM;
+	loadCleanup();
 
-					magicbyte = ptn_data[ptn_data_offset];
-					ptn_data_offset++;
-					//fread(&magicbyte, 1, 1, xmfile);
+	return 0;
+}
 
-					bool read_note=true, read_inst=true, read_vol=true,
-						read_eff_type=true, read_eff_param=true;
+void XMTransport::abortLoad(void)
+{
+	delete song;
+	song = 0;
 
-					if(magicbyte & 1<<7) { // It's the magic byte!
+	loadCleanup();
+}
 
-						read_note = magicbyte & 1<<0;
-						read_inst = magicbyte & 1<<1;
-						read_vol = magicbyte & 1<<2;
-						read_eff_type = magicbyte & 1<<3;
-						read_eff_param = magicbyte & 1<<4;
+void XMTransport::setLazySamples(bool lazy)
+{
+	lazy_samples = lazy;
+}
 
-					} else { // It's the note!
+void XMTransport::setSharedSamples(bool shared)
+{
+	shared_samples = shared;
+}
 
-						note = magicbyte;
-						read_note = false;
+Song *XMTransport::getLoadingSong(void)
+{
+	// The song can't be played before all patterns are there
+	if( (load_stage == XM_LOAD_INSTRUMENTS) || (load_stage == XM_LOAD_SAMPLES) || (load_stage == XM_LOAD_DONE) )
+		return song;
+	else
+		return 0;
+}
 
-					}
+void XMTransport::setLoadTimer(u8 timer)
+{
+	load_timer = timer;
+}
 
-					if(read_note) {
-						note = ptn_data[ptn_data_offset];
-						ptn_data_offset++;
-					}
 
-					if(read_inst) {
-						inst = ptn_data[ptn_data_offset];
-						ptn_data_offset++;
-					} else {
-						inst = NO_INSTRUMENT;
-					}
+// Saves a song to a file
+u16 XMTransport::save(const char *filename, Song *song)
+{
+	u16 n_channels = song->getChannels();
+	u16 n_patterns = song->getNumPatterns();
+	u16 n_inst = song->getInstruments();
 
-					if(read_vol) {
-						vol = ptn_data[ptn_data_offset];
-						ptn_data_offset++;
-					} else {
-						vol = 0; // 'Do nothing'
-					}
+	//
+	// Calculate the file size. The patterns are packed once just to get their
+	// size, which costs little compared to writing them.
+	//
 
-					if(read_eff_type) {
-						eff_type = ptn_data[ptn_data_offset];
-						ptn_data_offset++;
-					} else {
-						if(!read_eff_param)
-							eff_type = NO_EFFECT;
-						else
-							eff_type = EFFECT_ARPEGGIO; // If we have params, but no effect, assume arpeggio
-					}
+	u16 *packed_sizes = (u16*)malloc(sizeof(u16)*n_patterns);
+	if(packed_sizes == 0) {
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return XM_TRANSPORT_ERROR_MEMFULL;
+	}
 
-					if(read_eff_param) {
-						eff_param = ptn_data[ptn_data_offset];
-						ptn_data_offset++;
-					} else {
-						eff_param = NO_EFFECT_PARAM;
-					}
+	u32 file_size = XM_HEADER_SIZE;
 
-					//my_dprintf("note: %u\ninst: %u\nvol: %u\neff_type: %u\neff_param: %u\n",note,inst,vol,eff_type,eff_param);
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		u16 n_rows = song->getPatternLength(ptn);
+		if(n_rows > MAX_PATTERN_LENGTH) {
+			free(packed_sizes);
+			my_dprintf("%u rows!\n", n_rows);
+			return XM_TRANSPORT_PATTERN_TOO_LONG;
+		}
 
-					// Insert note into song
-					if(note > 0 && note < 97) {
-						ptn[chn][row].note = note - 1;
-					} else if(note==97) {
-						ptn[chn][row].note = STOP_NOTE;
-					} else {
-						ptn[chn][row].note = EMPTY_NOTE;
-					}
+		Cell **pattern = song->getPattern(ptn);
+		u32 packed_size = 0;
+		for(u16 row=0; row<n_rows; ++row)
+			packed_size += packRow(pattern, row, n_channels, 0);
 
-					if(inst != NO_INSTRUMENT) {
-						ptn[chn][row].instrument = inst-1; // XM Inst indices start with 1
-					} else {
-						ptn[chn][row].instrument = NO_INSTRUMENT;
-					}
+		// Empty patterns have no data, every cell would be a single byte
+		if(packed_size == (u32)n_rows*n_channels)
+			packed_size = 0;
 
-					// Separate volume column effects from the volume column
-					// and put them into the effcts column instead
+		packed_sizes[ptn] = packed_size;
+		file_size += XM_PATTERN_HEADER_SIZE + packed_size;
+	}
 
-					if((vol >= 0x10) && (vol <= 0x50))
-					{
-						u16 volume = (vol-16)*2;
-						if(volume>=MAX_VOLUME) volume = MAX_VOLUME;
-						ptn[chn][row].volume = volume;
-					}
-					else if(vol==0)
-					{
-						ptn[chn][row].volume = NO_VOLUME;
-					}
-					else if(vol>=0x60)
-					{
-						// It's an effect!
-						u8 volfx_param = vol & 0x0F;
-
-						if( (vol>=0x60)&&(vol<=0x6F) ) { // Volume slide down
-							eff2_type = 0x0A;
-							eff2_param = volfx_param;
-						} else if( (vol>=0x70)&&(vol<=0x7F) ) { // Volume slide up
-							eff2_type = 0x0A;
-							eff2_param = volfx_param << 4;
-						} else if( (vol>=0x80)&&(vol<=0x8F) ) { // Fine volume slide down
-							eff2_type = 0x0E;
-							eff2_param = 0xB0 | volfx_param;
-						} else if( (vol>=0x90)&&(vol<=0x9F) ) { // Fine volume slide up
-							eff2_type = 0x0E;
-							eff2_param = 0xA0 | volfx_param;
-						} else if( (vol>=0xA0)&&(vol<=0xAF) ) { // Set vibrato speed (calls vibrato)
-							eff2_type = 0x04;
-							eff2_param = volfx_param << 4;
-						} else if( (vol>=0xB0)&&(vol<=0xBF) ) { // Vibrato
-							eff2_type = 0x04;
-							eff2_param = volfx_param; // Vibrato depth
-						} else if( (vol>=0xC0)&&(vol<=0xCF) ) { // Set panning
-							eff2_type = 0x08;
-							eff2_param = volfx_param << 4;
-						} else if( (vol>=0xD0)&&(vol<=0xDF) ) { // Panning slide left
-							eff2_type = 0x19;
-							eff2_param = volfx_param;
-						} else if( (vol>=0xD0)&&(vol<=0xDF) ) { // Panning slide right
-							eff2_type = 0x19;
-							eff2_param = volfx_param << 4;
-						} else if( vol>=0xF0 ) { // Tone porta
-							eff2_type = 0x03;
-							eff2_param = volfx_param << 4;
-						}
-					}
+	for(u16 inst=0; inst<n_inst; ++inst)
+	{
+		file_size += XM_INST_HEADER_SIZE;
 
-					ptn[chn][row].effect = eff_type;
-					ptn[chn][row].effect_param = eff_param;
-					ptn[chn][row].effect2 = eff2_type;
-					ptn[chn][row].effect2_param = eff2_param;
-				}
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == NULL)
+			continue;
 
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			file_size += XM_SAMPLE_HEADER_SIZE;
+			if(sample == NULL)
+				continue;
+
+			// Lazy samples may not be in RAM, streamed ones never are
+			if(!sample->isLoaded() || (sample->getStream() != 0)) {
+				free(packed_sizes);
+				return XM_TRANSPORT_SAMPLE_NOT_LOADED;
 			}
 
-			free(ptn_data);
+			file_size += xmSampleSize(sample);
+		}
+	}
 
-		} else { // Make an empty pattern
+	// The old file is replaced, so its space can be used
+	if( (u64)file_size > (u64)my_getFreeDiskSpace() + my_getFileSize(filename) ) {
+		free(packed_sizes);
+		return XM_TRANSPORT_DISK_FULL;
+	}
 
-			if(pattern > 0) {
-				song->addPattern();
-			}
+	my_dprintf("saving %lu bytes\n", file_size);
 
-			song->resizePattern(pattern, n_rows);
-		}
+	FileWriter writer(filename);
+	if(!writer.isOpen()) {
+		free(packed_sizes);
+		return XM_TRANSPORT_ERROR_FOPENFAIL;
+	}
 
+	//
+	// Write header
+	//
+
+	writer.write("Extended Module: ", 17);
+
+	char songname[21] = {0};
+	strncpy(songname, song->getName(), 20);
+	writer.write(songname, 20);
+
+	writer.write8(0x1a); // wtf
+
+	char trackername[20] = "NitroTracker";
+	writer.write(trackername, 20);
+
+	writer.write16(0x104); // FT2 version number (else soundtracker won't accept the file
+	writer.write32(XM_HEADER_SIZE - 60); // Header size, counted from here
+	writer.write16(song->getPotLength());
+	writer.write16(song->getRestartPosition());
+	writer.write16(n_channels);
+	writer.write16(n_patterns);
+	writer.write16(n_inst);
+	writer.write16(1); // Flags, 1 means linear freq table (amiga table support maybe soon)
+	writer.write16(song->getTempo());
+	writer.write16(song->getBPM());
+
+	u8 pot[256] = {0};
+	for(u16 i=0; i<song->getPotLength(); ++i) {
+		pot[i] = song->getPotEntry(i);
 	}
+	writer.write(pot, 256);
 
 	//
-	// Read instruments
+	// Write patterns
 	//
 
-	for(u8 inst=0; inst<n_inst; ++inst)
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
 	{
-		struct InstInfo *instinfo = (struct InstInfo*)calloc(1, sizeof(struct InstInfo));
-		if (instinfo == NULL) {
-			fclose(xmfile);
-			my_dprintf("memfull on line %d\n", __LINE__);
-			delete song;
-			return XM_TRANSPORT_ERROR_MEMFULL;
-		}
+		u16 n_rows = song->getPatternLength(ptn);
 
-		// Read fields up to number of samples
+		writer.write32(XM_PATTERN_HEADER_SIZE);
+		writer.write8(0); // Packing type, is always 0
+		writer.write16(n_rows);
+		writer.write16(packed_sizes[ptn]);
 
-		fread(&instinfo->inst_size, 1, 4, xmfile);
-		fread(&instinfo->name, 1, 22, xmfile);
-		fread(&instinfo->inst_type, 1, 1, xmfile);
-		fread(&instinfo->n_samples, 1, 2, xmfile);
+		if(packed_sizes[ptn] == 0)
+			continue;
 
-		Instrument *instrument = new Instrument(instinfo->name);
-		if(instrument == 0)
-		{
-			free(instinfo);
-			fclose(xmfile);
-			my_dprintf("memfull on line %d\n", __LINE__);
-			delete song;
-			return XM_TRANSPORT_ERROR_MEMFULL;
-		}
-		song->setInstrument(inst, instrument);
+		Cell **pattern = song->getPattern(ptn);
+		u8 packed_row[5*MAX_CHANNELS];
+		for(u16 row=0; row<n_rows; ++row)
+			writer.write(packed_row, packRow(pattern, row, n_channels, packed_row));
+	}
 
-		if(instinfo->n_samples > 0)
-		{
-			// Read the rest of the instrument info
-			fread( &instinfo->sample_header_size, 4, 1, xmfile);
-			fread( &instinfo->note_samples, 96, 1, xmfile);
-			fread( &instinfo->vol_points, 48, 1, xmfile);
-			fread( &instinfo->pan_points, 48, 1, xmfile);
-			fread( &instinfo->n_vol_points, 1, 1, xmfile);
-			fread( &instinfo->n_pan_points, 1, 1, xmfile);
-			fread( &instinfo->vol_sustain_point, 1, 1, xmfile);
-			fread( &instinfo->vol_loop_start_point, 1, 1, xmfile);
-			fread( &instinfo->vol_loop_end_point, 1, 1, xmfile);
-			fread( &instinfo->pan_sustain_point, 1, 1, xmfile);
-			fread( &instinfo->pan_loop_start_point, 1, 1, xmfile);
-			fread( &instinfo->pan_loop_end_point, 1, 1, xmfile);
-			fread( &instinfo->vol_type, 1, 1, xmfile);
-			fread( &instinfo->pan_type, 1, 1, xmfile);
-			fread( &instinfo->vibrato_type, 1, 1, xmfile);
-			fread( &instinfo->vibrato_sweep, 1, 1, xmfile);
-			fread( &instinfo->vibrato_depth, 1, 1, xmfile);
-			fread( &instinfo->vibrato_rate, 1, 1, xmfile);
-			fread( &instinfo->vol_fadeout, 2, 1, xmfile);
-			fread( &instinfo->reserved_bytes, 11, 1, xmfile);
-
-			bool vol_env_on, vol_env_sustain, vol_env_loop, pan_env_on, pan_env_sustain, pan_env_loop;
-			
-			vol_env_on      = instinfo->vol_type & BIT(0);
-			vol_env_sustain = instinfo->vol_type & BIT(1);
-			vol_env_loop    = instinfo->vol_type & BIT(2);
-			pan_env_on      = instinfo->pan_type & BIT(0);
-			pan_env_sustain = instinfo->pan_type & BIT(1);
-			pan_env_loop    = instinfo->pan_type & BIT(2);
-
-			instrument->setVolumeEnvelope(instinfo->vol_points, instinfo->n_vol_points, instinfo->vol_sustain_point, 
-					vol_env_on, vol_env_sustain, vol_env_loop);
-			instrument->setPanningEnvelope(instinfo->pan_points, instinfo->n_pan_points, instinfo->pan_sustain_point, 
-					pan_env_on, pan_env_sustain, pan_env_loop);
-
-			// Skip the rest of the header if is longer than the current position
-			// This was really strange and took some time (and debugging with Tim)
-			// to figure out. Why the fsck is the instrument header that much longer?
-			// Well, don't care, skip it.
-
-			//if(instinfo->inst_size > 252) // <- apparently wrong! samples can even be nested, so we have to seek back here o_O
-			fseek(xmfile, instinfo->inst_size-252, SEEK_CUR);
-
-			for(u8 i=0; i<96; ++i)
-				instrument->setNoteSample(i,instinfo->note_samples[i]);
-
-			// Load the sample(s)
-
-			// Headers
-			u8 *sample_headers = (u8*)memalign(2, instinfo->n_samples*40);
-			if (sample_headers == NULL) {
-				free(instinfo);
-				fclose(xmfile);
-				my_dprintf("memfull on line %d\n", __LINE__);
-				delete song;
-				return XM_TRANSPORT_ERROR_MEMFULL;
-			}
-			fread(sample_headers, 40, instinfo->n_samples, xmfile);
+	free(packed_sizes);
 
-			for(u8 sample_id=0; sample_id < instinfo->n_samples; sample_id++)
-			{
-				// Sample length
-				u32 sample_length;
-				sample_length = *(u32*)(sample_headers+40*sample_id + 0);
-				my_dprintf("sample length: %lu\n", sample_length);
-
-				// Sample loop start
-				u32 sample_loop_start;
-				sample_loop_start = *(u32*)(sample_headers+40*sample_id + 4);
-				my_dprintf("sample loop start: %lu\n", sample_loop_start);
-
-				// Sample loop length
-				u32 sample_loop_length;
-				sample_loop_length = *(u32*)(sample_headers+40*sample_id + 8);
-				my_dprintf("sample loop length: %lu\n", sample_loop_length);
-
-				// Volume (0-64)
-				u8 sample_volume;
-				sample_volume = *(u8*)(sample_headers+40*sample_id + 12);
-				//my_dprintf("sample volume: %u\n",sample_volume);
-
-				if(sample_volume == 64) { // Convert scale to 0-255
-					sample_volume = 255;
-				} else {
-					sample_volume *= 4;
-				}
+	my_dprintf("patterns ready\n");
 
-				// Finetune
-				s8 sample_finetune;
-				sample_finetune = *(s8*)(sample_headers+40*sample_id + 13);
-				//my_dprintf("sample finetune: %d\n",sample_finetune);
-
-				// Type byte (loop type and wether it's 8 or 16 bit)
-				u8 sample_type;
-				sample_type = *(u8*)(sample_headers+40*sample_id + 14);
-
-				u8 loop_type = sample_type & 3;
-				if(sample_loop_length == 0)
-					loop_type = NO_LOOP;
-
-				bool sample_is_16_bit = sample_type & 0x10;
-				if(sample_is_16_bit)
-					my_dprintf("16 bit\n");
-				else
-					my_dprintf("8 bit\n");
-
-				// Panning
-				u8 sample_panning;
-				sample_panning = *(u8*)(sample_headers+40*sample_id + 15);
-				//my_dprintf("panning: %u\n", sample_panning);
-
-				// Relative note
-				s8 sample_rel_note;
-				sample_rel_note = *(s8*)(sample_headers+40*sample_id + 16);
-				//my_dprintf("rel note: %d\n", sample_rel_note);
-
-				// Sample name
-				char sample_name[22 + 1];
-				memset(sample_name, 0, sizeof(sample_name));
-				memcpy(sample_name, sample_headers+40*sample_id + 18, 22);
-
-				// Cut off trailing spaces
-				u8 i = sizeof(sample_name) - 2;
-				while(sample_name[i] == ' ')
-					--i;
-				++i;
-				sample_name[i] = '\0';
-
-				//my_dprintf("sample name: '%s' (%u)\n", sample_name, strlen(sample_name));
-
-				// Sample data
-				my_dprintf("loading data\n");
-				void *sample_data = 0;
-				if(sample_length > 0)
-				{
-					sample_data = memalign(2, sample_length);
-
-					if(sample_data==NULL)
-					{
-						free(sample_headers);
-						free(instinfo);
-						fclose(xmfile);
-						my_dprintf("memfull on line %d\n", __LINE__);
-						delete song;
-						return XM_TRANSPORT_ERROR_MEMFULL;
-					}
+	//
+	// Write instruments
+	//
 
-					fread(sample_data, sample_length, 1, xmfile);
-				}
+	for(u16 inst=0; inst<n_inst; ++inst)
+	{
+		// We also have to save empty instruments
+		Instrument *instrument = song->getInstrument(inst);
+		u16 inst_n_samples = (instrument != NULL) ? instrument->getSamples() : 0;
 
-				// Delta-decode
-				my_dprintf("delta decode\n");
-				if(sample_is_16_bit) {
-					s16 last = 0;
-					s16 *smp = (s16*)sample_data;
-					for(u32 i=0;i<sample_length/2;++i) {
-						smp[i] += last;
-						last = smp[i];
-					}
+		writer.write32(XM_INST_HEADER_SIZE);
 
-				} else {
-					s8 last = 0;
-					s8 *smp = (s8*)sample_data;
-					for(u32 i=0;i<sample_length;++i) {
-						smp[i] += last;
-						last = smp[i];
-					}
-				}
+		char inst_name[23] = {0};
+		if(instrument != NULL)
+			strncpy(inst_name, instrument->getName(), 22);
+		writer.write(inst_name, 22);
 
-				// Insert sample into the instrument
-				u32 n_samples;
-				if(sample_is_16_bit) {
-					n_samples = sample_length/2;
-					sample_loop_start /= 2;
-					sample_loop_length /= 2;
-				} else {
-					n_samples = sample_length;
-				}
-				Sample *sample = new Sample(sample_data, n_samples, 8363, sample_is_16_bit);
-				if(sample==NULL)
-				{
-					free(sample_data);
-					free(sample_headers);
-					free(instinfo);
-					fclose(xmfile);
-					my_dprintf("memfull on line %d\n", __LINE__);
-					delete song;
-					return XM_TRANSPORT_ERROR_MEMFULL;
-				}
+		writer.write8(0); // Instrument type, always 0
+		writer.write16(inst_n_samples);
 
-				sample->setVolume(sample_volume);
-				sample->setRelNote(sample_rel_note);
-				sample->setFinetune(sample_finetune);
-				sample->setPanning(sample_panning);
+		if(inst_n_samples == 0) {
+			writer.writeZeroes(XM_INST_HEADER_SIZE - 29);
+			continue;
+		}
 
-				sample->setLoop(loop_type);
-				sample->setLoopStartAndLength(sample_loop_start, sample_loop_length);
-				sample->setName(sample_name);
-				instrument->addSample(sample);
+		writer.write32(XM_SAMPLE_HEADER_SIZE);
 
-				my_dprintf("Sample loaded\n");
-			}
+		u8 note_samples[96];
+		for(u8 i=0; i<96; ++i)
+			note_samples[i] = instrument->getNoteSample(i);
+		writer.write(note_samples, 96);
 
-			free(sample_headers);
+		writeEnvelope(&writer, instrument->vol_envelope_x, instrument->vol_envelope_y, instrument->n_vol_points);
+		writeEnvelope(&writer, instrument->pan_envelope_x, instrument->pan_envelope_y, instrument->n_pan_points);
 
-			//my_dprintf("inst loaded\n");
+		u8 vol_type = (instrument->vol_env_on ? BIT(0) : 0) | (instrument->vol_env_sustain ? BIT(1) : 0) |
+			(instrument->vol_env_loop ? BIT(2) : 0);
+		u8 pan_type = (instrument->pan_env_on ? BIT(0) : 0) | (instrument->pan_env_sustain ? BIT(1) : 0) |
+			(instrument->pan_env_loop ? BIT(2) : 0);
 
-		}
-		else
+		writer.write8(instrument->n_vol_points);
+		writer.write8(instrument->n_pan_points);
+		writer.write8(instrument->vol_sustain_point);
+		writer.write16(0); // Vol env loop start and end (not used for now)
+		writer.write8(instrument->pan_sustain_point);
+		writer.write16(0); // Pan env loop start and end
+		writer.write8(vol_type);
+		writer.write8(pan_type);
+
+		// Vibrato stuff and fadeout are skipped for now, then 11 reserved bytes
+		// and some more to fill up to the header size
+		writer.writeZeroes(XM_INST_HEADER_SIZE - 235);
+
+		for(u16 smp=0; smp<inst_n_samples; ++smp)
+			writeSampleHeader(&writer, instrument->getSample(smp));
+
+		for(u16 smp=0; smp<inst_n_samples; ++smp)
 		{
-			// If the instrument has no samples, skip the rest of the instrument header
-			// (which should contain rubbish anyway)
-			fseek(xmfile, instinfo->inst_size-29, SEEK_CUR);
+			Sample *sample = instrument->getSample(smp);
+			if(sample != NULL)
+				writeSampleData(&writer, sample);
 		}
-
-		free(instinfo);
 	}
 
-	my_dprintf("XM Loaded.\n");
-
 	//
 	// Finish up
 	//
-	fclose(xmfile);
 
-	*_song = song;
+	if(!writer.close())
+		return XM_TRANSPORT_DISK_FULL;
+
+	my_dprintf("song saved as :\"%s\"\n", filename);
+
+	return 0;
+}
+
+const char *XMTransport::getError(u16 error_id)
+{
+	return xmtransporterrors[error_id-1];
+}
+
+/* ===================== PRIVATE ===================== */
+
+// Does the next piece of work: one pattern, one instrument header or one chunk of sample data
+u16 XMTransport::loadNext(void)
+{
+	u16 err = 0;
+
+	switch(load_stage)
+	{
+		case XM_LOAD_PATTERNS:
+			err = loadPattern();
+			if(err != 0)
+				break;
 
-	return 0;
-}
+			cur_pattern++;
+			if(cur_pattern == n_patterns)
+			{
+				// Before the song can be played early. The instruments are
+				// validated when they are put into the song.
+				song->validate();
+				load_stage = (n_inst > 0) ? XM_LOAD_INSTRUMENTS : XM_LOAD_DONE;
+			}
+			break;
 
+		case XM_LOAD_INSTRUMENTS:
+			err = loadInstrument();
+			if(err != 0)
+				break;
 
+			if(instinfo->n_samples > 0) {
+				cur_sample = 0;
+				sample_started = false;
+				load_stage = XM_LOAD_SAMPLES;
+			} else {
+				finishInstrument();
+			}
+			break;
 
-// Saves a song to a file
-u16 XMTransport::save(const char *filename, Song *song)
-{
-	if(my_getUsedRam() > my_getFreeDiskSpace())
-	{
-		return XM_TRANSPORT_DISK_FULL;
+		case XM_LOAD_SAMPLES:
+			err = loadSampleChunk();
+			break;
 	}
 
-	my_dprintf("free disk space: %ld kb\n", my_getFreeDiskSpace() / 1024);
-
-	my_start_malloc_invariant(); // security
+	return err;
+}
 
+u16 XMTransport::loadHeader(void)
+{
 	//
 	// Init
 	//
-
-	// TODO: Let the Arm7 update the RTC first
-	// TODO: Check if there's enough space on the card
-
-	FILE *xmfile = fopen(filename, "w");
-
-	if((s32)xmfile == -1) {
-		return XM_TRANSPORT_ERROR_FOPENFAIL;
+	if(reader->getSize() == 0)
+	{
+		my_dprintf("0-byte file!\n");
+		return XM_TRANSPORT_FILE_ZERO_BYTE;
 	}
 
 	//
-	// Write header
+	// Read header
 	//
 
 	// Magic number
-	char magicnumber[18] = "Extended Module: ";
-	fwrite(magicnumber, 1, 17, xmfile);
+	char magicnumber[18] = {0};
+	reader->read(magicnumber, 17);
+
+	if( strcmp(magicnumber, "Extended Module: ") != 0 ) {
+		my_dprintf("Not an XM file!\n");
+		return XM_TRANSPORT_ERROR_MAGICNUMBERINVALID;
+	}
 
 	// Song name
 	char songname[21] = {0};
-	strcpy(songname, song->getName());
-	fwrite(songname, 1, 20, xmfile);
-
-	// wtf
-	u8 versionbyte = 0x1a;
-	fwrite(&versionbyte, 1, 1, xmfile);
+	reader->read(songname, 20);
 
-	// Tracker Name
-	char trackername[21] = "NitroTracker";
-	fwrite(trackername, 1, 20, xmfile);
+	// Skip uninteresting stuff like tracker name
+	reader->skip(21);
 
-	// Version number
-	u16 version = 0x104; // FT2 version number (else soundtracker won't accept the file
-	fwrite(&version, 2, 1, xmfile);
+	reader->read(&header_version, 2);
+	my_dprintf("XM version %x\n", header_version);
 
 	// Header size
-	u32 headersize = 0x114;
-	fwrite(&headersize, 4, 1, xmfile);
+	u32 header_size;
+	reader->read(&header_size, 4);
 
-	// Song Length
-	u16 songlength = song->getPotLength();
-	fwrite(&songlength, 2, 1, xmfile);
+	// Song length (pot size)
+	u16 pot_size;
+	reader->read(&pot_size, 2);
+	//my_dprintf("songlen: %u\n",pot_size);
 
 	// Restart position
-	u16 restartpos = song->getRestartPosition();
-	fwrite(&restartpos, 2, 1, xmfile);
+	u16 restart_pos;
+	reader->read(&restart_pos, 2);
+	//my_dprintf("restart: %u\n", restart_pos);
 
 	// Number of channels
-	u16 n_channels = song->getChannels();
-	fwrite(&n_channels, 2, 1, xmfile);
+	reader->read(&n_channels, 2);
+	//my_dprintf("n chn: %u\n", n_channels);
 
 	// Number of patterns
-	u16 n_patterns = song->getNumPatterns();
-	fwrite(&n_patterns, 2, 1, xmfile);
+	reader->read(&n_patterns, 2);
+	//my_dprintf("n ptn: %u\n", n_patterns);
 
 	// Number of instruments
-	u16 n_inst = song->getInstruments();
-	fwrite(&n_inst, 2, 1, xmfile);
-
-	// Flags
-	u16 flags = 1; // Means linear freq table (amiga table support maybe soon)
-	fwrite(&flags, 2, 1, xmfile);
-
-	// Tempo
-	u16 tempo = song->getTempo();
-	fwrite(&tempo, 2, 1, xmfile);
-
-	// BPM
-	u16 bpm = song->getBPM();
-	fwrite(&bpm, 2, 1, xmfile);
+	reader->read(&n_inst, 2);
+	my_dprintf("n inst: %u\n", n_inst);
 
-	// POT
-	u8 pot[256] = {0};
-	for(u8 i=0; i<song->getPotLength(); ++i) {
-		pot[i] = song->getPotEntry(i);
+	// The song counts its patterns in a byte, so there can be 255 at most.
+	// Songs have room for MAX_CHANNELS channels only.
+	if( (pot_size > MAX_POT_LENGTH) || (n_channels == 0) || (n_channels > MAX_CHANNELS) ||
+	    (n_patterns >= MAX_PATTERNS) || (n_inst > MAX_INSTRUMENTS) )
+	{
+		my_dprintf("Invalid header!\n");
+		return XM_TRANSPORT_BAD_HEADER;
 	}
-	fwrite(pot, 1, 256, xmfile);
-
-	//
-	// Write patterns
-	//
 
-	// TODO: Skip empty pattern
+	// The song always has the first pattern order entry
+	if(pot_size == 0)
+		pot_size = 1;
 
-	for(u8 ptn = 0; ptn < n_patterns; ++ptn) {
-
-		my_dprintf("ptn %u\n", ptn);
+	// Flags, currently only used for the frequency table (0: amiga, 1: linear)
+	// TODO: Amiga freq table
+	u16 flags;
+	reader->read(&flags, 2);
+	//my_dprintf("flags: %u\n", flags);
 
-		// Pattern header length
-		u32 ptnheaderlength = 9;
-		fwrite(&ptnheaderlength, 4, 1, xmfile);
+	// Tempo
+	u16 tempo;
+	reader->read(&tempo, 2);
+	if(tempo == 0) tempo = 1; // Found an XM that actually had 0 there
+	my_dprintf("tempo: %u\n", tempo);
 
-		// Packing type
-		u8 packtype = 0; // Is always 0
-		fwrite(&packtype, 1, 1, xmfile);
 
-		// Number of rows
-		u16 n_rows = song->getPatternLength(ptn);
-		fwrite(&n_rows, 2, 1, xmfile);
+	// BPM
+	u16 bpm;
+	reader->read(&bpm, 2);
+	//my_dprintf("bpm: %u\n", bpm);
+	my_dprintf("new song %u %u %u\n",tempo, bpm, n_channels );
+	// Construct the song with the current info
+	song = new Song(tempo, bpm, n_channels);
+	if(song==NULL)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return XM_TRANSPORT_ERROR_MEMFULL;
+	}
 
-		if(n_rows > 256) {
-			my_dprintf("%u rows!\n",n_rows);
-			while(1);
-		}
+	song->setName(songname);
 
-		// Pack the pattern in memory, then save it
-		u8 *patterndata = (u8*)my_malloc(5*32*256);
+	song->setRestartPosition(restart_pos);
 
-		if(patterndata==0) {
-			fclose(xmfile);
-			return XM_TRANSPORT_ERROR_MEMFULL;
-		}
+	// Pattern order table
+	u16 i;
+	u8 potentry;
 
-		memset(patterndata, 0, 5*32*256);
-		Cell **pattern = song->getPattern(ptn);
+	reader->read(&potentry, 1);
+	song->setPotEntry(0, potentry); // The first entry is made automatically by the song
 
-		u16 datapos = 0;
+	for(i=1;i<pot_size;++i) {
+		reader->read(&potentry, 1);
+		song->potAdd(potentry);
+	}
+	reader->skip(256-pot_size);
 
-		Cell cell;
-		for(u16 row=0; row<n_rows; ++row) {
-			for(u16 chn=0; chn<n_channels; ++chn) {
+	return 0;
+}
 
-				//my_dprintf("ptn:%u row:%u chn:%u datapos:%u\n",ptn,row,chn,datapos);
+u16 XMTransport::loadPattern(void)
+{
+	u8 pattern = cur_pattern;
+	//my_dprintf("Reading pattern %u\n",pattern);
+
+	// Pattern header length
+	u32 pattern_header_length;
+	reader->read(&pattern_header_length, 4);
+
+	//my_dprintf("ptn header: %u\n",pattern_header_length);
+
+	// Skip packing type (is always 0)
+	reader->skip(1);
+
+	// Number of rows
+	u16 n_rows;
+	if( (header_version == 0x104) || (header_version == 0x103) ) {
+		reader->read(&n_rows, 2);
+	} else {
+		u8 u8_n_rows;
+		reader->read(&u8_n_rows, 1);
+		n_rows = (u16)u8_n_rows + 1;
+	}
 
-				cell = pattern[chn][row];
+	if(n_rows > MAX_PATTERN_LENGTH)
+	{
+		my_dprintf("Pattern too long: %u rows\n", n_rows);
+		return XM_TRANSPORT_PATTERN_TOO_LONG;
+	}
 
-				u8 write_note = cell.note != EMPTY_NOTE;
-				u8 write_instrument = cell.instrument != NO_INSTRUMENT;
-				u8 write_volume = (cell.volume != NO_VOLUME) || (cell.effect2 != NO_EFFECT);
-				u8 write_effect = cell.effect != NO_EFFECT;
-				u8 write_effect_param = cell.effect_param != NO_EFFECT_PARAM;
+	//my_dprintf("n_rows: %u\n",n_rows);
 
-				u8 magicbyte = 0;
-				magicbyte |= write_note         << 0;
-				magicbyte |= write_instrument   << 1;
-				magicbyte |= write_volume       << 2;
-				magicbyte |= write_effect       << 3;
-				magicbyte |= write_effect_param << 4;
+	// Packed patterndata size
+	u16 patterndata_size;
+	reader->read(&patterndata_size, 2);
+	//TODO: Handle empty patterns (which are left out in the xm format)
+	//my_dprintf("patterndata_size: %u (%u/%u)\n", patterndata_size,pattern,n_patterns);
 
-				// Check if everything in the cell is set. If not, use the magic byte
-				if(magicbyte != 31) {
-					magicbyte |= 1 << 7;
-					patterndata[datapos] = magicbyte;
-					datapos++;
-				}
+	if(patterndata_size > 0) { // Read the pattern
 
-				if(write_note) {
-					if(cell.note == EMPTY_NOTE) {
-						patterndata[datapos] = 0;
-					} else if(cell.note == STOP_NOTE) {
-						patterndata[datapos] = 97;
-					} else {
-						patterndata[datapos] = cell.note+1;
-					}
+		// Songs in memory are unpacked straight from the buffer
+		u8 *ptn_buffer = 0;
+		const u8 *ptn_data = reader->getPointer(patterndata_size);
 
-					datapos++;
-				}
-				if(write_instrument) {
-					patterndata[datapos] = cell.instrument+1;
-					datapos++;
-				}
-				if(write_volume) {
-					// Volume or volume effect?
-					if(cell.volume == NO_VOLUME) // Volume is not set, so it's a volume effect
-					{
-						// Convert "real" effect to volume effect
-						u8 eff2_type = cell.effect2;
-						u8 eff2_param = cell.effect2_param;
-
-						u8 volbyte = 0;
-
-						switch(eff2_type) {
-							case(0x0A): { // Volume slide
-								if(eff2_param > 0x0F) { // Up
-									volbyte = 0x70 | (eff2_param >> 4);
-								} else { // Down
-									volbyte = 0x60 | (eff2_param & 0x0F);
-								}
-								break;
-							}
-							case(0x0E): { // Fine volume slide
-								if((eff2_param & 0xF0) == 0xA0) { // Up
-									volbyte = 0x90 | (eff2_param & 0x0F);
-								} else if((eff2_param & 0xF0) == 0xB0) { // Down
-									volbyte = 0x80 | (eff2_param & 0x0F);
-								}
-								break;
-							}
-							case(0x04): { // Vibrato
-								if(eff2_param > 0x0F) { // Speed
-									volbyte = 0xA0 | (eff2_param >> 4);
-								} else { // Depth
-									volbyte = 0xB0 | (eff2_param & 0x0F);
-								}
-								break;
-							}
-							case(0x08): { // Set panning
-								volbyte = 0xC0 | (eff2_param >> 4);
-								break;
-							}
-							case(0x19): { // Panning slide
-								if(eff2_param > 0x0F) { // Right
-									volbyte = 0xE0 | (eff2_param >> 4);
-								} else { // Left
-									volbyte = 0xD0 | (eff2_param & 0x0F);
-								}
-								break;
-							}
-							case(0x03): { // Tone porta
-								volbyte = 0xF0 | (eff2_param >> 4);
-								break;
-							}
-						}
+		if(ptn_data != 0)
+		{
+			reader->skip(patterndata_size);
+		}
+		else
+		{
+			ptn_buffer = (u8*)memalign(2, patterndata_size);
+			if (ptn_buffer == NULL) {
+				my_dprintf("memfull on line %d\n", __LINE__);
+				return XM_TRANSPORT_ERROR_MEMFULL;
+			}
 
-						patterndata[datapos] = volbyte;
+			u32 bytes_read;
 
-					} else {
-						patterndata[datapos] = (cell.volume+1)/2+16;
-					}
-					datapos++;
-				}
-				if(write_effect) {
-					patterndata[datapos] = cell.effect;
-					datapos++;
-				}
-				if(write_effect_param) {
-					patterndata[datapos] = cell.effect_param;
-					datapos++;
-				}
+			bytes_read = reader->read(ptn_buffer, patterndata_size);
 
+			if(bytes_read != patterndata_size) {
+				free(ptn_buffer);
+				my_dprintf("pattern read error.\nread:%lu (should be %u)\n", bytes_read, patterndata_size);
+				return XM_TRANSPORT_ERROR_PATTERN_READ;
 			}
+
+			ptn_data = ptn_buffer;
 		}
 
-		// Packed patterndata size
-		u16 packed_ptn_size = datapos+1;
-		//my_dprintf("saving packed size\n");
-		fwrite(&packed_ptn_size, 2, 1, xmfile);
-		// Packed patterndata
-		my_dprintf("saving ptn (%u bytes) %p\n",packed_ptn_size,patterndata);
-		fwrite(patterndata, 1, packed_ptn_size, xmfile);
+		u32 ptn_data_offset = 0;
 
-		my_free(patterndata);
-	}
+		u8 chn;
+		u16 row;
 
-	my_dprintf("patterns ready\n");
+		if( ( (pattern > 0) && !song->addPattern() ) || !song->resizePattern(pattern, n_rows) ) {
+			free(ptn_buffer);
+			return XM_TRANSPORT_ERROR_MEMFULL;
+		}
 
-	//
-	// Write instruments
-	//
+		Cell **ptn = song->getPattern(pattern);
 
-	Instrument *instrument = 0;
+		for(row=0;row<n_rows;++row)
+		{
+			for(chn=0;chn<n_channels;++chn)
+			{
+				u8 magicbyte = 0, note = EMPTY_NOTE, inst = NO_INSTRUMENT, vol = NO_VOLUME,
+					eff_type = NO_EFFECT, eff_param = NO_EFFECT_PARAM, eff2_type = NO_EFFECT,
+					eff2_param = NO_EFFECT_PARAM;
 
-	for(u8 inst=0; inst<song->getInstruments(); ++inst) {
+				// Broken files have less data than rows. The rest stays empty.
+				if(ptn_data_offset >= patterndata_size)
+					break;
 
-		my_dprintf("saving inst %u\n", inst);
+				magicbyte = ptn_data[ptn_data_offset];
+				ptn_data_offset++;
+				//fread(&magicbyte, 1, 1, xmfile);
 
-		instrument = song->getInstrument(inst);
+				bool read_note=true, read_inst=true, read_vol=true,
+					read_eff_type=true, read_eff_param=true;
 
-		// We also have to save empty instruments
-		bool empty_inst = false;
-		if(instrument==NULL) {
-			instrument = new Instrument("");
-			if (instrument == NULL) {
-				fclose(xmfile);
-				my_dprintf("memfull on line %d\n", __LINE__);
-				return XM_TRANSPORT_ERROR_MEMFULL;
-			}
-			empty_inst = true;
-		}
+				if(magicbyte & 1<<7) { // It's the magic byte!
 
-		// Instrument size (always 0x107)
-		u32 inst_size = 0x107;
-		fwrite(&inst_size, 4, 1, xmfile);
+					read_note = magicbyte & 1<<0;
+					read_inst = magicbyte & 1<<1;
+					read_vol = magicbyte & 1<<2;
+					read_eff_type = magicbyte & 1<<3;
+					read_eff_param = magicbyte & 1<<4;
 
-		// Instrument name
-		char inst_name[33] = {0};
-		strcpy(inst_name, instrument->getName());
-		fwrite(inst_name, 1, 22, xmfile);
+				} else { // It's the note!
 
-		// Instrument type (always 0)
-		u8 inst_type = 0;
-		fwrite(&inst_type, 1, 1, xmfile);
+					note = magicbyte;
+					read_note = false;
 
-		// Number of samples in instrument
-		u16 inst_n_samples = instrument->getSamples();
-		fwrite(&inst_n_samples, 2, 1, xmfile);
+				}
 
-		my_dprintf("n samples: %u\n", inst_n_samples);
+				u8 n_bytes = read_note + read_inst + read_vol + read_eff_type + read_eff_param;
+				if(ptn_data_offset + n_bytes > patterndata_size) {
+					ptn_data_offset = patterndata_size;
+					break;
+				}
 
-		if(inst_n_samples > 0) {
+				if(read_note) {
+					note = ptn_data[ptn_data_offset];
+					ptn_data_offset++;
+				}
 
-			// Second part of inst header:
+				if(read_inst) {
+					inst = ptn_data[ptn_data_offset];
+					ptn_data_offset++;
+				} else {
+					inst = NO_INSTRUMENT;
+				}
 
-			struct InstInfo *instinfo = (InstInfo*)calloc(1, sizeof(InstInfo));
-			if (instinfo == NULL) {
-				if (empty_inst) delete instrument;
-				fclose(xmfile);
-				my_dprintf("memfull on line %d\n", __LINE__);
-				return XM_TRANSPORT_ERROR_MEMFULL;
-			}
+				if(read_vol) {
+					vol = ptn_data[ptn_data_offset];
+					ptn_data_offset++;
+				} else {
+					vol = 0; // 'Do nothing'
+				}
 
-			// Sample header size (always 0x28)
-			instinfo->sample_header_size = 0x28;
+				if(read_eff_type) {
+					eff_type = ptn_data[ptn_data_offset];
+					ptn_data_offset++;
+				} else {
+					if(!read_eff_param)
+						eff_type = NO_EFFECT;
+					else
+						eff_type = EFFECT_ARPEGGIO; // If we have params, but no effect, assume arpeggio
+				}
 
-			// Sample number for all notes
-			for(u8 i=0;i<96;++i)
-				instinfo->note_samples[i] = instrument->getNoteSample(i);
+				if(read_eff_param) {
+					eff_param = ptn_data[ptn_data_offset];
+					ptn_data_offset++;
+				} else {
+					eff_param = NO_EFFECT_PARAM;
+				}
 
-			// Volume envelope points
-			for(u8 i=0; i<12; ++i)
-			{
-				instinfo->vol_points[2*i] = instrument->vol_envelope_x[i];
-				instinfo->vol_points[2*i+1] = instrument->vol_envelope_y[i];
-			}
+				//my_dprintf("note: %u\ninst: %u\nvol: %u\neff_type: %u\neff_param: %u\n",note,inst,vol,eff_type,eff_param);
 
-			instinfo->n_vol_points = instrument->n_vol_points;
+				// Insert note into song
+				if(note > 0 && note < 97) {
+					ptn[chn][row].note = note - 1;
+				} else if(note==97) {
+					ptn[chn][row].note = STOP_NOTE;
+				} else {
+					ptn[chn][row].note = EMPTY_NOTE;
+				}
 
-			// Panning envelope points
-			for(u8 i=0; i<12; ++i)
-			{
-				instinfo->pan_points[2*i] = instrument->pan_envelope_x[i];
-				instinfo->pan_points[2*i+1] = instrument->pan_envelope_y[i];
-			}
+				if(inst != NO_INSTRUMENT) {
+					ptn[chn][row].instrument = inst-1; // XM Inst indices start with 1
+				} else {
+					ptn[chn][row].instrument = NO_INSTRUMENT;
+				}
 
-			instinfo->n_pan_points = instrument->n_pan_points;
-
-			// Vol env sustain, start, end (not used for now)
-			instinfo->vol_sustain_point = instrument->getVolumeEnvelopeSustainPoint();
-			instinfo->vol_loop_start_point = 0;
-			instinfo->vol_loop_end_point = 0;
-
-			// Volume envelope type
-			instinfo->vol_type = 0;
-			if(instrument->vol_env_on)
-				instinfo->vol_type |= BIT(0);
-			if(instrument->vol_env_sustain)
-				instinfo->vol_type |= BIT(1);
-			if(instrument->vol_env_loop)
-				instinfo->vol_type |= BIT(2);
-
-			// Panning envelope type
-			instinfo->pan_type = 0;
-			if(instrument->pan_env_on)
-				instinfo->pan_type |= BIT(0);
-			if(instrument->pan_env_sustain)
-				instinfo->pan_type |= BIT(1);
-			if(instrument->pan_env_loop)
-				instinfo->pan_type |= BIT(2);
-
-			// Vibrato stuff and fadeout are skipped for now
-
-			fwrite( &instinfo->sample_header_size, 4, 1, xmfile);
-			fwrite( &instinfo->note_samples, 96, 1, xmfile);
-			fwrite( &instinfo->vol_points, 48, 1, xmfile);
-			fwrite( &instinfo->pan_points, 48, 1, xmfile);
-			fwrite( &instinfo->n_vol_points, 1, 1, xmfile);
-			fwrite( &instinfo->n_pan_points, 1, 1, xmfile);
-			fwrite( &instinfo->vol_sustain_point, 1, 1, xmfile);
-			fwrite( &instinfo->vol_loop_start_point, 1, 1, xmfile);
-			fwrite( &instinfo->vol_loop_end_point, 1, 1, xmfile);
-			fwrite( &instinfo->pan_sustain_point, 1, 1, xmfile);
-			fwrite( &instinfo->pan_loop_start_point, 1, 1, xmfile);
-			fwrite( &instinfo->pan_loop_end_point, 1, 1, xmfile);
-			fwrite( &instinfo->vol_type, 1, 1, xmfile);
-			fwrite( &instinfo->pan_type, 1, 1, xmfile);
-			fwrite( &instinfo->vibrato_type, 1, 1, xmfile);
-			fwrite( &instinfo->vibrato_sweep, 1, 1, xmfile);
-			fwrite( &instinfo->vibrato_depth, 1, 1, xmfile);
-			fwrite( &instinfo->vibrato_rate, 1, 1, xmfile);
-			fwrite( &instinfo->vol_fadeout, 2, 1, xmfile);
-			fwrite( &instinfo->reserved_bytes, 11, 1, xmfile);
-
-			free(instinfo);
-
-			Sample *sample = 0;
-
-			// Fill up to header size = 0x107 = 263. We have written 252 bytes up will now.
-			u8* moreemptydata = (u8*)my_malloc(inst_size - 252);
-			memset(moreemptydata, 0, inst_size - 252);
-			fwrite(moreemptydata, 1, inst_size - 252, xmfile);
-			my_free(moreemptydata);
-
-			// Write sample headers
-
-			for(u8 smp=0; smp<inst_n_samples; ++smp)
-			{
-				sample = instrument->getSample(smp);
+				// Separate volume column effects from the volume column
+				// and put them into the effcts column instead
 
-				bool empty_sample = false;
-				if(sample == NULL)
+				if((vol >= 0x10) && (vol <= 0x50))
+				{
+					u16 volume = (vol-16)*2;
+					if(volume>=MAX_VOLUME) volume = MAX_VOLUME;
+					ptn[chn][row].volume = volume;
+				}
+				else if(vol==0)
+				{
+					ptn[chn][row].volume = NO_VOLUME;
+				}
+				else if(vol>=0x60)
 				{
-					sample = new Sample(NULL, 0);
-					if (sample == NULL) {
-						if (empty_inst) delete instrument;
-						fclose(xmfile);
-						my_dprintf("memfull on line %d\n", __LINE__);
-						return XM_TRANSPORT_ERROR_MEMFULL;
+					// It's an effect!
+					u8 volfx_param = vol & 0x0F;
+
+					if( (vol>=0x60)&&(vol<=0x6F) ) { // Volume slide down
+						eff2_type = 0x0A;
+						eff2_param = volfx_param;
+					} else if( (vol>=0x70)&&(vol<=0x7F) ) { // Volume slide up
+						eff2_type = 0x0A;
+						eff2_param = volfx_param << 4;
+					} else if( (vol>=0x80)&&(vol<=0x8F) ) { // Fine volume slide down
+						eff2_type = 0x0E;
+						eff2_param = 0xB0 | volfx_param;
+					} else if( (vol>=0x90)&&(vol<=0x9F) ) { // Fine volume slide up
+						eff2_type = 0x0E;
+						eff2_param = 0xA0 | volfx_param;
+					} else if( (vol>=0xA0)&&(vol<=0xAF) ) { // Set vibrato speed (calls vibrato)
+						eff2_type = 0x04;
+						eff2_param = volfx_param << 4;
+					} else if( (vol>=0xB0)&&(vol<=0xBF) ) { // Vibrato
+						eff2_type = 0x04;
+						eff2_param = volfx_param; // Vibrato depth
+					} else if( (vol>=0xC0)&&(vol<=0xCF) ) { // Set panning
+						eff2_type = 0x08;
+						eff2_param = volfx_param << 4;
+					} else if( (vol>=0xD0)&&(vol<=0xDF) ) { // Panning slide left
+						eff2_type = 0x19;
+						eff2_param = volfx_param;
+					} else if( (vol>=0xD0)&&(vol<=0xDF) ) { // Panning slide right
+						eff2_type = 0x19;
+						eff2_param = volfx_param << 4;
+					} else if( vol>=0xF0 ) { // Tone porta
+						eff2_type = 0x03;
+						eff2_param = volfx_param << 4;
 					}
-					empty_sample = true;
 				}
 
-				// Sample length
-				u32 smp_length = sample->getSize();
-				fwrite(&smp_length, 4, 1, xmfile);
+				ptn[chn][row].effect = eff_type;
+				ptn[chn][row].effect_param = eff_param;
+				ptn[chn][row].effect2 = eff2_type;
+				ptn[chn][row].effect2_param = eff2_param;
+			}
 
-				// Loop stuff
-				u32 smp_loop_start = sample->getLoopStart();
-				u32 smp_loop_length = sample->getLoopLength();
+		}
 
-				if(sample->is16bit())
-				{
-					smp_loop_start *= 2;
-					smp_loop_length *= 2;
-				}
+		free(ptn_buffer);
 
-				fwrite(&smp_loop_start, 4, 1, xmfile);
-				fwrite(&smp_loop_length, 4, 1, xmfile);
+	} else { // Make an empty pattern
 
-				// Sample Volume
-				u8 smp_vol = (sample->getVolume() + 1) / 4; // Convert scale to 0-64
-				fwrite(&smp_vol, 1, 1, xmfile);
+		if( ( (pattern > 0) && !song->addPattern() ) || !song->resizePattern(pattern, n_rows) )
+			return XM_TRANSPORT_ERROR_MEMFULL;
+	}
 
-				// Finetune
-				s8 smp_finetune = sample->getFinetune();
-				fwrite(&smp_finetune, 1, 1, xmfile);
+	return 0;
+}
 
-				// Type
-				u8 smp_type = 0;
-				smp_type |= sample->getLoop();
-				if(sample->is16bit()) {
-					smp_type |= 1<<4;
-				}
-				fwrite(&smp_type, 1, 1, xmfile);
+u16 XMTransport::loadInstrument(void)
+{
+	instinfo = (struct InstInfo*)calloc(1, sizeof(struct InstInfo));
+	if (instinfo == NULL) {
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return XM_TRANSPORT_ERROR_MEMFULL;
+	}
 
-				// Panning
-				u8 smp_panning = sample->getBasePanning();
-				fwrite(&smp_panning, 1, 1, xmfile);
+	// Read fields up to number of samples
 
-				// Relative note
-				s8 smp_relnote = sample->getRelNote();
-				fwrite(&smp_relnote, 1, 1, xmfile);
+	reader->read(&instinfo->inst_size, 4);
+	reader->read(&instinfo->name, 22);
+	reader->read(&instinfo->inst_type, 1);
+	reader->read(&instinfo->n_samples, 2);
 
-				// Reserved byte (what a crappy standard)
-				u8 smp_funky_reserved_byte = 0x80;
-				fwrite(&smp_funky_reserved_byte, 1, 1, xmfile);
+	// Notes refer to samples with a byte
+	if(instinfo->n_samples > 255)
+	{
+		my_dprintf("Too many samples: %u\n", instinfo->n_samples);
+		return XM_TRANSPORT_BAD_HEADER;
+	}
 
-				// Sample name
-				char sample_name[23] = "                      ";
-				strncpy(sample_name, sample->getName(), strlen(sample->getName())); // Don't copy \0 character
-				fwrite(sample_name, 1, 22, xmfile);
+	instrument = new Instrument(instinfo->name);
+	if(instrument == 0)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return XM_TRANSPORT_ERROR_MEMFULL;
+	}
 
-				if(empty_sample == true)
-					free(sample);
-			}
+	if(instinfo->n_samples > 0)
+	{
+		// Read the rest of the instrument info
+		reader->read(&instinfo->sample_header_size, 4);
+		reader->read(&instinfo->note_samples, 96);
+		reader->read(&instinfo->vol_points, 48);
+		reader->read(&instinfo->pan_points, 48);
+		reader->read(&instinfo->n_vol_points, 1);
+		reader->read(&instinfo->n_pan_points, 1);
+		reader->read(&instinfo->vol_sustain_point, 1);
+		reader->read(&instinfo->vol_loop_start_point, 1);
+		reader->read(&instinfo->vol_loop_end_point, 1);
+		reader->read(&instinfo->pan_sustain_point, 1);
+		reader->read(&instinfo->pan_loop_start_point, 1);
+		reader->read(&instinfo->pan_loop_end_point, 1);
+		reader->read(&instinfo->vol_type, 1);
+		reader->read(&instinfo->pan_type, 1);
+		reader->read(&instinfo->vibrato_type, 1);
+		reader->read(&instinfo->vibrato_sweep, 1);
+		reader->read(&instinfo->vibrato_depth, 1);
+		reader->read(&instinfo->vibrato_rate, 1);
+		reader->read(&instinfo->vol_fadeout, 2);
+		reader->read(&instinfo->reserved_bytes, 11);
+
+		bool vol_env_on, vol_env_sustain, vol_env_loop, pan_env_on, pan_env_sustain, pan_env_loop;
+		
+		vol_env_on      = instinfo->vol_type & BIT(0);
+		vol_env_sustain = instinfo->vol_type & BIT(1);
+		vol_env_loop    = instinfo->vol_type & BIT(2);
+		pan_env_on      = instinfo->pan_type & BIT(0);
+		pan_env_sustain = instinfo->pan_type & BIT(1);
+		pan_env_loop    = instinfo->pan_type & BIT(2);
+
+		instrument->setVolumeEnvelope(instinfo->vol_points, instinfo->n_vol_points, instinfo->vol_sustain_point, 
+				vol_env_on, vol_env_sustain, vol_env_loop);
+		instrument->setPanningEnvelope(instinfo->pan_points, instinfo->n_pan_points, instinfo->pan_sustain_point, 
+				pan_env_on, pan_env_sustain, pan_env_loop);
+
+		// Skip the rest of the header if is longer than the current position
+		// This was really strange and took some time (and debugging with Tim)
+		// to figure out. Why the fsck is the instrument header that much longer?
+		// Well, don't care, skip it.
+
+		//if(instinfo->inst_size > 252) // <- apparently wrong! samples can even be nested, so we have to seek back here o_O
+		reader->skip(instinfo->inst_size-252);
+
+		for(u8 i=0; i<96; ++i)
+			instrument->setNoteSample(i,instinfo->note_samples[i]);
+
+		// Load the sample(s)
+
+		// Headers
+		sample_headers = (u8*)memalign(2, instinfo->n_samples*40);
+		if (sample_headers == NULL) {
+			my_dprintf("memfull on line %d\n", __LINE__);
+			return XM_TRANSPORT_ERROR_MEMFULL;
+		}
+		reader->read(sample_headers, 40*instinfo->n_samples);
 
-			// Write sample data
+		return 0;
+	}
+	else
+	{
+		// If the instrument has no samples, skip the rest of the instrument header
+		// (which should contain rubbish anyway)
+		reader->skip(instinfo->inst_size-29);
 
-			for(u8 smp=0; smp<inst_n_samples; ++smp)
-			{
-				sample = instrument->getSample(smp);
+		return 0;
+	}
+}
 
-				bool empty_sample = false;
-				if(sample == NULL)
-				{
-					sample = new Sample(NULL, 0);
-					if (sample == NULL) {
-						if (empty_inst) delete instrument;
-						fclose(xmfile);
-						my_dprintf("memfull on line %d\n", __LINE__);
-						return XM_TRANSPORT_ERROR_MEMFULL;
-					}
-					empty_sample = true;
-				}
+u16 XMTransport::loadSampleChunk(void)
+{
+	if(!sample_started)
+	{
+		// Sample length and type
+		u8 *header = sample_headers + 40*cur_sample;
+		sample_length = *(u32*)(header + 0);
+		sample_is_16_bit = *(u8*)(header + 14) & 0x10;
+
+		// Truncated files end in the middle of the last sample. Load what is
+		// there instead of allocating what the header says.
+		u32 remaining = reader->getSize() - reader->tell();
+		if(sample_length > remaining)
+			sample_length = sample_is_16_bit ? (remaining & ~1) : remaining;
+
+		my_dprintf("sample length: %lu, %s\n", sample_length, sample_is_16_bit ? "16 bit" : "8 bit");
+
+		sample_pos = 0;
+		delta_last = 0;
+		sample_data = 0;
+		sample_packed = 0;
+		sample_offset = 0;
+		external_data = false;
+		sample_started = true;
+
+		if( (sample_length > 0) && (lazy_samples) )
+		{
+			sample_offset = reader->tell();
+			reader->skip(sample_length);
+			sample_pos = sample_length;
+		}
+		else if(sample_length > 0)
+		{
+			my_dprintf("loading data\n");
 
-				if(sample->is16bit())
-				{
-					s16 *sample_data = (s16*)sample->getData();
-					s16 *sample_data_enc = (s16*)my_malloc( sample->getSize() );
-
-					if(sample_data_enc != 0)
-					{
-						s16 last = 0;
-						for(u32 i=0; i<sample->getNSamples(); ++i)
-						{
-							sample_data_enc[i] = sample_data[i] - last;
-							last = sample_data[i];
-						}
-						fwrite(sample_data_enc, 1, sample->getSize(), xmfile);
+			// Writable buffers are decoded in place and used directly
+			// if the data is word aligned for the sound hardware
+			u8 *in_place = reader->getWritablePointer(sample_length);
+			if((uintptr_t)in_place & 3)
+				in_place = 0;
 
-						my_free(sample_data_enc);
+			if(in_place != 0)
+			{
+				reader->skip(sample_length);
+				sample_data = in_place;
+				sample_packed = in_place;
+				external_data = true;
+			}
+			else
+			{
+				sample_data = memalign(2, sample_length);
+				if(sample_data==NULL)
+				{
+					my_dprintf("memfull on line %d\n", __LINE__);
+					return XM_TRANSPORT_ERROR_MEMFULL;
+				}
 
-					} else { // slow uncached fallback if ram is nearly full
+				// Decode while copying out of a read-only buffer
+				sample_packed = reader->getPointer(sample_length);
+				if(sample_packed != 0)
+					reader->skip(sample_length);
+			}
+		}
+	}
 
-						my_dprintf("saving with slow uncached fallback\n");
-						s16 last = 0, curr;
-						for(u32 i=0; i<sample->getNSamples(); ++i) {
-							curr = sample_data[i] - last;
-							fwrite(&curr, 1, 2, xmfile);
-							last = sample_data[i];
-						}
-						my_dprintf("done\n");
-					}
+	// Decode a chunk. Files are read chunk by chunk as well.
+	u32 chunk = sample_length - sample_pos;
+	if(chunk > XM_LOAD_CHUNK_SIZE)
+		chunk = XM_LOAD_CHUNK_SIZE;
 
-				} else {
+	if(chunk > 0)
+	{
+		u8 *dest = (u8*)sample_data + sample_pos;
 
-					s8 *sample_data = (s8*)sample->getData();
-					s8 *sample_data_enc = (s8*)malloc( sample->getSize() );
+		if(sample_packed == 0)
+			reader->readDeltaCoded(dest, chunk, sample_is_16_bit, &delta_last);
+		else
+			ntxm_delta_decode(dest, sample_packed + sample_pos, chunk, sample_is_16_bit, &delta_last);
+		sample_pos += chunk;
+	}
 
-					if(sample_data_enc != 0)
-					{
-						s8 last = 0;
-						for(u32 i=0; i<sample->getNSamples(); ++i)
-						{
-							sample_data_enc[i] = sample_data[i] - last;
-							last = sample_data[i];
-						}
+	if(sample_pos < sample_length)
+		return 0;
 
-						fwrite(sample_data_enc, 1, sample->getSize(), xmfile);
+	u16 err = finishSample();
+	if(err != 0)
+		return err;
 
-						free(sample_data_enc);
-					}
-					else
-					{
-						my_dprintf("saving with slow uncached fallback\n");
-						s8 last = 0, curr;
-						for(u32 i=0; i<sample->getNSamples(); ++i)
-						{
-							curr = sample_data[i] - last;
-							fwrite(&curr, 1, 2, xmfile);
-							last = sample_data[i];
-						}
-						my_dprintf("done\n");
-					}
+	cur_sample++;
+	sample_started = false;
+	if(cur_sample == instinfo->n_samples)
+		finishInstrument();
 
-				}
+	return 0;
+}
 
-				if(empty_sample == true)
-					free(sample);
+u16 XMTransport::finishSample(void)
+{
+	u8 *sample_headers = this->sample_headers;
+	u8 sample_id = cur_sample;
+
+	// Sample loop start
+	u32 sample_loop_start;
+	sample_loop_start = *(u32*)(sample_headers+40*sample_id + 4);
+	my_dprintf("sample loop start: %lu\n", sample_loop_start);
+
+	// Sample loop length
+	u32 sample_loop_length;
+	sample_loop_length = *(u32*)(sample_headers+40*sample_id + 8);
+	my_dprintf("sample loop length: %lu\n", sample_loop_length);
+
+	// Volume (0-64)
+	u8 sample_volume;
+	sample_volume = *(u8*)(sample_headers+40*sample_id + 12);
+	//my_dprintf("sample volume: %u\n",sample_volume);
+
+	if(sample_volume == 64) { // Convert scale to 0-255
+		sample_volume = 255;
+	} else {
+		sample_volume *= 4;
+	}
 
-			}
-		}
-		else
-		{
-			// fill up the instrument header with 0es
-			u8 *zeroes = (u8*)my_memalign(2, inst_size - 29);
-			if (zeroes != NULL) {
-				memset(zeroes, 0, inst_size - 29);
-				fwrite(zeroes, inst_size - 29, 1, xmfile);
-				my_free(zeroes);
-			} else {
-				my_dprintf("saving with slow uncached fallback\n");
-				for (u32 i=0; i<inst_size - 29; ++i)
-					fputc(0, xmfile);
-				my_dprintf("done\n");
-			}
-		}
+	// Finetune
+	s8 sample_finetune;
+	sample_finetune = *(s8*)(sample_headers+40*sample_id + 13);
+	//my_dprintf("sample finetune: %d\n",sample_finetune);
+
+	// Type byte (loop type and wether it's 8 or 16 bit)
+	u8 sample_type;
+	sample_type = *(u8*)(sample_headers+40*sample_id + 14);
+
+	u8 loop_type = sample_type & 3;
+
+	// Panning
+	u8 sample_panning;
+	sample_panning = *(u8*)(sample_headers+40*sample_id + 15);
+	//my_dprintf("panning: %u\n", sample_panning);
+
+	// Relative note
+	s8 sample_rel_note;
+	sample_rel_note = *(s8*)(sample_headers+40*sample_id + 16);
+	//my_dprintf("rel note: %d\n", sample_rel_note);
+
+	// Sample name
+	char sample_name[22 + 1];
+	memset(sample_name, 0, sizeof(sample_name));
+	memcpy(sample_name, sample_headers+40*sample_id + 18, 22);
+
+	// Cut off trailing spaces
+	u8 i = sizeof(sample_name) - 1;
+	while( (i > 0) && (sample_name[i-1] == ' ') )
+		--i;
+	sample_name[i] = '\0';
+
+	//my_dprintf("sample name: '%s' (%u)\n", sample_name, strlen(sample_name));
+
+	// Insert sample into the instrument
+	u32 n_samples;
+	if(sample_is_16_bit) {
+		n_samples = sample_length/2;
+		sample_loop_start /= 2;
+		sample_loop_length /= 2;
+	} else {
+		n_samples = sample_length;
+	}
 
-		if(empty_inst == true) {
-			delete instrument;
-		}
+	// Some trackers save loops that reach past the end of the sample
+	if(sample_loop_start >= n_samples)
+		sample_loop_start = 0;
+	if(sample_loop_length > n_samples - sample_loop_start)
+		sample_loop_length = n_samples - sample_loop_start;
+	if(sample_loop_length == 0)
+		loop_type = NO_LOOP;
 
+	Sample *sample = new Sample(sample_data, n_samples, 8363, sample_is_16_bit);
+	if(sample==NULL)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return XM_TRANSPORT_ERROR_MEMFULL;
 	}
 
-	//
-	// Finish up
-	//
-	fclose(xmfile);
+	sample->setExternalData(external_data);
+	sample->setLazyOffset(sample_offset);
+	sample->setVolume(sample_volume);
+	sample->setRelNote(sample_rel_note);
+	sample->setFinetune(sample_finetune);
+	sample->setPanning(sample_panning);
+	sample->setBasePanning(); // The song may already be playing
+
+	// The loop points first, so a ping pong loop is only set up once
+	sample->setLoopStartAndLength(sample_loop_start, sample_loop_length);
+	sample->setLoop(loop_type);
+	sample->setName(sample_name);
+	if(shared_samples)
+		SamplePool::share(sample);
+	instrument->addSample(sample);
+	sample_data = 0;
+
+	my_dprintf("Sample loaded\n");
 
-	my_dprintf("song saved as :\"%s\"\n", filename);
+	return 0;
+}
 
-	my_end_malloc_invariant(); // security
+// Puts the instrument into the song once it is complete, so a song that is
+// already playing never sees half loaded instruments
+void XMTransport::finishInstrument(void)
+{
+	song->setInstrument(cur_inst, instrument);
+	instrument = 0;
 
-	return 0;
+	free(sample_headers);
+	sample_headers = 0;
+	free(instinfo);
+	instinfo = 0;
+
+	cur_inst++;
+	load_stage = (cur_inst < n_inst) ? XM_LOAD_INSTRUMENTS : XM_LOAD_DONE;
 }
 
-const char *XMTransport::getError(u16 error_id)
+void XMTransport::loadFailed(u16 err)
 {
-	return xmtransporterrors[error_id-1];
+	my_dprintf("loading failed: %s\n", getError(err));
+	load_error = err;
+	load_stage = XM_LOAD_ERROR;
 }
 
-/* ===================== PRIVATE ===================== */
+// Frees everything that belongs to the current load, except the song
+void XMTransport::loadCleanup(void)
+{
+	if( (sample_data != 0) && !external_data )
+		free(sample_data);
+	sample_data = 0;
+
+	free(sample_headers);
+	sample_headers = 0;
+	free(instinfo);
+	instinfo = 0;
+
+	delete instrument;
+	instrument = 0;
+
+	delete owned_reader;
+	owned_reader = 0;
+	reader = 0;
+
+	load_stage = XM_LOAD_IDLE;
+}
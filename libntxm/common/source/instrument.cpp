@@ -43,6 +43,51 @@
 
 #ifdef ARM9
 
+#define SILENT_SAMPLE_LENGTH	16
+
+// Notes without a sample are mapped to this one, so the player never finds a
+// 0 in a note table. It is shared by all instruments and never freed.
+static Sample *silent_sample = 0;
+
+static Sample *getSilentSample(void)
+{
+	if(silent_sample == 0)
+		silent_sample = new Sample(calloc(SILENT_SAMPLE_LENGTH, 1), SILENT_SAMPLE_LENGTH, 8363, false);
+	
+	return silent_sample;
+}
+
+// Envelope points must be in range and in order, or the player reads past the
+// arrays or divides by 0. Returns the number of values that were changed.
+static u16 validateEnvelope(u16 *xs, u16 *ys, u8 *n_points, u8 *sustain_point)
+{
+	u16 fixes = 0;
+	
+	if(*n_points > MAX_ENV_POINTS) {
+		*n_points = MAX_ENV_POINTS;
+		fixes++;
+	}
+	
+	for(u8 i=0; i<*n_points; ++i)
+	{
+		if(ys[i] > MAX_ENV_Y) {
+			ys[i] = MAX_ENV_Y;
+			fixes++;
+		}
+		if( (i > 0) && (xs[i] <= xs[i-1]) ) {
+			xs[i] = xs[i-1] + 1;
+			fixes++;
+		}
+	}
+	
+	if( (*n_points > 0) && (*sustain_point >= *n_points) ) {
+		*sustain_point = *n_points - 1;
+		fixes++;
+	}
+	
+	return fixes;
+}
+
 Instrument::Instrument(const char *_name, u8 _type, u8 _volume)
 	:type(_type), volume(_volume),
 	 n_vol_points(0), vol_env_on(false), vol_env_sustain(false), vol_env_loop(false),
@@ -53,9 +98,12 @@ Instrument::Instrument(const char *_name, u8 _type, u8 _volume)
 	strncpy(name, _name, MAX_INST_NAME_LENGTH);
 	
 	note_samples = (u8*)calloc(sizeof(u8)*MAX_OCTAVE*12, 1);
+	note_table = (NoteInfo*)calloc(sizeof(NoteInfo)*MAX_OCTAVE*12, 1);
 	
 	samples = NULL;
 	n_samples = 0;
+	
+	updateNoteTable();
 }
 
 Instrument::Instrument(const char *_name, Sample *_sample, u8 _volume)
@@ -74,17 +122,21 @@ Instrument::Instrument(const char *_name, Sample *_sample, u8 _volume)
 	note_samples = (u8*)malloc(sizeof(u8)*MAX_OCTAVE*12);
 	for(u16 i=0;i<MAX_OCTAVE*12; ++i)
 		note_samples[i] = 0;
+	
+	note_table = (NoteInfo*)calloc(sizeof(NoteInfo)*MAX_OCTAVE*12, 1);
+	updateNoteTable();
 }
 
 Instrument::~Instrument()
 {
-	for(u8 i=0;i<n_samples;++i) {
+	for(u16 i=0;i<n_samples;++i) {
 		delete samples[i];
 	}
 	if(samples != NULL)
 		free(samples);
 	
 	free(note_samples);
+	free(note_table);
 	
 	free(name);
 }
@@ -94,6 +146,8 @@ void Instrument::addSample(Sample *sample)
 	n_samples++;
 	samples = (Sample**)realloc(samples, sizeof(Sample*)*n_samples);
 	samples[n_samples-1] = sample;
+	
+	updateNoteTable();
 }
 
 void Instrument::setSample(u8 idx, Sample *sample)
@@ -116,6 +170,61 @@ void Instrument::setSample(u8 idx, Sample *sample)
 	}
 	
 	samples[idx] = sample;
+	
+	updateNoteTable();
+}
+
+void Instrument::updateNoteTable(void)
+{
+	// So the samples update the table when they change
+	for(u16 i=0; i<n_samples; ++i)
+	{
+		if(samples[i] != 0)
+			samples[i]->instrument = this;
+	}
+	
+	for(u8 note=0; note<MAX_OCTAVE*12; ++note)
+		updateNoteInfo(note);
+	
+	DC_FlushRange(note_table, sizeof(NoteInfo)*MAX_OCTAVE*12);
+}
+
+Sample *Instrument::getSampleForNote(u8 _note) {
+	Sample *sample = note_table[_note].sample;
+	return (sample == silent_sample) ? 0 : sample;
+}
+
+u16 Instrument::validate(void)
+{
+	u16 fixes = validateEnvelope(vol_envelope_x, vol_envelope_y, &n_vol_points, &vol_sustain_point) +
+		validateEnvelope(pan_envelope_x, pan_envelope_y, &n_pan_points, &pan_sustain_point);
+	
+	// Loops that reach past the end would make the hardware play whatever
+	// comes after the sample
+	for(u16 i=0; i<n_samples; ++i)
+	{
+		Sample *sample = samples[i];
+		if( (sample == 0) || (sample->getLoop() == NO_LOOP) )
+			continue;
+		
+		// Ping pong loops can only be rebuilt with the data in RAM
+		if( (sample->getLoop() == PING_PONG_LOOP) && !sample->isLoaded() )
+			continue;
+		
+		u32 length = sample->getNSamples();
+		u32 loop_start = sample->getLoopStart();
+		u32 loop_length = sample->getLoopLength();
+		
+		if( (loop_start > length) || (loop_length > length - loop_start) )
+		{
+			if(loop_start >= length)
+				loop_start = 0;
+			sample->setLoopStartAndLength(loop_start, length - loop_start);
+			fixes++;
+		}
+	}
+	
+	return fixes;
 }
 
 #endif
@@ -128,10 +237,6 @@ Sample *Instrument::getSample(u8 idx)
 		return NULL;
 }
 
-Sample *Instrument::getSampleForNote(u8 _note) {
-	return samples[note_samples[_note]];
-}
-
 #ifdef ARM7
 
 void Instrument::play(u8 _note, u8 _volume, u8 _channel /* effects here */)
@@ -151,9 +256,12 @@ void Instrument::play(u8 _note, u8 _volume, u8 _channel /* effects here */)
 	
 	switch(type) {
 		case INST_SAMPLE:
-			if( (n_samples > 0) && (samples[note_samples[_note]] != 0) )
-				samples[note_samples[_note]]->play(_note, play_volume, _channel);
+		{
+			NoteInfo *ni = &note_table[_note];
+			if(ni->sample != 0)
+				ni->sample->playTimer(ni->timer, play_volume, _channel);
 			break;
+		}
 	}
 }
 
@@ -164,9 +272,18 @@ void Instrument::bendNote(u8 _note, u8 _basenote, s16 _finetune, u8 _channel)
 	
 	switch(type) {
 		case INST_SAMPLE:
-			if(n_samples > 0)
-				samples[note_samples[_note]]->bendNote(_note, _basenote, _finetune, _channel);
+		{
+			NoteInfo *ni = &note_table[_note];
+			if(ni->sample == 0)
+				break;
+			
+			// Arpeggio and note resets don't bend, so the timer is in the table
+			if(_finetune == 0)
+				ni->sample->setTimer(ni->timer, _channel);
+			else
+				ni->sample->bendNote(_note, _basenote, _finetune, _channel);
 			break;
+		}
 	}
 }
 
@@ -177,8 +294,8 @@ void Instrument::bendNoteDirect(u8 _note, s16 _fine_step, u8 _channel)
 	
 	switch(type) {
 		case INST_SAMPLE:
-			if(n_samples > 0)
-				samples[note_samples[_note]]->bendNoteDirect(_fine_step, _channel);
+			if(note_table[_note].sample != 0)
+				note_table[_note].sample->bendNoteDirect(_fine_step, _channel);
 			break;
 	}
 }
@@ -189,6 +306,9 @@ void Instrument::bendNoteDirect(u8 _note, s16 _fine_step, u8 _channel)
 
 void Instrument::setNoteSample(u16 note, u8 sample_id) {
 	note_samples[note] = sample_id;
+	
+	updateNoteInfo(note);
+	DC_FlushRange(&note_table[note], sizeof(NoteInfo));
 }
 
 #endif
@@ -214,7 +334,7 @@ bool Instrument::getVolEnvEnabled(void)
 
 // Calculate how long in ms the instrument will play note given note
 u32 Instrument::calcPlayLength(u8 note) {
-	return samples[note_samples[note]]->calcPlayLength(note);
+	return note_table[note].play_length;
 }
 
 #ifdef ARM9
@@ -237,6 +357,9 @@ u16 Instrument::getSamples(void) {
 
 void Instrument::setVolumeEnvelope(u16 *envelope, u8 n_points, u8 v_sustain_point, bool vol_env_on_, bool vol_env_sustain_, bool vol_env_loop_)
 {
+	if(n_points > MAX_ENV_POINTS)
+		n_points = MAX_ENV_POINTS;
+	
 	n_vol_points = n_points;
 	for(u8 i=0; i<n_points; ++i)
 	{
@@ -252,6 +375,9 @@ void Instrument::setVolumeEnvelope(u16 *envelope, u8 n_points, u8 v_sustain_poin
 
 void Instrument::setPanningEnvelope(u16 *envelope, u8 n_points, u8 p_sustain_point,  bool pan_env_on_, bool pan_env_sustain_, bool pan_env_loop_)
 {
+	if(n_points > MAX_ENV_POINTS)
+		n_points = MAX_ENV_POINTS;
+	
 	n_pan_points = n_points;
 	for(u8 i=0; i<n_points; ++i)
 	{
@@ -267,6 +393,9 @@ void Instrument::setPanningEnvelope(u16 *envelope, u8 n_points, u8 p_sustain_poi
 
 void Instrument::setVolumeEnvelopePoints(u16 *xs, u16 *ys, u16 n_points)
 {
+	if(n_points > MAX_ENV_POINTS)
+		n_points = MAX_ENV_POINTS;
+	
 	n_vol_points = n_points;
 	for(u8 i=0; i<n_points; ++i)
 	{
@@ -351,3 +480,27 @@ u16 Instrument::getEnvelopeAmp(u8 channel, u8 note)
 	
 	return y;
 }
+
+/* ===================== PRIVATE ===================== */
+
+#ifdef ARM9
+
+void Instrument::updateNoteInfo(u8 _note)
+{
+	NoteInfo *ni = &note_table[_note];
+	
+	Sample *sample = 0;
+	if(note_samples[_note] < n_samples)
+		sample = samples[note_samples[_note]];
+	
+	if(sample == 0)
+		sample = getSilentSample();
+	
+	ni->sample = sample;
+	ni->play_length = sample->calcPlayLength(_note);
+	ni->timer = sample->calcTimer(_note);
+	ni->volume = sample->getVolume();
+	ni->loop = sample->getLoop();
+}
+
+#endif
@@ -33,10 +33,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <math.h>
 #include <nds.h>
 
 #include "ntxm/ntxmtools.h"
 #include <sys/statvfs.h>
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #ifdef ARM9
 
@@ -121,17 +127,19 @@ u32 my_getFreeDiskSpace(void)
 		my_dprintf("stat failed!\n");
 		return 0;
 	} else {
-		return fiData.f_bsize*fiData.f_bfree;
+		// Cards can have more than 4 GB free
+		u64 free_space = (u64)fiData.f_bsize*fiData.f_bfree;
+		return (free_space > 0xFFFFFFFF) ? 0xFFFFFFFF : (u32)free_space;
 	}
 }
 
 u32 my_getFileSize(const char *filename)
 {
-	FILE *file = fopen(filename, "r");
-	fseek(file, 0, SEEK_END);
-	u32 filesize = ftell(file);
-	fclose(file);
-	return filesize;
+	// Ask the file system instead of opening the file
+	struct stat st;
+	if(stat(filename, &st) != 0)
+		return 0;
+	return st.st_size;
 }
 
 #endif
@@ -161,3 +169,732 @@ void ntxm_unsigned2signed_16(uint16_t *buffer, size_t count)
 	}
 	if (count & 1) buffer[count - 1] ^= 0x8000;
 }
+
+// XM samples are stored as deltas. dest and src may be the same. src need not be
+// aligned, since songs in memory can have their samples at any address.
+// last carries the previous value from one chunk to the next, it starts at 0.
+//
+// Where src and dest are aligned alike, a word is decoded at a time: one load
+// gets two 16 bit or four 8 bit deltas, their running sums are put together
+// in a register and written with one store. This saves the byte loads and
+// stores, which take most of the time on the arm9.
+void ntxm_delta_decode(void *dest, const u8 *src, u32 size, bool is_16_bit, s16 *last)
+{
+	u8 *dst = (u8*)dest;
+	u32 prev = *last;
+	u32 i = 0;
+	bool words = ((((uintptr_t)src ^ (uintptr_t)dst) & 3) == 0);
+
+	if(is_16_bit)
+	{
+		size &= ~1;
+
+		// Single samples until both are word aligned
+		while( (i < size) && ( (!words) || ((uintptr_t)(src + i) & 3) ) )
+		{
+			prev += src[i] | (src[i+1] << 8);
+			*(u16*)(dst + i) = prev;
+			i += 2;
+		}
+
+		for(; i + 4 <= size; i += 4)
+		{
+			u32 w = *(const u32*)(src + i);
+			u32 lo = prev + w;
+			prev = lo + (w >> 16);
+			*(u32*)(dst + i) = (lo & 0xFFFF) | (prev << 16);
+		}
+
+		if(i < size)
+		{
+			prev += src[i] | (src[i+1] << 8);
+			*(u16*)(dst + i) = prev;
+		}
+
+		*last = (s16)prev;
+	}
+	else
+	{
+		while( (i < size) && ( (!words) || ((uintptr_t)(src + i) & 3) ) )
+		{
+			prev += src[i];
+			dst[i] = prev;
+			i++;
+		}
+
+		for(; i + 4 <= size; i += 4)
+		{
+			u32 w = *(const u32*)(src + i);
+			u32 b0 = prev + w;
+			u32 b1 = b0 + (w >> 8);
+			u32 b2 = b1 + (w >> 16);
+			prev = b2 + (w >> 24);
+			*(u32*)(dst + i) = (b0 & 0xFF) | ((b1 & 0xFF) << 8) | ((b2 & 0xFF) << 16) | (prev << 24);
+		}
+
+		for(; i < size; ++i)
+		{
+			prev += src[i];
+			dst[i] = prev;
+		}
+
+		*last = (s8)prev;
+	}
+}
+
+// The inverse of ntxm_delta_decode(), for saving. src must be aligned to the
+// sample size, dest need not be aligned.
+void ntxm_delta_encode(u8 *dest, const void *src, u32 size, bool is_16_bit, s16 *last)
+{
+	const u8 *smp = (const u8*)src;
+	u32 prev = *last;
+	u32 i = 0;
+	bool words = ((((uintptr_t)smp ^ (uintptr_t)dest) & 3) == 0);
+
+	if(is_16_bit)
+	{
+		size &= ~1;
+
+		while( (i < size) && ( (!words) || ((uintptr_t)(smp + i) & 3) ) )
+		{
+			u32 cur = *(const u16*)(smp + i);
+			u32 delta = cur - prev;
+			dest[i] = delta;
+			dest[i+1] = delta >> 8;
+			prev = cur;
+			i += 2;
+		}
+
+		for(; i + 4 <= size; i += 4)
+		{
+			u32 w = *(const u32*)(smp + i);
+			u32 lo = w - prev;
+			u32 hi = (w >> 16) - w;
+			*(u32*)(dest + i) = (lo & 0xFFFF) | (hi << 16);
+			prev = w >> 16;
+		}
+
+		if(i < size)
+		{
+			u32 cur = *(const u16*)(smp + i);
+			u32 delta = cur - prev;
+			dest[i] = delta;
+			dest[i+1] = delta >> 8;
+			prev = cur;
+		}
+
+		*last = (s16)prev;
+	}
+	else
+	{
+		while( (i < size) && ( (!words) || ((uintptr_t)(smp + i) & 3) ) )
+		{
+			dest[i] = smp[i] - prev;
+			prev = smp[i];
+			i++;
+		}
+
+		for(; i + 4 <= size; i += 4)
+		{
+			u32 w = *(const u32*)(smp + i);
+			u32 d0 = w - prev;
+			u32 d1 = (w >> 8) - w;
+			u32 d2 = (w >> 16) - (w >> 8);
+			u32 d3 = (w >> 24) - (w >> 16);
+			*(u32*)(dest + i) = (d0 & 0xFF) | ((d1 & 0xFF) << 8) | ((d2 & 0xFF) << 16) | (d3 << 24);
+			prev = w >> 24;
+		}
+
+		for(; i < size; ++i)
+		{
+			dest[i] = smp[i] - prev;
+			prev = smp[i];
+		}
+
+		*last = (s8)prev;
+	}
+}
+
+#ifdef ARM9
+
+// Rounds to 8 bit with triangular dither of one step. The error of each sample
+// is subtracted from the next one, which moves the noise to high frequencies,
+// where it is less audible than flat noise. seed carries the random state.
+u64 ntxm_dither_16to8(s8 *dest, const s16 *src, u32 n_samples, u32 *seed)
+{
+	u32 rnd = *seed;
+	s32 error = 0;
+	u64 noise = 0;
+
+	for(u32 i=0; i<n_samples; ++i)
+	{
+		s32 value = src[i];
+
+		rnd = rnd * 1664525 + 1013904223;
+		s32 dither = (s32)((rnd >> 24) & 0xFF) - (s32)((rnd >> 16) & 0xFF);
+
+		s32 wanted = value - error;
+		s32 q = my_clamp((wanted + dither + 128) >> 8, -128, 127);
+		// Clipped samples would feed back large errors
+		error = my_clamp(q * 256 - wanted, -512, 512);
+
+		// dest[i] is a byte of a sample that has been read already
+		if(dest != 0)
+			dest[i] = q;
+
+		s32 diff = q * 256 - value;
+		noise += (s64)diff * diff;
+	}
+
+	*seed = rnd;
+	return noise;
+}
+
+static inline s32 sampleAt(const void *src, u32 i, u32 n_samples, bool is_16_bit)
+{
+	if(i >= n_samples)
+		i = n_samples - 1;
+	return is_16_bit ? ((const s16*)src)[i] : ((const s8*)src)[i] * 256;
+}
+
+// Drops every other sample, (n_samples+1)/2 are left. Before that, the half
+// band filter (-1 0 9 16 9 0 -1)/32 removes what the lower rate can't hold.
+// The error is that of playing the result back at the old rate with linear
+// interpolation.
+u64 ntxm_decimate(void *dest, const void *src, u32 n_samples, bool is_16_bit)
+{
+	if(n_samples == 0)
+		return 0;
+
+	// The filter window around sample 2j. It is read ahead, so the samples
+	// written in place are never needed again.
+	s32 w[7];
+	for(u32 k=0; k<7; ++k)
+		w[k] = sampleAt(src, (k < 3) ? 0 : k - 3, n_samples, is_16_bit);
+
+	u32 n_out = (n_samples + 1) / 2;
+	s32 prev = 0;
+	u64 noise = 0;
+
+	for(u32 j=0; j<n_out; ++j)
+	{
+		s32 y = (-w[0] + 9 * w[2] + 16 * w[3] + 9 * w[4] - w[6] + 16) >> 5;
+		y = my_clamp(y, -32768, 32767);
+		if(!is_16_bit)
+			y = my_clamp((y + 128) >> 8, -128, 127) * 256;
+
+		s32 diff = y - w[3];
+		noise += (s64)diff * diff;
+		if(j > 0) {
+			diff = (prev + y) / 2 - w[2];
+			noise += (s64)diff * diff;
+		}
+		if( (j == n_out - 1) && (n_samples % 2 == 0) ) {
+			diff = y - w[4];
+			noise += (s64)diff * diff;
+		}
+		prev = y;
+
+		if(dest != 0)
+		{
+			if(is_16_bit)
+				((s16*)dest)[j] = y;
+			else
+				((s8*)dest)[j] = y / 256;
+		}
+
+		for(u32 k=0; k<5; ++k)
+			w[k] = w[k+2];
+		w[5] = sampleAt(src, 2 * j + 4, n_samples, is_16_bit);
+		w[6] = sampleAt(src, 2 * j + 5, n_samples, is_16_bit);
+	}
+
+	return noise;
+}
+
+u64 ntxm_signal_energy(const void *src, u32 n_samples, bool is_16_bit)
+{
+	u64 energy = 0;
+	for(u32 i=0; i<n_samples; ++i)
+	{
+		s32 value = sampleAt(src, i, n_samples, is_16_bit);
+		energy += (s64)value * value;
+	}
+	return energy;
+}
+
+s16 ntxm_snr(u64 signal, u64 noise)
+{
+	if(noise == 0)
+		return NTXM_SNR_MAX;
+	if(signal == 0)
+		return 0;
+
+	float snr = 100.0f * log10f((float)signal / (float)noise);
+	if(snr > NTXM_SNR_MAX)
+		return NTXM_SNR_MAX;
+	return (s16)snr;
+}
+
+/*
+ * The editing kernels load and store a word at a time where the data is word
+ * aligned, like ntxm_delta_decode(), and multiply by a gain instead of
+ * dividing. The host tools do eight samples at a time with SSE2 instead. Both
+ * round and saturate alike, so they give the same results.
+ */
+
+static inline s32 clampSample(s32 value, bool is_16_bit)
+{
+	return is_16_bit ? my_clamp(value, -32768, 32767) : my_clamp(value, -128, 127);
+}
+
+// gain is 16.16 fixed point
+static inline s32 gainSample(s32 value, u32 gain, bool is_16_bit)
+{
+	return clampSample((s32)(((s64)value * gain + 0x8000) >> 16), is_16_bit);
+}
+
+static inline u32 byteSwap(u32 w)
+{
+	return (w >> 24) | ((w >> 8) & 0xFF00) | ((w & 0xFF00) << 8) | (w << 24);
+}
+
+#ifdef __SSE2__
+
+// Eight 16 bit samples in reverse order
+static inline __m128i reverse8(__m128i x)
+{
+	x = _mm_shufflelo_epi16(x, 0x1B);
+	x = _mm_shufflehi_epi16(x, 0x1B);
+	return _mm_shuffle_epi32(x, 0x4E);
+}
+
+// x holds four samples in the low halves of its lanes, g their gains. The
+// gains are split at bit 15, so the 16 bit multiplies can take them.
+static inline __m128i gain4(__m128i x, __m128i g)
+{
+	__m128i lo = _mm_madd_epi16(x, _mm_and_si128(g, _mm_set1_epi32(0x7FFF)));
+	__m128i hi = _mm_madd_epi16(x, _mm_srli_epi32(g, 15));
+	lo = _mm_srai_epi32(_mm_add_epi32(lo, _mm_set1_epi32(0x8000)), 15);
+	return _mm_srai_epi32(_mm_add_epi32(hi, lo), 1);
+}
+
+// Eight 16 bit samples, the first four get the gains g0, the others g1
+static inline __m128i gain8(__m128i x, __m128i g0, __m128i g1)
+{
+	__m128i zero = _mm_setzero_si128();
+	return _mm_packs_epi32(gain4(_mm_unpacklo_epi16(x, zero), g0), gain4(_mm_unpackhi_epi16(x, zero), g1));
+}
+
+// Sign extends the low or high eight of 16 bytes to 16 bit
+static inline __m128i widenLo(__m128i x)
+{
+	return _mm_srai_epi16(_mm_unpacklo_epi8(_mm_setzero_si128(), x), 8);
+}
+
+static inline __m128i widenHi(__m128i x)
+{
+	return _mm_srai_epi16(_mm_unpackhi_epi8(_mm_setzero_si128(), x), 8);
+}
+
+#endif
+
+void ntxm_reverse(void *data, u32 n_samples, bool is_16_bit)
+{
+	if(is_16_bit)
+	{
+		s16 *lo = (s16*)data;
+		s16 *hi = lo + n_samples;
+
+#ifdef __SSE2__
+		while(hi - lo >= 16)
+		{
+			hi -= 8;
+			__m128i a = _mm_loadu_si128((const __m128i*)lo);
+			__m128i b = _mm_loadu_si128((const __m128i*)hi);
+			_mm_storeu_si128((__m128i*)lo, reverse8(b));
+			_mm_storeu_si128((__m128i*)hi, reverse8(a));
+			lo += 8;
+		}
+#endif
+
+		// Words from both ends, if they get aligned at the same time
+		if( (((uintptr_t)lo + (uintptr_t)hi) & 3) == 0 )
+		{
+			if( ((uintptr_t)lo & 3) && (hi - lo >= 2) )
+			{
+				s16 tmp = *lo;
+				*lo++ = *--hi;
+				*hi = tmp;
+			}
+
+			for(; hi - lo >= 4; lo += 2, hi -= 2)
+			{
+				u32 a = *(u32*)lo;
+				u32 b = *(u32*)(hi - 2);
+				*(u32*)lo = (b >> 16) | (b << 16);
+				*(u32*)(hi - 2) = (a >> 16) | (a << 16);
+			}
+		}
+
+		while(hi - lo >= 2)
+		{
+			s16 tmp = *lo;
+			*lo++ = *--hi;
+			*hi = tmp;
+		}
+	}
+	else
+	{
+		s8 *lo = (s8*)data;
+		s8 *hi = lo + n_samples;
+
+#ifdef __SSE2__
+		while(hi - lo >= 32)
+		{
+			hi -= 16;
+			__m128i a = _mm_loadu_si128((const __m128i*)lo);
+			__m128i b = _mm_loadu_si128((const __m128i*)hi);
+			a = reverse8(_mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8)));
+			b = reverse8(_mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8)));
+			_mm_storeu_si128((__m128i*)lo, b);
+			_mm_storeu_si128((__m128i*)hi, a);
+			lo += 16;
+		}
+#endif
+
+		if( (((uintptr_t)lo + (uintptr_t)hi) & 3) == 0 )
+		{
+			while( ((uintptr_t)lo & 3) && (hi - lo >= 2) )
+			{
+				s8 tmp = *lo;
+				*lo++ = *--hi;
+				*hi = tmp;
+			}
+
+			for(; hi - lo >= 8; lo += 4, hi -= 4)
+			{
+				u32 a = *(u32*)lo;
+				u32 b = *(u32*)(hi - 4);
+				*(u32*)lo = byteSwap(b);
+				*(u32*)(hi - 4) = byteSwap(a);
+			}
+		}
+
+		while(hi - lo >= 2)
+		{
+			s8 tmp = *lo;
+			*lo++ = *--hi;
+			*hi = tmp;
+		}
+	}
+}
+
+// Multiplies sample i by (ramp + i * step) / 2^24. Keeping the ramp finer
+// than the 16.16 gains lets long fades step by less than 1/65536.
+static void scaleSamples(void *data, u32 n_samples, bool is_16_bit, u32 ramp, s32 step)
+{
+	u32 i = 0;
+
+	if(is_16_bit)
+	{
+		s16 *smp = (s16*)data;
+
+#ifdef __SSE2__
+		__m128i r0 = _mm_add_epi32(_mm_set1_epi32(ramp), _mm_set_epi32(3 * step, 2 * step, step, 0));
+		__m128i r1 = _mm_add_epi32(r0, _mm_set1_epi32(4 * step));
+		__m128i r_step = _mm_set1_epi32(8 * step);
+		for(; i + 8 <= n_samples; i += 8)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(smp + i));
+			x = gain8(x, _mm_srli_epi32(r0, 8), _mm_srli_epi32(r1, 8));
+			_mm_storeu_si128((__m128i*)(smp + i), x);
+			r0 = _mm_add_epi32(r0, r_step);
+			r1 = _mm_add_epi32(r1, r_step);
+		}
+		ramp += i * step;
+#endif
+
+		if( (i < n_samples) && ((uintptr_t)(smp + i) & 3) )
+		{
+			smp[i] = gainSample(smp[i], ramp >> 8, true);
+			ramp += step;
+			i++;
+		}
+
+		for(; i + 2 <= n_samples; i += 2)
+		{
+			u32 w = *(u32*)(smp + i);
+			s32 a = gainSample((s16)w, ramp >> 8, true);
+			ramp += step;
+			s32 b = gainSample((s16)(w >> 16), ramp >> 8, true);
+			ramp += step;
+			*(u32*)(smp + i) = (a & 0xFFFF) | ((u32)b << 16);
+		}
+
+		if(i < n_samples)
+			smp[i] = gainSample(smp[i], ramp >> 8, true);
+	}
+	else
+	{
+		s8 *smp = (s8*)data;
+
+#ifdef __SSE2__
+		__m128i r[4];
+		for(u32 k=0; k<4; ++k)
+			r[k] = _mm_add_epi32(_mm_set1_epi32(ramp + 4 * k * step), _mm_set_epi32(3 * step, 2 * step, step, 0));
+		__m128i r_step = _mm_set1_epi32(16 * step);
+		for(; i + 16 <= n_samples; i += 16)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(smp + i));
+			__m128i lo = gain8(widenLo(x), _mm_srli_epi32(r[0], 8), _mm_srli_epi32(r[1], 8));
+			__m128i hi = gain8(widenHi(x), _mm_srli_epi32(r[2], 8), _mm_srli_epi32(r[3], 8));
+			_mm_storeu_si128((__m128i*)(smp + i), _mm_packs_epi16(lo, hi));
+			for(u32 k=0; k<4; ++k)
+				r[k] = _mm_add_epi32(r[k], r_step);
+		}
+		ramp += i * step;
+#endif
+
+		while( (i < n_samples) && ((uintptr_t)(smp + i) & 3) )
+		{
+			smp[i] = gainSample(smp[i], ramp >> 8, false);
+			ramp += step;
+			i++;
+		}
+
+		for(; i + 4 <= n_samples; i += 4)
+		{
+			u32 w = *(u32*)(smp + i);
+			u32 out = 0;
+			for(u32 k=0; k<32; k+=8)
+			{
+				out |= (gainSample((s8)(w >> k), ramp >> 8, false) & 0xFF) << k;
+				ramp += step;
+			}
+			*(u32*)(smp + i) = out;
+		}
+
+		for(; i < n_samples; ++i)
+		{
+			smp[i] = gainSample(smp[i], ramp >> 8, false);
+			ramp += step;
+		}
+	}
+}
+
+void ntxm_gain(void *data, u32 n_samples, bool is_16_bit, u32 gain)
+{
+	if(gain > 64 * NTXM_GAIN_ONE)
+		gain = 64 * NTXM_GAIN_ONE;
+	scaleSamples(data, n_samples, is_16_bit, gain << 8, 0);
+}
+
+void ntxm_fade(void *data, u32 n_samples, bool is_16_bit, bool in)
+{
+	if(n_samples == 0)
+		return;
+
+	s32 step = (NTXM_GAIN_ONE << 8) / n_samples;
+	if(in)
+		scaleSamples(data, n_samples, is_16_bit, 0, step);
+	else
+		scaleSamples(data, n_samples, is_16_bit, NTXM_GAIN_ONE << 8, -step);
+}
+
+// Frame i is read before sample i is written, so this works in place
+void ntxm_mix_to_mono(void *dest, const void *src, u32 n_frames, bool is_16_bit)
+{
+	u32 i = 0;
+
+	if(is_16_bit)
+	{
+		const s16 *in = (const s16*)src;
+		s16 *out = (s16*)dest;
+
+#ifdef __SSE2__
+		__m128i ones = _mm_set1_epi16(1);
+		for(; i + 8 <= n_frames; i += 8)
+		{
+			__m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(in + 2 * i)), ones);
+			__m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(in + 2 * i + 8)), ones);
+			_mm_storeu_si128((__m128i*)(out + i), _mm_packs_epi32(_mm_srai_epi32(a, 1), _mm_srai_epi32(b, 1)));
+		}
+#endif
+
+		// A frame is a word
+		if( ((uintptr_t)(in + 2 * i) & 3) == 0 )
+		{
+			for(; i < n_frames; ++i)
+			{
+				u32 w = *(const u32*)(in + 2 * i);
+				out[i] = ((s16)w + (s16)(w >> 16)) >> 1;
+			}
+		}
+
+		for(; i < n_frames; ++i)
+			out[i] = (in[2 * i] + in[2 * i + 1]) >> 1;
+	}
+	else
+	{
+		const s8 *in = (const s8*)src;
+		s8 *out = (s8*)dest;
+
+#ifdef __SSE2__
+		__m128i ones = _mm_set1_epi16(1);
+		for(; i + 16 <= n_frames; i += 16)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(in + 2 * i + 16));
+			__m128i s0 = _mm_srai_epi32(_mm_madd_epi16(widenLo(a), ones), 1);
+			__m128i s1 = _mm_srai_epi32(_mm_madd_epi16(widenHi(a), ones), 1);
+			__m128i s2 = _mm_srai_epi32(_mm_madd_epi16(widenLo(b), ones), 1);
+			__m128i s3 = _mm_srai_epi32(_mm_madd_epi16(widenHi(b), ones), 1);
+			__m128i mono = _mm_packs_epi16(_mm_packs_epi32(s0, s1), _mm_packs_epi32(s2, s3));
+			_mm_storeu_si128((__m128i*)(out + i), mono);
+		}
+#endif
+
+		// Two frames in a word
+		while( (i < n_frames) && ((uintptr_t)(in + 2 * i) & 3) )
+		{
+			out[i] = (in[2 * i] + in[2 * i + 1]) >> 1;
+			i++;
+		}
+
+		for(; i + 2 <= n_frames; i += 2)
+		{
+			u32 w = *(const u32*)(in + 2 * i);
+			out[i] = ((s8)w + (s8)(w >> 8)) >> 1;
+			out[i+1] = ((s8)(w >> 16) + (s8)(w >> 24)) >> 1;
+		}
+
+		for(; i < n_frames; ++i)
+			out[i] = (in[2 * i] + in[2 * i + 1]) >> 1;
+	}
+}
+
+s32 ntxm_remove_dc(void *data, u32 n_samples, bool is_16_bit)
+{
+	if(n_samples == 0)
+		return 0;
+
+	s64 sum = 0;
+	u32 i = 0;
+
+	if(is_16_bit)
+	{
+		s16 *smp = (s16*)data;
+
+#ifdef __SSE2__
+		// The 32 bit sums of pairs can take 2^15 additions
+		__m128i ones = _mm_set1_epi16(1);
+		while(i + 8 <= n_samples)
+		{
+			__m128i acc = _mm_setzero_si128();
+			for(u32 k=0; (k < 0x4000) && (i + 8 <= n_samples); ++k, i += 8)
+				acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_loadu_si128((const __m128i*)(smp + i)), ones));
+
+			s32 lanes[4];
+			_mm_storeu_si128((__m128i*)lanes, acc);
+			sum += (s64)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+#endif
+
+		for(; i < n_samples; ++i)
+			sum += smp[i];
+	}
+	else
+	{
+		s8 *smp = (s8*)data;
+
+#ifdef __SSE2__
+		// Sums of the bytes made unsigned, in two 64 bit lanes
+		__m128i bias = _mm_set1_epi8((char)0x80);
+		__m128i acc = _mm_setzero_si128();
+		for(; i + 16 <= n_samples; i += 16)
+		{
+			__m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(smp + i)), bias);
+			acc = _mm_add_epi64(acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+		}
+
+		s64 lanes[2];
+		_mm_storeu_si128((__m128i*)lanes, acc);
+		sum = lanes[0] + lanes[1] - 128 * (s64)i;
+#endif
+
+		for(; i < n_samples; ++i)
+			sum += smp[i];
+	}
+
+	s32 dc = (s32)(sum / (s64)n_samples);
+	if(dc == 0)
+		return 0;
+
+	i = 0;
+	if(is_16_bit)
+	{
+		s16 *smp = (s16*)data;
+
+#ifdef __SSE2__
+		__m128i offset = _mm_set1_epi16(dc);
+		for(; i + 8 <= n_samples; i += 8)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(smp + i));
+			_mm_storeu_si128((__m128i*)(smp + i), _mm_subs_epi16(x, offset));
+		}
+#endif
+
+		if( (i < n_samples) && ((uintptr_t)(smp + i) & 3) )
+		{
+			smp[i] = clampSample(smp[i] - dc, true);
+			i++;
+		}
+
+		for(; i + 2 <= n_samples; i += 2)
+		{
+			u32 w = *(u32*)(smp + i);
+			s32 a = clampSample((s16)w - dc, true);
+			s32 b = clampSample((s16)(w >> 16) - dc, true);
+			*(u32*)(smp + i) = (a & 0xFFFF) | ((u32)b << 16);
+		}
+
+		if(i < n_samples)
+			smp[i] = clampSample(smp[i] - dc, true);
+	}
+	else
+	{
+		s8 *smp = (s8*)data;
+
+#ifdef __SSE2__
+		__m128i offset = _mm_set1_epi8(dc);
+		for(; i + 16 <= n_samples; i += 16)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(smp + i));
+			_mm_storeu_si128((__m128i*)(smp + i), _mm_subs_epi8(x, offset));
+		}
+#endif
+
+		while( (i < n_samples) && ((uintptr_t)(smp + i) & 3) )
+		{
+			smp[i] = clampSample(smp[i] - dc, false);
+			i++;
+		}
+
+		for(; i + 4 <= n_samples; i += 4)
+		{
+			u32 w = *(u32*)(smp + i);
+			u32 out = 0;
+			for(u32 k=0; k<32; k+=8)
+				out |= (clampSample((s8)(w >> k) - dc, false) & 0xFF) << k;
+			*(u32*)(smp + i) = out;
+		}
+
+		for(; i < n_samples; ++i)
+			smp[i] = clampSample(smp[i] - dc, false);
+	}
+
+	return dc;
+}
+
+#endif
@@ -36,10 +36,13 @@
 #include <math.h>
 
 #include "ntxm/sample.h"
+#include "ntxm/adpcm.h"
 #include "ntxm/fifocommand.h"
 
 #ifdef ARM9
 #include "ntxm/ntxmtools.h"
+#include "ntxm/sample_pool.h"
+#include "ntxm/instrument.h"
 #endif
 
 #define MAX(x,y)						((x)>(y)?(x):(y))
@@ -53,6 +56,10 @@
 #define SOUND_8BIT 		(0)
 #endif
 
+#if !defined(SOUND_FREQ)
+#define SOUND_FREQ(n)	(-0x1000000 / (n))
+#endif
+
 extern bool ntxm_stereo_output;
 
 /* ===================== PUBLIC ===================== */
@@ -83,7 +90,7 @@ inline u32 linear_freq_table_lookup(u32 note)
 	*/
 
 	// fast version
-	if(note<=LINEAR_FREQ_TABLE_MAX_NOTE*N_FINETUNE_STEPS)
+	if(note<LINEAR_FREQ_TABLE_MAX_NOTE*N_FINETUNE_STEPS) // The table ends before the max note
 	{
 		if(note>=LINEAR_FREQ_TABLE_MIN_NOTE*N_FINETUNE_STEPS) {
 			return linear_freq_table[note-LINEAR_FREQ_TABLE_MIN_NOTE*N_FINETUNE_STEPS];
@@ -99,75 +106,54 @@ inline u32 linear_freq_table_lookup(u32 note)
 
 Sample::Sample(void *_sound_data, u32 _n_samples, u16 _sampling_frequency, bool _is_16_bit,
 	u8 _loop, u8 _volume)
-	:original_data(0), pingpong_data(0), n_samples(_n_samples), is_16_bit(_is_16_bit), loop(_loop),
-	loop_start(0), loop_length(0), volume(_volume), panning(128), base_panning(128)
+	:pingpong_built(false), external_data(false), pool_data(0), instrument(0), lazy_offset(0), stream(0), n_samples(_n_samples), is_16_bit(_is_16_bit), loop(_loop),
+	loop_start(0), loop_length(0), volume(_volume), panning(128), base_panning(128), adpcm_snr(0),
+	reductions(0), reduction_snr(0), n_mips(0)
 {
 	sound_data = _sound_data;
+	memset(mips, 0, sizeof(mips));
+	memset(peaks, 0, sizeof(peaks));
 
 	memset(name, 0, SAMPLE_NAME_LENGTH);
 
-	calcSize();
 	setFormat();
+	calcSize();
 	calcRelnoteAndFinetune(_sampling_frequency);
 
 	setLoopStartAndLength(0, _n_samples);
 }
 
-Sample::Sample(const char *filename, u8 _loop, bool *_success)
-	:original_data(0), pingpong_data(0), loop(_loop), loop_start(0), loop_length(0), volume(255),
-	panning(128), base_panning(128)
+Sample::Sample(const char *filename, u8 _loop, bool *_success, bool to_8_bit, u32 max_rate)
+	:pingpong_built(false), external_data(false), pool_data(0), instrument(0), lazy_offset(0), stream(0), n_samples(0), is_16_bit(false), loop(_loop), loop_start(0), loop_length(0), volume(255),
+	panning(128), base_panning(128), adpcm_snr(0), reductions(0), reduction_snr(0), n_mips(0)
 {
-	sound_data = (void**)calloc(20*sizeof(void*), 1);
+	memset(mips, 0, sizeof(mips));
+	memset(peaks, 0, sizeof(peaks));
+	sound_data = 0;
 
-	if(!wav.load(filename))
+	// The wav is converted to what the sample needs while it is read
+	if(!wav.load(filename, to_8_bit, max_rate))
 	{
 		my_dprintf("WAV loading failed\n");
 		*_success = false;
 		return;
 	}
 
-	char *smpname = strrchr(filename, '/') + 1;
+	const char *smpname = strrchr(filename, '/');
+	smpname = (smpname != 0) ? smpname + 1 : filename;
 	strncpy(name, smpname, SAMPLE_NAME_LENGTH);
 	name[SAMPLE_NAME_LENGTH] = 0;
 
-	if (sound_data) free(sound_data);
 	sound_data = wav.getAudioData();
 
 	calcRelnoteAndFinetune( wav.getSamplingRate() );
 
-	u8 bit_per_sample = wav.getBitPerSample();
-
-	if(bit_per_sample == 16)
-		is_16_bit = true;
-	else
-		is_16_bit = false;
-
-	if(wav.getCompression() == CMP_ADPCM)
-		sound_format = SOUND_FORMAT_ADPCM;
-	else
-		setFormat();
+	is_16_bit = (wav.getBitPerSample() == 16);
+	setFormat();
 
 	n_samples = wav.getNSamples();
-
-	/*
-	if(sound_format == SOUND_FORMAT_ADPCM) {
-		n_samples = wav.getNSamples() * 4; // ADPCM compresses 4 samples in 1
-	} else {
-		n_samples = wav.getNSamples();
-	}*/
-
 	calcSize();
 
-	if(wav.isStereo() == true)
-	{
-		if(!convertStereoToMono())
-		{
-			my_dprintf("Stereo 2 Mono conversion failed\n");
-			*_success = false;
-			return;
-		}
-	}
-
 	setLoopStart(0);
 	setLoopLength(n_samples);
 
@@ -176,14 +162,81 @@ Sample::Sample(const char *filename, u8 _loop, bool *_success)
 
 Sample::~Sample()
 {
-	if(pingpong_data != 0)
-		removePingPongLoop();
+	freeMips();
+	freePeaks();
 
-	free(sound_data);
+	dropData(sound_data);
+}
+
+void Sample::setExternalData(bool external)
+{
+	external_data = external;
+}
+
+bool Sample::hasExternalData(void)
+{
+	return external_data;
+}
+
+void Sample::setLazyOffset(u32 offset)
+{
+	lazy_offset = offset;
+}
+
+u32 Sample::getLazyOffset(void)
+{
+	return lazy_offset;
+}
+
+void Sample::setStream(StreamState *_stream)
+{
+	freeMips();
+
+	stream = _stream;
+	DC_FlushRange(this, sizeof(Sample));
+}
+
+// The data must be flushed before the arm7 sees the pointer
+void Sample::attachData(void *data)
+{
+	freeMips();
+
+	if(loop == PING_PONG_LOOP)
+	{
+		sound_data = data;
+		setupPingPongLoop();
+	}
+	else
+	{
+		DC_FlushRange(data, size);
+		sound_data = data;
+	}
+
+	DC_FlushRange(this, sizeof(Sample));
+}
+
+void Sample::detachData(void)
+{
+	if( (lazy_offset == 0) || (sound_data == 0) ) // Could not be loaded again
+		return;
+
+	freeMips();
+
+	// The reversed loop is built again when the data comes back
+	pingpong_built = false;
+
+	void *data = sound_data;
+	sound_data = 0;
+	DC_FlushRange(this, sizeof(Sample));
+
+	dropData(data);
 }
 
 void Sample::saveAsWav(char *filename)
 {
+	if(!decompress())
+		return;
+
 	wav.setCompression(0);
 	wav.setNChannels(1);
 	wav.setSamplingRate(LOOKUP_FREQ(rel_note+96,finetune));
@@ -193,15 +246,478 @@ void Sample::saveAsWav(char *filename)
 	wav.save(filename);
 }
 
+bool Sample::compress(s16 *snr)
+{
+	if(sound_format == SOUND_FORMAT_ADPCM)
+	{
+		if(snr != 0)
+			*snr = adpcm_snr;
+		return true;
+	}
+
+	if( (sound_data == 0) || (stream != 0) || (loop == PING_PONG_LOOP) || (n_samples == 0) )
+		return false;
+
+	freeMips();
+	freePeaks(); // The padding moves the samples
+
+	// Room for the padding and repeated loops, the rest is given back after
+	u8 *adpcm = (u8*)malloc(ADPCM_SIZE(n_samples + ADPCM_MAX_UNROLL + 2 * ADPCM_BLOCK_SAMPLES));
+	if(adpcm == 0)
+		return false;
+
+	u32 new_loop_start, new_loop_length;
+	u32 new_n_samples = encodeAdpcm(adpcm, &adpcm_snr, &new_loop_start, &new_loop_length);
+	adpcm = (u8*)realloc(adpcm, ADPCM_SIZE(new_n_samples));
+
+	if(snr != 0)
+		*snr = adpcm_snr;
+
+	dropData(sound_data);
+
+	// ADPCM decodes to 16 bit, the loop is kept in those units
+	sound_data = adpcm;
+	n_samples = new_n_samples;
+	is_16_bit = true;
+	sound_format = SOUND_FORMAT_ADPCM;
+	loop_start = new_loop_start * 2;
+	loop_length = new_loop_length * 2;
+	calcSize();
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+
+	my_dprintf("compressed to %lu bytes, snr %d.%d dB\n", size, adpcm_snr / 10, adpcm_snr % 10);
+
+	updateNotes();
+	return true;
+}
+
+bool Sample::decompress(void)
+{
+	if(sound_format != SOUND_FORMAT_ADPCM)
+		return true;
+
+	s16 *pcm = (s16*)malloc(n_samples * 2);
+	if(pcm == 0)
+		return false;
+
+	AdpcmDecoder decoder((const u8*)sound_data);
+	decoder.decode(pcm, n_samples);
+
+	dropData(sound_data);
+
+	sound_data = pcm;
+	adpcm_snr = 0;
+	setFormat();
+	calcSize();
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+
+	return true;
+}
+
+s16 Sample::measureCompression(u32 *compressed_size)
+{
+	if(sound_format == SOUND_FORMAT_ADPCM)
+	{
+		*compressed_size = size;
+		return adpcm_snr;
+	}
+
+	if( (sound_data == 0) || (stream != 0) || (loop == PING_PONG_LOOP) || (n_samples == 0) )
+	{
+		*compressed_size = size;
+		return 0;
+	}
+
+	s16 snr;
+	u32 new_loop_start, new_loop_length;
+	*compressed_size = ADPCM_SIZE(encodeAdpcm(0, &snr, &new_loop_start, &new_loop_length));
+	return snr;
+}
+
+void Sample::setAdpcmData(void)
+{
+	is_16_bit = true;
+	sound_format = SOUND_FORMAT_ADPCM;
+	calcSize();
+	setLoopStartAndLength(getLoopStart(), getLoopLength());
+}
+
+bool Sample::reduceTo8Bit(s16 *snr)
+{
+	if( (!is_16_bit) || (!canReduce()) || (!ownData()) )
+		return false;
+
+	freeMips();
+
+	// Ping pong loops are rebuilt from the reduced data
+	bool ping_pong = pingpong_built;
+	if(ping_pong)
+		removePingPongLoop();
+
+	u32 start = getLoopStart();
+	u32 length = getLoopLength();
+
+	u64 signal = ntxm_signal_energy(sound_data, n_samples, true);
+	u32 seed = 1;
+	u64 noise = ntxm_dither_16to8((s8*)sound_data, (const s16*)sound_data, n_samples, &seed);
+
+	if(!external_data)
+	{
+		void *shrunk = realloc(sound_data, n_samples);
+		if(shrunk != 0)
+			sound_data = shrunk;
+	}
+
+	is_16_bit = false;
+	setFormat();
+	calcSize();
+	loop_start = start;
+	loop_length = length;
+
+	addReduction(SAMPLE_REDUCED_8BIT, ntxm_snr(signal, noise));
+	if(snr != 0)
+		*snr = ntxm_snr(signal, noise);
+
+	updatePeaks(0, n_samples);
+
+	if(ping_pong)
+		setupPingPongLoop();
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+
+	return true;
+}
+
+bool Sample::halveRate(s16 *snr)
+{
+	// The relative note can go down to -96
+	if( (!canReduce()) || (getNSamples() < 2) || (rel_note < -96 + 12) || (!ownData()) )
+		return false;
+
+	freeMips();
+
+	bool ping_pong = pingpong_built;
+	if(ping_pong)
+		removePingPongLoop();
+
+	u32 bps = is_16_bit ? 2 : 1;
+	u32 start = getLoopStart() / 2;
+	u32 length = (getLoopLength() + 1) / 2;
+
+	u64 signal = ntxm_signal_energy(sound_data, n_samples, is_16_bit);
+	u64 noise = ntxm_decimate(sound_data, sound_data, n_samples, is_16_bit);
+	n_samples = (n_samples + 1) / 2;
+
+	if(!external_data)
+	{
+		void *shrunk = realloc(sound_data, n_samples * bps);
+		if(shrunk != 0)
+			sound_data = shrunk;
+	}
+
+	calcSize();
+	rel_note -= 12;
+
+	if(start >= n_samples)
+		start = 0;
+	if(length > n_samples - start)
+		length = n_samples - start;
+	loop_start = start * bps;
+	loop_length = length * bps;
+
+	addReduction(SAMPLE_REDUCED_RATE, ntxm_snr(signal, noise));
+	if(snr != 0)
+		*snr = ntxm_snr(signal, noise);
+
+	updatePeaks(0, n_samples);
+
+	if(ping_pong)
+		setupPingPongLoop();
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+
+	updateNotes();
+	return true;
+}
+
+s16 Sample::measureReduceTo8Bit(void)
+{
+	if( (!is_16_bit) || (!canReduce()) )
+		return 0;
+
+	u32 seed = 1;
+	u64 noise = ntxm_dither_16to8(0, (const s16*)getData(), getNSamples(), &seed);
+	return ntxm_snr(ntxm_signal_energy(getData(), getNSamples(), true), noise);
+}
+
+s16 Sample::measureHalveRate(void)
+{
+	if( (!canReduce()) || (getNSamples() < 2) || (rel_note < -96 + 12) )
+		return 0;
+
+	u64 noise = ntxm_decimate(0, getData(), getNSamples(), is_16_bit);
+	return ntxm_snr(ntxm_signal_energy(getData(), getNSamples(), is_16_bit), noise);
+}
+
+// Each level is made from the one before. They are made from sound_data, so
+// a ping pong loop is in them unrolled, like the hardware plays it.
+u8 Sample::buildMips(u8 levels)
+{
+	freeMips();
+
+	if( (sound_data == 0) || (stream != 0) || (sound_format == SOUND_FORMAT_ADPCM) || (n_samples < 2) )
+		return 0;
+
+	if(levels > SAMPLE_MIP_LEVELS)
+		levels = SAMPLE_MIP_LEVELS;
+
+	u32 bps = is_16_bit ? 2 : 1;
+	u32 played_loop_length = (loop == PING_PONG_LOOP) ? 2 * loop_length : loop_length;
+	const void *src = sound_data;
+	u32 n = pingpong_built ? n_samples + loop_length / bps : n_samples;
+
+	for(u8 level=1; level<=levels; ++level)
+	{
+		// The loop has to start and end at a word of the level, or it would
+		// move
+		if( (loop != NO_LOOP) && ( (played_loop_length % (4 << level) != 0) || (loop_start % (4 << level) != 0) ) )
+			break;
+
+		u32 bytes = (((n + 1) / 2) * bps + 3) & ~3;
+		void *data = calloc(bytes, 1);
+		if(data == 0)
+			break;
+
+		ntxm_decimate(data, src, n, is_16_bit);
+		n = (n + 1) / 2;
+
+		SampleMip *mip = &mips[level-1];
+		mip->data = data;
+		mip->size = bytes;
+		if(loop == NO_LOOP) {
+			mip->repeat_point = 0;
+			mip->length = bytes >> 2;
+		} else {
+			mip->repeat_point = (loop_start >> level) >> 2;
+			mip->length = (played_loop_length >> level) >> 2;
+		}
+
+		DC_FlushRange(data, bytes);
+		n_mips = level;
+		src = data;
+	}
+
+	DC_FlushRange(this, sizeof(Sample));
+
+	return n_mips;
+}
+
+void Sample::freeMips(void)
+{
+	if(n_mips == 0)
+		return;
+
+	// The arm7 must not pick a level while it is freed
+	u8 levels = n_mips;
+	n_mips = 0;
+	DC_FlushRange(this, sizeof(Sample));
+
+	for(u8 i=0; i<levels; ++i)
+	{
+		free(mips[i].data);
+		mips[i].data = 0;
+		mips[i].size = 0;
+	}
+}
+
+bool Sample::buildPeaks(void)
+{
+	if( (sound_data == 0) || (sound_format == SOUND_FORMAT_ADPCM) )
+		return false;
+
+	if(!resizePeaks())
+		return false;
+
+	updatePeaks(0, n_samples);
+	return true;
+}
+
+void Sample::freePeaks(void)
+{
+	for(u8 level=0; level<SAMPLE_PEAK_LEVELS; ++level)
+	{
+		free(peaks[level]);
+		peaks[level] = 0;
+	}
+}
+
+bool Sample::hasPeaks(void)
+{
+	return peaks[0] != 0;
+}
+
+void Sample::getPeak(u32 startsample, u32 endsample, s16 *min, s16 *max)
+{
+	if(endsample > n_samples)
+		endsample = n_samples;
+
+	bool have_data = (sound_data != 0) && (sound_format != SOUND_FORMAT_ADPCM);
+	if( (startsample >= endsample) || ( (!have_data) && (!hasPeaks()) ) )
+	{
+		*min = *max = 0;
+		return;
+	}
+
+	s32 lo = 32767, hi = -32768;
+	u32 i = startsample;
+
+	while(i < endsample)
+	{
+		// The largest bucket that starts here and ends in the range
+		s8 level = hasPeaks() ? SAMPLE_PEAK_LEVELS - 1 : -1;
+		for(; level >= 0; --level)
+		{
+			u32 bucket = 1 << SAMPLE_PEAK_SHIFT(level);
+			u32 bucket_end = i + bucket;
+			if(bucket_end > n_samples)
+				bucket_end = n_samples;
+			if( ((i & (bucket - 1)) == 0) && (bucket_end <= endsample) )
+				break;
+		}
+
+		// Without the data, the bucket the sample is in has to do
+		if( (level < 0) && (!have_data) )
+			level = 0;
+
+		if(level >= 0)
+		{
+			u32 shift = SAMPLE_PEAK_SHIFT(level);
+			SamplePeak *peak = &peaks[level][i >> shift];
+			lo = (peak->min < lo) ? peak->min : lo;
+			hi = MAX(peak->max, hi);
+			i = ((i >> shift) + 1) << shift;
+		}
+		else
+		{
+			s32 value = is_16_bit ? ((s16*)sound_data)[i] : ((s8*)sound_data)[i];
+			lo = (value < lo) ? value : lo;
+			hi = MAX(value, hi);
+			i++;
+		}
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+u32 Sample::trim(u16 threshold, bool trim_start)
+{
+	// A shared sample's data stays in the pool for the other songs, so a
+	// trimmed copy would not save anything
+	if( (sound_data == 0) || (stream != 0) || (lazy_offset != 0) || (sound_format == SOUND_FORMAT_ADPCM)
+		|| (pool_data != 0) )
+		return 0;
+
+	u8 bps = is_16_bit ? 2 : 1;
+	u32 first = 0, end = n_samples;
+
+	if( (loop == FORWARD_LOOP) && (loop_length > 0) )
+	{
+		// The hardware never gets past the loop end
+		end = (loop_start + loop_length) / bps;
+	}
+	else if(loop == NO_LOOP)
+	{
+		while( (end > 0) && isSilent(end - 1, threshold) )
+			end--;
+
+		if(trim_start)
+		{
+			while( (first < end) && isSilent(first, threshold) )
+				first++;
+			first &= ~(4 / bps - 1); // The data has to start at a word
+		}
+
+		// Keep a word of a silent sample
+		if(end < first + 4 / bps)
+			end = first + 4 / bps;
+	}
+
+	if(end > n_samples)
+		end = n_samples;
+	if( (first == 0) && (end == n_samples) )
+		return 0;
+
+	u32 old_size = getMemorySize();
+	crop(first, end);
+
+	my_dprintf("trimmed %lu bytes\n", old_size - getMemorySize());
+
+	return old_size - getMemorySize();
+}
+
 #endif
 
+bool Sample::isCompressed(void)
+{
+	return sound_format == SOUND_FORMAT_ADPCM;
+}
+
+s16 Sample::getCompressionSnr(void)
+{
+	return adpcm_snr;
+}
+
+u8 Sample::getReductions(void)
+{
+	return reductions;
+}
+
+s16 Sample::getReductionSnr(void)
+{
+	return reduction_snr;
+}
+
+u8 Sample::getMipLevels(void)
+{
+	return n_mips;
+}
+
+u32 Sample::getMipSize(u8 level)
+{
+	if( (level == 0) || (level > n_mips) )
+		return 0;
+	return mips[level-1].size;
+}
+
 #if defined(ARM7)
 
+// The mip level each channel was started with, bends keep it
+static u8 channel_mip_levels[16];
+
+Sample **ntxm_channel_samples = 0;
+
+// Each level halves the rate, so the timer period doubles
+static inline u16 mipTimer(u16 timer, u8 level)
+{
+	if(level == 0)
+		return timer;
+
+	u32 period = (u32)(0x10000 - timer) << level;
+	if(period > 0xFFFF)
+		period = 0xFFFF;
+	return 0x10000 - period;
+}
+
 // volume_ ranges from 0-127. The value 255 means "no volume", i.e. the sample's own volume shall be used.
 void Sample::play(u8 note, u8 volume_ , u8 channel)
 {
-	if(channel>15) return; // DS has only 16 channels!
-
 	/*
 	if(note+rel_note > N_LINEAR_FREQ_TABLE_NOTES) {
 		CommandDbgOut("Freq out of range!\n");
@@ -209,24 +725,19 @@ void Sample::play(u8 note, u8 volume_ , u8 channel)
 	}
 	*/
 
+	playTimer(calcTimer(note), volume_, channel);
+}
+
+void Sample::playTimer(u16 timer, u8 volume_, u8 channel)
+{
+	if(channel>15) return; // DS has only 16 channels!
+
 	u32 loop_bit;
 	if( ( ( loop == FORWARD_LOOP ) || (loop == PING_PONG_LOOP) ) && (loop_length > 0) )
 		loop_bit = SOUND_REPEAT;
 	else
 		loop_bit = SOUND_ONE_SHOT;
 
-	// Add 48 to the note, because otherwise absolute_note can get negative.
-	// (The minimum value of relative note is -48)
-	u8 absolute_note = note + 48;
-
-	// Choose the subsampled version. The first 12 octaves will be fine,
-	// if the note is higher, choose a subsampled version.
-	// Octave 12 is more of a good guess, so there could be better, more
-	// reasonable values.
-	u8 realnote;
-
-	realnote = absolute_note+rel_note;
-
 	// If a volume is given, it overrides the sample's own volume
 	u8 smpvolume;
 	if(volume_ == NO_VOLUME)
@@ -234,11 +745,43 @@ void Sample::play(u8 note, u8 volume_ , u8 channel)
 	else
 		smpvolume = volume_; // Channel volume is 0..127
 
+	// Very high notes play a filtered copy at a lower rate, see buildMips()
+	u8 level = 0;
+	while( (level < n_mips) && ( ((u32)(0x10000 - timer) << level) < SAMPLE_MIP_MIN_PERIOD ) )
+		level++;
+	channel_mip_levels[channel] = level;
+	timer = mipTimer(timer, level);
+
+	if(ntxm_channel_samples != 0)
+		ntxm_channel_samples[channel] = this;
+
 	SCHANNEL_CR(channel) = 0;
-	SCHANNEL_TIMER(channel) = SOUND_FREQ((int)LOOKUP_FREQ(realnote,finetune));
+	SCHANNEL_TIMER(channel) = timer;
 	SCHANNEL_SOURCE(channel) = (uint32)sound_data;
 
-	if( loop == NO_LOOP )
+	if( stream != 0 )
+	{
+		// Play the head once, then loop over the ring
+		SCHANNEL_SOURCE(channel) = (uint32)stream->buffer;
+		SCHANNEL_REPEAT_POINT(channel) = stream->head_size >> 2;
+		SCHANNEL_LENGTH(channel) = stream->ring_size >> 2;
+		loop_bit = SOUND_REPEAT;
+		startStream(timer, channel);
+	}
+	else if( level > 0 )
+	{
+		const SampleMip *mip = &mips[level-1];
+		SCHANNEL_SOURCE(channel) = (uint32)mip->data;
+		SCHANNEL_REPEAT_POINT(channel) = mip->repeat_point;
+		SCHANNEL_LENGTH(channel) = mip->length;
+	}
+	else if( sound_format == SOUND_FORMAT_ADPCM )
+	{
+		// The header word comes first, loops are kept in 16 bit units
+		SCHANNEL_REPEAT_POINT(channel) = 1 + (loop == NO_LOOP ? 0 : loop_start >> 4);
+		SCHANNEL_LENGTH(channel) = (loop == NO_LOOP) ? (size >> 2) - 1 : loop_length >> 4;
+	}
+	else if( loop == NO_LOOP )
 	{
 		SCHANNEL_REPEAT_POINT(channel) = 0;
 		SCHANNEL_LENGTH(channel) = size >> 2;
@@ -269,31 +812,93 @@ void Sample::bendNote(u8 note, u8 basenote, s16 _finetune, u8 channel)
 	u8 absolute_note = note + 48;
 	u8 realnote = (absolute_note+rel_note);
   _finetune += finetune; //Need to offset by sample's finetune
-	SCHANNEL_TIMER(channel) = SOUND_FREQ((int)LOOKUP_FREQ(realnote,_finetune));
+	u16 timer = SOUND_FREQ((int)LOOKUP_FREQ(realnote,_finetune));
+	setTimer(timer, channel);
 }
 
 void Sample::bendNoteDirect(s16 fine_step, u8 channel)
 {
   CommandDbgOut("finestep: 0x%x channel: 0x%x\n", fine_step, channel);
-	SCHANNEL_TIMER(channel) = SOUND_FREQ((int)GET_FREQ_DIRECT(fine_step));
+	u16 timer = SOUND_FREQ((int)GET_FREQ_DIRECT(fine_step));
+	setTimer(timer, channel);
+}
+
+// The channel keeps playing the mip level it was started with. Streams must
+// know the new rate, or they refill the ring too early or too late.
+void Sample::setTimer(u16 timer, u8 channel)
+{
+	SCHANNEL_TIMER(channel) = mipTimer(timer, channel_mip_levels[channel]);
+
+	if( (stream != 0) && (stream->channel == channel) )
+		setStreamRate(timer);
+}
+
+void Sample::startStream(u16 timer, u8 channel)
+{
+	stream->play_pos = 0;
+	stream->play_frac = 0;
+	stream->channel = channel;
+	setStreamRate(timer);
+	stream->generation++;
+	stream->playing = true;
+}
+
+// The arm9 knows where the hardware is only from the time and the frequency
+void Sample::setStreamRate(u16 timer)
+{
+	// The sound timer runs at 16.756991 MHz. Its ticks per ms in 16.16 fixed
+	// point, times the bytes per sample, still fit into 32 bits, so this runs
+	// on every bend without a 64 bit division. The result is the same.
+	u32 ticks_per_ms = is_16_bit ? 2196372324u : 1098186162u; // 16756991 * 65536 * bps / 1000
+	stream->rate = ticks_per_ms / (0x10000 - timer);
 }
 
 #endif
 
 u32 Sample::calcPlayLength(u8 note)
 {
-	u32 samples_per_second = LOOKUP_FREQ(48+note+rel_note,finetune);
-	return n_samples * 1000 / samples_per_second;
+	u32 samples_per_second = calcFrequency(note);
+	if(samples_per_second == 0) // Relative note out of the table
+		return 0;
+
+	// n_samples * 1000 overflows 32 bits above 4.29 M samples
+	u64 ms = (u64)n_samples * 1000 / samples_per_second;
+	return (ms > 0xFFFFFFFF) ? 0xFFFFFFFF : (u32)ms;
+}
+
+u32 Sample::calcFrequency(u8 note)
+{
+	return LOOKUP_FREQ(48+note+rel_note,finetune);
+}
+
+u16 Sample::calcTimer(u8 note)
+{
+	// Add 48 to the note, because otherwise absolute_note can get negative.
+	// (The minimum value of relative note is -48)
+	u8 absolute_note = note + 48;
+
+	// Choose the subsampled version. The first 12 octaves will be fine,
+	// if the note is higher, choose a subsampled version.
+	// Octave 12 is more of a good guess, so there could be better, more
+	// reasonable values.
+	u8 realnote = absolute_note+rel_note;
+
+	int freq = LOOKUP_FREQ(realnote,finetune);
+	if(freq == 0) // Relative note out of the table
+		return 0;
+	return SOUND_FREQ(freq);
 }
 
 #ifdef ARM9
 
 void Sample::setRelNote(s8 _rel_note) {
 	rel_note = _rel_note;
+	updateNotes();
 }
 
 void Sample::setFinetune(s8 _finetune) {
 	finetune = _finetune;
+	updateNotes();
 }
 
 #endif
@@ -306,35 +911,38 @@ s8 Sample::getFinetune(void) {
 	return finetune;
 }
 
-u32 Sample::getSize(void)
+u32 Sample::getSize(void)
+{
+	return size;
+}
+
+u32 Sample::getNSamples(void)
+{
+	return n_samples;
+}
+
+u32 Sample::getMemorySize(void)
+{
+	if(pingpong_built)
+		return size + loop_length;
+	else
+		return size;
+}
+
+bool Sample::isLoaded(void)
 {
-	if(loop == PING_PONG_LOOP)
-	{
-		if(is_16_bit) {
-			return original_n_samples * 2;
-		} else {
-			return original_n_samples;
-		}
-	} else {
-		return size;
-	}
+	return (lazy_offset == 0) || (sound_data != 0) || (stream != 0);
 }
 
-u32 Sample::getNSamples(void)
+StreamState *Sample::getStream(void)
 {
-	if(loop == PING_PONG_LOOP)
-		return original_n_samples;
-	else
-		return n_samples;
+	return stream;
 }
 
 void *Sample::getData(void)
 {
-	// sound_data is modified for the loop, but original_data points to the unmodified sound data
-	if(loop == PING_PONG_LOOP)
-		return original_data;
-	else
-		return sound_data;
+	// The reversed loop of ping pong loops comes after the data
+	return sound_data;
 }
 
 u8 Sample::getLoop(void) {
@@ -348,6 +956,12 @@ bool Sample::setLoop(u8 loop_) // Set loop type. Can fail due to memory constrai
 	if(loop_ == loop)
 		return true;
 
+	freeMips();
+
+	// The hardware can't play ADPCM backwards
+	if( (loop_ == PING_PONG_LOOP) && (!decompress()) )
+		return false;
+
 	if(loop == PING_PONG_LOOP) // Switching from ping-pong to sth else
 	{
 		removePingPongLoop();
@@ -364,14 +978,17 @@ bool Sample::setLoop(u8 loop_) // Set loop type. Can fail due to memory constrai
 	if(loop_ == PING_PONG_LOOP)
 	{
 		// Check if enough memory is available
-		u8 *testmem = (u8*)malloc(2*loop_length + size);
+		u8 *testmem = (u8*)malloc(loop_length + size);
 		if(testmem == 0)
 			return false;
 		free(testmem);
 
 		setupPingPongLoop();
+		updateNotes();
+		return (loop == PING_PONG_LOOP);
 	}
 
+	updateNotes();
 	return true;
 }
 
@@ -393,6 +1010,8 @@ u32 Sample::getLoopStart(void)
 
 void Sample::setLoopStart(u32 _loop_start)
 {
+	freeMips();
+
 	u32 loop_length_in_samples;
 	if(is_16_bit)
 		loop_length_in_samples = loop_length / 2;
@@ -407,6 +1026,8 @@ void Sample::setLoopStart(u32 _loop_start)
 
 void Sample::setLoopLength(u32 _loop_length)
 {
+	freeMips();
+
 	u32 loop_start_in_samples;
 	if(is_16_bit)
 		loop_start_in_samples = loop_start / 2;
@@ -421,10 +1042,28 @@ void Sample::setLoopLength(u32 _loop_length)
 
 void Sample::setLoopStartAndLength(u32 _loop_start, u32 _loop_length)
 {
+	freeMips();
+
 	// NDS fix: If loop length is 0, it won't play the beginning of the sample until the loop
 	if(_loop_length == 0)
 		_loop_length = 2;
 
+	// ADPCM loops in whole words
+	if(sound_format == SOUND_FORMAT_ADPCM)
+	{
+		_loop_start &= ~(ADPCM_BLOCK_SAMPLES - 1);
+		_loop_length = (_loop_length + ADPCM_BLOCK_SAMPLES / 2) & ~(ADPCM_BLOCK_SAMPLES - 1);
+		if(_loop_length == 0)
+			_loop_length = ADPCM_BLOCK_SAMPLES;
+
+		// Rounding must not take the loop past the last word of the data
+		u32 end = (n_samples + ADPCM_BLOCK_SAMPLES - 1) & ~(ADPCM_BLOCK_SAMPLES - 1);
+		if(_loop_start >= end)
+			_loop_start = end - ADPCM_BLOCK_SAMPLES;
+		if(_loop_start + _loop_length > end)
+			_loop_length = end - _loop_start;
+	}
+
 	if(is_16_bit)
 	{
 		loop_length = _loop_length * 2;
@@ -436,8 +1075,14 @@ void Sample::setLoopStartAndLength(u32 _loop_start, u32 _loop_length)
 		loop_start = _loop_start;
 	}
 
+	// The new loop can only use what was kept of the old one
 	if( loop == PING_PONG_LOOP )
-		updatePingPongLoop();
+	{
+		removePingPongLoop();
+		setupPingPongLoop();
+	}
+
+	updateNotes();
 }
 
 #endif
@@ -452,6 +1097,7 @@ u32 Sample::getLoopLength(void)
 
 void Sample::setVolume(u8 vol) {
 	volume = vol;
+	updateNotes();
 }
 
 u8 Sample::getVolume(void) {
@@ -505,6 +1151,11 @@ const char *Sample::getName(void)
 // Deletes the part between start sample and end sample
 void Sample::delPart(u32 startsample, u32 endsample)
 {
+	if( (!decompress()) || (!ownData()) )
+		return;
+
+	freeMips();
+
 	if(endsample >= n_samples)
 		endsample = n_samples-1;
 
@@ -518,7 +1169,7 @@ void Sample::delPart(u32 startsample, u32 endsample)
 	// Special case: everything is deleted
 	if((startsample==0)&&(endsample==n_samples))
 	{
-		free(sound_data);
+		dropData(sound_data);
 		n_samples = 0;
 		calcSize();
 		loop_start = loop_length = 0;
@@ -535,7 +1186,18 @@ void Sample::delPart(u32 startsample, u32 endsample)
 	{
 		memmove((u8*)sound_data + startsample * bps, (u8*)sound_data + (endsample + 1) * bps, ((n_samples - 1) - endsample) * bps);
 	}
-	sound_data = realloc(sound_data, new_n_samples * bps);
+	if(external_data)
+	{
+		// The data belongs to someone else, so make a copy that can be resized
+		void *own_data = malloc(new_n_samples * bps);
+		memcpy(own_data, sound_data, new_n_samples * bps);
+		sound_data = own_data;
+		external_data = false;
+	}
+	else
+	{
+		sound_data = realloc(sound_data, new_n_samples * bps);
+	}
 
 	n_samples = new_n_samples;
 
@@ -545,7 +1207,7 @@ void Sample::delPart(u32 startsample, u32 endsample)
 	// Update Loop
 	u32 loop_end = loop_start + loop_length;
 	u32 start = startsample * bps;
-	u32 end = endsample * bps;
+	u32 end = (endsample + 1) * bps - 1; // The last deleted byte
 	u32 del = end - start + 1;
 
 	if(loop != NO_LOOP)
@@ -598,130 +1260,133 @@ void Sample::delPart(u32 startsample, u32 endsample)
 		loop_length = size;
 	}
 
+	updatePeaks(startsample, n_samples);
+
 	if(restore_ping_pong)
 		setLoop(PING_PONG_LOOP);
+
+	updateNotes();
 }
 
-void Sample::fadeIn(u32 startsample, u32 endsample)
+// Heuristically cut silence in the beginning
+void Sample::cutSilence(void)
 {
-	fade(startsample, endsample, true);
+	if(!decompress())
+		return;
 
-	if(loop == PING_PONG_LOOP)
-		updatePingPongLoop();
-}
+	// Up to the loop, and at least one sample stays
+	u32 limit = (loop == NO_LOOP) ? n_samples - 1 : getLoopStart();
+	u32 first = 0;
+	while( (first < limit) && isSilent(first, SILENCE_THRESHOLD_16) )
+		first++;
 
-void Sample::fadeOut(u32 startsample, u32 endsample)
-{
-	fade(startsample, endsample, false);
+	if(first <= CROP_IGNORE_START)
+		return;
 
-	if( loop == PING_PONG_LOOP )
-		updatePingPongLoop();
+	delPart(0, first - 1);
 }
 
-void Sample::reverse(u32 startsample, u32 endsample)
+void Sample::fadeIn(u32 startsample, u32 endsample)
 {
-	void *data = getData();
-	u32 nsamples = getNSamples();
+	if( (!decompress()) || (!ownData()) )
+		return;
 
-	if(endsample >= nsamples)
-		endsample = nsamples-1;
+	freeMips();
 
-	s32 offset = startsample;
-	s32 length = endsample - startsample;
+	fade(startsample, endsample, true);
+}
 
-	// Make sure there is enough RAM for this
-	void *testmem = malloc( (is_16_bit?2:1) * length);
-	if(testmem == NULL)
-	{
-		my_dprintf("Not enough memory for reversing\n");
+void Sample::fadeOut(u32 startsample, u32 endsample)
+{
+	if( (!decompress()) || (!ownData()) )
 		return;
-	}
-	else
-		free(testmem);
-
-	// Do it!
-	if(is_16_bit == true)
-	{
-		s16 *new_sounddata = (s16*)malloc(2 * length);
-		s16 *sounddata = (s16*)(data);
-
-		// First reverse the selected region
-		for(s32 i=0;i<length;++i) {
-			new_sounddata[i] = sounddata[offset+length-1-i];
-		}
 
-		// Then copy it into the sample
-		memcpy(sounddata + offset, new_sounddata, 2 * length);
+	freeMips();
 
-		free(new_sounddata);
+	fade(startsample, endsample, false);
+}
 
-	} else {
+void Sample::reverse(u32 startsample, u32 endsample)
+{
+	if( (!decompress()) || (!ownData()) )
+		return;
 
-		s8 *new_sounddata = (s8*)malloc(length);
-		s8 *sounddata = (s8*)(data);
+	freeMips();
 
-		// First reverse the selected region
-		for(s32 i=0;i<length;++i) {
-			new_sounddata[i] = sounddata[offset+length-1-i];
-		}
+	u32 nsamples = getNSamples();
 
-		// Then copy it into the sample
-		memcpy(sounddata + offset, new_sounddata, length);
+	if(endsample >= nsamples)
+		endsample = nsamples-1;
+	if( (nsamples == 0) || (startsample > endsample) )
+		return;
 
-		free(new_sounddata);
-	}
+	u8 bps = is_16_bit ? 2 : 1;
+	ntxm_reverse((u8*)getData() + startsample * bps, endsample - startsample, is_16_bit);
 
-	// Now everything's clear and we set the variables right
-	calcSize();
+	updatePeaks(startsample, endsample + 1);
 
 	if( loop == PING_PONG_LOOP )
-		updatePingPongLoop();
+		updatePingPongLoop(startsample, endsample + 1);
 }
 
-
 void Sample::normalize(u16 percent, u32 startsample, u32 endsample)
 {
-	void *data = getData();
+	if( (!decompress()) || (!ownData()) )
+		return;
 
-	if(is_16_bit == true)
-	{
-		s16 *sounddata = (s16*)(data);
-		s32 smp;
+	freeMips();
 
-		for(u32 i=startsample;i<endsample;++i) {
-			smp = (s32)percent * (s32)sounddata[i] / 100;
+	if(endsample > n_samples)
+		endsample = n_samples;
+	if(startsample >= endsample)
+		return;
 
-			smp = my_clamp(smp, -32768, 32767);
+	u8 bps = is_16_bit ? 2 : 1;
+	u32 gain = (u32)percent * NTXM_GAIN_ONE / 100;
+	ntxm_gain((u8*)getData() + startsample * bps, endsample - startsample, is_16_bit, gain);
 
-			sounddata[i] = smp;
-		}
+	updatePeaks(startsample, endsample);
 
-	} else {
+	if( loop == PING_PONG_LOOP )
+		updatePingPongLoop(startsample, endsample);
+}
+
+void Sample::removeDcOffset(u32 startsample, u32 endsample)
+{
+	if( (!decompress()) || (!ownData()) )
+		return;
 
-		s8 *sounddata = (s8*)(data);
-		s16 smp;
+	freeMips();
 
-		for(u32 i=startsample;i<endsample;++i) {
-			smp = (s32)percent * (s32)sounddata[i] / 100;
+	if(endsample > n_samples)
+		endsample = n_samples;
+	if(startsample >= endsample)
+		return;
 
-			smp = my_clamp(smp, -128, 127);
+	u8 bps = is_16_bit ? 2 : 1;
+	ntxm_remove_dc((u8*)getData() + startsample * bps, endsample - startsample, is_16_bit);
 
-			sounddata[i] = smp;
-		}
-	}
+	updatePeaks(startsample, endsample);
 
 	if( loop == PING_PONG_LOOP )
-		updatePingPongLoop();
+		updatePingPongLoop(startsample, endsample);
 }
 
 void Sample::drawLine(int x1, int y1, int x2, int y2)
 {
+	if( (!decompress()) || (!ownData()) )
+		return;
+
+	freeMips();
+
 	x1 = my_clamp(x1, 0, n_samples-1);
 	x2 = my_clamp(x2, 0, n_samples-1);
 	int minval = is_16_bit?-32768:-128;
 	int maxval = is_16_bit?32767:127;
 	y1 = my_clamp(y1, minval, maxval);
 	y2 = my_clamp(y2, minval, maxval);
+	u32 firstsample = (x1 < x2) ? x1 : x2;
+	u32 lastsample = MAX(x1, x2);
 
 	void *data = getData();
 	s16 *sounddata16 = (s16*)(data);
@@ -775,8 +1440,10 @@ void Sample::drawLine(int x1, int y1, int x2, int y2)
 		}
 	}
 
+	updatePeaks(firstsample, lastsample + 1);
+
 	if( loop == PING_PONG_LOOP )
-			updatePingPongLoop();
+		updatePingPongLoop(firstsample, lastsample + 1);
 }
 
 #endif
@@ -785,7 +1452,9 @@ void Sample::drawLine(int x1, int y1, int x2, int y2)
 
 void Sample::calcSize(void)
 {
-	if(is_16_bit) {
+	if(sound_format == SOUND_FORMAT_ADPCM) {
+		size = ADPCM_SIZE(n_samples);
+	} else if(is_16_bit) {
 		size = n_samples*2;
 	} else {
 		size = n_samples;
@@ -796,7 +1465,7 @@ void Sample::calcSize(void)
 
 void Sample::setFormat(void) {
 
-	// TODO ADPCM and stuff
+	// ADPCM is set by compress() and setAdpcmData()
 	if(is_16_bit) {
 		sound_format = SOUND_16BIT;
 	} else {
@@ -804,6 +1473,79 @@ void Sample::setFormat(void) {
 	}
 }
 
+// Lays the sample out for ADPCM and encodes it, or only measures it if dest is
+// 0. Returns the new number of samples. A forward loop must start on a word,
+// so the sample gets a few copies of its first value in front. A loop that is
+// not a multiple of 8 samples long is repeated until it is, or rounded if that
+// would take more than ADPCM_MAX_UNROLL samples. Whatever follows the loop is
+// never played and left out.
+u32 Sample::encodeAdpcm(u8 *dest, s16 *snr, u32 *new_loop_start, u32 *new_loop_length)
+{
+	const u8 *data = (const u8*)sound_data;
+	u32 bps = is_16_bit ? 2 : 1;
+	u32 start = getLoopStart();
+	u32 length = getLoopLength();
+
+	AdpcmEncoder encoder(dest);
+	encoder.start(data, n_samples, is_16_bit);
+
+	if( (loop != FORWARD_LOOP) || (length == 0) || (start + length > n_samples) )
+	{
+		encoder.encode(data, n_samples, is_16_bit);
+		encoder.finish();
+
+		*new_loop_start = 0;
+		*new_loop_length = encoder.getNSamples();
+	}
+	else
+	{
+		u32 pad = (ADPCM_BLOCK_SAMPLES - start % ADPCM_BLOCK_SAMPLES) % ADPCM_BLOCK_SAMPLES;
+		for(u32 i=0; i<pad; ++i)
+			encoder.encode(data, 1, is_16_bit);
+		encoder.encode(data, start, is_16_bit);
+
+		u32 repeats = 1;
+		while( (length * repeats) % ADPCM_BLOCK_SAMPLES != 0 )
+			repeats *= 2;
+
+		if( (repeats > 1) && (length * repeats > ADPCM_MAX_UNROLL) )
+		{
+			// The loop is long, so a few samples more or less hardly change its pitch
+			repeats = 1;
+			u32 rounded = (length + ADPCM_BLOCK_SAMPLES / 2) & ~(ADPCM_BLOCK_SAMPLES - 1);
+			length = (start + rounded <= n_samples) ? rounded : length & ~(ADPCM_BLOCK_SAMPLES - 1);
+		}
+
+		for(u32 i=0; i<repeats; ++i)
+			encoder.encode(data + start * bps, length, is_16_bit);
+
+		*new_loop_start = pad + start;
+		*new_loop_length = length * repeats;
+	}
+
+	if(snr != 0)
+		*snr = encoder.getSnr();
+
+	return encoder.getNSamples();
+}
+
+bool Sample::canReduce(void)
+{
+	return (sound_data != 0) && (stream == 0) && (sound_format != SOUND_FORMAT_ADPCM) && (n_samples > 0);
+}
+
+// The noise of the reductions adds up
+void Sample::addReduction(u8 reduction, s16 snr)
+{
+	if(reductions == 0) {
+		reduction_snr = snr;
+	} else {
+		float noise = powf(10.0f, -reduction_snr / 100.0f) + powf(10.0f, -snr / 100.0f);
+		reduction_snr = (s16)(-100.0f * log10f(noise));
+	}
+	reductions |= reduction;
+}
+
 int fncompare (const void *elem1, const void *elem2 )
 {
 	if ( *(u16*)elem1 < *(u16*)elem2) return -1;
@@ -828,6 +1570,13 @@ u16 Sample::findClosestFreq(u32 freq)
 	bool found = false;
 
 	u16 left = 0, right = LINEAR_FREQ_TABLE_SIZE-1, middle = (right-left)/2 + left;
+
+	// The search would not end for rates outside of the table
+	if(freq <= linear_freq_table_lookup(left))
+		return left;
+	if(freq >= linear_freq_table_lookup(right))
+		return right;
+
 	if ( (linear_freq_table_lookup(middle) <= freq) && (linear_freq_table_lookup(middle+1) >= freq) ) {
 		found = true;
 	} else
@@ -850,176 +1599,317 @@ u16 Sample::findClosestFreq(u32 freq)
 	return middle;
 }
 
-bool Sample::convertStereoToMono(void)
+void Sample::fade(u32 startsample, u32 endsample, bool in)
+{
+	u32 nsamples = getNSamples();
+
+	if(endsample >= nsamples)
+		endsample = nsamples-1;
+	if( (nsamples == 0) || (startsample > endsample) )
+		return;
+
+	u8 bps = is_16_bit ? 2 : 1;
+	ntxm_fade((u8*)getData() + startsample * bps, endsample - startsample + 1, is_16_bit, in);
+
+	updatePeaks(startsample, endsample + 1);
+
+	if( loop == PING_PONG_LOOP )
+		updatePingPongLoop(startsample, endsample + 1);
+}
+
+// Appends the reversed loop to the data, so the hardware can play it as a
+// forward loop: [before the loop][loop][reversed loop]. A ping pong loop
+// never gets past its end, so whatever follows it is dropped.
+void Sample::setupPingPongLoop(void)
 {
-	void *_tmpbuf = malloc(size);
-	if(!_tmpbuf)
+	if( (sound_data == 0) || (pingpong_built) ) // Lazy sample, the loop is set up in attachData()
+		return;
+
+	// Loops past the end are fixed by Song::validate(), until then the copy
+	// must not read past the data
+	if(loop_start + loop_length > size)
 	{
-		my_dprintf("not enough ram for stereo 2 mono conversion\n");
-		return false;
+		if(loop_start >= size)
+			loop_start = 0;
+		loop_length = size - loop_start;
+	}
+
+	if(loop_length == 0)
+		return;
+
+	u32 loop_end = loop_start + loop_length;
+	void *data;
+	if(external_data)
+	{
+		// The data belongs to someone else, so make a copy that can be resized
+		data = malloc(loop_end + loop_length);
+		if(data != 0)
+			memcpy(data, sound_data, loop_end);
+	}
+	else
+	{
+		data = realloc(sound_data, loop_end + loop_length);
 	}
 
-	if(is_16_bit == true)
+	if(data == 0)
 	{
-		// Make a buffer for the converted sample
-		s16 *tmpbuf = (s16*)_tmpbuf;
-		s16 *src = (s16*)sound_data;
-
-		// Convert the sample down
-		s32 smp;
-		for(u32 i=0; i<size/2; ++i) {
-			smp = src[2*i] + src[2*i+1];
-			tmpbuf[i] = smp / 2;
-		}
+		// Playing it as ping pong loop would read past the data
+		my_dprintf("memfull on line %d\n", __LINE__);
+		loop = FORWARD_LOOP;
+		DC_FlushRange(this, sizeof(Sample));
+		return;
+	}
+
+	if(external_data)
+		dropData(sound_data); // The copy is the sample's own now
+	sound_data = data;
+	external_data = false;
+
+	if(is_16_bit)
+		n_samples = loop_end / 2;
+	else
+		n_samples = loop_end;
+
+	calcSize();
+
+	updatePeaks(n_samples, n_samples); // The last buckets lose what came after the loop
+
+	pingpong_built = true;
+	updatePingPongLoop(0, n_samples); // Flushes the reversed loop
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+}
+
+// Drops the reversed loop
+void Sample::removePingPongLoop(void)
+{
+	if(!pingpong_built)
+		return;
+
+	pingpong_built = false;
 
-		// Overwrite the original with the converted sample
-		memcpy(sound_data, tmpbuf, size);
+	if(!external_data)
+	{
+		void *shrunk = realloc(sound_data, size);
+		if(shrunk != 0)
+			sound_data = shrunk;
+	}
+
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
+}
+
+// Copies the edited part of the loop into the reversed loop. The reversed
+// loop starts with the last sample again, which the hardware turns around
+// on, and ends before the first one, which the loop starts with anyway.
+void Sample::updatePingPongLoop(u32 startsample, u32 endsample)
+{
+	if(!pingpong_built)
+	{
+		setupPingPongLoop();
+		return;
+	}
+
+	u32 first = (is_16_bit ? loop_start / 2 : loop_start) + 1;
+	u32 end = n_samples;
+
+	if(endsample >= end)
+		endsample = end;
+	if(startsample < first)
+		startsample = first;
 
-		// Delete the temporary buffer
-		free(tmpbuf);
+	// reversed[i] is data[end - i], that is data[2 * end - i]
+	if(is_16_bit)
+	{
+		s16 *data = (s16*)sound_data;
+		if(endsample == end)
+			data[end] = data[end - 1];
+		for(u32 i=startsample; i<endsample; ++i)
+			data[2 * end - i] = data[i];
 	}
 	else
 	{
-		// Make a buffer for the converted sample
-		s8 *tmpbuf = (s8*)_tmpbuf;
-		s8 *src = (s8*)sound_data;
-
-		// Convert the sample down
-		s32 smp;
-		for(u32 i=0; i<size; ++i) {
-			smp = src[2*i] + src[2*i+1];
-			tmpbuf[i] = smp / 2;
-		}
+		s8 *data = (s8*)sound_data;
+		if(endsample == end)
+			data[end] = data[end - 1];
+		for(u32 i=startsample; i<endsample; ++i)
+			data[2 * end - i] = data[i];
+	}
 
-		// Overwrite the original with the converted sample
-		memcpy(sound_data, tmpbuf, size);
+	DC_FlushRange((u8*)sound_data + size, loop_length);
+}
 
-		// Delete the temporary buffer
-		free(tmpbuf);
+// Fits the buckets to n_samples. Frees them if there is not enough memory.
+bool Sample::resizePeaks(void)
+{
+	for(u8 level=0; level<SAMPLE_PEAK_LEVELS; ++level)
+	{
+		u32 n_buckets = (n_samples >> SAMPLE_PEAK_SHIFT(level)) + 1;
+		SamplePeak *resized = (SamplePeak*)realloc(peaks[level], n_buckets * sizeof(SamplePeak));
+		if(resized == 0)
+		{
+			my_dprintf("memfull on line %d\n", __LINE__);
+			freePeaks();
+			return false;
+		}
+		peaks[level] = resized;
 	}
 	return true;
 }
 
-void Sample::fade(u32 startsample, u32 endsample, bool in)
+// Recalculates the buckets over the samples, each level from the one below
+void Sample::updatePeaks(u32 startsample, u32 endsample)
 {
-	void *data = getData();
-	u32 nsamples = getNSamples();
+	if( (!hasPeaks()) || (!resizePeaks()) )
+		return;
 
-	if(endsample >= nsamples)
-		endsample = nsamples-1;
+	if(n_samples == 0)
+		return;
+
+	// Past the end, the last bucket may still hold cut off samples
+	if(endsample > n_samples)
+		endsample = n_samples;
+	if(startsample >= endsample)
+		startsample = endsample - 1;
 
-	s32 offset = startsample;
-	s32 length = endsample - startsample + 1;
+	u32 first = startsample >> SAMPLE_PEAK_SHIFT(0);
+	u32 last = (endsample - 1) >> SAMPLE_PEAK_SHIFT(0);
 
-	if(is_16_bit == true)
+	for(u32 b=first; b<=last; ++b)
 	{
-		s16 *sounddata = (s16*)(data);
+		u32 i = b << SAMPLE_PEAK_SHIFT(0);
+		u32 end = i + (1 << SAMPLE_PEAK_SHIFT(0));
+		if(end > n_samples)
+			end = n_samples;
 
-		if(in==true) {
-			for(s32 i=0;i<length;++i) {
-				sounddata[offset+i] = (((i * 1024) / length) * sounddata[offset+i]) / 1024;
-			}
-		} else {
-			for(s32 i=0;i<length;++i) {
-				sounddata[offset+i] = ((((length-i) * 1024) / length) * sounddata[offset+i]) / 1024;
-			}
+		s32 lo = 32767, hi = -32768;
+		for(; i<end; ++i)
+		{
+			s32 value = is_16_bit ? ((s16*)sound_data)[i] : ((s8*)sound_data)[i];
+			lo = (value < lo) ? value : lo;
+			hi = MAX(value, hi);
 		}
+		peaks[0][b].min = lo;
+		peaks[0][b].max = hi;
 	}
-	else
+
+	for(u8 level=1; level<SAMPLE_PEAK_LEVELS; ++level)
 	{
-		s8 *sounddata = (s8*)(data);
+		u32 ratio = SAMPLE_PEAK_SHIFT(level) - SAMPLE_PEAK_SHIFT(level-1);
+		u32 n_below = ((n_samples - 1) >> SAMPLE_PEAK_SHIFT(level-1)) + 1;
+		first >>= ratio;
+		last >>= ratio;
 
-		if(in==true) {
-			for(s32 i=0;i<length;++i) {
-				sounddata[offset+i] = i * sounddata[offset+i] / length;
-			}
-		} else {
-			for(s32 i=0;i<length;++i) {
-				sounddata[offset+i] = (length-i) * sounddata[offset+i] / length;
+		for(u32 b=first; b<=last; ++b)
+		{
+			u32 k = b << ratio;
+			u32 end = k + (1 << ratio);
+			if(end > n_below)
+				end = n_below;
+
+			s16 lo = 32767, hi = -32768;
+			for(; k<end; ++k)
+			{
+				lo = (peaks[level-1][k].min < lo) ? peaks[level-1][k].min : lo;
+				hi = MAX(peaks[level-1][k].max, hi);
 			}
+			peaks[level][b].min = lo;
+			peaks[level][b].max = hi;
 		}
 	}
-
-	// Now everything's clear and we set the variables right
-	calcSize();
-
-	if( loop == PING_PONG_LOOP )
-		updatePingPongLoop();
 }
 
-void Sample::setupPingPongLoop(void)
+bool Sample::isSilent(u32 sample, u16 threshold)
 {
-	original_data = sound_data; // "Backup"
-	original_n_samples = n_samples;
-
-	u32 original_size = size;
+	s32 value = is_16_bit ? ((s16*)sound_data)[sample] : ((s8*)sound_data)[sample] * 256;
+	return (value <= threshold) && (value >= -threshold);
+}
 
-	pingpong_data = realloc(pingpong_data, original_size + loop_length);
+void Sample::crop(u32 firstsample, u32 endsample)
+{
+	freeMips();
 
-	// Copy sound data until loop end
-	memcpy(pingpong_data, original_data, loop_start + loop_length);
+	u8 bps = is_16_bit ? 2 : 1;
+	u32 bytes = (endsample - firstsample) * bps;
+	u8 *src = (u8*)sound_data + firstsample * bps;
 
-	// Copy reverse loop
-	if(is_16_bit)
+	if(external_data)
 	{
-		s16 *orig = (s16*)original_data;
-		s16 *pp = (s16*)pingpong_data;
-		u32 pos = (loop_start + loop_length) / 2;
-
-		for(u32 i=0; i<loop_length/2; ++i)
-			pp[pos+i] = orig[pos-i];
+		// Not ours to resize, but a part of it will do
+		sound_data = src;
 	}
 	else
 	{
-		s8 *orig = (s8*)original_data;
-		s8 *pp = (s8*)pingpong_data;
-		u32 pos = loop_start + loop_length;
-
-		for(u32 i=0; i<loop_length; ++i)
-			pp[pos+i] = orig[pos-i];
+		memmove(sound_data, src, bytes);
+		void *resized = realloc(sound_data, bytes);
+		if(resized != 0)
+			sound_data = resized;
 	}
 
-	// Copy rest
-	u32 pos = loop_start + loop_length;
-
-	memcpy((u8*)pingpong_data+ pos + loop_length, (u8*)original_data + pos, original_size - pos);
+	n_samples = endsample - firstsample;
+	calcSize();
 
-	// Set as new sound data
-	sound_data = pingpong_data;
+	// Only samples without a loop lose their beginning
+	loop_start = (loop_start > firstsample * bps) ? loop_start - firstsample * bps : 0;
+	if(loop_start > size)
+		loop_start = size;
+	if(loop_start + loop_length > size)
+		loop_length = size - loop_start;
 
-	if(is_16_bit)
-		n_samples = (original_size + loop_length) / 2;
+	if(firstsample > 0)
+		updatePeaks(0, n_samples);
 	else
-		n_samples = original_size + loop_length;
+		updatePeaks(n_samples, n_samples);
 
-	calcSize();
+	DC_FlushRange(sound_data, size);
+	DC_FlushRange(this, sizeof(Sample));
 
-	DC_FlushAll();
+	updateNotes();
 }
 
-void Sample::removePingPongLoop(void)
+// The instrument's note table holds the length, loop and pitch of the sample
+void Sample::updateNotes(void)
 {
-	free(pingpong_data);
-	pingpong_data = 0;
-
-	sound_data = original_data;
-	n_samples = original_n_samples;
-
-	if(is_16_bit)
-		size = n_samples*2;
-	else
-		size = n_samples;
+	if(instrument != 0)
+		instrument->updateNoteTable();
+}
 
-	calcSize();
+// Frees the data, or lets go of it if it isn't the sample's own
+void Sample::dropData(void *data)
+{
+	if(pool_data != 0)
+		SamplePool::release(pool_data);
+	else if(!external_data)
+		free(data);
 
-	DC_FlushAll();
+	pool_data = 0;
+	external_data = false;
 }
 
-void Sample::updatePingPongLoop(void)
+// Shared data is copied before it is changed
+bool Sample::ownData(void)
 {
-	if(pingpong_data != 0)
-		removePingPongLoop();
-	setupPingPongLoop();
+	if(pool_data == 0)
+		return true;
+
+	u32 bytes = getMemorySize();
+	void *data = malloc(bytes);
+	if(data == 0)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return false;
+	}
+
+	memcpy(data, sound_data, bytes);
+	DC_FlushRange(data, bytes);
+
+	void *shared = sound_data;
+	sound_data = data;
+	DC_FlushRange(this, sizeof(Sample));
+
+	dropData(shared);
+	return true;
 }
 
 #endif
@@ -32,6 +32,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 
 #ifdef ARM7
 #include "ntxm/demokit.h"
@@ -50,6 +52,48 @@ the second and third dimensions are only
 allocated as far as needed.
 */
 
+#ifdef ARM9
+
+typedef struct {
+	Sample *sample;
+	s16 snr;
+} CompressionCandidate;
+
+// Best signal to noise ratio first
+static int compareCandidates(const void *a, const void *b)
+{
+	s16 sa = ((const CompressionCandidate*)a)->snr;
+	s16 sb = ((const CompressionCandidate*)b)->snr;
+	return (sb > sa) - (sb < sa);
+}
+
+// The DS mixes at 32768 Hz, so nothing above this is heard
+#define OUTPUT_NYQUIST		16384
+
+typedef struct {
+	Sample *sample;
+	u8 instrument;
+	u8 reduction;	// SAMPLE_REDUCED_*
+	bool inaudible;	// Halving the rate removes only what isn't heard
+	s16 snr;
+	float score;	// Bytes saved per noise
+} ReductionCandidate;
+
+static void scoreReduction(ReductionCandidate *c)
+{
+	Sample *sample = c->sample;
+	
+	if(c->reduction == SAMPLE_REDUCED_8BIT)
+		c->snr = sample->measureReduceTo8Bit();
+	else
+		c->snr = c->inaudible ? NTXM_SNR_MAX : sample->measureHalveRate();
+	
+	// The noise power relative to the signal is 10^(-snr/10 dB)
+	c->score = (float)(sample->getSize() / 2) * powf(10.0f, c->snr / 100.0f);
+}
+
+#endif
+
 /* ===================== PUBLIC ===================== */
 
 // Everything that changes the song is only possible on arm9.
@@ -58,13 +102,19 @@ allocated as far as needed.
 #ifdef ARM9
 
 Song::Song(u8 _speed, u8 _bpm, u8 _channels)
-	:speed(_speed), bpm(_bpm), n_channels(_channels), restart_position(0), n_patterns(0)
+	:speed(_speed), bpm(_bpm), n_channels(_channels), restart_position(0), n_instruments(0),
+	playable(false), n_patterns(0), stats_dirty(true)
 {
+	channel_capacity = n_channels;
+	
 	// Init arrays
 	patternlengths = (u16*)malloc(sizeof(u16)*MAX_PATTERNS);
 	internal_patternlengths = (u16*)malloc(sizeof(u16)*MAX_PATTERNS);
+	pattern_versions = (u32*)calloc(MAX_PATTERNS, sizeof(u32));
 	pattern_order_table = (u8*)malloc(sizeof(u8)*MAX_POT_LENGTH);
 	instruments = (Instrument**)calloc(1, sizeof(Instrument*)*MAX_INSTRUMENTS);
+	play_instruments = (Instrument**)malloc(sizeof(Instrument*)*PLAY_INSTRUMENTS);
+	empty_instrument = new Instrument("");
 	name = (char*)malloc(MAX_SONG_NAME_LENGTH+1);
 	memset(name, 0, MAX_SONG_NAME_LENGTH+1);
 	strncpy(name, "unnamed", MAX_SONG_NAME_LENGTH);
@@ -82,6 +132,10 @@ Song::Song(u8 _speed, u8 _bpm, u8 _channels)
 		instruments[i] = NULL;
 	}
 	
+	for(u16 i=0; i<PLAY_INSTRUMENTS; ++i) {
+		play_instruments[i] = empty_instrument;
+	}
+	
 	n_patterns = 0;
 	potsize = 0;
 
@@ -104,10 +158,14 @@ Song::~Song()
 	
 	killPatterns();
 	
+	delete empty_instrument;
+	
 	// Delete arrays
 	free(patternlengths);
 	free(internal_patternlengths);
+	free(pattern_versions);
 	free(pattern_order_table);
+	free(play_instruments);
 	free(name);
 }
 
@@ -154,20 +212,27 @@ Instrument *Song::getInstrument(u8 instidx) {
 
 u8 Song::getInstruments(void)
 {
-	// Return highest instrument index+1
-	u8 n_inst = 0;
-	for(u8 i=0; i<MAX_INSTRUMENTS; ++i) {
-		if( instruments[i] != 0 ) {
-			n_inst = i+1;
-		}
-	}
-	return n_inst;
+	return n_instruments;
 }
 
 #ifdef ARM9
 
 void Song::setInstrument(u8 idx, Instrument *instrument) {
+	if(instrument != NULL)
+		instrument->validate();
+	
 	instruments[idx] = instrument;
+	play_instruments[idx] = (instrument != NULL) ? instrument : empty_instrument;
+	
+	// Keep the highest instrument index+1 up to date
+	if( (instrument != NULL) && (idx >= n_instruments) ) {
+		n_instruments = idx+1;
+	} else if( (instrument == NULL) && (idx+1 == n_instruments) ) {
+		while( (n_instruments > 0) && (instruments[n_instruments-1] == NULL) )
+			n_instruments--;
+	}
+	
+	stats_dirty = true;
 	DC_FlushAll();
 }
 
@@ -219,64 +284,97 @@ void Song::setPotEntry(u8 idx, u8 value) {
 	DC_FlushAll();
 }
 
-void Song::addPattern(u16 length)
+bool Song::addPattern(u16 length)
 {
+	Cell **ptn = reallocPattern(NULL, 0, 0, channel_capacity, length);
+	if(ptn == NULL)
+		return false;
+	
 	patternlengths[n_patterns] = length;
 	internal_patternlengths[n_patterns] = length;
 
 	n_patterns++;
 	
-	patterns[n_patterns-1] = (Cell**)malloc(sizeof(Cell*)*n_channels);
+	patterns[n_patterns-1] = ptn;
+	
+	pattern_versions[n_patterns-1]++;
+	stats_dirty = true;
+	DC_FlushAll();
+	
+	return true;
+}
+
+bool Song::channelAdd(void) {
+	
+	if(n_channels==MAX_CHANNELS) return true;
 	
-	u16 i,j;
-	for(i=0;i<n_channels;++i)
+	// Only reallocate if the patterns have no room for another channel. Songs
+	// are loaded without spare columns, so only editing pays for them.
+	if(n_channels == channel_capacity)
 	{
-		patterns[n_patterns-1][i] = (Cell*)malloc(sizeof(Cell)*patternlengths[n_patterns-1]);
+		u8 new_capacity = my_clamp(n_channels + 1 + CHANNEL_ADD_SPARE, 1, MAX_CHANNELS);
+		
+		// All patterns have the same capacity, so either all of them grow or none
+		Cell ***grown = (Cell***)malloc(sizeof(Cell**)*n_patterns);
+		if(grown == NULL)
+		{
+			my_dprintf("memfull on line %d\n", __LINE__);
+			return false;
+		}
 		
-		Cell *cell;
-		for(j=0;j<patternlengths[n_patterns-1];++j)
+		for(u16 pattern=0;pattern<n_patterns;++pattern)
 		{
-			cell = &patterns[n_patterns-1][i][j];
-			clearCell(cell);
+			grown[pattern] = reallocPattern(patterns[pattern], channel_capacity,
+				internal_patternlengths[pattern], new_capacity, internal_patternlengths[pattern]);
+			
+			if(grown[pattern] == NULL)
+			{
+				while(pattern > 0)
+					free(grown[--pattern]);
+				free(grown);
+				return false;
+			}
+		}
+		
+		for(u16 pattern=0;pattern<n_patterns;++pattern)
+		{
+			free(patterns[pattern]);
+			patterns[pattern] = grown[pattern];
 		}
+		free(grown);
+		
+		channel_capacity = new_capacity;
 	}
-	DC_FlushAll();
-}
-
-void Song::channelAdd(void) {
 	
-	if(n_channels==MAX_CHANNELS) return;
-	
-	// Go through all patterns and add a channel
+	// The spare column may contain a channel that was deleted before
 	for(u8 pattern=0;pattern<n_patterns;++pattern) {
-		patterns[pattern] = (Cell**)realloc(patterns[pattern], sizeof(Cell*)*(n_channels+1));
-		patterns[pattern][n_channels] = (Cell*)malloc(sizeof(Cell)*internal_patternlengths[pattern]);
-
-		// Clear
-		Cell *cell;
-		for(u16 j=0;j<internal_patternlengths[pattern];++j) {
-			cell = &patterns[pattern][n_channels][j];
-			clearCell(cell);
-		}
+		Cell *cell = patterns[pattern][n_channels];
+		for(u16 j=0;j<internal_patternlengths[pattern];++j)
+			clearCell(&cell[j]);
 	}
 
 	n_channels++;
 	
+	for(u8 pattern=0;pattern<n_patterns;++pattern)
+		pattern_versions[pattern]++;
+	
+	stats_dirty = true;
 	DC_FlushAll();
+	
+	return true;
 }
 
 void Song::channelDel(void) {
 	
 	if(n_channels==1) return;
 	
-	// Go through all patterns and delete the last channel
-	for(u8 pattern=0;pattern<n_patterns;++pattern) {
-		free(patterns[pattern][n_channels-1]);
-		patterns[pattern] = (Cell**)realloc(patterns[pattern], sizeof(Cell*)*(n_channels-1));
-	}
-	
+	// The last column stays allocated as spare capacity
 	n_channels--;
 	
+	for(u8 pattern=0;pattern<n_patterns;++pattern)
+		pattern_versions[pattern]++;
+	
+	stats_dirty = true;
 	DC_FlushAll();
 }
 
@@ -288,7 +386,7 @@ u8 Song::getNumPatterns(void) {
 
 #ifdef ARM9
 
-void Song::resizePattern(u8 ptn, u16 newlength)
+bool Song::resizePattern(u8 ptn, u16 newlength)
 {
 	// If the pattern is shortened or if the pattern is enlarged,
 	// but stays below or equal to the internal length
@@ -299,23 +397,24 @@ void Song::resizePattern(u8 ptn, u16 newlength)
 	
 	} else { // If the pattern is enlarged beyond the internal length
 	
-		// Go through all channels of this pattern and resize them
-		for(u8 channel=0; channel<n_channels; ++channel) {
-			patterns[ptn][channel] = (Cell*)realloc(patterns[ptn][channel], sizeof(Cell)*newlength);
-			
-			// The new cells must be cleared
-			Cell *cell;
-			for(u16 i=internal_patternlengths[ptn]; i<newlength;++i) {
-				cell = &patterns[ptn][channel][i];
-				clearCell(cell);
-			}
-		}
+		// All channels are in one block, so this is a single reallocation
+		Cell **resized = reallocPattern(patterns[ptn], channel_capacity, internal_patternlengths[ptn],
+			channel_capacity, newlength);
+		if(resized == NULL)
+			return false;
 		
+		free(patterns[ptn]);
+		patterns[ptn] = resized;
 		patternlengths[ptn] = newlength;
 		internal_patternlengths[ptn] = newlength;
 	}
 	
+	pattern_versions[ptn]++;
+	stats_dirty = true;
+	
 	DC_FlushAll();
+	
+	return true;
 }
 
 // The most important function
@@ -376,13 +475,19 @@ void Song::zapPatterns(void) {
 	
 	killPatterns();
 	n_channels = DEFAULT_CHANNELS;
+	channel_capacity = n_channels;
 	n_patterns = 0;
 	
+	// Versions keep counting, so nothing mistakes a new pattern for an old one
+	for(u16 i=0; i<MAX_PATTERNS; ++i)
+		pattern_versions[i]++;
+	
 	patterns = (Cell***)malloc(sizeof(Cell**)*MAX_PATTERNS);
 	
 	addPattern();
 	
 	restart_position = 0;
+	stats_dirty = true;
 	DC_FlushAll();
 }
 
@@ -394,7 +499,13 @@ void Song::zapInstruments(void)
 	for(u16 i=0; i<MAX_INSTRUMENTS; ++i) {
 		instruments[i] = NULL;
 	}
+	n_instruments = 0;
 	
+	for(u16 i=0; i<PLAY_INSTRUMENTS; ++i) {
+		play_instruments[i] = empty_instrument;
+	}
+	
+	stats_dirty = true;
 	DC_FlushAll();
 }
 
@@ -409,6 +520,202 @@ void Song::clearCell(Cell *cell)
 	cell->effect2_param = NO_EFFECT_PARAM;
 }
 
+void Song::setCell(u8 ptn, u8 chn, u16 row, const Cell *cell)
+{
+	setRowRange(ptn, chn, row, 1, cell);
+}
+
+void Song::setRowRange(u8 ptn, u8 chn, u16 row, u16 n_rows, const Cell *cells)
+{
+	if( (ptn >= n_patterns) || (chn >= n_channels) || (row >= internal_patternlengths[ptn]) )
+		return;
+	
+	if(row + n_rows > internal_patternlengths[ptn])
+		n_rows = internal_patternlengths[ptn] - row;
+	
+	memcpy(&patterns[ptn][chn][row], cells, sizeof(Cell)*n_rows);
+	
+	publishCells(ptn, chn, row, 1, n_rows);
+}
+
+void Song::clearRowRange(u8 ptn, u8 chn, u16 row, u16 n_rows)
+{
+	if( (ptn >= n_patterns) || (chn >= n_channels) || (row >= internal_patternlengths[ptn]) )
+		return;
+	
+	if(row + n_rows > internal_patternlengths[ptn])
+		n_rows = internal_patternlengths[ptn] - row;
+	
+	for(u16 i=row; i<row+n_rows; ++i)
+		clearCell(&patterns[ptn][chn][i]);
+	
+	publishCells(ptn, chn, row, 1, n_rows);
+}
+
+void Song::setRow(u8 ptn, u16 row, const Cell *cells)
+{
+	if( (ptn >= n_patterns) || (row >= internal_patternlengths[ptn]) )
+		return;
+	
+	for(u8 chn=0; chn<n_channels; ++chn)
+		patterns[ptn][chn][row] = cells[chn];
+	
+	publishCells(ptn, 0, row, n_channels, 1);
+}
+
+void Song::getBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, Cell *cells)
+{
+	u16 stride = n_rows;
+	if(!clipBlock(ptn, chn, row, &n_chn, &n_rows))
+		return;
+	
+	for(u8 c=0; c<n_chn; ++c)
+		memcpy(&cells[c*stride], &patterns[ptn][chn+c][row], sizeof(Cell)*n_rows);
+}
+
+void Song::setBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, const Cell *cells)
+{
+	u16 stride = n_rows;
+	if(!clipBlock(ptn, chn, row, &n_chn, &n_rows))
+		return;
+	
+	for(u8 c=0; c<n_chn; ++c)
+		memcpy(&patterns[ptn][chn+c][row], &cells[c*stride], sizeof(Cell)*n_rows);
+	
+	publishCells(ptn, chn, row, n_chn, n_rows);
+}
+
+void Song::copyBlock(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+                     u8 dst_ptn, u8 dst_chn, u16 dst_row)
+{
+	if( !clipBlock(src_ptn, src_chn, src_row, &n_chn, &n_rows) ||
+	    !clipBlock(dst_ptn, dst_chn, dst_row, &n_chn, &n_rows) )
+		return;
+	
+	copyCells(src_ptn, src_chn, src_row, n_chn, n_rows, dst_ptn, dst_chn, dst_row);
+	
+	publishCells(dst_ptn, dst_chn, dst_row, n_chn, n_rows);
+}
+
+void Song::moveBlock(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+                     u8 dst_ptn, u8 dst_chn, u16 dst_row)
+{
+	if( !clipBlock(src_ptn, src_chn, src_row, &n_chn, &n_rows) ||
+	    !clipBlock(dst_ptn, dst_chn, dst_row, &n_chn, &n_rows) )
+		return;
+	
+	copyCells(src_ptn, src_chn, src_row, n_chn, n_rows, dst_ptn, dst_chn, dst_row);
+	
+	// Clear the source cells that were not overwritten by the copy
+	Cell empty;
+	clearCell(&empty);
+	
+	u16 src_end = src_row + n_rows;
+	u16 dst_end = dst_row + n_rows;
+	
+	for(u8 c=src_chn; c<src_chn+n_chn; ++c)
+	{
+		Cell *col = patterns[src_ptn][c];
+		
+		if( (src_ptn != dst_ptn) || (c < dst_chn) || (c >= dst_chn+n_chn) ) {
+			for(u16 r=src_row; r<src_end; ++r)
+				col[r] = empty;
+		} else {
+			for(u16 r=src_row; (r<src_end) && (r<dst_row); ++r)
+				col[r] = empty;
+			for(u16 r=(dst_end > src_row) ? dst_end : src_row; r<src_end; ++r)
+				col[r] = empty;
+		}
+	}
+	
+	if(src_ptn != dst_ptn) {
+		publishCells(src_ptn, src_chn, src_row, n_chn, n_rows);
+		publishCells(dst_ptn, dst_chn, dst_row, n_chn, n_rows);
+	} else {
+		// Publish the bounding box of both blocks in one go
+		u8 chn = (src_chn < dst_chn) ? src_chn : dst_chn;
+		u16 row = (src_row < dst_row) ? src_row : dst_row;
+		u8 chn_end = ((src_chn > dst_chn) ? src_chn : dst_chn) + n_chn;
+		u16 row_end = ((src_end > dst_end) ? src_end : dst_end);
+		publishCells(src_ptn, chn, row, chn_end - chn, row_end - row);
+	}
+}
+
+void Song::clearBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows)
+{
+	Cell empty;
+	clearCell(&empty);
+	fillBlock(ptn, chn, row, n_chn, n_rows, &empty);
+}
+
+void Song::fillBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, const Cell *cell)
+{
+	if(!clipBlock(ptn, chn, row, &n_chn, &n_rows))
+		return;
+	
+	Cell fill = *cell;
+	for(u8 c=chn; c<chn+n_chn; ++c)
+	{
+		Cell *col = &patterns[ptn][c][row];
+		for(u16 r=0; r<n_rows; ++r)
+			col[r] = fill;
+	}
+	
+	publishCells(ptn, chn, row, n_chn, n_rows);
+}
+
+void Song::transposeBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, s8 semitones)
+{
+	if(!clipBlock(ptn, chn, row, &n_chn, &n_rows))
+		return;
+	
+	for(u8 c=chn; c<chn+n_chn; ++c)
+	{
+		Cell *col = &patterns[ptn][c][row];
+		for(u16 r=0; r<n_rows; ++r)
+		{
+			// This also skips EMPTY_NOTE and STOP_NOTE
+			if(col[r].note > MAX_NOTE)
+				continue;
+			
+			s16 note = col[r].note + semitones;
+			if( (note >= 0) && (note <= MAX_NOTE) )
+				col[r].note = note;
+		}
+	}
+	
+	publishCells(ptn, chn, row, n_chn, n_rows);
+}
+
+void Song::scaleBlockVolume(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, u16 factor)
+{
+	if(!clipBlock(ptn, chn, row, &n_chn, &n_rows))
+		return;
+	
+	for(u8 c=chn; c<chn+n_chn; ++c)
+	{
+		Cell *col = &patterns[ptn][c][row];
+		for(u16 r=0; r<n_rows; ++r)
+		{
+			if(col[r].volume == NO_VOLUME)
+				continue;
+			
+			u32 volume = (col[r].volume * factor + 128) >> 8;
+			col[r].volume = (volume > MAX_VOLUME) ? MAX_VOLUME : volume;
+		}
+	}
+	
+	publishCells(ptn, chn, row, n_chn, n_rows);
+}
+
+void Song::patternChanged(u8 ptn)
+{
+	if(ptn >= n_patterns)
+		return;
+	
+	publishCells(ptn, 0, 0, n_channels, internal_patternlengths[ptn]);
+}
+
 void Song::setChannelMute(u8 chn, bool muted)
 {
 	if(chn >= n_channels)
@@ -418,6 +725,367 @@ void Song::setChannelMute(u8 chn, bool muted)
 	DC_FlushAll();
 }
 
+u16 Song::getSampleCount(void)
+{
+	if(stats_dirty)
+		updateStats();
+	
+	return n_used_samples;
+}
+
+u16 Song::getUsedChannels(void)
+{
+	if(stats_dirty)
+		updateStats();
+	
+	return used_channels;
+}
+
+bool Song::effectUsed(u8 effect)
+{
+	if(stats_dirty)
+		updateStats();
+	
+	return used_effects[effect / 32] & BIT(effect % 32);
+}
+
+void Song::invalidateStats(void)
+{
+	stats_dirty = true;
+}
+
+u32 Song::validate(void)
+{
+	u32 fixes = 0;
+	
+	// There is always at least one pattern and one order table entry
+	for(u16 i=0; i<potsize; ++i)
+	{
+		if(pattern_order_table[i] >= n_patterns) {
+			pattern_order_table[i] = 0;
+			fixes++;
+		}
+	}
+	
+	if(restart_position >= potsize) {
+		restart_position = 0;
+		fixes++;
+	}
+	
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		if(patternlengths[ptn] == 0) {
+			resizePattern(ptn, 1);
+			fixes++;
+		}
+		
+		// Hidden rows too, they come back when the pattern is made longer
+		fixes += validateCells(ptn, 0, 0, n_channels, internal_patternlengths[ptn]);
+	}
+	
+	for(u16 i=0; i<PLAY_INSTRUMENTS; ++i)
+	{
+		if( (i < MAX_INSTRUMENTS) && (instruments[i] != NULL) ) {
+			fixes += instruments[i]->validate();
+			play_instruments[i] = instruments[i];
+		} else {
+			play_instruments[i] = empty_instrument;
+		}
+	}
+	
+	if(fixes > 0)
+		my_dprintf("Song validated, %u fixes\n", (unsigned)fixes);
+	
+	playable = true;
+	stats_dirty = true;
+	DC_FlushAll();
+	
+	return fixes;
+}
+
+u32 Song::getSampleMemory(void)
+{
+	u32 bytes = 0;
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u8 smp=0; smp<instruments[inst]->getSamples(); ++smp)
+		{
+			Sample *sample = instruments[inst]->getSample(smp);
+			if(sample != NULL)
+				bytes += sample->getMemorySize();
+		}
+	}
+	return bytes;
+}
+
+u32 Song::compressSamples(u32 budget, s16 min_snr)
+{
+	u32 bytes = getSampleMemory();
+	if( (budget != 0) && (bytes <= budget) )
+		return bytes;
+	
+	u16 n_candidates = 0;
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] != NULL)
+			n_candidates += instruments[inst]->getSamples();
+	}
+	
+	CompressionCandidate *candidates = (CompressionCandidate*)calloc(n_candidates, sizeof(CompressionCandidate));
+	if(candidates == NULL)
+		return bytes;
+	
+	// Measuring means encoding every sample once, which is only needed to
+	// choose between them
+	bool measure = (budget != 0) || (min_snr > 0);
+	
+	u16 n = 0;
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u8 smp=0; (smp<instruments[inst]->getSamples()) && (n<n_candidates); ++smp)
+		{
+			Sample *sample = instruments[inst]->getSample(smp);
+			if( (sample == NULL) || (sample->isCompressed()) )
+				continue;
+			
+			u32 compressed_size = 0;
+			s16 snr = NTXM_SNR_MAX;
+			if(measure)
+				snr = sample->measureCompression(&compressed_size);
+			
+			if( (measure) && ( (compressed_size >= sample->getSize()) || (snr < min_snr) ) )
+				continue;
+			
+			candidates[n].sample = sample;
+			candidates[n].snr = snr;
+			n++;
+		}
+	}
+	
+	qsort(candidates, n, sizeof(CompressionCandidate), compareCandidates);
+	
+	for(u16 i=0; i<n; ++i)
+	{
+		if( (budget != 0) && (bytes <= budget) )
+			break;
+		
+		Sample *sample = candidates[i].sample;
+		u32 old_size = sample->getMemorySize();
+		if(!sample->compress())
+			continue;
+		
+		bytes = bytes - old_size + sample->getMemorySize();
+	}
+	
+	free(candidates);
+	
+	DC_FlushAll();
+	
+	return bytes;
+}
+
+u32 Song::reduceSamples(u32 budget, s16 min_snr)
+{
+	u32 bytes = getSampleMemory();
+	if( (budget != 0) && (bytes <= budget) )
+		return bytes;
+	
+	u16 n_samples = 0;
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] != NULL)
+			n_samples += instruments[inst]->getSamples();
+	}
+	
+	u8 *lowest = (u8*)malloc(MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	u8 *highest = (u8*)malloc(MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	ReductionCandidate *candidates = (ReductionCandidate*)calloc(2 * n_samples + 1, sizeof(ReductionCandidate));
+	if( (lowest == NULL) || (highest == NULL) || (candidates == NULL) )
+	{
+		free(lowest);
+		free(highest);
+		free(candidates);
+		return bytes;
+	}
+	
+	findSampleNotes(lowest, highest);
+	
+	u16 n = 0;
+	
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u8 smp=0; (smp<instruments[inst]->getSamples()) && (smp<MAX_INSTRUMENT_SAMPLES); ++smp)
+		{
+			Sample *sample = instruments[inst]->getSample(smp);
+			if( (sample == NULL) || (sample->hasExternalData()) ) // Nothing to save
+				continue;
+			
+			// The timer can't go below 256 Hz
+			u16 idx = inst * MAX_INSTRUMENT_SAMPLES + smp;
+			bool used = (lowest[idx] <= highest[idx]);
+			bool inaudible = used && (sample->calcFrequency(highest[idx]) / 4 >= OUTPUT_NYQUIST);
+			bool too_slow = used && (sample->calcFrequency(lowest[idx]) / 2 <= 256);
+			
+			for(u8 r=0; r<2; ++r)
+			{
+				ReductionCandidate *c = &candidates[n];
+				c->sample = sample;
+				c->instrument = inst;
+				c->reduction = (r == 0) ? SAMPLE_REDUCED_8BIT : SAMPLE_REDUCED_RATE;
+				c->inaudible = inaudible;
+				
+				if( (c->reduction == SAMPLE_REDUCED_RATE) && too_slow )
+					continue;
+				
+				scoreReduction(c);
+				if( (c->snr > 0) && (c->snr >= min_snr) )
+					n++;
+			}
+		}
+	}
+	
+	// Greedily, the best one at a time. Reducing a sample changes what its
+	// other reduction would save, so that is scored again.
+	while( (n > 0) && ( (budget == 0) || (bytes > budget) ) )
+	{
+		u16 best = 0;
+		for(u16 i=1; i<n; ++i)
+		{
+			if(candidates[i].score > candidates[best].score)
+				best = i;
+		}
+		
+		ReductionCandidate c = candidates[best];
+		candidates[best] = candidates[--n];
+		
+		u32 old_size = c.sample->getMemorySize();
+		bool done = (c.reduction == SAMPLE_REDUCED_8BIT) ? c.sample->reduceTo8Bit() : c.sample->halveRate();
+		if(!done)
+			continue;
+		
+		bytes = bytes - old_size + c.sample->getMemorySize();
+		my_dprintf("reduced %u: %d.%d dB\n", c.instrument, c.snr / 10, c.snr % 10);
+		
+		for(u16 i=0; i<n; ++i)
+		{
+			if(candidates[i].sample != c.sample)
+				continue;
+			
+			scoreReduction(&candidates[i]);
+			if( (candidates[i].snr <= 0) || (candidates[i].snr < min_snr) )
+				candidates[i] = candidates[--n];
+			break;
+		}
+	}
+	
+	free(lowest);
+	free(highest);
+	free(candidates);
+	
+	DC_FlushAll();
+	
+	return bytes;
+}
+
+u32 Song::buildSampleMips(u8 levels, u32 *level_bytes)
+{
+	if(levels > SAMPLE_MIP_LEVELS)
+		levels = SAMPLE_MIP_LEVELS;
+	
+	if(level_bytes != NULL)
+		memset(level_bytes, 0, SAMPLE_MIP_LEVELS * sizeof(u32));
+	
+	u8 *lowest = (u8*)malloc(MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	u8 *highest = (u8*)malloc(MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	if( (lowest == NULL) || (highest == NULL) )
+	{
+		free(lowest);
+		free(highest);
+		return 0;
+	}
+	
+	findSampleNotes(lowest, highest);
+	
+	u32 bytes = 0;
+	
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u8 smp=0; (smp<instruments[inst]->getSamples()) && (smp<MAX_INSTRUMENT_SAMPLES); ++smp)
+		{
+			Sample *sample = instruments[inst]->getSample(smp);
+			if(sample == NULL)
+				continue;
+			
+			// Each level halves the rate until the timer can play it
+			u16 idx = inst * MAX_INSTRUMENT_SAMPLES + smp;
+			u8 needed = 0;
+			if(lowest[idx] <= highest[idx])
+			{
+				u32 freq = sample->calcFrequency(highest[idx]);
+				while( (needed < levels) && (freq > 0x1000000 / SAMPLE_MIP_MIN_PERIOD) )
+				{
+					freq >>= 1;
+					needed++;
+				}
+			}
+			
+			if(needed == 0)
+			{
+				sample->freeMips();
+				continue;
+			}
+			
+			u8 built = sample->buildMips(needed);
+			for(u8 level=1; level<=built; ++level)
+			{
+				u32 size = sample->getMipSize(level);
+				if(level_bytes != NULL)
+					level_bytes[level-1] += size;
+				bytes += size;
+			}
+		}
+	}
+	
+	free(lowest);
+	free(highest);
+	
+	return bytes;
+}
+
+u32 Song::trimSamples(u16 threshold, bool trim_start)
+{
+	u32 saved = 0;
+	
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u8 smp=0; smp<instruments[inst]->getSamples(); ++smp)
+		{
+			Sample *sample = instruments[inst]->getSample(smp);
+			if(sample != NULL)
+				saved += sample->trim(threshold, trim_start);
+		}
+	}
+	
+	DC_FlushAll();
+	
+	return saved;
+}
+
 #endif
 
 bool Song::channelMuted(u8 chn)
@@ -428,6 +1096,16 @@ bool Song::channelMuted(u8 chn)
 	return channels_muted[chn];
 }
 
+bool Song::isPlayable(void)
+{
+	return playable;
+}
+
+u32 Song::getPatternVersion(u8 ptn)
+{
+	return pattern_versions[ptn];
+}
+
 /* ===================== PRIVATE ===================== */
 
 #ifdef ARM9
@@ -436,19 +1114,112 @@ void Song::killPatterns(void) {
 	
 	for(u8 ptn=0; ptn<n_patterns; ++ptn) {
 		
-		for(u8 chn=0; chn<n_channels; ++chn) {
-			
-			free(patterns[ptn][chn]);
-		}
-		
 		free(patterns[ptn]);
 	}
 	free(patterns);
 }
 
+// Each pattern is a single block: a table of capacity channel pointers,
+// followed by the channels, each rows cells long. The table keeps
+// patterns[ptn][chn][row] working for the arm7. Existing cells are kept and
+// the new cells of the used channels are cleared. Spare channels are neither
+// kept nor cleared, channelAdd() clears them. The old block is left to the
+// caller, so it still has the pattern if there is not enough memory for the
+// new one. Then NULL is returned.
+Cell **Song::reallocPattern(Cell **ptn, u8 old_capacity, u16 old_rows, u8 capacity, u16 rows)
+{
+	u32 old_offset = sizeof(Cell*)*old_capacity;
+	u32 offset = sizeof(Cell*)*capacity;
+	
+	u8 *block = (u8*)malloc(offset + sizeof(Cell)*capacity*rows);
+	if(block == NULL)
+	{
+		my_dprintf("memfull on line %d\n", __LINE__);
+		return NULL;
+	}
+	
+	// Copy the columns straight to their new place. realloc() would copy the
+	// block once more before they could be moved.
+	if(ptn != NULL)
+	{
+		u8 *old_block = (u8*)ptn;
+		for(u8 chn=0; (chn<old_capacity) && (chn<n_channels); ++chn)
+			memcpy(block + offset + sizeof(Cell)*chn*rows, old_block + old_offset + sizeof(Cell)*chn*old_rows,
+				sizeof(Cell)*old_rows);
+	}
+	
+	Cell **columns = (Cell**)block;
+	for(u8 chn=0; chn<capacity; ++chn)
+	{
+		columns[chn] = (Cell*)(block + offset + sizeof(Cell)*chn*rows);
+		
+		if(chn >= n_channels)
+			continue;
+		
+		u16 first_new_row = (chn < old_capacity) ? old_rows : 0;
+		for(u16 row=first_new_row; row<rows; ++row)
+			clearCell(&columns[chn][row]);
+	}
+	
+	return columns;
+}
+
+void Song::publishCells(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows)
+{
+	validateCells(ptn, chn, row, n_chn, n_rows);
+	
+	// Channels lie back to back, so whole columns and single channels are one
+	// range. For anything else, flush the channels one by one instead of
+	// flushing everything between them.
+	if( (n_chn == 1) || (n_rows == internal_patternlengths[ptn]) ) {
+		DC_FlushRange(&patterns[ptn][chn][row], sizeof(Cell)*((n_chn-1)*internal_patternlengths[ptn] + n_rows));
+	} else {
+		for(u8 c=chn; c<chn+n_chn; ++c)
+			DC_FlushRange(&patterns[ptn][c][row], sizeof(Cell)*n_rows);
+	}
+	
+	bumpPatternVersion(ptn);
+	stats_dirty = true;
+}
+
+void Song::copyCells(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+                     u8 dst_ptn, u8 dst_chn, u16 dst_row)
+{
+	// Blocks in the same pattern may overlap. Rows are handled by memmove,
+	// channels by going through them in the right direction.
+	if( (src_ptn == dst_ptn) && (dst_chn > src_chn) ) {
+		for(s16 c=n_chn-1; c>=0; --c)
+			memmove(&patterns[dst_ptn][dst_chn+c][dst_row], &patterns[src_ptn][src_chn+c][src_row],
+				sizeof(Cell)*n_rows);
+	} else {
+		for(u8 c=0; c<n_chn; ++c)
+			memmove(&patterns[dst_ptn][dst_chn+c][dst_row], &patterns[src_ptn][src_chn+c][src_row],
+				sizeof(Cell)*n_rows);
+	}
+}
+
+bool Song::clipBlock(u8 ptn, u8 chn, u16 row, u8 *n_chn, u16 *n_rows)
+{
+	if( (ptn >= n_patterns) || (chn >= n_channels) || (row >= internal_patternlengths[ptn]) )
+		return false;
+	
+	if(chn + *n_chn > n_channels)
+		*n_chn = n_channels - chn;
+	if(row + *n_rows > internal_patternlengths[ptn])
+		*n_rows = internal_patternlengths[ptn] - row;
+	
+	return (*n_chn > 0) && (*n_rows > 0);
+}
+
+void Song::bumpPatternVersion(u8 ptn)
+{
+	pattern_versions[ptn]++;
+	DC_FlushRange(&pattern_versions[ptn], sizeof(u32));
+}
+
 void Song::killInstruments(void) {
 	
-	for(u8 i=0;i<MAX_INSTRUMENTS;++i)
+	for(u8 i=0;i<n_instruments;++i)
 	{
 		if(instruments[i] != NULL)
 		{
@@ -459,6 +1230,125 @@ void Song::killInstruments(void) {
 	
 	free(instruments);
 	instruments = NULL;
+	n_instruments = 0;
+}
+
+void Song::updateStats(void)
+{
+	n_used_samples = 0;
+	for(u8 inst=0; inst<n_instruments; ++inst)
+	{
+		if(instruments[inst] == NULL)
+			continue;
+		
+		for(u16 smp=0; smp<instruments[inst]->getSamples(); ++smp)
+			if(instruments[inst]->getSample(smp) != NULL)
+				n_used_samples++;
+	}
+	
+	used_channels = 0;
+	memset(used_effects, 0, sizeof(used_effects));
+	
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		for(u8 chn=0; chn<n_channels; ++chn)
+		{
+			Cell *cell = patterns[ptn][chn];
+			for(u16 row=0; row<patternlengths[ptn]; ++row, ++cell)
+			{
+				if( (cell->note != EMPTY_NOTE) || (cell->instrument != NO_INSTRUMENT) ||
+				    (cell->volume != NO_VOLUME) || (cell->effect != NO_EFFECT) ||
+				    (cell->effect2 != NO_EFFECT) )
+					used_channels |= BIT(chn);
+				
+				if(cell->effect != NO_EFFECT)
+					used_effects[cell->effect / 32] |= BIT(cell->effect % 32);
+				if(cell->effect2 != NO_EFFECT)
+					used_effects[cell->effect2 / 32] |= BIT(cell->effect2 % 32);
+			}
+		}
+	}
+	
+	stats_dirty = false;
+}
+
+// Clears notes and instruments that are out of range and clamps volumes.
+// Returns the number of values that were changed.
+u32 Song::validateCells(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows)
+{
+	u32 fixes = 0;
+	
+	for(u8 c=chn; c<chn+n_chn; ++c)
+	{
+		Cell *cell = &patterns[ptn][c][row];
+		for(u16 r=0; r<n_rows; ++r, ++cell)
+		{
+			if( (cell->note > MAX_NOTE) && (cell->note != EMPTY_NOTE) && (cell->note != STOP_NOTE) ) {
+				cell->note = EMPTY_NOTE;
+				fixes++;
+			}
+			if( (cell->instrument >= MAX_INSTRUMENTS) && (cell->instrument != NO_INSTRUMENT) ) {
+				cell->instrument = NO_INSTRUMENT;
+				fixes++;
+			}
+			if( (cell->volume > MAX_VOLUME) && (cell->volume != NO_VOLUME) ) {
+				cell->volume = MAX_VOLUME;
+				fixes++;
+			}
+		}
+	}
+	
+	return fixes;
+}
+
+// Follows the pattern order like the player, so cells without an instrument
+// use the one that was last played in the channel
+void Song::findSampleNotes(u8 *lowest, u8 *highest)
+{
+	memset(lowest, 255, MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	memset(highest, 0, MAX_INSTRUMENTS * MAX_INSTRUMENT_SAMPLES);
+	
+	u8 channel_inst[MAX_CHANNELS];
+	memset(channel_inst, NO_INSTRUMENT, sizeof(channel_inst));
+	
+	for(u16 pos=0; pos<potsize; ++pos)
+	{
+		u8 ptn = pattern_order_table[pos];
+		if(ptn >= n_patterns)
+			continue;
+		
+		for(u8 chn=0; chn<n_channels; ++chn)
+		{
+			Cell *cell = patterns[ptn][chn];
+			for(u16 row=0; row<patternlengths[ptn]; ++row, ++cell)
+			{
+				if(cell->instrument != NO_INSTRUMENT)
+					channel_inst[chn] = cell->instrument;
+				
+				u8 inst = channel_inst[chn];
+				if( (cell->note > MAX_NOTE) || (inst >= MAX_INSTRUMENTS) || (instruments[inst] == NULL) )
+					continue;
+				
+				u8 smp = instruments[inst]->getNoteSample(cell->note);
+				if(smp >= MAX_INSTRUMENT_SAMPLES)
+					continue;
+				
+				// An arpeggio goes up to 15 half tones higher
+				u8 arp_x = cell->effect_param >> 4, arp_y = cell->effect_param & 0xF;
+				u16 high = cell->note;
+				if(cell->effect == EFFECT_ARPEGGIO)
+					high += (arp_x > arp_y) ? arp_x : arp_y;
+				if(high > MAX_NOTE)
+					high = MAX_NOTE;
+				
+				u16 idx = inst * MAX_INSTRUMENT_SAMPLES + smp;
+				if(cell->note < lowest[idx])
+					lowest[idx] = cell->note;
+				if(high > highest[idx])
+					highest[idx] = high;
+			}
+		}
+	}
 }
 
 #endif
@@ -0,0 +1,106 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <nds.h>
+
+/*
+IMA-ADPCM as the DS sound hardware plays it: a word with the initial value and
+step index, followed by 4 bit codes, the low nibble first. A sample takes a
+quarter of its 16 bit size. The hardware loops in whole words, so loop points
+must be multiples of ADPCM_BLOCK_SAMPLES. When it gets to the loop start for
+the first time, it saves its value and step index and restores them at every
+loop end, so the loop sounds the same every time and needs no state of its own.
+*/
+
+#define ADPCM_HEADER_SIZE		4
+#define ADPCM_BLOCK_SAMPLES		8	// Samples in a word
+#define ADPCM_SIZE(n_samples)	(ADPCM_HEADER_SIZE + ((n_samples) + ADPCM_BLOCK_SAMPLES - 1) / ADPCM_BLOCK_SAMPLES * 4)
+#define ADPCM_MAX_INDEX			88
+
+#define ADPCM_SEED_SAMPLES		64		// Samples used to choose the initial step index
+#define ADPCM_MAX_UNROLL		16384	// Loops are repeated up to this many samples to fit into words
+
+typedef struct {
+	s32 value;
+	s32 index;
+} AdpcmState;
+
+// Encodes 8 or 16 bit PCM. The sample can be given in several pieces, e.g. to
+// repeat a loop. The signal to noise ratio is measured on the way.
+class AdpcmEncoder {
+	public:
+		// With dest=0, nothing is written and only the quality is measured
+		AdpcmEncoder(u8 *_dest);
+		
+		// Chooses the initial step index that suits the first samples best and
+		// writes the header. src is the start of the sample.
+		void start(const void *src, u32 n_samples, bool is_16_bit);
+		
+		void encode(const void *src, u32 n_samples, bool is_16_bit);
+		
+		// Repeats the last value up to the end of the word
+		void finish(void);
+		
+		u32 getNSamples(void) { return n_samples; }
+		
+		// Signal to noise ratio in 1/10 dB
+		s16 getSnr(void);
+		
+	private:
+		void encodeValue(s32 value);
+		
+		u8 *dest;
+		AdpcmState state;
+		u32 n_samples;
+		s32 last;
+		u64 signal;
+		u64 noise;
+};
+
+// Decodes ADPCM data including the header, in as many pieces as needed
+class AdpcmDecoder {
+	public:
+		AdpcmDecoder(const u8 *_src);
+		
+		void decode(s16 *dest, u32 n_samples);
+		
+	private:
+		const u8 *src;
+		AdpcmState state;
+		u32 pos;	// In samples
+};
+
+#endif
@@ -32,7 +32,10 @@ typedef enum {
     MIC_OFF,
     PATTERN_LOOP,
     SAMPLE_FINISH,
-    SET_STEREO_OUTPUT
+    SET_STEREO_OUTPUT,
+    REQUEST_SAMPLE,
+    SAMPLE_REQUEST_DONE,
+    SET_CHANNEL_SAMPLES
 } NTXMFifoMessageType;
 
 struct PlaySampleCommand
@@ -100,6 +103,14 @@ struct SetStereoOutputCommand {
     bool state;
 };
 
+struct RequestSampleCommand {
+    Sample *sample;
+};
+
+struct SetChannelSamplesCommand {
+    Sample **table;
+};
+
 typedef struct NTXMFifoMessage {
     u16 commandType;
 
@@ -118,6 +129,8 @@ typedef struct NTXMFifoMessage {
         StopInstCommand        stopInst;
         PatternLoopCommand     ptnLoop;
         SetStereoOutputCommand setStereoOutput;
+        RequestSampleCommand   requestSample;
+        SetChannelSamplesCommand setChannelSamples;
     };
 } NTXMFifoMessage;
 
@@ -130,6 +143,7 @@ void CommandPlaySample(Sample *sample);
 void CommandStopSample(int channel);
 void CommandStartRecording(u16* buffer, int length);
 int CommandStopRecording(void);
+// Returns when the arm7 has stopped the old song's channels, so it can be freed
 void CommandSetSong(void *song);
 void CommandStartPlay(u8 potpos, u16 row, bool loop);
 void CommandStopPlay(void);
@@ -140,11 +154,22 @@ void CommandMicOn(void);
 void CommandMicOff(void);
 void CommandSetPatternLoop(bool state);
 void CommandSetStereoOutput(bool state);
+// Tells the arm7 that a sample request was handled, whether or not the sample
+// could be loaded. Until then, it does not ask for that sample again.
+void CommandSampleRequestDone(Sample *sample);
+// Gives the arm7 a table of MAX_CHANNELS entries in which it keeps the sample
+// each channel plays, or 0. See SampleCache. Returns when the arm7 has stopped
+// the channels in the old table and no longer writes to it.
+void CommandSetChannelSamples(Sample **table);
 
 void RegisterRowCallback(void (*onUpdateRow_)(u16));
 void RegisterStopCallback(void (*onStop_)(void));
 void RegisterPlaySampleFinishedCallback(void (*onPlaySampleFinished_)(void));
 void RegisterPotPosChangeCallback(void (*onPotPosChange_)(u16));
+// Called from the FIFO interrupt when the arm7 wants to play a sample whose
+// data is not loaded
+void RegisterSampleRequestCallback(void (*onSampleRequest_)(Sample*));
+u16 GetPotPos(void); // The pattern order position the arm7 reported last
 #endif
 
 #if defined(ARM7)
@@ -153,6 +178,7 @@ void CommandUpdateRow(u16 row);
 void CommandUpdatePotPos(u16 potpos);
 void CommandNotifyStop(void);
 void CommandSampleFinish(void);
+void CommandRequestSample(Sample *sample);
 #endif
 
 #endif /* FIFOCOMMAND_H_ */
@@ -34,6 +34,7 @@
 #define FORMAT_TRANSPORT_H
 
 #include "song.h"
+#include "reader.h"
 
 // This is the abstract base class of transports.
 // Transports are classes that handle import and export of songs.
@@ -43,6 +44,9 @@ class FormatTransport {
 		// Loads a song from a file pots it into _song
 		// Returns 0 on success, an error code else
 		virtual u16 load(const char *filename, Song **_song) = 0;
+		
+		// Loads a song from a reader, see reader.h
+		virtual u16 load(Reader *reader, Song **_song) = 0;
 	
 		// Saves a song to a file
 		virtual u16 save(const char *filename, Song *song) = 0;
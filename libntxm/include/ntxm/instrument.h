@@ -51,10 +51,21 @@
 
 #define STOP_NOTE       254
 
+// Everything the player needs to start or re-pitch a note, prepared on the
+// arm9 whenever the instrument or its samples change
+typedef struct {
+	Sample *sample;		// Sample mapped to the note, a silent one if there is none
+	u32 play_length;	// How long the note plays in ms
+	u16 timer;			// SCHANNEL_TIMER value for the unbent note
+	u8 volume;			// Sample volume (0..255)
+	u8 loop;			// Loop type of the sample
+} NoteInfo;
+
 class Instrument
 {
 	friend class EnvelopeEditor;
 	friend class XMTransport;
+	friend class NTXTransport;
 	
 	public:
 	
@@ -62,10 +73,13 @@ class Instrument
 		Instrument(const char *_name, Sample *_sample, u8 _volume=255);
 		~Instrument();
 	
+		// A sample belongs to exactly one instrument. It only keeps the note
+		// table of the last instrument it was added to up to date.
 		void addSample(Sample *sample);
 		Sample *getSample(u8 idx); // If not present, 0 is returned
 		void setSample(u8 idx, Sample *sample);
-		Sample *getSampleForNote(u8 _note);
+		Sample *getSampleForNote(u8 _note); // 0 if there is none (arm9 only)
+		const NoteInfo *getNoteInfo(u8 _note) { return &note_table[_note]; }
 		void play(u8 _note, u8 _volume, u8 _channel);
 		void bendNote(u8 _note, u8 _basenote, s16 _finetune, u8 _channel);
 		void bendNoteDirect(u8 _note, s16 _fine_step, u8 _channel);
@@ -77,6 +91,14 @@ class Instrument
 		// Calculate how long in ms the instrument will play note given note
 		u32 calcPlayLength(u8 note);
 		
+		// Rebuilds the note table. The samples do this themselves when they
+		// change, call it after putting samples into the instrument directly.
+		void updateNoteTable(void);
+		
+		// Fixes envelopes and sample loops the player can't handle. Returns the
+		// number of values that were changed. See Song::validate().
+		u16 validate(void);
+		
 		const char *getName(void);
 		void setName(const char *_name);
 	
@@ -99,6 +121,8 @@ class Instrument
 		
 	private:
 		
+		void updateNoteInfo(u8 _note);
+		
 		char *name;
 		
 		u8 type;
@@ -116,6 +140,7 @@ class Instrument
 		// Synth *synth;
 	
 		u8 *note_samples;
+		NoteInfo *note_table; // One entry per note, see updateNoteTable()
 		
 		u16 vol_envelope_x[MAX_ENV_POINTS];
 		u16 vol_envelope_y[MAX_ENV_POINTS];
@@ -61,6 +61,7 @@ class ModTransport: public FormatTransport {
 		// Loads a song from a file and puts it in the song argument
 		// returns 0 on success, an error code else
 		u16 load(const char *filename, Song **_song);
+		u16 load(Reader *reader, Song **_song);
 		
 		// Saves a song to a file
 		u16 save(const char *filename, Song *song);
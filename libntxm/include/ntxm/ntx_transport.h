@@ -0,0 +1,185 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ * 
+ * Version: Noncommercial zLib License / GPL 3.0
+ * 
+ * The contents of this file are subject to the Noncommercial zLib License 
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ * 
+ ***** END LICENSE BLOCK *****/
+
+#ifndef NTX_TRANSPORT
+#define NTX_TRANSPORT
+
+#include "format_transport.h"
+
+#define NTX_TRANSPORT_ERROR_FOPENFAIL			1
+#define NTX_TRANSPORT_ERROR_MAGICNUMBERINVALID	2
+#define NTX_TRANSPORT_ERROR_VERSION				3
+#define NTX_TRANSPORT_ERROR_MEMFULL				4
+#define NTX_TRANSPORT_ERROR_READ				5
+#define NTX_TRANSPORT_ERROR_CORRUPT				6
+#define NTX_TRANSPORT_DISK_FULL					7
+#define NTX_TRANSPORT_SAMPLE_NOT_LOADED			8
+
+#define NTX_MAGIC				"NTXM"
+#define NTX_VERSION				2		// 2 added ADPCM samples
+
+#define NTX_INST_PRESENT		BIT(0)
+
+#define NTX_SAMPLE_PRESENT		BIT(0)
+#define NTX_SAMPLE_16BIT		BIT(1)
+#define NTX_SAMPLE_ADPCM		BIT(2)	// The data is ADPCM, see adpcm.h
+
+#define NTX_ENV_ON				BIT(0)
+#define NTX_ENV_SUSTAIN			BIT(1)
+#define NTX_ENV_LOOP			BIT(2)
+
+/*
+NTX is libntxm's own song format. It holds the song the way it is kept in RAM,
+so loading it is just copying: the cells are stored like in a pattern, and the
+sample data is stored decoded and word aligned, so it can be played right from
+the file buffer. Files are made from XMs with ntxm_tool or with save().
+
+A file is laid out like this, all numbers are little endian and everything is
+word aligned:
+
+	NTXHeader
+	NTXPattern[n_patterns]
+	NTXInstrument[n_instruments]
+	NTXSample[n_samples]		(the samples of all instruments, in order)
+	Cells of all patterns
+	Sample data, starting at data_offset
+
+Everything before data_offset is read in one go and offsets within the file
+are turned into pointers in a single pass, checking that they stay inside the
+file. There are no pointers in the file itself.
+*/
+
+typedef struct {
+	char magic[4];
+	u32 version;
+	u32 file_size;
+	u32 data_offset;		// Size of everything but the sample data
+	char name[MAX_SONG_NAME_LENGTH];
+	u8 speed;
+	u8 bpm;
+	u8 n_channels;
+	u8 restart_position;
+	u16 pot_length;
+	u16 n_patterns;
+	u16 n_instruments;		// Highest instrument index+1
+	u16 n_samples;
+	u32 patterns;			// Offsets of the tables
+	u32 instruments;
+	u32 samples;
+	u8 pot[MAX_POT_LENGTH];
+} NTXHeader;
+
+typedef struct {
+	u32 cells;				// Offset of the cells, one channel after the other
+	u16 rows;
+	u16 channels;			// Bit mask of the stored channels, the others are empty
+} NTXPattern;
+
+typedef struct {
+	char name[MAX_INST_NAME_LENGTH+2];
+	u8 flags;
+	u8 type;
+	u8 volume;
+	u8 n_samples;
+	u16 first_sample;		// Index of the first sample in the sample table
+	u8 vol_flags;
+	u8 pan_flags;
+	u8 n_vol_points;
+	u8 vol_sustain_point;
+	u8 n_pan_points;
+	u8 pan_sustain_point;
+	u16 vol_points[2*MAX_ENV_POINTS];	// x, y, x, y, ...
+	u16 pan_points[2*MAX_ENV_POINTS];
+	u8 note_samples[MAX_OCTAVE*12];
+} NTXInstrument;
+
+typedef struct {
+	u32 data;				// Offset of the sample data
+	u32 n_samples;			// Loop points and length are in samples
+	u32 loop_start;
+	u32 loop_length;
+	u8 flags;
+	u8 loop;
+	u8 volume;
+	u8 panning;
+	s8 rel_note;
+	s8 finetune;
+	u16 reserved;
+	char name[SAMPLE_NAME_LENGTH];
+} NTXSample;
+
+class NTXTransport: public FormatTransport {
+	public:
+		
+		NTXTransport();
+		~NTXTransport();
+		
+		// Loads a song from a file. The song data is read with one read,
+		// the samples with one read each.
+		u16 load(const char *filename, Song **_song);
+		
+		// Loads a song from a buffer. The sample data is copied.
+		u16 loadFromMemory(const u8 *data, u32 size, Song **_song);
+		
+		// Loads a song from a buffer and plays the samples right from it, so
+		// they take no extra RAM. The buffer must be word aligned and kept until
+		// the song is deleted.
+		u16 loadInPlace(u8 *data, u32 size, Song **_song);
+		
+		u16 load(Reader *reader, Song **_song);
+		
+		// Saves a song to a file, returns 0 on success, an error code otherwise.
+		// All samples must be loaded.
+		u16 save(const char *filename, Song *song);
+		
+		const char *getError(u16 error_id);
+		
+	private:
+		u16 loadBlock(Reader *reader);
+		const void *relocate(u32 offset, u32 size);
+		u16 loadPatterns(void);
+		u16 loadInstruments(Reader *reader);
+		Sample *loadSample(Reader *reader, const NTXSample *ntx_sample, u16 *err);
+		
+		// Loader state
+		Song *song;
+		const u8 *block;		// Everything before the sample data
+		u8 *block_buffer;		// The block, if it had to be read
+		u32 block_size;
+		u32 file_start;			// Position of the file in the reader
+		const NTXHeader *header;
+		const NTXPattern *patterns;
+		const NTXInstrument *instruments;
+		const NTXSample *samples;
+};
+
+#endif
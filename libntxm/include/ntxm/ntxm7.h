@@ -72,6 +72,10 @@ class NTXM7
 		// Set a pattern to looping
 		void setPatternLoop(bool loopstate);
 		
+		// The arm9 handled a request for the sample's data
+		void sampleRequestDone(Sample *sample);
+		void setChannelSamples(Sample **table);
+		
 	private:
 		Player *player;
 };
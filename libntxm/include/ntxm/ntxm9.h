@@ -35,6 +35,7 @@
 
 #include "song.h"
 #include "xm_transport.h"
+#include "sample_cache.h"
 
 class NTXM9
 {
@@ -46,6 +47,26 @@ class NTXM9
 		// Returns 0 on success, else an error code
 		u16 load(const char *filename);
 		
+		// Incremental loading, for loading songs while a game keeps running.
+		// Call loadStep() once per frame until loadFinished() returns true.
+		// With play_early, the song is handed to the arm7 as soon as its
+		// patterns are loaded, so play() works while the samples are still
+		// coming in. Both return 0 on success, else an error code.
+		u16 beginLoad(const char *filename, bool play_early=false);
+		u16 loadStep(u32 budget_us);
+		bool loadFinished(void);
+		u8 getLoadProgress(void); // 0..100
+		
+		// Loads a song, but leaves the sample data in the file. Samples are
+		// read when the song needs them, and at most sample_budget bytes of
+		// sample data are kept in RAM. One-shot samples of stream_min_size
+		// bytes or more are streamed from the file while they play, 0 turns
+		// this off. Call update() once per frame while the song is playing.
+		// Returns 0 on success, else an error code.
+		u16 loadLazy(const char *filename, u32 sample_budget, u32 stream_min_size=0);
+		void update(void);
+		u32 getStreamUnderruns(void); // How often streamed samples ran dry
+		
 		// Returns a pointer to a string describing the error corresponding
 		// to the given error code.
 		const char *getError(u16 error_id);
@@ -57,8 +78,13 @@ class NTXM9
 		void stop(void);
 		
 	private:
+		void unloadSong(void);
+		
 		XMTransport* xm_transport;
+		SampleCache *sample_cache;
 		Song *song;
+		bool play_early;
+		bool song_sent; // Was the loading song already passed to the arm7?
 };
 
 #endif
@@ -78,4 +78,38 @@ u32 my_getFileSize(const char *filename);
 void ntxm_unsigned2signed_8(uint8_t *buffer, size_t count);
 void ntxm_unsigned2signed_16(uint16_t *buffer, size_t count);
 
+// XM delta coding of sample data, see ntxmtools.cpp
+void ntxm_delta_decode(void *dest, const u8 *src, u32 size, bool is_16_bit, s16 *last);
+void ntxm_delta_encode(u8 *dest, const void *src, u32 size, bool is_16_bit, s16 *last);
+
+#ifdef ARM9
+
+// Sample quality reduction, see Song::reduceSamples(). The kernels work in
+// place (dest may be src) or only measure (dest=0), and return the energy of
+// the error they cause. Energies are in 16 bit units, 8 bit samples count 256
+// times as much.
+u64 ntxm_dither_16to8(s8 *dest, const s16 *src, u32 n_samples, u32 *seed);
+u64 ntxm_decimate(void *dest, const void *src, u32 n_samples, bool is_16_bit);
+u64 ntxm_signal_energy(const void *src, u32 n_samples, bool is_16_bit);
+
+#define NTXM_SNR_MAX	1000	// 100 dB, reported for samples that are reproduced exactly
+
+// Signal to noise ratio in 1/10 dB
+s16 ntxm_snr(u64 signal, u64 noise);
+
+// Sample editing, see Sample::reverse(), normalize() and so on. The kernels
+// work in place and allocate nothing. Results are rounded and saturated.
+#define NTXM_GAIN_ONE	0x10000	// Gains are 16.16 fixed point, up to 64
+
+void ntxm_reverse(void *data, u32 n_samples, bool is_16_bit);
+void ntxm_gain(void *data, u32 n_samples, bool is_16_bit, u32 gain);
+// From silence to full volume or back. The gain steps by 1/n_samples.
+void ntxm_fade(void *data, u32 n_samples, bool is_16_bit, bool in);
+// Averages the channels of interleaved stereo frames. dest may be src.
+void ntxm_mix_to_mono(void *dest, const void *src, u32 n_frames, bool is_16_bit);
+// Subtracts the average value and returns it
+s32 ntxm_remove_dc(void *data, u32 n_samples, bool is_16_bit);
+
+#endif
+
 #endif
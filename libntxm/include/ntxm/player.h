@@ -46,6 +46,8 @@
 
 #define DELAY_CMD 0x0ed0
 
+#define PLAYER_MAX_SAMPLE_REQUESTS	16	// Less than the arm9 queues, see SampleCache
+
 typedef struct
 {
 	u16 row;							// Current row
@@ -88,6 +90,8 @@ typedef struct
 	u8 single_sample_channel;
 
 	u8 last_autochannel;				// Last channel used for playing an inst with channel==255
+
+	StreamState *channel_stream[MAX_CHANNELS];	// Streamed sample that is played, if any
 } PlayerState;
 
 typedef struct {
@@ -120,6 +124,7 @@ class Player {
 		// Play Control
 		//
 
+		// Stops the channels that play the old song, so it can be freed
 		void setSong(Song *_song);
 
 		// Set a pattern to looping
@@ -134,7 +139,8 @@ class Player {
 		void stop(void);
 
 		// Play the note with the given settings. channel == 255 -> search for free channel
-		void playNote(u8 note, u8 volume, u8 channel, u8 instidx);
+		// Returns false if nothing was played, e.g. because the sample is not loaded.
+		bool playNote(u8 note, u8 volume, u8 channel, u8 instidx);
 
 		// Play the given sample (and send a notification when done)
 		void playSample(Sample *sample, u8 note, u8 volume, u8 channel);
@@ -142,6 +148,13 @@ class Player {
 		// Stop playback on a channel
 		void stopChannel(u8 channel);
 
+		// The arm9 handled a request for the sample's data, so it may be asked again
+		void sampleRequestDone(Sample *sample);
+
+		// Replaces the table of the samples the channels play. The channels
+		// in the old table are stopped, as their data is about to go away.
+		void setChannelSamples(Sample **table);
+
 		//
 		// Callbacks
 		//
@@ -161,6 +174,7 @@ class Player {
 
 		void startPlayTimer(void);
 		void playRow(void);
+		u8 rowInstrument(u8 channel, u8 inst); // The instrument a note in the row plays
 		void updateChannelVol(u8 volume, u8 channel); //Pattern volume updates per channel
 		void handleEffects(void); // Row Effect handler
 		void handleTickEffects(void); // Tick Effect handler
@@ -174,6 +188,13 @@ class Player {
 
 		void handleFade(u32 passed_time);
 
+		void requestSample(Sample *sample);
+		void releaseStoppedChannels(void);
+
+		void setChannelStream(u8 channel, StreamState *stream);
+		void updateStreams(u32 passed_time);
+		void stopStream(u8 channel);
+
 		bool calcNextPos(u16 *nextrow, u8 *nextpotpos); // Calculate next row and pot position
 
 		Song *song;
@@ -186,6 +207,9 @@ class Player {
 		void (*onSampleFinish)();
 
 		u32 lastms; // For timer
+
+		Sample *requested_samples[PLAYER_MAX_SAMPLE_REQUESTS]; // Asked for, but not answered yet
+		u8 n_requested_samples;
 };
 
 #endif
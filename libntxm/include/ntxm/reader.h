@@ -0,0 +1,156 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ * 
+ * Version: Noncommercial zLib License / GPL 3.0
+ * 
+ * The contents of this file are subject to the Noncommercial zLib License 
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ * 
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef READER_H
+#define READER_H
+
+#include <nds.h>
+#include <stdio.h>
+
+#define READER_DECODE_BLOCK_SIZE	2048	// Half of the arm9's data cache
+
+/*
+Readers are where the transports get their data from. A reader can be a file,
+a buffer in memory or a compressed stream, so songs and samples can come from
+anywhere. Everything is read in blocks, there are no per-byte calls.
+*/
+
+class Reader {
+	public:
+		virtual ~Reader() {};
+		
+		// Reads up to size bytes to dest and returns how many were read
+		virtual u32 read(void *dest, u32 size) = 0;
+		
+		// Moves the read position by offset bytes, which may be negative
+		virtual bool skip(s32 offset) = 0;
+		
+		virtual u32 getSize(void) = 0;
+		virtual u32 tell(void) = 0;
+		
+		// Readers that have their data in memory return a pointer to the next
+		// size bytes, so they can be used without copying. The read position is
+		// not changed. Returns 0 if that's not possible.
+		virtual const u8 *getPointer(u32 size) { return 0; }
+		
+		// Same, but the data may be changed. Only for writable buffers.
+		virtual u8 *getWritablePointer(u32 size) { return 0; }
+		
+		// Reads XM delta coded sample data and decodes it. This is done in
+		// blocks that fit into the arm9's data cache, so the data is decoded
+		// while it is still cached. Returns how many bytes were read.
+		u32 readDeltaCoded(void *dest, u32 size, bool is_16_bit, s16 *last);
+};
+
+// Reads from a file
+class FileReader: public Reader {
+	public:
+		FileReader(const char *filename, u32 buffer_size=4096);
+		~FileReader();
+		
+		bool isOpen(void) { return file != NULL; }
+		
+		u32 read(void *dest, u32 size);
+		bool skip(s32 offset);
+		u32 getSize(void) { return size; }
+		u32 tell(void);
+		
+	private:
+		FILE *file;
+		u32 size;
+};
+
+// Reads from a buffer in memory. The buffer is not copied.
+class MemoryReader: public Reader {
+	public:
+		MemoryReader(const u8 *_data, u32 _size);
+		// If writable is set, getWritablePointer() hands out the buffer
+		MemoryReader(u8 *_data, u32 _size, bool writable);
+		
+		u32 read(void *dest, u32 size);
+		bool skip(s32 offset);
+		u32 getSize(void) { return size; }
+		u32 tell(void) { return pos; }
+		
+		const u8 *getPointer(u32 _size);
+		u8 *getWritablePointer(u32 _size);
+		
+	private:
+		const u8 *data;
+		u8 *writable_data;
+		u32 size;
+		u32 pos;
+};
+
+#define LZ77_WINDOW_SIZE	4096
+#define LZ77_INPUT_BUFFER	256
+
+// Decompresses data in the LZ77 format of the GBA/DS BIOS (type 0x10, e.g.
+// from "gbalzss" or "grit -Z lz77") while it is read. Skipping forward
+// decompresses, skipping backward starts over from the beginning.
+class LZ77Reader: public Reader {
+	public:
+		// src must be positioned at the compression header
+		LZ77Reader(Reader *_src);
+		~LZ77Reader();
+		
+		bool isValid(void) { return valid; }
+		
+		u32 read(void *dest, u32 size);
+		bool skip(s32 offset);
+		u32 getSize(void) { return size; }
+		u32 tell(void) { return pos; }
+		
+	private:
+		void restart(void);
+		u8 nextByte(void);
+		
+		Reader *src;
+		u32 src_start;		// Position of the compressed data in src
+		bool valid;
+		
+		u32 size;			// Decompressed size
+		u32 pos;
+		
+		u8 *window;			// The last LZ77_WINDOW_SIZE bytes that were decompressed
+		u8 flags;
+		u8 flag_bits;		// Blocks left in the current flag byte
+		u16 copy_disp;		// Pending back reference
+		u8 copy_len;
+		
+		u8 input[LZ77_INPUT_BUFFER];
+		u16 input_pos;
+		u16 input_len;
+};
+
+#endif
@@ -38,8 +38,9 @@
 #include "linear_freq_table.h"
 
 #define BASE_NOTE				96	// Index if C-4 (FT2 base note)
-#define SILENCE_THRESHOLD_16	2000
-#define CROP_IGNORE_START		200
+#define SILENCE_THRESHOLD_16	2000	// For cutSilence()
+#define CROP_IGNORE_START		200		// Shorter silence is left alone by cutSilence()
+#define SAMPLE_TRIM_THRESHOLD	64		// Silence for trim(), in 16 bit units (-54 dB)
 
 #define NO_VOLUME				255
 
@@ -49,20 +50,86 @@
 
 #define SAMPLE_NAME_LENGTH		24
 
+// Filtered copies for high notes, see Sample::buildMips()
+#define SAMPLE_MIP_LEVELS		2	// Half and quarter rate
+#define SAMPLE_MIP_MIN_PERIOD	256	// Timer periods below this (above 65 kHz) play the next level
+
+// Waveform peaks for sample editors, see Sample::buildPeaks()
+#define SAMPLE_PEAK_LEVELS			3
+#define SAMPLE_PEAK_SHIFT(level)	(8 + 4 * (level))	// Buckets of 256, 4096 and 65536 samples
+
+typedef struct {
+	s16 min;
+	s16 max;
+} SamplePeak;
+
+typedef struct {
+	void *data;
+	u32 size;			// In bytes
+	u32 repeat_point;	// SCHANNEL_REPEAT_POINT and SCHANNEL_LENGTH for the level
+	u32 length;
+} SampleMip;
+
+// Quality reductions, see Sample::getReductions()
+#define SAMPLE_REDUCED_8BIT		BIT(0)
+#define SAMPLE_REDUCED_RATE		BIT(1)
+
+// State of a streamed sample, shared by both cpus (see SampleStream). The
+// hardware plays the head once and then loops over the ring, which the arm9
+// keeps filling ahead of the play position that the arm7 estimates.
+typedef struct {
+	u8 *buffer;				// The head, followed by the ring
+	u32 head_size;			// Bytes at the start of the sample that are always in the buffer
+	u32 ring_size;
+	u32 length;				// Length of the whole sample in bytes
+
+	// Written by the arm7
+	volatile u32 play_pos;	// Bytes the hardware has played, estimated from the time
+	volatile u32 play_frac;	// Fractional part of play_pos (16 bit)
+	volatile u32 rate;		// Bytes per ms (16.16 fixed point)
+	volatile u8 generation;	// Incremented whenever the sample is started
+	volatile u8 channel;
+	volatile bool playing;
+} StreamState;
+
+class Instrument;
+
 class Sample
 {
+	friend class SamplePool;
+	friend class Instrument;
+
 	public:
 		Sample(void *_sound_data, u32 _n_samples, u16 _sampling_frequency=44100,
 			bool _is_16_bit=true, u8 _loop=NO_LOOP, u8 _volume=255);
-		Sample(const char *filename, u8 _loop, bool *_success);
+		// Loads a wav, see Wav::load() for to_8_bit and max_rate
+		Sample(const char *filename, u8 _loop, bool *_success, bool to_8_bit=false, u32 max_rate=0);
 		~Sample();
 
 		void saveAsWav(char *filename);
 
+		// The sample data belongs to someone else, e.g. a buffer the song was loaded
+		// from. It is not freed and is copied before it's resized.
+		void setExternalData(bool external);
+		bool hasExternalData(void);
+
+		// Lazily loaded samples leave their data in the song file at the given
+		// offset. The data is attached when it's needed and can be detached
+		// again to free memory, see SampleCache. Unloaded samples are skipped by
+		// the player and can't be edited or saved.
+		void setLazyOffset(u32 offset);
+		u32 getLazyOffset(void);
+		void attachData(void *data);
+		void detachData(void);
+
 		void play(u8 note, u8 volume_, u8 channel  /* effects here */);
+		void playTimer(u16 timer, u8 volume_, u8 channel); // Play with a precalculated timer value
 		void bendNote(u8 note, u8 basenote, s16 _finetune, u8 channel);
 		void bendNoteDirect(s16 fine_step, u8 channel);
-		u32 calcPlayLength(u8 note);
+		void setTimer(u16 timer, u8 channel); // Bend to a precalculated timer value
+		u32 calcPlayLength(u8 note); // In ms. Instruments keep it per note, see NoteInfo.
+		u16 calcTimer(u8 note); // SCHANNEL_TIMER value for the unbent note
+		u32 calcFrequency(u8 note); // Samples per second, 0 if out of the table
 
 		void setRelNote(s8 _rel_note);
 		void setFinetune(s8 _finetune);
@@ -72,8 +139,88 @@ class Sample
 
 		u32 getSize(void); // Get the size in bytes
 		u32 getNSamples(void); // Get the numer of (PCM) samples
+		// The bytes the data takes in RAM. Ping pong loops are played from
+		// the data followed by a reversed copy of the loop, so they take
+		// getSize() plus the loop length. Whatever comes after a ping pong
+		// loop is never played and dropped when the copy is made.
+		u32 getMemorySize(void);
 
 		void *getData(void);
+		bool isLoaded(void); // False if the data of a lazy sample is not in RAM
+
+		// Streamed samples play from a small buffer that is refilled while
+		// playing, see SampleStream
+		void setStream(StreamState *_stream);
+		StreamState *getStream(void);
+
+		// The sound hardware also plays IMA-ADPCM, which takes 4 bits per
+		// sample (see adpcm.h). compress() converts the sample to it and puts
+		// the signal to noise ratio in 1/10 dB into snr. Forward loops are
+		// moved to 8 sample boundaries, short loops are repeated until they
+		// fit, so they keep their pitch. Streamed, unloaded and ping pong
+		// samples can't be compressed. Editing a compressed sample or saving
+		// it as WAV decompresses it to 16 bit first. The instrument's note
+		// table is updated with the new length. See also
+		// Song::compressSamples().
+		bool compress(s16 *snr=0);
+		bool decompress(void); // True if the sample is PCM afterwards
+		bool isCompressed(void);
+		// What compress() would do, without changing the sample
+		s16 measureCompression(u32 *compressed_size);
+		s16 getCompressionSnr(void); // 0 if unknown, e.g. for NTX samples
+		// The data given to the constructor is ADPCM, with n_samples samples
+		void setAdpcmData(void);
+
+		// Cheaper ways to save memory, see Song::reduceSamples().
+		// reduceTo8Bit() converts a 16 bit sample with noise shaped dither.
+		// halveRate() drops every other sample and lowers the relative note
+		// by an octave, so the sample keeps its pitch. Both put the signal to
+		// noise ratio in 1/10 dB into snr and can't be done to compressed,
+		// streamed and unloaded samples.
+		bool reduceTo8Bit(s16 *snr=0);
+		bool halveRate(s16 *snr=0);
+		// What they would do, without changing the sample. 0 if they can't.
+		s16 measureReduceTo8Bit(void);
+		s16 measureHalveRate(void);
+		u8 getReductions(void); // SAMPLE_REDUCED_* flags
+		s16 getReductionSnr(void); // Of all reductions together
+
+		// Drops data that is never heard: what follows the end of a forward
+		// loop, and the end of a sample without a loop as far as it stays
+		// within threshold (in 16 bit units) of 0. With trim_start, such
+		// silence at the beginning goes, too. That makes the sound start
+		// earlier, as the player has no sample offset to make up for it.
+		// Data that isn't the sample's own is shortened, not copied. Returns
+		// the bytes saved, 0 for compressed, streamed, lazily loaded, shared
+		// (see SamplePool) and ping pong samples. See also Song::trimSamples().
+		u32 trim(u16 threshold=SAMPLE_TRIM_THRESHOLD, bool trim_start=false);
+
+		// Very high notes play a sample faster than the DS outputs, so the
+		// hardware skips samples, which aliases. buildMips() makes filtered
+		// copies at half and quarter the rate, levels 1 and 2, which notes
+		// above 65 kHz play instead, at a lower timer rate. Loops must keep
+		// their exact start and length in whole words, levels where they
+		// don't are left out. Changing the sample or its loop frees the copies. Returns the
+		// number of levels made, 0 e.g. for compressed, streamed or unloaded
+		// samples. See also Song::buildSampleMips().
+		u8 buildMips(u8 levels=SAMPLE_MIP_LEVELS);
+		void freeMips(void);
+		u8 getMipLevels(void);
+		u32 getMipSize(u8 level); // Extra bytes for the level
+
+		// Drawing the waveform scans the whole sample when zoomed out. With
+		// buildPeaks(), the sample keeps the minimum and maximum of each
+		// bucket of 256, 4096 and 65536 samples, and edits update the buckets
+		// they touch. getPeak() then only reads a few buckets and the samples
+		// at the ends of the range, so drawing takes time by pixels, not by
+		// samples. It works without the peaks, too. Samples unloaded by the
+		// cache are drawn from the buckets alone, to 256 samples exactly.
+		// Compressing frees the peaks, compressed samples have none.
+		bool buildPeaks(void);
+		void freePeaks(void);
+		bool hasPeaks(void);
+		// Range of the samples [startsample, endsample), in 8 or 16 bit units
+		void getPeak(u32 startsample, u32 endsample, s16 *min, s16 *max);
 
 		u8 getLoop(void); // 0: no loop, 1: loop, 2: ping pong loop
 		bool setLoop(u8 loop_); // Set loop type. Can fail due to memory constraints
@@ -84,7 +231,8 @@ class Sample
 		void setLoopStart(u32 _loop_start);
 		u32 getLoopStart(void);
 
-		// Sets loop start and length, arguments are given in samples
+		// Sets loop start and length, arguments are given in samples. Loops of
+		// compressed samples are rounded to 8 samples.
 		void setLoopStartAndLength(u32 _loop_start, u32 _loop_length);
 
 		void setVolume(u8 vol);
@@ -106,29 +254,49 @@ class Sample
 		void fadeOut(u32 startsample, u32 endsample);
 		void reverse(u32 startsample, u32 endsample);
 		void normalize(u16 percent, u32 startsample, u32 endsample);
+		// Moves the part between the samples to be centered around 0
+		void removeDcOffset(u32 startsample, u32 endsample);
 
 		// Draws a line into the sample
 		void drawLine(int x1, int y1, int x2, int y2);
-		//void cutSilence(void); // Heuristically cut silence in the beginning
+		void cutSilence(void); // Heuristically cut silence in the beginning
 
 	private:
 		void calcSize(void);
 		void setFormat(void);
 		void calcRelnoteAndFinetune(u32 freq);
 		u16 findClosestFreq(u32 freq);
-		bool convertStereoToMono(void);
 
 		void fade(u32 startsample, u32 endsample, bool in);
+		bool resizePeaks(void);
+		void updatePeaks(u32 startsample, u32 endsample); // After editing these samples
+
+		void updateNotes(void); // After the length, loop or pitch changed
+		void dropData(void *data); // Frees it or lets go of it
+		bool ownData(void); // Copies shared data, see SamplePool
+
+		bool isSilent(u32 sample, u16 threshold);
+		void crop(u32 firstsample, u32 endsample); // Keeps [firstsample, endsample)
+
+		void startStream(u16 timer, u8 channel);
+		void setStreamRate(u16 timer);
+
+		u32 encodeAdpcm(u8 *dest, s16 *snr, u32 *new_loop_start, u32 *new_loop_length);
+		bool canReduce(void);
+		void addReduction(u8 reduction, s16 snr);
 
 		void setupPingPongLoop(void);
 		void removePingPongLoop(void);
-		void updatePingPongLoop(void);
+		void updatePingPongLoop(u32 startsample, u32 endsample); // After editing these samples
 
 		void *sound_data;
-		void *original_data;
-		void *pingpong_data;
+		bool pingpong_built; // The reversed loop follows the data
+		bool external_data;
+		void *pool_data; // The SamplePool copy the data is part of, 0 if it's not shared
+		Instrument *instrument; // The one instrument that has the sample, set by updateNoteTable()
+		u32 lazy_offset; // 0 if the sample is not lazily loaded
+		StreamState *stream; // 0 if the sample is not streamed
 		u32 n_samples;
-		u32 original_n_samples;
 		bool is_16_bit;
 		u8 loop;
 		s8 rel_note;		// Offset in the frequency table from base note
@@ -143,9 +311,21 @@ class Sample
 		// These are calculated in the constructor
 		u32 size;
 		u32 sound_format;
+		s16 adpcm_snr;
+		u8 reductions;
+		s16 reduction_snr;
+		SampleMip mips[SAMPLE_MIP_LEVELS];
+		u8 n_mips;
+		SamplePeak *peaks[SAMPLE_PEAK_LEVELS]; // 0 if not built
 
 		Wav wav;
 		// Other formats may follow
 };
 
+#ifdef ARM7
+// The sample each channel was last started with. The arm9 provides the table,
+// so it knows which data is still played (see SampleCache). 0 until then.
+extern Sample **ntxm_channel_samples;
+#endif
+
 #endif
@@ -0,0 +1,127 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ * 
+ * Version: Noncommercial zLib License / GPL 3.0
+ * 
+ * The contents of this file are subject to the Noncommercial zLib License 
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ * 
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef SAMPLE_CACHE_H
+#define SAMPLE_CACHE_H
+
+#include <nds.h>
+
+#include "song.h"
+#include "reader.h"
+#include "sample_stream.h"
+
+#define SAMPLE_CACHE_DEFAULT_LOOKAHEAD	2	// Pattern orders whose samples are loaded ahead
+#define SAMPLE_CACHE_KEEP_ORDERS		2	// A sample stays at least this many orders after it was needed
+#define SAMPLE_CACHE_MAX_REQUESTS		32
+
+/*
+Keeps the sample data of a song that was loaded with lazy samples (see
+XMTransport::setLazySamples) in RAM while it is needed. Samples are loaded
+when the arm7 asks for them and ahead of time for the next pattern orders.
+If the budget would be exceeded, the samples that were not needed for the
+longest time are freed. That way, songs that don't fit into RAM can be played.
+Long one-shot samples can be streamed from the file as well.
+
+Samples that were needed in the last SAMPLE_CACHE_KEEP_ORDERS pattern orders
+are never freed, and neither are samples that a channel still plays (the arm7
+keeps a table of them), so notes that are still ringing keep their data. Only one
+cache can receive requests from the arm7 at a time, and the song's instruments
+must not be changed while it exists. Delete the cache before the song.
+*/
+
+typedef struct {
+	Sample *sample;
+	u32 last_used;	// Value of the order counter when the sample was last needed
+	u32 bytes;		// RAM taken by the data, 0 if it's not loaded
+} SampleCacheEntry;
+
+class SampleCache {
+	public:
+		// The reader must be the one the song was loaded from. It is deleted
+		// with the cache.
+		SampleCache(Song *_song, Reader *_reader, u32 _budget);
+		~SampleCache();
+		
+		// Loads requested samples and the samples of the next pattern orders,
+		// reading from the file if necessary. Call it once per frame with the
+		// current pattern order position.
+		void update(u8 potpos);
+		
+		// Queues a sample for loading in the next update(). Interrupt safe.
+		void request(Sample *sample);
+		
+		// Loads a sample right away. Returns false if it does not fit into the
+		// budget or can't be read.
+		bool load(Sample *sample);
+		// Frees the data, unless a channel still plays it
+		void evict(Sample *sample);
+		
+		// One-shot samples of at least min_size bytes are streamed instead of
+		// loaded, see SampleStream. Their buffers count against the budget.
+		void streamLongSamples(u32 min_size);
+		u32 getStreamUnderruns(void);
+		
+		void setLookahead(u8 orders);
+		u32 getUsedMemory(void);
+		u32 getBudget(void);
+		
+	private:
+		SampleCacheEntry *findEntry(Sample *sample);
+		bool makeRoom(u32 size);
+		void touchOrders(u8 potpos);
+		bool isPlaying(Sample *sample);
+		
+		Song *song;
+		Reader *reader;
+		u32 budget;
+		u32 used;
+		u8 lookahead;
+		
+		SampleCacheEntry *entries; // Sorted by sample address
+		u16 n_entries;
+		
+		SampleStream **streams;
+		u16 n_streams;
+		
+		u32 order_counter; // Incremented whenever the pattern order changes
+		u16 last_potpos;
+		
+		Sample **channel_samples_mem;		// Cached address, for the arm7 and free()
+		Sample * volatile *channel_samples;	// Uncached address, the arm7 writes to it
+		
+		Sample *requests[SAMPLE_CACHE_MAX_REQUESTS];
+		volatile u8 request_head;
+		volatile u8 request_tail;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+
+#ifndef SAMPLE_POOL_H
+#define SAMPLE_POOL_H
+
+#include <nds.h>
+
+#include "song.h"
+
+/*
+The songs of a soundtrack often use the same drum and bass samples. The pool
+keeps one copy of such data for all of them. share() hashes a sample's data
+and looks for an equal copy with the same size and format. If there is one,
+the sample uses it and its own data is freed. Otherwise its data becomes the
+copy that later samples can share. A copy counts its users and is freed when
+the last of them is deleted or has its data replaced, e.g. by compress().
+Shared data is never written to, editing a sample makes it a copy of its own
+first.
+
+Streamed, lazily loaded samples and samples whose data belongs to someone
+else (songs loaded in place) are not shared. The pool is global and not
+thread safe, all songs that share samples must be loaded on the arm9.
+*/
+
+typedef struct {
+	void *data;
+	u32 bytes;
+	u32 hash;
+	u32 format;	// Sound format of the data
+	u16 users;
+} SamplePoolEntry;
+
+class SamplePool {
+	friend class Sample;
+	
+	public:
+		// Returns the bytes saved, 0 if the data is new to the pool or the
+		// sample can't share it. Call it before the arm7 plays the sample.
+		static u32 share(Sample *sample);
+		// All samples of the song, see also XMTransport::setSharedSamples()
+		static u32 shareSong(Song *song);
+		
+		static u32 getSharedBytes(void); // What the songs would take more without the pool
+		static u32 getPooledBytes(void); // What the copies take
+		static u16 getCopies(void);
+		
+	private:
+		static void release(void *data); // A user of the copy is gone
+		static u16 findHash(u32 hash); // The first entry with the hash or above
+		
+		static SamplePoolEntry *entries; // Sorted by hash
+		static u16 n_entries;
+		static u16 capacity;
+};
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ * 
+ * Version: Noncommercial zLib License / GPL 3.0
+ * 
+ * The contents of this file are subject to the Noncommercial zLib License 
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ * 
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef SAMPLE_STREAM_H
+#define SAMPLE_STREAM_H
+
+#include <nds.h>
+
+#include "sample.h"
+#include "reader.h"
+
+#define SAMPLE_STREAM_HEAD_SIZE		4096
+#define SAMPLE_STREAM_RING_SIZE		8192
+#define SAMPLE_STREAM_MARGIN		512		// Bytes left free in front of the play position
+
+/*
+Plays a long one-shot sample without having it in RAM. The first head_size
+bytes are kept in a buffer, followed by a ring of ring_size bytes. The
+hardware plays the head once and then loops over the ring, and update()
+refills the ring from the reader ahead of the play position. The arm7
+estimates that position from the time and the frequency. So memory use is
+the same for any sample length.
+
+A streamed sample plays on one channel at a time, a new note restarts it.
+Streams must be deleted before the sample, and only after the arm7 has
+stopped playing them.
+*/
+
+class SampleStream {
+	public:
+		// The sample's data is read from the reader, starting at offset. XM
+		// sample data is delta_coded. Sizes must be multiples of 4.
+		SampleStream(Sample *_sample, Reader *_reader, u32 _offset, bool _delta_coded,
+			u32 _head_size=SAMPLE_STREAM_HEAD_SIZE, u32 _ring_size=SAMPLE_STREAM_RING_SIZE);
+		~SampleStream();
+		
+		bool isValid(void);
+		
+		// Refills the ring. Call it at least once per frame.
+		void update(void);
+		
+		// How often the hardware got ahead of the data
+		u16 getUnderruns(void);
+		
+		// RAM taken by the buffers
+		u32 getMemoryUsage(void);
+		
+	private:
+		u32 read(u8 *dest, u32 size);
+		void rewind(void);
+		void fill(u32 target);
+		
+		Sample *sample;
+		Reader *reader;
+		u32 offset;
+		bool delta_coded;
+		
+		StreamState *state_mem;	// Cached address, for the arm7 and free()
+		StreamState *state;		// Uncached address, the arm7 writes to it
+		u8 *buffer;
+		u32 head_size;
+		u32 ring_size;
+		u32 length;
+		
+		u32 fill_pos;		// Bytes of the sample that were written to the buffer
+		u8 generation;		// Generation of the last start that was seen
+		s16 delta_last;		// Delta decoder state at fill_pos
+		s16 head_last;		// Delta decoder state at the end of the head
+		u16 underruns;
+		bool rewound;		// The ring holds the data after the head and was not played yet
+		bool valid;
+};
+
+#endif
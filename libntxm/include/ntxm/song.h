@@ -47,11 +47,13 @@
 #define DEFAULT_BPM				125
 #define DEFAULT_SPEED			6
 #define DEFAULT_CHANNELS		4
+#define CHANNEL_ADD_SPARE		1 // Columns channelAdd() allocates in advance
 
 #define EMPTY_NOTE				255
 #define STOP_NOTE				254
 
 #define NO_INSTRUMENT			255
+#define PLAY_INSTRUMENTS		256 // Instrument numbers a cell can hold
 #define MAX_SONG_NAME_LENGTH	20
 
 #define NO_VOLUME				255
@@ -152,7 +154,12 @@ typedef struct {
 /*
 This class represents a song. The format is kept open. The current feature set
 is a subset of XM, but export and import for mod, it, s3m could come. To edit a
-pattern, get its pointer with getPattern().
+pattern, use setCell() and friends, which are safe during playback. You can also
+get its pointer with getPattern(), but then you have to call patternChanged()
+when you're done.
+
+The player does not check the song data, so songs are validated before they are
+played, see validate(). The editing functions keep a validated song valid.
 */
 
 class Song {
@@ -177,7 +184,7 @@ class Song {
 		u32 getMsPerTick(void);
 		
 		Instrument *getInstrument(u8 instidx);
-		u8 getInstruments(void);
+		u8 getInstruments(void); // Highest instrument index+1
 		
 		void setInstrument(u8 idx, Instrument *instrument);
 		
@@ -193,15 +200,17 @@ class Song {
 		u8 getPotEntry(u8 idx);
 		void setPotEntry(u8 idx, u8 value);
 		
-		void addPattern(u16 length=DEFAULT_PATTERN_LENGTH);
+		// These return false if there is not enough memory, the song is
+		// unchanged then
+		bool addPattern(u16 length=DEFAULT_PATTERN_LENGTH);
 		
 		// More/less channels
-		void channelAdd(void);
+		bool channelAdd(void);
 		void channelDel(void);
 		
 		u8 getNumPatterns(void);
 		
-		void resizePattern(u8 ptn, u16 newlength);
+		bool resizePattern(u8 ptn, u16 newlength);
 		
 		// The most important functions
 		void setName(const char *_name);
@@ -222,15 +231,117 @@ class Song {
 		
 		void clearCell(Cell *cell);
 		
+		// Cell edits. Only the touched cells are flushed to RAM, so these are
+		// cheap enough to be used while the arm7 is playing the pattern.
+		void setCell(u8 ptn, u8 chn, u16 row, const Cell *cell);
+		void setRowRange(u8 ptn, u8 chn, u16 row, u16 n_rows, const Cell *cells);
+		void clearRowRange(u8 ptn, u8 chn, u16 row, u16 n_rows);
+		void setRow(u8 ptn, u16 row, const Cell *cells); // One cell per channel
+		
+		// Block operations on a rectangle of n_chn channels and n_rows rows. Blocks
+		// are clipped to the pattern and flushed to RAM once per operation.
+		// Buffers passed to getBlock/setBlock hold n_rows cells for each channel,
+		// one channel after the other.
+		void getBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, Cell *cells);
+		void setBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, const Cell *cells);
+		void copyBlock(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+		               u8 dst_ptn, u8 dst_chn, u16 dst_row);
+		void moveBlock(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+		               u8 dst_ptn, u8 dst_chn, u16 dst_row);
+		void clearBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows);
+		void fillBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, const Cell *cell);
+		// Notes that would leave the note range are left alone, like in FT2
+		void transposeBlock(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, s8 semitones);
+		// Scales the volume column. factor is 8.8 fixed point, so 256 is 100%.
+		void scaleBlockVolume(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows, u16 factor);
+		
+		// Call this after editing a pattern through getPattern()
+		void patternChanged(u8 ptn);
+		
+		// The version of a pattern is incremented with every change, so
+		// anything that caches pattern data knows when to refresh it.
+		u32 getPatternVersion(u8 ptn);
+		
 		// Muting
 		void setChannelMute(u8 chn, bool muted);
 		bool channelMuted(u8 chn);
 		
+		// Song statistics. They are cached and only recalculated after the song
+		// changed, so UIs can poll them.
+		u16 getSampleCount(void);
+		u16 getUsedChannels(void); // Bit mask of channels that contain anything
+		bool effectUsed(u8 effect); // Is the effect used in any visible row?
+		
+		// Call this after adding or removing samples of an instrument that is
+		// already in the song
+		void invalidateStats(void);
+		
+		// Fixes everything the player can't handle: notes and instruments out
+		// of range in the patterns, pattern order entries without a pattern,
+		// broken envelopes and sample loops. Missing instruments and samples
+		// play as silence. Afterwards the song is playable. The loaders do this,
+		// other songs are validated when they are handed to the arm7. Returns
+		// the number of values that were changed.
+		u32 validate(void);
+		bool isPlayable(void);
+		
+		// The memory taken by the sample data of all instruments in bytes,
+		// see Sample::getMemorySize()
+		u32 getSampleMemory(void);
+		
+		// Compresses samples to ADPCM (see Sample::compress()) until the sample
+		// data fits into budget bytes. The samples that lose the least quality
+		// are compressed first, samples that would get a signal to noise ratio
+		// below min_snr (in 1/10 dB) are left alone. With a budget of 0, all
+		// samples are compressed. Returns the sample memory afterwards.
+		u32 compressSamples(u32 budget, s16 min_snr=0);
+		
+		// Like compressSamples(), but with Sample::reduceTo8Bit() and
+		// Sample::halveRate(). The reductions that save the most bytes for the
+		// least noise come first. The notes the song plays decide how much
+		// halving the rate of a sample matters: the part of the sound it
+		// removes lies above a quarter of the rate the sample is played at,
+		// which can be above what the DS outputs. It can also make the lowest
+		// notes too slow for the hardware, then the rate is kept. See the
+		// samples' getReductions() for what was done.
+		u32 reduceSamples(u32 budget, s16 min_snr=0);
+		
+		// Builds the filtered copies (Sample::buildMips()) of the samples the
+		// song plays at above 65 kHz, as many levels as their highest note
+		// needs, up to levels. Other samples' copies are freed. Do this after
+		// compressing or reducing, which frees them, too. level_bytes, if
+		// given, gets the extra memory of each level (SAMPLE_MIP_LEVELS
+		// entries). Returns the extra memory of all levels in bytes.
+		u32 buildSampleMips(u8 levels=SAMPLE_MIP_LEVELS, u32 *level_bytes=0);
+		
+		// Trims the samples (Sample::trim()) and returns the bytes saved.
+		// Do this before building the mips, trimming frees them.
+		u32 trimSamples(u16 threshold=SAMPLE_TRIM_THRESHOLD, bool trim_start=false);
+		
 	private:
 		
 		void killPatterns(void);
 		void killInstruments(void);
 		
+		// The lowest and highest note each sample is played with in the
+		// pattern order, by instrument*MAX_INSTRUMENT_SAMPLES+sample. Unused
+		// samples get lowest > highest.
+		void findSampleNotes(u8 *lowest, u8 *highest);
+		
+		// Validates the given block of cells, writes it back to RAM and bumps the
+		// pattern version
+		void publishCells(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows);
+		void bumpPatternVersion(u8 ptn);
+		Cell **reallocPattern(Cell **ptn, u8 old_capacity, u16 old_rows, u8 capacity, u16 rows);
+		
+		// Copies cells without flushing, the blocks must already be clipped
+		void copyCells(u8 src_ptn, u8 src_chn, u16 src_row, u8 n_chn, u16 n_rows,
+		               u8 dst_ptn, u8 dst_chn, u16 dst_row);
+		// Clips a block to the pattern. Returns false if nothing is left.
+		bool clipBlock(u8 ptn, u8 chn, u16 row, u8 *n_chn, u16 *n_rows);
+		void updateStats(void);
+		u32 validateCells(u8 ptn, u8 chn, u16 row, u8 n_chn, u16 n_rows);
+		
 		u8 speed;
 		u8 bpm;
 		u8 n_channels;
@@ -245,6 +356,13 @@ class Song {
 		
 		u8 *pattern_order_table;
 		Instrument **instruments;
+		u8 n_instruments; // Highest instrument index+1
+		
+		// What the player uses instead of instruments. It has an entry for every
+		// instrument number a cell can hold, empty_instrument where there is none.
+		Instrument **play_instruments;
+		Instrument *empty_instrument;
+		bool playable;
 		
 		char *name;
 		
@@ -252,8 +370,16 @@ class Song {
 		u16 potsize;
 		
 		Cell ***patterns;
+		u8 channel_capacity; // Channels that fit in the patterns without reallocating
+		u32 *pattern_versions;
 		
 		bool channels_muted[MAX_CHANNELS];
+		
+		// Cached statistics, see updateStats()
+		bool stats_dirty;
+		u16 n_used_samples;
+		u16 used_channels;
+		u32 used_effects[256/32];
 };
 
 #endif
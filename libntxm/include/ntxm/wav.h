@@ -36,18 +36,26 @@
 #define CMP_PCM		0
 #define CMP_ADPCM	1
 
+#define WAV_MAX_CHANNELS	8
+#define WAV_MAX_HALVINGS	4	// load() can divide the rate by up to 16
+
 #include <nds.h>
 
+class Reader;
+
 /*
 
 A class that imeplements wav reading
 and writing exactly as far as we need
 it and not one single bit more.
 
-It supports
-- 8/16 Bit
+It reads
+- 8/16/24/32 Bit integer and 32 Bit float PCM
+- IMA ADPCM
+- up to 8 channels, which are mixed to mono
 - arbitrary sampling rate
-- raw PCM/IMA ADPCM
+
+and writes 8/16 Bit PCM.
 
 */
 
@@ -55,19 +63,27 @@ class Wav {
 	public:
 		Wav();
 		~Wav();
-		bool load(const char *filename);
+		
+		// The data is converted while it is read, a few frames at a time, right
+		// into the buffer the sample keeps: 8 bit is made signed, the channels
+		// are mixed, 24/32 bit, float and ADPCM become 16 bit. With to_8_bit,
+		// 16 bit is dithered to 8 bit, and a max_rate other than 0 halves the
+		// rate until it is no higher. So loading takes hardly more memory than
+		// the result. Afterwards the wav is mono, 8 or 16 bit PCM.
+		bool load(const char *filename, bool to_8_bit=false, u32 max_rate=0);
+		bool load(Reader *reader, bool to_8_bit=false, u32 max_rate=0);
 		bool save(const char *filename);
 		
 		u8 *getAudioData(void)    { return audio_data_; }
 		u32 getNSamples(void)     { return (n_channels_==2)?n_samples_/2:n_samples_; }
-		u16 getSamplingRate(void) { return sampling_rate_; }
+		u32 getSamplingRate(void) { return sampling_rate_; }
 		bool isStereo(void)       { return n_channels_ == 2; }
 		u8 getBitPerSample(void)  { return bit_per_sample_; }
 		u8 getCompression(void)   { return compression_; }
 
 		void setCompression(u8 compression)     { compression_ = compression; }
 		void setNChannels(u8 n_channels)        { n_channels_ = n_channels; }
-		void setSamplingRate(u16 sampling_rate) { sampling_rate_ = sampling_rate; }
+		void setSamplingRate(u32 sampling_rate) { sampling_rate_ = sampling_rate; }
 		void setBitPerSample(u8 bit_per_sample) { bit_per_sample_ = bit_per_sample; }
 		void setNSamples(u32 n_samples)         { n_samples_ = n_samples; }
 		void setAudioData(u8 *audio_data)       { audio_data_ = audio_data; }
@@ -75,7 +91,7 @@ class Wav {
 	private:
 		u8 compression_;
 		u8 n_channels_;
-		u16 sampling_rate_;
+		u32 sampling_rate_;
 		u8 bit_per_sample_;
 		u32 n_samples_;
 		u8 *audio_data_;
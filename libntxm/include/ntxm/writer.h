@@ -0,0 +1,84 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ * 
+ * Version: Noncommercial zLib License / GPL 3.0
+ * 
+ * The contents of this file are subject to the Noncommercial zLib License 
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ * 
+ ***** END LICENSE BLOCK *****/
+
+
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <nds.h>
+#include <stdio.h>
+
+#define WRITER_BUFFER_SIZE		16384
+#define WRITER_SMALL_BUFFER		256		// Used if there's no RAM for the buffer
+
+/*
+Writes a file through a buffer, so small pieces like header fields cost no
+file system calls and the file is written in blocks of the buffer size. All but the last block start at
+a multiple of the buffer size. Data can be put into the buffer directly with
+getSpace() and advance().
+*/
+
+class FileWriter {
+	public:
+		FileWriter(const char *filename, u32 buffer_size=WRITER_BUFFER_SIZE);
+		~FileWriter();
+		
+		bool isOpen(void) { return file != NULL; }
+		
+		void write(const void *data, u32 size);
+		void writeZeroes(u32 size);
+		void write8(u8 value) { write(&value, 1); }
+		void write16(u16 value) { write(&value, 2); }
+		void write32(u32 value) { write(&value, 4); }
+		
+		// Returns the free part of the buffer and puts its size into *size,
+		// which is never 0. Call advance() with the number of bytes used.
+		u8 *getSpace(u32 *size);
+		void advance(u32 size);
+		
+		// Writes what's left and closes the file. Returns false if anything
+		// could not be written.
+		bool close(void);
+		
+	private:
+		void flush(void);
+		
+		FILE *file;
+		u8 *buffer;
+		u32 buffer_size;
+		u32 pos;
+		bool ok;
+		u8 small_buffer[WRITER_SMALL_BUFFER];
+};
+
+#endif
@@ -45,6 +45,25 @@
 #define XM_TRANSPORT_PATTERN_TOO_LONG			8
 #define XM_TRANSPORT_FILE_ZERO_BYTE				9
 #define XM_TRANSPORT_DISK_FULL					10
+#define XM_TRANSPORT_SAMPLE_NOT_LOADED			11
+#define XM_TRANSPORT_BAD_HEADER					12
+
+// Stages of incremental loading
+#define XM_LOAD_IDLE			0
+#define XM_LOAD_PATTERNS		1
+#define XM_LOAD_INSTRUMENTS		2
+#define XM_LOAD_SAMPLES			3
+#define XM_LOAD_DONE			4
+#define XM_LOAD_ERROR			5
+
+#define XM_LOAD_CHUNK_SIZE		16384	// Sample data is loaded in pieces of this size
+#define XM_LOAD_DEFAULT_TIMER	0
+
+// Sizes of the headers as they are saved
+#define XM_HEADER_SIZE			336
+#define XM_PATTERN_HEADER_SIZE	9
+#define XM_INST_HEADER_SIZE		0x107
+#define XM_SAMPLE_HEADER_SIZE	40
 
 // This class implements loading from and saving to the XM file format
 // introduced by Fasttracker II. Man, those were the days!
@@ -79,16 +98,107 @@ struct InstInfo {
 class XMTransport: public FormatTransport {
 	public:
 		
+		XMTransport();
+		~XMTransport();
+		
 		// Loads a song from a file and puts it in the song argument
 		// returns 0 on success, an error code else
 		u16 load(const char *filename, Song **_song);
 		
-		// Saves a song to a file, returns 0 on success, an error code otherwise
+		// Loads a song from a buffer, e.g. a file embedded in the rom. Patterns
+		// are unpacked straight from the buffer and samples are decoded while
+		// they are copied out of it. The buffer can be freed afterwards.
+		u16 loadFromMemory(const u8 *data, u32 size, Song **_song);
+		
+		// Like loadFromMemory, but samples are decoded in place and used directly
+		// where they are word aligned, so they take no extra RAM. The buffer is
+		// changed and must be kept until the song is deleted.
+		u16 loadInPlace(u8 *data, u32 size, Song **_song);
+		
+		// Loads a song from any reader
+		u16 load(Reader *_reader, Song **_song);
+		
+		// Incremental loading, for loading without freezing the game.
+		// beginLoad() reads the song header, then each call to step() loads
+		// for about budget_us microseconds (at least one pattern, instrument
+		// header or XM_LOAD_CHUNK_SIZE bytes of sample data). finish() loads
+		// the rest and hands out the song. The reader must be kept until then.
+		// All of them return 0 or an error code.
+		u16 beginLoad(Reader *_reader);
+		u16 beginLoad(const char *filename);
+		u16 step(u32 budget_us);
+		bool loadFinished(void); // Done or failed
+		u8 getLoadProgress(void); // 0..100
+		u16 finish(Song **_song);
+		void abortLoad(void);
+		
+		// Once all patterns are loaded, the song can be played while the
+		// instruments are loading. They show up as soon as they are complete.
+		// Returns 0 before that. The song must not be deleted by the caller.
+		Song *getLoadingSong(void);
+		
+		// step() measures time with cpuStartTiming(), which uses this timer
+		// and the next one. The default is XM_LOAD_DEFAULT_TIMER (timers 0 and 1).
+		void setLoadTimer(u8 timer);
+		
+		// With lazy samples, the loader skips the sample data and only notes
+		// where it is in the file. A SampleCache loads it when it's needed.
+		void setLazySamples(bool lazy);
+		
+		// With shared samples, each sample is handed to SamplePool::share()
+		// as soon as it is loaded, so data that another song already has is
+		// freed again right away.
+		void setSharedSamples(bool shared);
+		
+		// Saves a song to a file, returns 0 on success, an error code otherwise.
+		// Everything goes through one buffer and is written in big blocks.
+		// Empty patterns are saved without data.
 		u16 save(const char *filename, Song *song);
 		
 		const char *getError(u16 error_id);
 		
 	private:
+		u16 loadNext(void);
+		u16 loadHeader(void);
+		u16 loadPattern(void);
+		u16 loadInstrument(void);
+		u16 loadSampleChunk(void);
+		u16 finishSample(void);
+		void finishInstrument(void);
+		void loadFailed(u16 err);
+		void loadCleanup(void);
+		
+		// Loader state
+		Reader *reader;
+		Reader *owned_reader;	// Reader created by beginLoad(filename)
+		Song *song;
+		u8 load_stage;
+		u16 load_error;
+		u8 load_timer;
+		bool lazy_samples;
+		bool shared_samples;
+		
+		u16 header_version;
+		u16 n_channels;
+		u16 n_patterns;
+		u16 n_inst;
+		
+		u16 cur_pattern;
+		u16 cur_inst;
+		struct InstInfo *instinfo;
+		Instrument *instrument;
+		u8 *sample_headers;
+		
+		u16 cur_sample;
+		bool sample_started;
+		void *sample_data;
+		const u8 *sample_packed; // Sample data in the reader's buffer, if it has one
+		u32 sample_length;
+		u32 sample_offset; // Position of the data in the file, for lazy samples
+		u32 sample_pos;
+		bool sample_is_16_bit;
+		bool external_data;
+		s16 delta_last;
 };
 
 #endif
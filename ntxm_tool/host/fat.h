@@ -0,0 +1,3 @@
+/*
+ * The host has its own file system, see nds.h
+ */
@@ -0,0 +1,65 @@
+/*
+ * Just enough of libnds to build the song code of libntxm for the host,
+ * so the tools use the same loaders and savers as the library.
+ */
+
+#ifndef HOST_NDS_H
+#define HOST_NDS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+typedef volatile u8 vu8;
+typedef volatile u16 vu16;
+typedef volatile u32 vu32;
+typedef volatile s32 vs32;
+
+#define BIT(n)	(1 << (n))
+
+// There is no second cpu to flush the cache for
+static inline void DC_FlushAll(void) {}
+static inline void DC_FlushRange(const void *base, u32 size) {}
+static inline void DC_InvalidateRange(const void *base, u32 size) {}
+
+#define memUncached(p)	(p)
+
+// Timing for the incremental loader. The ticks are microseconds here.
+static __thread u64 host_timing_start;	// Per thread, for the batch mode
+
+static inline u64 hostMicroseconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static inline void cpuStartTiming(int timer)
+{
+	host_timing_start = hostMicroseconds();
+}
+
+static inline u32 cpuGetTiming(void)
+{
+	return (u32)(hostMicroseconds() - host_timing_start);
+}
+
+static inline u32 cpuEndTiming(void)
+{
+	return cpuGetTiming();
+}
+
+#define timerTicks2usec(ticks)	(ticks)
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <nds.h>
+
+#include "batch.h"
+#include "fuzz.h"
+#include "ntxm/xm_transport.h"
+#include "ntxm/ntx_transport.h"
+#include "ntxm/song.h"
+#include "ntxm/ntxmtools.h"
+
+/* ===================== PUBLIC ===================== */
+
+Batch::Batch(const char *_outdir, bool _ntx, bool _trim, u16 _n_threads)
+	:outdir(_outdir), ntx(_ntx), trim(_trim), n_threads(_n_threads), jobs(0), queue(0),
+	n_jobs(0), capacity(0), next_job(0), wall_us(0)
+{
+	if(n_threads == 0)
+		n_threads = 1;
+	if(n_threads > BATCH_MAX_THREADS)
+		n_threads = BATCH_MAX_THREADS;
+	
+	pthread_mutex_init(&queue_lock, NULL);
+}
+
+Batch::~Batch()
+{
+	pthread_mutex_destroy(&queue_lock);
+	free(queue);
+	free(jobs);
+}
+
+void Batch::add(const char *filename)
+{
+	if(n_jobs == capacity)
+	{
+		u32 new_capacity = (capacity == 0) ? 64 : capacity * 2;
+		BatchJob *new_jobs = (BatchJob*)realloc(jobs, new_capacity * sizeof(BatchJob));
+		if(new_jobs == 0) {
+			fprintf(stderr, "%s: out of memory\n", filename);
+			return;
+		}
+		jobs = new_jobs;
+		capacity = new_capacity;
+	}
+	
+	BatchJob *job = &jobs[n_jobs++];
+	memset(job, 0, sizeof(BatchJob));
+	job->filename = filename;
+}
+
+static int compareJobs(const void *a, const void *b)
+{
+	u32 size_a = (*(BatchJob**)a)->in_size;
+	u32 size_b = (*(BatchJob**)b)->in_size;
+	
+	if(size_a == size_b)
+		return 0;
+	return (size_a > size_b) ? -1 : 1;
+}
+
+u32 Batch::run(void)
+{
+	if(n_jobs == 0)
+		return 0;
+	
+	queue = (BatchJob**)malloc(n_jobs * sizeof(BatchJob*));
+	if(queue == 0) {
+		fprintf(stderr, "out of memory\n");
+		return n_jobs;
+	}
+	
+	// Two songs with the same name would overwrite each other's output
+	char name_a[1024], name_b[1024];
+	for(u32 i=0; (outdir != 0) && (i<n_jobs); ++i)
+	{
+		makeOutputName(jobs[i].filename, name_a, sizeof(name_a));
+		for(u32 j=0; j<i; ++j)
+		{
+			makeOutputName(jobs[j].filename, name_b, sizeof(name_b));
+			if(strcmp(name_a, name_b) == 0) {
+				jobs[i].error = "has the same output file as an earlier song";
+				break;
+			}
+		}
+	}
+	
+	// The file size is the best guess for the work a song takes
+	for(u32 i=0; i<n_jobs; ++i)
+	{
+		FILE *file = fopen(jobs[i].filename, "rb");
+		if(file != NULL) {
+			fseek(file, 0, SEEK_END);
+			jobs[i].in_size = ftell(file);
+			fclose(file);
+		}
+		queue[i] = &jobs[i];
+	}
+	qsort(queue, n_jobs, sizeof(BatchJob*), compareJobs);
+	
+	u16 n_workers = (n_jobs < n_threads) ? n_jobs : n_threads;
+	pthread_t threads[BATCH_MAX_THREADS];
+	
+	u64 start = hostMicroseconds();
+	
+	// The calling thread is one of the workers
+	u16 n_started = 1;
+	for(; n_started<n_workers; ++n_started)
+	{
+		if(pthread_create(&threads[n_started], NULL, worker, this) != 0)
+			break;
+	}
+	
+	worker(this);
+	
+	for(u16 i=1; i<n_started; ++i)
+		pthread_join(threads[i], NULL);
+	
+	wall_us = hostMicroseconds() - start;
+	n_threads = n_started;
+	
+	u32 n_failed = 0;
+	for(u32 i=0; i<n_jobs; ++i)
+		if(jobs[i].error != 0)
+			n_failed++;
+	
+	return n_failed;
+}
+
+void Batch::printReport(void)
+{
+	u64 total_us = 0;
+	u64 total_in = 0, total_out = 0, total_trimmed = 0;
+	u32 max_mem = 0;
+	
+	printf("%-32s %8s %8s %8s %8s %8s %8s %8s %7s %3s %3s %4s %5s\n", "song", "read us", "load us", "val us", "save us",
+		"in KB", "out KB", "mem KB", "trim KB", "ptn", "ins", "smp", "chn");
+	
+	for(u32 i=0; i<n_jobs; ++i)
+	{
+		BatchJob *job = &jobs[i];
+		
+		const char *name = strrchr(job->filename, '/');
+		name = (name != 0) ? name + 1 : job->filename;
+		
+		if(job->error != 0) {
+			fprintf(stderr, "%s: %s\n", job->filename, job->error);
+			printf("%-32.32s failed\n", name);
+			continue;
+		}
+		
+		printf("%-32.32s %8u %8u %8u %8u %8u %8u %8u %7u %3u %3u %4u %2u/%2u\n", name,
+			job->read_us, job->load_us, job->validate_us, job->save_us, (job->in_size + 1023) / 1024,
+			(job->out_size + 1023) / 1024, (job->mem_size + 1023) / 1024, (job->trimmed + 1023) / 1024, job->n_patterns,
+			job->n_instruments, job->n_samples, job->used_channels, job->n_channels);
+		
+		total_us += job->read_us + job->load_us + job->validate_us + job->save_us;
+		total_in += job->in_size;
+		total_out += job->out_size;
+		total_trimmed += job->trimmed;
+		if(job->mem_size > max_mem)
+			max_mem = job->mem_size;
+	}
+	
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	
+	// CPU time over wall time is how many cores were really busy. The sum of
+	// the job times can't tell, threads that wait for a core count as busy.
+	u64 cpu_us = (u64)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+	
+	printf("\n%u songs on %u threads in %u ms, %u ms in jobs, %u ms of CPU time (%.1f cores busy)\n",
+		n_jobs, n_threads, wall_us / 1000, (u32)(total_us / 1000), (u32)(cpu_us / 1000),
+		(wall_us > 0) ? (double)cpu_us / wall_us : 0.0);
+	printf("%u KB in, %u KB out, %u KB trimmed, largest song %u KB, peak RSS %ld KB\n", (u32)(total_in / 1024),
+		(u32)(total_out / 1024), (u32)(total_trimmed / 1024), max_mem / 1024, usage.ru_maxrss);
+}
+
+/* ===================== PRIVATE ===================== */
+
+void *Batch::worker(void *arg)
+{
+	Batch *batch = (Batch*)arg;
+	
+	BatchJob *job;
+	while( (job = batch->nextJob()) != 0 )
+		batch->process(job);
+	
+	return 0;
+}
+
+BatchJob *Batch::nextJob(void)
+{
+	BatchJob *job = 0;
+	
+	pthread_mutex_lock(&queue_lock);
+	if(next_job < n_jobs)
+		job = queue[next_job++];
+	pthread_mutex_unlock(&queue_lock);
+	
+	return job;
+}
+
+void Batch::process(BatchJob *job)
+{
+	if(job->error != 0)
+		return;
+	
+	// Read the file in one go, so the loader parses memory and not stdio
+	u64 start = hostMicroseconds();
+	
+	FILE *file = fopen(job->filename, "rb");
+	if(file == NULL) {
+		job->error = "can't open file";
+		return;
+	}
+	
+	fseek(file, 0, SEEK_END);
+	job->in_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	u8 *data = (u8*)malloc(job->in_size);
+	if(data == 0) {
+		fclose(file);
+		job->error = "out of memory";
+		return;
+	}
+	
+	u32 got = fread(data, 1, job->in_size, file);
+	fclose(file);
+	
+	if(got != job->in_size) {
+		free(data);
+		job->error = "read error";
+		return;
+	}
+	
+	job->read_us = hostMicroseconds() - start;
+	
+	// Load
+	XMTransport xm;
+	NTXTransport ntx_transport;
+	Song *song = 0;
+	
+	start = hostMicroseconds();
+	
+	if( (job->in_size >= 4) && (memcmp(data, NTX_MAGIC, 4) == 0) ) {
+		job->err = ntx_transport.loadInPlace(data, job->in_size, &song);
+		if(job->err != 0)
+			job->error = ntx_transport.getError(job->err);
+	} else {
+		job->err = xm.loadInPlace(data, job->in_size, &song);
+		if(job->err != 0)
+			job->error = xm.getError(job->err);
+	}
+	
+	job->load_us = hostMicroseconds() - start;
+	
+	if(song == 0) {
+		if(job->error == 0)
+			job->error = "no song";
+		free(data);
+		return;
+	}
+	
+	// Check and analyze
+	start = hostMicroseconds();
+	u32 fixes = song->validate();
+	job->validate_us = hostMicroseconds() - start;
+	
+	const char *problem = checkSong(song);
+	if(problem != 0)
+		job->error = problem;
+	else if(fixes != 0)
+		job->error = "the loader left the song invalid";
+	
+	job->n_patterns = song->getNumPatterns();
+	job->pot_length = song->getPotLength();
+	job->n_instruments = song->getInstruments();
+	job->n_samples = song->getSampleCount();
+	job->n_channels = song->getChannels();
+	
+	u16 used = song->getUsedChannels();
+	for(u8 chn=0; chn<job->n_channels; ++chn)
+		if(used & BIT(chn))
+			job->used_channels++;
+	
+	if( (job->error == 0) && trim )
+		job->trimmed = song->trimSamples();
+	
+	job->mem_size = job->in_size;
+	
+	for(u16 ptn=0; ptn<job->n_patterns; ++ptn)
+		job->mem_size += song->getPatternLength(ptn) * job->n_channels * sizeof(Cell);
+	
+	for(u8 pos=0; pos<job->pot_length; ++pos)
+	{
+		job->rows += song->getPatternLength(song->getPotEntry(pos));
+	}
+	
+	// Samples that are used in place don't take memory of their own
+	for(u8 inst=0; inst<job->n_instruments; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if(sample == 0)
+				continue;
+			
+			u8 *smp_data = (u8*)sample->getData();
+			if( (smp_data < data) || (smp_data >= data + job->in_size) )
+				job->mem_size += sample->getMemorySize();
+		}
+	}
+	
+	// Save
+	if( (job->error == 0) && (outdir != 0) )
+	{
+		char out_filename[1024];
+		makeOutputName(job->filename, out_filename, sizeof(out_filename));
+		
+		start = hostMicroseconds();
+		
+		if(ntx) {
+			job->err = ntx_transport.save(out_filename, song);
+			if(job->err != 0)
+				job->error = ntx_transport.getError(job->err);
+		} else {
+			job->err = xm.save(out_filename, song);
+			if(job->err != 0)
+				job->error = xm.getError(job->err);
+		}
+		
+		job->save_us = hostMicroseconds() - start;
+		
+		if(job->error == 0) {
+			job->out_size = my_getFileSize(out_filename);
+			printf("%s -> %s\n", job->filename, out_filename);
+		}
+	}
+	
+	delete song;
+	free(data);
+}
+
+void Batch::makeOutputName(const char *filename, char *dest, u32 size)
+{
+	const char *name = strrchr(filename, '/');
+	name = (name != 0) ? name + 1 : filename;
+	
+	const char *ext = strrchr(name, '.');
+	int name_len = (ext != 0) ? ext - name : strlen(name);
+	
+	snprintf(dest, size, "%s/%.*s.%s", outdir, name_len, name, ntx ? "ntx" : "xm");
+}
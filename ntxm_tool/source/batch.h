@@ -0,0 +1,114 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <nds.h>
+#include <pthread.h>
+
+/*
+Batch converts many songs at once for asset pipelines. Every song is one job,
+the jobs are handed out to a thread per core from a shared queue, largest
+file first so no thread is left with a big song at the end. A job reads the
+whole file with one fread, loads it in place (no stdio parsing), checks and
+analyzes it (with checkSong() from fuzz.h), trims its samples if asked to and saves it as NTX or XM if an output directory is given.
+*/
+
+#define BATCH_MAX_THREADS	64
+
+struct BatchJob {
+	const char *filename;
+	
+	u16 err;			// 0 or the error code of the transport
+	const char *error;	// Message if the job failed
+	
+	u32 in_size;		// Bytes
+	u32 out_size;
+	u32 mem_size;		// File buffer plus pattern and sample data of the song
+	u32 trimmed;		// Sample bytes saved by Song::trimSamples()
+	
+	u32 read_us;
+	u32 load_us;
+	u32 validate_us;	// Song::validate() again, the loader already did it once
+	u32 save_us;
+	
+	// Analysis
+	u8 n_patterns;
+	u8 pot_length;
+	u8 n_instruments;
+	u16 n_samples;
+	u8 n_channels;
+	u8 used_channels;
+	u32 rows;			// Rows in the pattern order table
+};
+
+class Batch {
+	public:
+		// outdir may be 0 for checking and analyzing only. If ntx is set,
+		// the songs are saved as NTX, else as XM. With trim, their samples
+		// are trimmed first.
+		Batch(const char *_outdir, bool _ntx, bool _trim, u16 _n_threads);
+		~Batch();
+		
+		void add(const char *filename);
+		
+		// Processes all jobs and returns the number of failed ones
+		u32 run(void);
+		
+		// Prints a line per song and the totals
+		void printReport(void);
+		
+	private:
+		static void *worker(void *arg);
+		BatchJob *nextJob(void);
+		void process(BatchJob *job);
+		void makeOutputName(const char *filename, char *dest, u32 size);
+		
+		const char *outdir;
+		bool ntx;
+		bool trim;
+		u16 n_threads;
+		
+		BatchJob *jobs;
+		BatchJob **queue;	// Jobs sorted by size, largest first
+		u32 n_jobs;
+		u32 capacity;
+		
+		u32 next_job;
+		pthread_mutex_t queue_lock;
+		
+		u32 wall_us;
+};
+
+#endif
@@ -0,0 +1,331 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <nds.h>
+
+#include "fuzz.h"
+#include "ntxm/xm_transport.h"
+#include "ntxm/ntx_transport.h"
+#include "ntxm/song.h"
+
+/* ===================== PUBLIC ===================== */
+
+Fuzzer::Fuzzer(u32 _seed, const char *_corpus_dir)
+	:state(_seed), corpus_dir(_corpus_dir), n_runs(0), n_rejected(0), n_broken(0), n_corpus(0),
+	n_validated(0), fixes(0), validate_us(0), max_validate_us(0)
+{
+	if(state == 0)
+		state = 1; // xorshift never leaves 0
+}
+
+u32 Fuzzer::run(const char *filename, u32 runs)
+{
+	FILE *file = fopen(filename, "rb");
+	if(file == NULL) {
+		fprintf(stderr, "%s: can't open file\n", filename);
+		return 1;
+	}
+	
+	fseek(file, 0, SEEK_END);
+	u32 size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	u8 *original = (u8*)malloc(size);
+	u8 *data = (u8*)malloc(size);
+	
+	bool ok = (original != 0) && (data != 0) && (fread(original, 1, size, file) == size);
+	fclose(file);
+	
+	if(!ok) {
+		fprintf(stderr, "%s: read error\n", filename);
+		free(original);
+		free(data);
+		return 1;
+	}
+	
+	bool ntx = (size >= 4) && (memcmp(original, NTX_MAGIC, 4) == 0);
+	u32 broken = 0;
+	
+	for(u32 i=0; i<runs; ++i)
+	{
+		n_runs++;
+		
+		memcpy(data, original, size);
+		mutateFile(data, size);
+		
+		Song *song = 0;
+		u16 err;
+		if(ntx) {
+			NTXTransport transport;
+			err = transport.loadFromMemory(data, size, &song);
+		} else {
+			XMTransport transport;
+			err = transport.loadFromMemory(data, size, &song);
+		}
+		
+		if(err != 0) {
+			n_rejected++;
+			continue;
+		}
+		
+		if(corpus_dir != 0)
+		{
+			char corpus_filename[1024];
+			snprintf(corpus_filename, sizeof(corpus_filename), "%s/fuzz_%08x.%s", corpus_dir,
+				(unsigned)random(), ntx ? "ntx" : "xm");
+			
+			FILE *out = fopen(corpus_filename, "wb");
+			if( (out != NULL) && (fwrite(data, 1, size, out) == size) )
+				n_corpus++;
+			if(out != NULL)
+				fclose(out);
+		}
+		
+		const char *problem = checkSong(song);
+		if(problem == 0)
+		{
+			corruptSong(song);
+			
+			u64 start = hostMicroseconds();
+			fixes += song->validate();
+			u32 time = hostMicroseconds() - start;
+			
+			n_validated++;
+			validate_us += time;
+			if(time > max_validate_us)
+				max_validate_us = time;
+			
+			problem = checkSong(song);
+		}
+		
+		if(problem != 0) {
+			fprintf(stderr, "%s: run %u: %s\n", filename, (unsigned)i, problem);
+			broken++;
+		}
+		
+		delete song;
+	}
+	
+	n_broken += broken;
+	
+	free(original);
+	free(data);
+	
+	return broken;
+}
+
+void Fuzzer::printReport(void)
+{
+	printf("%u runs, %u rejected by the loader, %u songs broken", n_runs, n_rejected, n_broken);
+	if(corpus_dir != 0)
+		printf(", %u files written to %s", n_corpus, corpus_dir);
+	printf("\n");
+	
+	if(n_validated > 0)
+		printf("validate() after corrupting: %u us average, %u us max, %u fixes on average\n",
+			(u32)(validate_us / n_validated), max_validate_us, (u32)(fixes / n_validated));
+}
+
+/* ===================== PRIVATE ===================== */
+
+u32 Fuzzer::random(void)
+{
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+u32 Fuzzer::random(u32 max)
+{
+	return (max > 0) ? random() % max : 0;
+}
+
+void Fuzzer::mutateFile(u8 *data, u32 size)
+{
+	static const u8 interesting[] = {0, 1, 0x7F, 0x80, 0xFE, 0xFF};
+	
+	if(size == 0)
+		return;
+	
+	u32 n_changes = 1 + random(8);
+	for(u32 i=0; i<n_changes; ++i)
+	{
+		u32 pos = (random(2) == 0) ? random(size < FUZZ_HEADER_REGION ? size : FUZZ_HEADER_REGION) : random(size);
+		
+		switch(random(3))
+		{
+			case 0: data[pos] = random(); break;
+			case 1: data[pos] ^= BIT(random(8)); break;
+			case 2: data[pos] = interesting[random(sizeof(interesting))]; break;
+		}
+	}
+}
+
+// Overwrites parts of the song without going through the editing functions,
+// like code that writes to getPattern() and forgets patternChanged()
+void Fuzzer::corruptSong(Song *song)
+{
+	u16 n_patterns = song->getNumPatterns();
+	u32 n_cells = random(64);
+	for(u32 i=0; (i<n_cells) && (n_patterns > 0); ++i)
+	{
+		u8 ptn = random(n_patterns);
+		u16 rows = song->getPatternLength(ptn);
+		if(rows == 0)
+			continue;
+		
+		Cell *cell = &song->getPattern(ptn)[random(song->getChannels())][random(rows)];
+		cell->note = random();
+		cell->instrument = random();
+		cell->volume = random();
+	}
+	
+	if(random(4) == 0)
+		song->setPotEntry(random(song->getPotLength()), random());
+	if(random(4) == 0)
+		song->setRestartPosition(random());
+	
+	for(u8 inst=0; inst<song->getInstruments(); ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if( (instrument == 0) || (random(4) != 0) )
+			continue;
+		
+		u16 *xs, *ys;
+		u16 n_points = instrument->getVolumeEnvelope(&xs, &ys);
+		for(u16 i=0; i<n_points; ++i) {
+			xs[i] = random(0x200);
+			ys[i] = random(0x80);
+		}
+		instrument->setVolumeEnvelopeSustainPoint(random());
+		
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			
+			// Ping pong loops would be rebuilt from the broken values right away
+			if( (sample == 0) || (sample->getLoop() != FORWARD_LOOP) )
+				continue;
+			
+			u32 length = sample->getNSamples();
+			sample->setLoopStartAndLength(random(length * 2 + 1), random(length * 2 + 1));
+		}
+	}
+}
+
+const char *checkSong(Song *song)
+{
+	if(!song->isPlayable())
+		return "not validated";
+	
+	// getNumPatterns() returns a u8, so 256 patterns come back as 0
+	u16 n_patterns = song->getNumPatterns();
+	if(n_patterns == 0)
+		n_patterns = MAX_PATTERNS;
+	
+	for(u16 i=0; i<song->getPotLength(); ++i)
+		if(song->getPotEntry(i) >= n_patterns)
+			return "pattern order entry without a pattern";
+	
+	if(song->getRestartPosition() >= song->getPotLength())
+		return "restart position out of range";
+	
+	for(u16 ptn=0; ptn<n_patterns; ++ptn)
+	{
+		u16 rows = song->getPatternLength(ptn);
+		if(rows == 0)
+			return "pattern without rows";
+		
+		Cell **pattern = song->getPattern(ptn);
+		for(u8 chn=0; chn<song->getChannels(); ++chn)
+		{
+			for(u16 row=0; row<rows; ++row)
+			{
+				Cell *cell = &pattern[chn][row];
+				if( (cell->note > MAX_NOTE) && (cell->note != EMPTY_NOTE) && (cell->note != STOP_NOTE) )
+					return "note out of range";
+				if( (cell->instrument >= MAX_INSTRUMENTS) && (cell->instrument != NO_INSTRUMENT) )
+					return "instrument out of range";
+				if( (cell->volume > MAX_VOLUME) && (cell->volume != NO_VOLUME) )
+					return "volume out of range";
+			}
+		}
+	}
+	
+	for(u8 inst=0; inst<song->getInstruments(); ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u8 note=0; note<=MAX_NOTE; ++note)
+			if(instrument->getNoteInfo(note)->sample == 0)
+				return "note without a sample";
+		
+		u16 *xs, *ys;
+		for(u8 env=0; env<2; ++env)
+		{
+			u16 n_points = (env == 0) ? instrument->getVolumeEnvelope(&xs, &ys) : instrument->getPanningEnvelope(&xs, &ys);
+			if(n_points > MAX_ENV_POINTS)
+				return "too many envelope points";
+			
+			for(u16 i=0; i<n_points; ++i)
+			{
+				if(ys[i] > MAX_ENV_Y)
+					return "envelope point out of range";
+				if( (i > 0) && (xs[i] <= xs[i-1]) )
+					return "envelope points out of order";
+			}
+		}
+		
+		u16 n_vol_points = instrument->getVolumeEnvelope(&xs, &ys);
+		if( (n_vol_points > 0) && (instrument->getVolumeEnvelopeSustainPoint() >= n_vol_points) )
+			return "sustain point out of range";
+		
+		for(u16 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if( (sample == 0) || (sample->getLoop() == NO_LOOP) )
+				continue;
+			
+			if( (u64)sample->getLoopStart() + sample->getLoopLength() > sample->getNSamples() )
+				return "sample loop past the end";
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <nds.h>
+
+class Song;
+
+/*
+Fuzz tests the loaders and Song::validate(). Every run changes a few random
+bytes of a song file, mostly in the headers and patterns, and loads it from
+memory. A loaded song must satisfy everything the player relies on. Then
+random patterns cells, pattern order entries, envelopes and sample loops of
+the song are overwritten, the song is validated again and checked again.
+Build with "make SANITIZE=1" to also catch memory errors.
+*/
+
+#define FUZZ_HEADER_REGION	4096	// Half of the changes go to the start of the file
+
+class Fuzzer {
+	public:
+		// Mutated files that load are written to corpus_dir, if it is given,
+		// so they can be checked again with "ntxm_tool batch"
+		Fuzzer(u32 _seed, const char *_corpus_dir);
+		
+		// Returns the number of runs that left a song the player can't handle
+		u32 run(const char *filename, u32 n_runs);
+		
+		void printReport(void);
+		
+	private:
+		u32 random(void);
+		u32 random(u32 max); // 0..max-1
+		
+		void mutateFile(u8 *data, u32 size);
+		void corruptSong(Song *song);
+		
+		u32 state;
+		const char *corpus_dir;
+		
+		u32 n_runs;
+		u32 n_rejected;
+		u32 n_broken;
+		u32 n_corpus;
+		
+		u32 n_validated;
+		u64 fixes;
+		u64 validate_us;
+		u32 max_validate_us;
+};
+
+// Returns what is wrong with the song for the player, or 0 if nothing is
+const char *checkSong(Song *song);
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * libNTXM - XM Player Library for the Nintendo DS
+ *
+ *    Copyright (C) 2005-2008 Tobias Weyand (0xtob)
+ *                         me@nitrotracker.tobw.net
+ *
+ */
+
+/***** BEGIN LICENSE BLOCK *****
+ *
+ * Version: Noncommercial zLib License / GPL 3.0
+ *
+ * The contents of this file are subject to the Noncommercial zLib License
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You should have recieved a copy of the license with this package.
+ *
+ * Software distributed under the License is distributed on an "AS IS" basis,
+ * WITHOUT WARRANTY OF ANY KIND, either express or implied.
+ *
+ * Alternatively, the contents of this file may be used under the terms of
+ * either of the GNU General Public License Version 3 or later (the "GPL"),
+ * in which case the provisions of the GPL are applicable instead of those above.
+ * If you wish to allow use of your version of this file only under the terms of
+ * either the GPL, and not to allow others to use your version of this file under
+ * the terms of the Noncommercial zLib License, indicate your decision by
+ * deleting the provisions above and replace them with the notice and other
+ * provisions required by the GPL. If you do not delete the provisions above,
+ * a recipient may use your version of this file under the terms of any one of
+ * the GPL or the Noncommercial zLib License.
+ *
+ ***** END LICENSE BLOCK *****/
+
+
+/*
+ * ntxm_tool converts XM files to NTX files, libntxm's own format that loads
+ * without any unpacking (see ntx_transport.h). It runs on the host and uses
+ * the same loaders and savers as the library.
+ *
+ * Usage:
+ *   ntxm_tool song.xm song.ntx        Convert
+ *   ntxm_tool -b song.xm song.ntx     Convert and compare the load times
+ *   ntxm_tool -c kb song.xm song.ntx  Convert and compress samples to ADPCM
+ *                                     until they fit into kb kilobytes
+ *   ntxm_tool -r kb song.xm song.ntx  Convert and reduce samples to 8 bit or
+ *                                     half the rate until they fit
+ *   ntxm_tool -m song.xm song.ntx     Convert and show the memory the filtered
+ *                                     copies for high notes take on the DS
+ *   ntxm_tool batch [-j jobs] [-f ntx|xm] [-o dir] songs...
+ *                                     Check, analyze and convert many songs on
+ *                                     all cores (see batch.h)
+ *   ntxm_tool fuzz [-n runs] [-s seed] [-o dir] song
+ *                                     Fuzz test the loaders and validation with
+ *                                     mutations of a song (see fuzz.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <nds.h>
+
+#include "ntxm/xm_transport.h"
+#include "ntxm/ntx_transport.h"
+#include "ntxm/sample_pool.h"
+#include "batch.h"
+#include "fuzz.h"
+
+#define BENCH_RUNS	20
+
+static void usage(void)
+{
+	printf("usage: ntxm_tool [-b] [-m] [-t|-T] [-r kb] [-c kb] song.xm song.ntx\n");
+	printf("  -b  compare the load times of both files\n");
+	printf("  -t  trim what follows loops and the silence at the end of samples\n");
+	printf("  -T  like -t, and the silence at the start, too\n");
+	printf("  -r  reduce samples to 8 bit or half the rate until they take at\n");
+	printf("      most kb kilobytes, 0 reduces all of them\n");
+	printf("  -c  then compress samples to ADPCM until they fit into kb kilobytes,\n");
+	printf("      0 compresses all of them\n");
+	printf("  -m  show the memory the filtered copies for high notes take\n");
+	printf("       ntxm_tool batch [-j jobs] [-f ntx|xm] [-t] [-o dir] songs...\n");
+	printf("  -j  number of threads, the default is one per core\n");
+	printf("  -t  trim the samples as above before saving\n");
+	printf("  -f  output format, the default is ntx\n");
+	printf("  -o  output directory, without it the songs are only checked\n");
+	printf("       ntxm_tool fuzz [-n runs] [-s seed] [-o dir] song\n");
+	printf("  -n  number of mutations to try, the default is 1000\n");
+	printf("  -s  random seed, the default is 1\n");
+	printf("  -o  directory for the mutated files that load\n");
+	printf("       ntxm_tool share songs...\n");
+	printf("      shows how much memory the songs save by sharing samples\n");
+}
+
+static u8 *readFile(const char *filename, u32 *size)
+{
+	FILE *file = fopen(filename, "rb");
+	if(file == NULL)
+		return 0;
+	
+	fseek(file, 0, SEEK_END);
+	*size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	
+	u8 *data = (u8*)malloc(*size);
+	if( (data != 0) && (fread(data, 1, *size, file) != *size) ) {
+		free(data);
+		data = 0;
+	}
+	
+	fclose(file);
+	return data;
+}
+
+// Average load time in microseconds, or 0 on errors
+static u32 benchFile(FormatTransport *transport, const char *filename)
+{
+	u64 start = hostMicroseconds();
+	
+	for(u16 i=0; i<BENCH_RUNS; ++i)
+	{
+		Song *song = 0;
+		if(transport->load(filename, &song) != 0)
+			return 0;
+		delete song;
+	}
+	
+	return (hostMicroseconds() - start) / BENCH_RUNS;
+}
+
+static u32 benchMemory(const char *filename, bool ntx)
+{
+	u32 size;
+	u8 *data = readFile(filename, &size);
+	if(data == 0)
+		return 0;
+	
+	u8 *copy = (u8*)malloc(size);
+	u32 time = 0;
+	
+	for(u16 i=0; (i<BENCH_RUNS) && (copy != 0); ++i)
+	{
+		// In place loading changes the buffer, so every run gets a fresh copy
+		memcpy(copy, data, size);
+		
+		Song *song = 0;
+		u16 err;
+		u64 start = hostMicroseconds();
+		
+		if(ntx) {
+			NTXTransport transport;
+			err = transport.loadInPlace(copy, size, &song);
+		} else {
+			XMTransport transport;
+			err = transport.loadInPlace(copy, size, &song);
+		}
+		
+		time += hostMicroseconds() - start;
+		delete song;
+		
+		if(err != 0) {
+			time = 0;
+			break;
+		}
+	}
+	
+	free(copy);
+	free(data);
+	
+	return time / BENCH_RUNS;
+}
+
+static void bench(const char *xm_filename, const char *ntx_filename)
+{
+	XMTransport xm;
+	NTXTransport ntx;
+	
+	printf("Average of %u loads, on this machine:\n", BENCH_RUNS);
+	printf("                  XM          NTX\n");
+	printf("  from file  %8u us  %8u us\n", benchFile(&xm, xm_filename), benchFile(&ntx, ntx_filename));
+	printf("  in place   %8u us  %8u us\n", benchMemory(xm_filename, false), benchMemory(ntx_filename, true));
+}
+
+// Lists the samples that were reduced or compressed
+static void printSamples(Song *song, u32 before, u32 budget)
+{
+	u32 after = song->getSampleMemory();
+	
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u8 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if( (sample == 0) || ( (!sample->isCompressed()) && (sample->getReductions() == 0) ) )
+				continue;
+			
+			u8 reductions = sample->getReductions();
+			printf("  %3u/%-2u %-22s %8u bytes ", inst + 1, smp, sample->getName(), (unsigned)sample->getSize());
+			if(reductions & SAMPLE_REDUCED_8BIT)
+				printf(" 8 bit");
+			if(reductions & SAMPLE_REDUCED_RATE)
+				printf(" half rate");
+			if(reductions != 0)
+				printf(" %d.%d dB", sample->getReductionSnr() / 10, sample->getReductionSnr() % 10);
+			if(sample->isCompressed())
+				printf(" ADPCM %d.%d dB", sample->getCompressionSnr() / 10, sample->getCompressionSnr() % 10);
+			printf("\n");
+		}
+	}
+	
+	printf("Samples: %u -> %u bytes\n", (unsigned)before, (unsigned)after);
+	if( (budget != 0) && (after > budget) )
+		printf("Warning: the samples don't fit into %u bytes\n", (unsigned)budget);
+}
+
+// Builds the filtered copies for high notes like the DS would after loading
+// and lists what they take. They are not saved.
+static void printMips(Song *song)
+{
+	u32 level_bytes[SAMPLE_MIP_LEVELS];
+	u32 total = song->buildSampleMips(SAMPLE_MIP_LEVELS, level_bytes);
+	
+	for(u8 inst=0; inst<MAX_INSTRUMENTS; ++inst)
+	{
+		Instrument *instrument = song->getInstrument(inst);
+		if(instrument == 0)
+			continue;
+		
+		for(u8 smp=0; smp<instrument->getSamples(); ++smp)
+		{
+			Sample *sample = instrument->getSample(smp);
+			if( (sample == 0) || (sample->getMipLevels() == 0) )
+				continue;
+			
+			printf("  %3u/%-2u %-22s %8u bytes ", inst + 1, smp, sample->getName(), (unsigned)sample->getSize());
+			for(u8 level=1; level<=sample->getMipLevels(); ++level)
+				printf(" +%u", (unsigned)sample->getMipSize(level));
+			printf("\n");
+		}
+	}
+	
+	for(u8 level=1; level<=SAMPLE_MIP_LEVELS; ++level)
+		printf("Mip level %u: %u bytes\n", level, (unsigned)level_bytes[level-1]);
+	printf("Mips: %u bytes on top of %u bytes of samples\n", (unsigned)total, (unsigned)song->getSampleMemory());
+}
+
+static int batch(int argc, char **argv)
+{
+	long n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+	u16 n_threads = (n_cores > 0) ? n_cores : 1;
+	const char *outdir = 0;
+	bool ntx = true;
+	bool trim = false;
+	int arg = 2;
+	
+	for(; (arg < argc) && (argv[arg][0] == '-'); ++arg)
+	{
+		if(arg + 1 >= argc) {
+			usage();
+			return 1;
+		}
+		
+		if(strcmp(argv[arg], "-t") == 0) {
+			trim = true;
+		} else if(strcmp(argv[arg], "-j") == 0) {
+			n_threads = atoi(argv[++arg]);
+		} else if(strcmp(argv[arg], "-o") == 0) {
+			outdir = argv[++arg];
+		} else if( (strcmp(argv[arg], "-f") == 0) && (strcmp(argv[arg+1], "ntx") == 0) ) {
+			ntx = true;
+			arg++;
+		} else if( (strcmp(argv[arg], "-f") == 0) && (strcmp(argv[arg+1], "xm") == 0) ) {
+			ntx = false;
+			arg++;
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	
+	if(arg == argc) {
+		usage();
+		return 1;
+	}
+	
+	Batch batch(outdir, ntx, trim, n_threads);
+	for(; arg<argc; ++arg)
+		batch.add(argv[arg]);
+	
+	u32 n_failed = batch.run();
+	batch.printReport();
+	
+	return (n_failed == 0) ? 0 : 1;
+}
+
+static int fuzz(int argc, char **argv)
+{
+	u32 n_runs = 1000;
+	u32 seed = 1;
+	const char *corpus_dir = 0;
+	int arg = 2;
+	
+	for(; (arg + 1 < argc) && (argv[arg][0] == '-'); arg += 2)
+	{
+		if(strcmp(argv[arg], "-n") == 0) {
+			n_runs = strtoul(argv[arg+1], 0, 0);
+		} else if(strcmp(argv[arg], "-s") == 0) {
+			seed = strtoul(argv[arg+1], 0, 0);
+		} else if(strcmp(argv[arg], "-o") == 0) {
+			corpus_dir = argv[arg+1];
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	
+	if(argc - arg != 1) {
+		usage();
+		return 1;
+	}
+	
+	Fuzzer fuzzer(seed, corpus_dir);
+	u32 n_broken = fuzzer.run(argv[arg], n_runs);
+	fuzzer.printReport();
+	
+	return (n_broken == 0) ? 0 : 1;
+}
+
+// Loads the songs together, as a game would keep them, with the samples
+// shared through the pool
+static int share(int argc, char **argv)
+{
+	if(argc < 3) {
+		usage();
+		return 1;
+	}
+	
+	u16 n_songs = argc - 2;
+	Song **songs = (Song**)calloc(n_songs, sizeof(Song*));
+	u32 total = 0;
+	int ret = 0;
+	
+	XMTransport xm;
+	xm.setSharedSamples(true);
+	
+	for(u16 i=0; i<n_songs; ++i)
+	{
+		const char *filename = argv[i+2];
+		u32 shared = SamplePool::getSharedBytes();
+		
+		u16 err = xm.load(filename, &songs[i]);
+		if(err != 0) {
+			fprintf(stderr, "%s: %s\n", filename, xm.getError(err));
+			songs[i] = 0;
+			ret = 1;
+			continue;
+		}
+		
+		u32 bytes = songs[i]->getSampleMemory();
+		total += bytes;
+		printf("%-32s %8u bytes of samples, %8u shared\n", filename, (unsigned)bytes,
+			(unsigned)(SamplePool::getSharedBytes() - shared));
+	}
+	
+	printf("Samples: %u bytes, %u with sharing (%u copies)\n", (unsigned)total,
+		(unsigned)(total - SamplePool::getSharedBytes()), SamplePool::getCopies());
+	
+	for(u16 i=0; i<n_songs; ++i)
+		delete songs[i];
+	free(songs);
+	
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	if( (argc > 1) && (strcmp(argv[1], "batch") == 0) )
+		return batch(argc, argv);
+	if( (argc > 1) && (strcmp(argv[1], "fuzz") == 0) )
+		return fuzz(argc, argv);
+	if( (argc > 1) && (strcmp(argv[1], "share") == 0) )
+		return share(argc, argv);
+	
+	bool do_bench = false;
+	bool do_mips = false;
+	bool do_trim = false;
+	bool trim_start = false;
+	bool do_reduce = false;
+	bool do_compress = false;
+	u32 reduce_budget = 0;
+	u32 budget = 0;
+	int arg = 1;
+	
+	for(; (argc > arg) && (argv[arg][0] == '-'); ++arg)
+	{
+		if(strcmp(argv[arg], "-b") == 0) {
+			do_bench = true;
+		} else if(strcmp(argv[arg], "-m") == 0) {
+			do_mips = true;
+		} else if(strcmp(argv[arg], "-t") == 0) {
+			do_trim = true;
+		} else if(strcmp(argv[arg], "-T") == 0) {
+			do_trim = true;
+			trim_start = true;
+		} else if( (strcmp(argv[arg], "-r") == 0) && (arg + 1 < argc) ) {
+			do_reduce = true;
+			reduce_budget = strtoul(argv[++arg], 0, 0) * 1024;
+		} else if( (strcmp(argv[arg], "-c") == 0) && (arg + 1 < argc) ) {
+			do_compress = true;
+			budget = strtoul(argv[++arg], 0, 0) * 1024;
+		} else {
+			usage();
+			return 1;
+		}
+	}
+	
+	if(argc - arg != 2) {
+		usage();
+		return 1;
+	}
+	
+	const char *xm_filename = argv[arg];
+	const char *ntx_filename = argv[arg+1];
+	
+	XMTransport xm;
+	Song *song = 0;
+	u16 err = xm.load(xm_filename, &song);
+	if(err != 0) {
+		fprintf(stderr, "%s: %s\n", xm_filename, xm.getError(err));
+		return 1;
+	}
+	
+	if(do_trim) {
+		u32 untrimmed = song->getSampleMemory();
+		u32 saved = song->trimSamples(SAMPLE_TRIM_THRESHOLD, trim_start);
+		printf("Trimmed: %u -> %u bytes\n", (unsigned)untrimmed, (unsigned)(untrimmed - saved));
+	}
+	
+	u32 before = song->getSampleMemory();
+	if(do_reduce)
+		song->reduceSamples(reduce_budget);
+	if(do_compress)
+		song->compressSamples(budget);
+	if(do_reduce || do_compress)
+		printSamples(song, before, do_compress ? budget : reduce_budget);
+	if(do_mips)
+		printMips(song);
+	
+	NTXTransport ntx;
+	err = ntx.save(ntx_filename, song);
+	delete song;
+	
+	if(err != 0) {
+		fprintf(stderr, "%s: %s\n", ntx_filename, ntx.getError(err));
+		return 1;
+	}
+	
+	if(do_bench)
+		bench(xm_filename, ntx_filename);
+	
+	return 0;
+}